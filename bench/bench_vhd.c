@@ -0,0 +1,275 @@
+/**
+ *  @file       bench_vhd.c
+ *  @brief      This application measures the sector I/O of Vinil.
+ *              It creates its own scratch VHDs, runs sequential and random
+ *              read/write workloads against them and prints one JSON object
+ *              per run with throughput, IOPS and latency percentiles.
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#include "vhd.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BENCH_MAX_VALUES  16
+
+typedef struct {
+  const char* name;
+  int write;
+  int random;
+} BenchWorkload;
+
+// writes go first, so the reads of dynamic VHDs find allocated blocks
+static const BenchWorkload workloads[] = {
+  {"seqwrite", 1, 0},
+  {"seqread", 0, 0},
+  {"randwrite", 1, 1},
+  {"randread", 0, 1}
+};
+
+typedef struct {
+  VinilVHD* vhd;
+  const BenchWorkload* workload;
+  uint64_t first;             // first request of a sequential thread
+  uint64_t ops;               // requests executed by the thread
+  uint64_t requests;          // number of requests which fit in the disk
+  uint32_t request_sectors;
+  uint64_t seed;
+  uint64_t* latencies;        // nanoseconds
+  int ok;
+} BenchThread;
+
+static uint64_t bench_random(uint64_t* state) {
+  // xorshift64*
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 2685821657736338717ULL;
+}
+
+static int bench_compare(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+static void* bench_worker(void* arg) {
+  BenchThread* thread = (BenchThread*)arg;
+  size_t size = (size_t)thread->request_sectors * 512;
+
+  void* buffer = vinil_alloc_aligned_buffer(size);
+  if (buffer == NULL)
+    return NULL;
+  memset(buffer, 0x5A, size);
+
+  thread->ok = TRUE;
+  uint64_t i;
+  for (i = 0; thread->ok && i < thread->ops; i++) {
+    uint64_t request = thread->workload->random ? bench_random(&thread->seed) % thread->requests
+                                                : (thread->first + i) % thread->requests;
+    uint64_t sector = request * thread->request_sectors;
+
+    uint64_t start = vinil_clock_ns();
+    thread->ok = thread->workload->write ? vinil_vhd_pwrite(thread->vhd, buffer, sector, thread->request_sectors)
+                                         : vinil_vhd_pread(thread->vhd, buffer, sector, thread->request_sectors);
+    thread->latencies[i] = vinil_clock_ns() - start;
+  }
+
+  vinil_free_aligned_buffer(buffer);
+
+  return NULL;
+}
+
+static int bench_run(VinilVHD* vhd, const char* disk, const BenchWorkload* workload, uint32_t request_sectors,
+                     int threads, uint64_t ops, int direct) {
+  BenchThread* states = (BenchThread*)calloc(threads, sizeof(BenchThread));
+  vinil_thread* ids = (vinil_thread*)calloc(threads, sizeof(vinil_thread));
+  uint64_t* latencies = (uint64_t*)malloc(ops * sizeof(uint64_t));
+  if (states == NULL || ids == NULL || latencies == NULL) {
+    free(states);
+    free(ids);
+    free(latencies);
+    return FALSE;
+  }
+
+  uint64_t requests = vhd->footer->current_size / 512 / request_sectors;
+  uint64_t done = 0;
+  int i;
+  for (i = 0; i < threads; i++) {
+    states[i].vhd = vhd;
+    states[i].workload = workload;
+    states[i].ops = ops / threads + ((uint64_t)i < ops % threads);
+    states[i].first = done;
+    states[i].requests = requests;
+    states[i].request_sectors = request_sectors;
+    states[i].seed = 0x9E3779B97F4A7C15ULL * (i + 1);
+    states[i].latencies = latencies + done;
+    done += states[i].ops;
+  }
+
+  uint64_t start = vinil_clock_ns();
+  int started;
+  for (started = 0; started < threads; started++)
+    if (!vinil_thread_create(&ids[started], bench_worker, &states[started]))
+      break;
+
+  int ok = started == threads;
+  for (i = 0; i < started; i++) {
+    vinil_thread_join(ids[i]);
+    ok = ok && states[i].ok;
+  }
+  double seconds = (vinil_clock_ns() - start) / 1e9;
+
+  if (ok) {
+    qsort(latencies, ops, sizeof(uint64_t), bench_compare);
+
+    printf("{\"disk\": \"%s\", \"workload\": \"%s\", \"request_bytes\": %u, \"threads\": %d, \"direct\": %s, "
+           "\"ops\": %llu, \"seconds\": %.6f, \"mb_s\": %.2f, \"iops\": %.1f, "
+           "\"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f}\n",
+           disk, workload->name, request_sectors * 512, threads, direct ? "true" : "false",
+           (unsigned long long)ops, seconds, ops * request_sectors * 512.0 / (1024 * 1024) / seconds, ops / seconds,
+           latencies[ops / 2] / 1e3, latencies[ops * 99 / 100] / 1e3, latencies[ops * 999 / 1000] / 1e3);
+    fflush(stdout);
+  }
+
+  free(states);
+  free(ids);
+  free(latencies);
+
+  return ok;
+}
+
+static int bench_parse_list(const char* text, uint64_t* values) {
+  int n = 0;
+  while (*text && n < BENCH_MAX_VALUES) {
+    char* end;
+    values[n] = strtoull(text, &end, 10);
+    if (end == text || values[n] == 0)
+      return 0;
+    n++;
+    text = *end == ',' ? end + 1 : end;
+  }
+
+  return n;
+}
+
+static void bench_usage(void) {
+  fprintf(stderr,
+          "usage: bench_vhd [options]\n"
+          "  --disk=fixed|dynamic|all     disk types (default all)\n"
+          "  --size=MB                    size of the scratch VHDs (default 256)\n"
+          "  --request=SECTORS[,...]      request sizes in sectors (default 8,256)\n"
+          "  --threads=N[,...]            thread counts (default 1,4)\n"
+          "  --workload=NAME[,...]        seqwrite, seqread, randwrite, randread (default all)\n"
+          "  --ops=N                      requests per run (default: one pass over the disk)\n"
+          "  --direct                     opens the VHDs with VINIL_VHD_OPEN_DIRECT\n"
+          "  --dir=PATH                   directory of the scratch VHDs (default .)\n"
+          "  --keep                       keeps the scratch VHDs\n");
+}
+
+// usage:
+// ./bench_vhd --disk=fixed --request=8 --threads=1,8 > results.json
+int main(int argc, char* argv[]) {
+  const char* disks = "all";
+  const char* selected = NULL;
+  const char* dir = ".";
+  uint64_t size = 256;
+  uint64_t requests[BENCH_MAX_VALUES] = {8, 256};
+  uint64_t threads[BENCH_MAX_VALUES] = {1, 4};
+  int request_count = 2;
+  int thread_count = 2;
+  uint64_t ops = 0;
+  int direct = FALSE;
+  int keep = FALSE;
+
+  int i;
+  for (i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    if (strncmp(arg, "--disk=", 7) == 0)
+      disks = arg + 7;
+    else if (strncmp(arg, "--size=", 7) == 0)
+      size = strtoull(arg + 7, NULL, 10);
+    else if (strncmp(arg, "--request=", 10) == 0)
+      request_count = bench_parse_list(arg + 10, requests);
+    else if (strncmp(arg, "--threads=", 10) == 0)
+      thread_count = bench_parse_list(arg + 10, threads);
+    else if (strncmp(arg, "--workload=", 11) == 0)
+      selected = arg + 11;
+    else if (strncmp(arg, "--ops=", 6) == 0)
+      ops = strtoull(arg + 6, NULL, 10);
+    else if (strcmp(arg, "--direct") == 0)
+      direct = TRUE;
+    else if (strncmp(arg, "--dir=", 6) == 0)
+      dir = arg + 6;
+    else if (strcmp(arg, "--keep") == 0)
+      keep = TRUE;
+    else {
+      bench_usage();
+      return -1;
+    }
+  }
+
+  if (size == 0 || request_count == 0 || thread_count == 0) {
+    bench_usage();
+    return -1;
+  }
+
+  const char* types[2] = {"fixed", "dynamic"};
+  int disk_types[2] = {VINIL_VHD_FIXED, VINIL_VHD_DYNAMIC};
+  int failed = 0;
+
+  int t;
+  for (t = 0; t < 2; t++) {
+    if (strcmp(disks, "all") != 0 && strcmp(disks, types[t]) != 0)
+      continue;
+
+    char vhd_path[VINIL_MAX_PATH];
+    sprintf(vhd_path, "%s/bench_%s.vhd", dir, types[t]);
+    remove(vhd_path);
+
+    // fixed VHDs are preallocated, so the first pass does not measure the file system
+    int prealloc = disk_types[t] == VINIL_VHD_FIXED ? VINIL_VHD_PREALLOC_FALLOCATE : VINIL_VHD_PREALLOC_SPARSE;
+    VinilVHD* vhd = vinil_vhd_create(vhd_path, size * 1024 * 1024, disk_types[t], prealloc);
+    if (vhd == NULL && prealloc != VINIL_VHD_PREALLOC_SPARSE)
+      vhd = vinil_vhd_create(vhd_path, size * 1024 * 1024, disk_types[t], VINIL_VHD_PREALLOC_FULL);
+
+    if (vhd && direct) {
+      vinil_vhd_close(vhd);
+      vhd = vinil_vhd_open_with_flags(vhd_path, VINIL_VHD_OPEN_DIRECT);
+    }
+
+    if (vhd == NULL) {
+      fprintf(stderr, "ERROR: Can't create %s\n", vhd_path);
+      return -1;
+    }
+
+    int r, n, w;
+    for (r = 0; r < request_count; r++) {
+      uint64_t fitting = vhd->footer->current_size / 512 / requests[r];
+      if (fitting == 0)
+        continue;
+
+      for (n = 0; n < thread_count; n++) {
+        for (w = 0; w < (int)(sizeof(workloads) / sizeof(workloads[0])); w++) {
+          if (selected && !strstr(selected, workloads[w].name))
+            continue;
+
+          uint64_t run_ops = ops ? ops : fitting;
+          if (!bench_run(vhd, types[t], &workloads[w], (uint32_t)requests[r], (int)threads[n], run_ops, direct)) {
+            fprintf(stderr, "ERROR: %s failed on %s\n", workloads[w].name, vhd_path);
+            failed++;
+          }
+        }
+      }
+    }
+
+    vinil_vhd_close(vhd);
+    if (!keep)
+      remove(vhd_path);
+  }
+
+  return failed ? -1 : 0;
+}
@@ -12,40 +12,25 @@
 #include "vhd.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <time.h>
 
 // usage:
-// ./create_vhd test.vhd 1024
+// ./create_vhd test.vhd 1024 [sparse|fallocate|full]
 int main(int argc, char* argv[]) {
   char* vhd_path = argv[1];      // filename
   uint64_t vhd_size = atol(argv[2]);  // virtual hard disk size
+  int prealloc = VINIL_VHD_PREALLOC_SPARSE;
 
-  VinilVHD* vhd = vinil_vhd_open(vhd_path);
+  if (argc > 3 && strcmp(argv[3], "fallocate") == 0)
+    prealloc = VINIL_VHD_PREALLOC_FALLOCATE;
+  else if (argc > 3 && strcmp(argv[3], "full") == 0)
+    prealloc = VINIL_VHD_PREALLOC_FULL;
 
-  if (!vhd) {
-    printf("ERROR: Can't open %s\n", vhd_path);
-    return -1;
-  }
+  VinilVHD* vhd = vinil_vhd_create(vhd_path, vhd_size, VINIL_VHD_FIXED, prealloc);
 
-  memcpy(vhd->footer->cookie, "conectix", 9);
-  vhd->footer->features = 0;
-  vhd->footer->file_format_version = 0x00010000;
-  vhd->footer->data_offset = 0xFFFFFFFF;
-  vhd->footer->timestamp = (uint32_t)time(NULL);
-  memcpy(vhd->footer->creator_application, "vnil", 4);
-  vhd->footer->creator_version = 0x00000001;
-  vhd->footer->creator_host_os = 0x4D616320;                    // Mac OS X
-  vhd->footer->original_size = vhd_size;
-  vhd->footer->current_size = vhd_size;
-  vhd->footer->disk_geometry = vinil_compute_chs(vhd_size);
-  vhd->footer->disk_type = 2;                                   // Fixed
-  vinil_uuid_generate(&vhd->footer->uuid);
-  vhd->footer->saved_state = 0;
-  vhd->footer->checksum = vinil_checksum_vhd_footer(vhd->footer);
-
-  if (!vinil_vhd_commit_structural_changes(vhd)) {
-    printf("ERROR: Can't commit structural changes\n");
+  if (!vhd) {
+    printf("ERROR: Can't create %s\n", vhd_path);
     return -1;
   }
 
@@ -53,4 +38,3 @@ int main(int argc, char* argv[]) {
 
   return 0;
 }
-
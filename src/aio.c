@@ -0,0 +1,545 @@
+/**
+ *  @file       aio.c
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#include "aio.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef VINIL_HAVE_IO_URING
+  #include <errno.h>
+  #include <unistd.h>
+  #include <sys/mman.h>
+  #include <sys/syscall.h>
+  #include <linux/io_uring.h>
+#endif
+
+#define AIO_MAX_THREADS 16
+
+#ifdef VINIL_HAVE_IO_URING
+typedef struct {
+  vinil_iovec iov;
+  int op;
+  uint64_t offset;
+  uint64_t tag;
+  uint64_t start;
+  uint64_t crc_ticket;      // of vinil_crc_begin_write, for the writes of a VHD with checksums
+} AIOSlot;
+
+typedef struct {
+  int fd;
+  void* sq_ring;
+  void* cq_ring;
+  size_t sq_ring_size;
+  size_t cq_ring_size;
+  struct io_uring_sqe* sqes;
+  size_t sqes_size;
+  unsigned* sq_tail;
+  unsigned* sq_mask;
+  unsigned* sq_array;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned* cq_mask;
+  struct io_uring_cqe* cqes;
+  AIOSlot* slots;
+  unsigned* free_slots;
+  unsigned free_count;
+} AIORing;
+#endif
+
+struct VinilAIO {
+  VinilVHD* vhd;
+  unsigned depth;
+  unsigned in_flight;
+  int backend;
+
+#ifdef VINIL_HAVE_IO_URING
+  AIORing ring;
+#endif
+
+  vinil_mutex lock;
+  vinil_cond request_ready;
+  vinil_cond completion_ready;
+  VinilAIORequest* requests;
+  unsigned request_head;
+  unsigned request_count;
+  VinilAIOCompletion* completions;
+  unsigned completion_head;
+  unsigned completion_count;
+  vinil_thread threads[AIO_MAX_THREADS];
+  unsigned thread_count;
+  int stop;
+};
+
+static int aio_valid_request(VinilAIO* aio, const VinilAIORequest* request) {
+  if (request->op == VINIL_AIO_FLUSH)
+    return TRUE;
+
+  if (request->op != VINIL_AIO_READ && request->op != VINIL_AIO_WRITE)
+    return FALSE;
+
+  uint64_t sectors = aio->vhd->footer->current_size / 512;
+
+  return request->sector <= sectors && request->count <= sectors - request->sector;
+}
+
+static int aio_execute(VinilVHD* vhd, const VinilAIORequest* request) {
+  switch (request->op) {
+    case VINIL_AIO_READ:
+      return vinil_vhd_pread(vhd, request->buffer, request->sector, request->count);
+    case VINIL_AIO_WRITE:
+      return vinil_vhd_pwrite(vhd, request->buffer, request->sector, request->count);
+    case VINIL_AIO_FLUSH:
+      return vinil_vhd_flush(vhd);
+  }
+
+  return FALSE;
+}
+
+// must be called with aio->lock held
+static void aio_push_completion(VinilAIO* aio, uint64_t tag, int result) {
+  unsigned index = (aio->completion_head + aio->completion_count) % aio->depth;
+  aio->completions[index].tag = tag;
+  aio->completions[index].result = result;
+  aio->completion_count++;
+
+  vinil_cond_signal(&aio->completion_ready);
+}
+
+// must be called with aio->lock held
+static int aio_pop_completions(VinilAIO* aio, VinilAIOCompletion* completions, int max) {
+  int n = 0;
+  while (n < max && aio->completion_count > 0) {
+    completions[n++] = aio->completions[aio->completion_head];
+    aio->completion_head = (aio->completion_head + 1) % aio->depth;
+    aio->completion_count--;
+  }
+
+  return n;
+}
+
+static void* aio_worker(void* arg) {
+  VinilAIO* aio = (VinilAIO*)arg;
+
+  vinil_mutex_lock(&aio->lock);
+
+  while (TRUE) {
+    while (!aio->stop && aio->request_count == 0)
+      vinil_cond_wait(&aio->request_ready, &aio->lock);
+
+    if (aio->request_count == 0)
+      break;
+
+    VinilAIORequest request = aio->requests[aio->request_head];
+    aio->request_head = (aio->request_head + 1) % aio->depth;
+    aio->request_count--;
+
+    vinil_mutex_unlock(&aio->lock);
+    int result = aio_execute(aio->vhd, &request);
+    vinil_mutex_lock(&aio->lock);
+
+    aio_push_completion(aio, request.tag, result);
+  }
+
+  vinil_mutex_unlock(&aio->lock);
+
+  return NULL;
+}
+
+static int aio_start_threads(VinilAIO* aio) {
+  aio->requests = (VinilAIORequest*)malloc(aio->depth * sizeof(VinilAIORequest));
+  if (aio->requests == NULL)
+    return FALSE;
+
+  unsigned count = aio->depth < AIO_MAX_THREADS ? aio->depth : AIO_MAX_THREADS;
+  for (aio->thread_count = 0; aio->thread_count < count; aio->thread_count++)
+    if (!vinil_thread_create(&aio->threads[aio->thread_count], aio_worker, aio))
+      return aio->thread_count > 0;
+
+  return TRUE;
+}
+
+#ifdef VINIL_HAVE_IO_URING
+static int aio_ring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static void aio_ring_destroy(AIORing* ring) {
+  if (ring->sqes)
+    munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  if (ring->sq_ring)
+    munmap(ring->sq_ring, ring->sq_ring_size);
+  if (ring->fd >= 0)
+    close(ring->fd);
+
+  free(ring->slots);
+  free(ring->free_slots);
+}
+
+static int aio_ring_init(AIORing* ring, unsigned depth) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+
+  ring->fd = (int)syscall(__NR_io_uring_setup, depth, &params);
+  if (ring->fd < 0)
+    return FALSE;
+
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_ring_size > ring->sq_ring_size)
+      ring->sq_ring_size = ring->cq_ring_size;
+    ring->cq_ring_size = ring->sq_ring_size;
+  }
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED) {
+    ring->sq_ring = NULL;
+    return FALSE;
+  }
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cq_ring = ring->sq_ring;
+  } else {
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED) {
+      ring->cq_ring = NULL;
+      return FALSE;
+    }
+  }
+
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    return FALSE;
+  }
+
+  char* sq = (char*)ring->sq_ring;
+  char* cq = (char*)ring->cq_ring;
+  ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+  ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+  ring->slots = (AIOSlot*)malloc(depth * sizeof(AIOSlot));
+  ring->free_slots = (unsigned*)malloc(depth * sizeof(unsigned));
+  if (ring->slots == NULL || ring->free_slots == NULL)
+    return FALSE;
+
+  for (ring->free_count = 0; ring->free_count < depth; ring->free_count++)
+    ring->free_slots[ring->free_count] = depth - 1 - ring->free_count;
+
+  return TRUE;
+}
+
+static int aio_ring_aligned(VinilVHD* vhd, const VinilAIORequest* request) {
+  return request->op == VINIL_AIO_FLUSH ||
+         ((uintptr_t)request->buffer % vhd->alignment == 0 &&
+          request->sector * 512 % vhd->alignment == 0 && request->count * 512 % vhd->alignment == 0);
+}
+
+static void aio_ring_end_crc(VinilVHD* vhd, AIOSlot* slot) {
+  if (slot->crc_ticket)
+    vinil_crc_end_write(vhd->crc, slot->offset / 512, slot->iov.iov_len / 512, slot->crc_ticket);
+}
+
+static void aio_ring_queue(AIORing* ring, VinilVHD* vhd, const VinilAIORequest* request, uint64_t crc_ticket) {
+  unsigned slot_index = ring->free_slots[--ring->free_count];
+  AIOSlot* slot = &ring->slots[slot_index];
+  slot->op = request->op;
+  slot->offset = request->sector * 512;
+  slot->tag = request->tag;
+  slot->iov.iov_base = request->buffer;
+  slot->iov.iov_len = (size_t)(request->count * 512);
+  slot->start = vhd->stats || vhd->trace ? vinil_clock_ns() : 0;
+  slot->crc_ticket = crc_ticket;
+
+  unsigned tail = *ring->sq_tail;
+  unsigned index = tail & *ring->sq_mask;
+  struct io_uring_sqe* sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->fd = vhd->fd;
+
+  if (request->op == VINIL_AIO_FLUSH) {
+    // the flush waits for the requests submitted before it
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    sqe->flags = IOSQE_IO_DRAIN;
+  } else {
+    sqe->opcode = request->op == VINIL_AIO_READ ? IORING_OP_READV : IORING_OP_WRITEV;
+    sqe->addr = (uint64_t)(uintptr_t)&slot->iov;
+    sqe->len = 1;
+    sqe->off = slot->offset;
+  }
+  sqe->user_data = slot_index;
+
+  ring->sq_array[index] = index;
+  vinil_atomic_store(ring->sq_tail, tail + 1);
+}
+
+// must be called with aio->lock held
+// takes back the last count entries which the kernel did not consume and fails their requests
+static void aio_ring_cancel(VinilAIO* aio, unsigned count) {
+  AIORing* ring = &aio->ring;
+  unsigned tail = *ring->sq_tail;
+
+  while (count-- > 0) {
+    tail--;
+    unsigned slot_index = (unsigned)ring->sqes[ring->sq_array[tail & *ring->sq_mask]].user_data;
+    aio_ring_end_crc(aio->vhd, &ring->slots[slot_index]);
+    aio_push_completion(aio, ring->slots[slot_index].tag, FALSE);
+    ring->free_slots[ring->free_count++] = slot_index;
+  }
+
+  vinil_atomic_store(ring->sq_tail, tail);
+}
+
+static int aio_ring_reap(VinilAIO* aio, VinilAIOCompletion* completions, int max) {
+  AIORing* ring = &aio->ring;
+  unsigned head = *ring->cq_head;
+  unsigned tail = vinil_atomic_load(ring->cq_tail);
+  int n = 0;
+
+  while (head != tail && n < max) {
+    struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+    AIOSlot* slot = &ring->slots[cqe->user_data];
+    int result = cqe->res >= 0;
+
+    // short transfers are finished synchronously
+    if (result && slot->op != VINIL_AIO_FLUSH && (size_t)cqe->res < slot->iov.iov_len) {
+      char* buffer = (char*)slot->iov.iov_base + cqe->res;
+      size_t size = slot->iov.iov_len - cqe->res;
+      uint64_t offset = slot->offset + cqe->res;
+      result = slot->op == VINIL_AIO_READ ? vinil_pread(aio->vhd->fd, buffer, size, offset)
+                                          : vinil_pwrite(aio->vhd->fd, buffer, size, offset);
+    }
+
+    // a checkpoint cannot wait for the writes in the ring, so they are marked once they are
+    // done: the ones marked before a checkpoint are in the file by then, the others are listed after it
+    if (aio->vhd->cbt && slot->op == VINIL_AIO_WRITE) {
+      vinil_rwlock_read_lock(&aio->vhd->cbt_lock);
+      vinil_cbt_mark(aio->vhd->cbt, slot->offset / 512, slot->iov.iov_len / 512);
+      vinil_rwlock_read_unlock(&aio->vhd->cbt_lock);
+    }
+    aio_ring_end_crc(aio->vhd, slot);
+
+    if (aio->vhd->stats || aio->vhd->trace) {
+      int op = slot->op == VINIL_AIO_READ ? VINIL_TRACE_READ : 
+               slot->op == VINIL_AIO_WRITE ? VINIL_TRACE_WRITE : VINIL_TRACE_FLUSH;
+      uint64_t size = slot->op == VINIL_AIO_FLUSH ? 0 : slot->iov.iov_len;
+      if (aio->vhd->stats)
+        vinil_stats_record(aio->vhd->stats, op, size, vinil_clock_ns() - slot->start);
+      if (aio->vhd->trace)
+        vinil_trace_record(aio->vhd->trace, op, slot->offset / 512, size / 512, slot->start, result);
+    }
+
+    completions[n].tag = slot->tag;
+    completions[n].result = result ? TRUE : FALSE;
+    n++;
+
+    ring->free_slots[ring->free_count++] = (unsigned)cqe->user_data;
+    head++;
+  }
+
+  vinil_atomic_store(ring->cq_head, head);
+
+  return n;
+}
+#endif
+
+VinilAIO* vinil_aio_create(VinilVHD* vhd, unsigned queue_depth, int flags) {
+  if (queue_depth == 0)
+    return NULL;
+
+  VinilAIO* aio = (VinilAIO*)calloc(1, sizeof(VinilAIO));
+  if (aio == NULL)
+    return NULL;
+
+  aio->vhd = vhd;
+  aio->depth = queue_depth;
+  aio->completions = (VinilAIOCompletion*)malloc(queue_depth * sizeof(VinilAIOCompletion));
+
+  if (aio->completions == NULL || !vinil_mutex_init(&aio->lock)) {
+    free(aio->completions);
+    free(aio);
+    return NULL;
+  }
+
+  vinil_cond_init(&aio->request_ready);
+  vinil_cond_init(&aio->completion_ready);
+
+#ifdef VINIL_HAVE_IO_URING
+  // the kernel only knows where the sectors are when the VHD is fixed and
+  // none of them waits in a write-back buffer
+  aio->ring.fd = -1;
+  if (!(flags & VINIL_AIO_NO_IO_URING) && vhd->header == NULL && vhd->write_back == NULL) {
+    if (aio_ring_init(&aio->ring, queue_depth)) {
+      aio->backend = VINIL_AIO_BACKEND_IO_URING;
+      return aio;
+    }
+
+    aio_ring_destroy(&aio->ring);
+    memset(&aio->ring, 0, sizeof(AIORing));
+    aio->ring.fd = -1;
+  }
+#endif
+
+  aio->backend = VINIL_AIO_BACKEND_THREADS;
+  if (!aio_start_threads(aio)) {
+    vinil_aio_destroy(aio);
+    return NULL;
+  }
+
+  return aio;
+}
+
+void vinil_aio_destroy(VinilAIO* aio) {
+  VinilAIOCompletion completions[64];
+  while (aio->in_flight > 0 &&
+         vinil_aio_wait(aio, completions, 1, 64) > 0);
+
+  vinil_mutex_lock(&aio->lock);
+  aio->stop = TRUE;
+  vinil_cond_broadcast(&aio->request_ready);
+  vinil_mutex_unlock(&aio->lock);
+
+  unsigned i;
+  for (i = 0; i < aio->thread_count; i++)
+    vinil_thread_join(aio->threads[i]);
+
+#ifdef VINIL_HAVE_IO_URING
+  if (aio->backend == VINIL_AIO_BACKEND_IO_URING)
+    aio_ring_destroy(&aio->ring);
+#endif
+
+  vinil_cond_destroy(&aio->request_ready);
+  vinil_cond_destroy(&aio->completion_ready);
+  vinil_mutex_destroy(&aio->lock);
+  free(aio->requests);
+  free(aio->completions);
+  free(aio);
+}
+
+int vinil_aio_backend(VinilAIO* aio) {
+  return aio->backend;
+}
+
+unsigned vinil_aio_in_flight(VinilAIO* aio) {
+  return aio->in_flight;
+}
+
+int vinil_aio_submit(VinilAIO* aio, const VinilAIORequest* requests, int count) {
+  int submitted = 0;
+  int queued = 0;
+
+  vinil_mutex_lock(&aio->lock);
+
+  while (submitted < count && aio->in_flight < aio->depth) {
+    const VinilAIORequest* request = &requests[submitted++];
+    aio->in_flight++;
+
+    if (!aio_valid_request(aio, request)) {
+      aio_push_completion(aio, request->tag, FALSE);
+      continue;
+    }
+
+#ifdef VINIL_HAVE_IO_URING
+    if (aio->backend == VINIL_AIO_BACKEND_IO_URING && !aio_ring_aligned(aio->vhd, request)) {
+      // O_DIRECT would reject it, so it takes the read-modify-write path of vinil_vhd_pwrite
+      aio_push_completion(aio, request->tag, aio_execute(aio->vhd, request));
+      continue;
+    }
+
+    if (aio->backend == VINIL_AIO_BACKEND_IO_URING) {
+      // the blocks written by the kernel stay stale until vinil_vhd_stop_crc checksums them
+      uint64_t crc_ticket = aio->vhd->crc && request->op == VINIL_AIO_WRITE
+                                ? vinil_crc_begin_write(aio->vhd->crc, request->sector, request->count) : 0;
+      if (aio->vhd->crc && request->op == VINIL_AIO_WRITE && crc_ticket == 0) {
+        aio_push_completion(aio, request->tag, FALSE);
+        continue;
+      }
+
+      aio_ring_queue(&aio->ring, aio->vhd, request, crc_ticket);
+      queued++;
+      continue;
+    }
+#endif
+
+    unsigned index = (aio->request_head + aio->request_count) % aio->depth;
+    aio->requests[index] = *request;
+    aio->request_count++;
+    vinil_cond_signal(&aio->request_ready);
+  }
+
+  vinil_mutex_unlock(&aio->lock);
+
+#ifdef VINIL_HAVE_IO_URING
+  // every queued entry is consumed by the kernel, even when some of them fail
+  while (queued > 0) {
+    int n = aio_ring_enter(aio->ring.fd, queued, 0, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    queued -= n;
+  }
+
+  // the entries left behind would never complete, so they are failed and vinil_aio_wait returns them
+  if (queued > 0) {
+    vinil_mutex_lock(&aio->lock);
+    aio_ring_cancel(aio, queued);
+    vinil_mutex_unlock(&aio->lock);
+  }
+#endif
+
+  return submitted;
+}
+
+int vinil_aio_wait(VinilAIO* aio, VinilAIOCompletion* completions, int min, int max) {
+  if (min > max)
+    min = max;
+  if ((unsigned)min > aio->in_flight)
+    min = aio->in_flight;
+
+  vinil_mutex_lock(&aio->lock);
+
+  // requests rejected by vinil_aio_submit are completed here by both backends
+  int n = aio_pop_completions(aio, completions, max);
+
+#ifdef VINIL_HAVE_IO_URING
+  if (aio->backend == VINIL_AIO_BACKEND_IO_URING) {
+    n += aio_ring_reap(aio, completions + n, max - n);
+    while (n < min) {
+      if (aio_ring_enter(aio->ring.fd, 0, min - n, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+        break;
+      n += aio_ring_reap(aio, completions + n, max - n);
+    }
+    // nothing else completes the ring requests, so a failed wait returns what was reaped
+    if (n < min)
+      min = n;
+  }
+#endif
+
+  while (n < min) {
+    vinil_cond_wait(&aio->completion_ready, &aio->lock);
+    n += aio_pop_completions(aio, completions + n, max - n);
+  }
+
+  aio->in_flight -= n;
+
+  vinil_mutex_unlock(&aio->lock);
+
+  return n;
+}
@@ -0,0 +1,116 @@
+/**
+ *  @file       aio.h
+ *  @brief      Asynchronous Virtual Hard Disk I/O interface.
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#ifndef VINIL_AIO_H_
+#define VINIL_AIO_H_
+
+#include <stdint.h>
+
+#include "vhd.h"
+
+/** @brief Reads count sectors into buffer */
+#define VINIL_AIO_READ            0
+
+/** @brief Writes count sectors from buffer */
+#define VINIL_AIO_WRITE           1
+
+/** @brief Flushes the writes completed before the flush was submitted */
+#define VINIL_AIO_FLUSH           2
+
+/** @brief Never uses io_uring, even when it is available */
+#define VINIL_AIO_NO_IO_URING     0x01
+
+/** @brief Requests are executed by the kernel through io_uring */
+#define VINIL_AIO_BACKEND_IO_URING  1
+
+/** @brief Requests are executed by a pool of threads */
+#define VINIL_AIO_BACKEND_THREADS   2
+
+/** @brief An asynchronous request */
+typedef struct {
+  int       op;         /**< VINIL_AIO_READ, VINIL_AIO_WRITE or VINIL_AIO_FLUSH */
+  void*     buffer;     /**< a (512*count) bytes buffer, unused by flushes */
+  uint64_t  sector;     /**< number of the first sector */
+  uint64_t  count;      /**< number of sectors */
+  uint64_t  tag;        /**< user data returned with the completion */
+} VinilAIORequest;
+
+/** @brief The completion of an asynchronous request */
+typedef struct {
+  uint64_t  tag;        /**< tag of the completed request */
+  int       result;     /**< TRUE if the request succeeded, FALSE otherwise */
+} VinilAIOCompletion;
+
+/** @brief A queue of asynchronous requests executed against a VinilVHD object */
+typedef struct VinilAIO VinilAIO;
+
+/** @brief  Creates a queue of asynchronous requests. Fixed VHDs use io_uring when the
+ *          kernel supports it (unless they were opened with VINIL_VHD_OPEN_WRITE_BACK),
+ *          other VHDs (and systems without io_uring) use a pool
+ *          of threads which calls vinil_vhd_pread/vinil_vhd_pwrite.
+ *          A VinilAIO object must be used by one thread at a time.
+ *
+ *  @param    vhd           VinilVHD object, it must stay open while the queue exists
+ *
+ *  @param    queue_depth   maximum number of requests in flight
+ *
+ *  @param    flags         bitwise or of VINIL_AIO_* flags (or zero)
+ *
+ *  @return   a new VinilAIO object or a null pointer if an error occurs
+ */
+VINILAPI VinilAIO* vinil_aio_create(VinilVHD* vhd, unsigned queue_depth, int flags);
+
+/** @brief  Waits for every request in flight and destroys the queue
+ *
+ *  @param    aio       VinilAIO object
+ */
+VINILAPI void vinil_aio_destroy(VinilAIO* aio);
+
+/** @brief  Returns the backend which executes the requests
+ *
+ *  @param    aio       VinilAIO object
+ *
+ *  @return   VINIL_AIO_BACKEND_IO_URING or VINIL_AIO_BACKEND_THREADS
+ */
+VINILAPI int vinil_aio_backend(VinilAIO* aio);
+
+/** @brief  Submits a batch of requests. Requests which do not fit in the queue are
+ *          not submitted, and invalid requests complete with a FALSE result.
+ *
+ *  @param    aio       VinilAIO object
+ *
+ *  @param    requests  requests to be submitted
+ *
+ *  @param    count     number of requests
+ *
+ *  @return   the number of submitted requests
+ */
+VINILAPI int vinil_aio_submit(VinilAIO* aio, const VinilAIORequest* requests, int count);
+
+/** @brief  Collects completed requests
+ *
+ *  @param    aio           VinilAIO object
+ *
+ *  @param    completions   array which receives the completions
+ *
+ *  @param    min           number of completions to wait for (zero only polls)
+ *
+ *  @param    max           size of the completions array
+ *
+ *  @return   the number of completions stored in the array
+ */
+VINILAPI int vinil_aio_wait(VinilAIO* aio, VinilAIOCompletion* completions, int min, int max);
+
+/** @brief  Returns the number of requests which were submitted but not collected yet
+ *
+ *  @param    aio       VinilAIO object
+ *
+ *  @return   number of requests in flight
+ */
+VINILAPI unsigned vinil_aio_in_flight(VinilAIO* aio);
+
+#endif
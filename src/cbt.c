@@ -0,0 +1,343 @@
+/**
+ *  @file       cbt.c
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#include "cbt.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define CBT_HEADER_SIZE   48
+#define CBT_IO_WORDS      512
+
+struct VinilCBT {
+  int fd;
+  uint64_t sectors;
+  uint32_t granularity;
+  uint32_t shift;             // log2 of the sectors tracked by each bit
+  uint64_t bits;
+  uint64_t words;
+  uint64_t epoch;
+  int checkpoints;
+  char names[VINIL_CBT_CHECKPOINTS][VINIL_CBT_NAME_SIZE];
+  // bitmaps[0] holds the changes made before the first checkpoint, bitmaps[i + 1] the
+  // ones made after names[i], the last one is the live bitmap set by vinil_cbt_mark
+  uint64_t* bitmaps[VINIL_CBT_CHECKPOINTS + 1];
+  uint64_t* live;
+};
+
+static void cbt_put(uint8_t* p, uint64_t value, int size) {
+  int i;
+  for (i = 0; i < size; i++)
+    p[i] = (uint8_t)(value >> (8 * i));
+}
+
+static uint64_t cbt_get(const uint8_t* p, int size) {
+  uint64_t value = 0;
+  int i;
+  for (i = size - 1; i >= 0; i--)
+    value = (value << 8) | p[i];
+  return value;
+}
+
+static int cbt_write_header(VinilCBT* cbt, int clean) {
+  uint8_t header[CBT_HEADER_SIZE];
+  memcpy(header, "VNLCBTMP", 8);
+  cbt_put(header + 8, VINIL_CBT_VERSION, 4);
+  cbt_put(header + 12, clean, 4);
+  cbt_put(header + 16, cbt->sectors, 8);
+  cbt_put(header + 24, cbt->granularity, 4);
+  cbt_put(header + 28, cbt->checkpoints, 4);
+  cbt_put(header + 32, cbt->epoch, 8);
+  cbt_put(header + 40, cbt->words, 8);
+
+  return vinil_pwrite(cbt->fd, header, CBT_HEADER_SIZE, 0);
+}
+
+static int cbt_write_bitmap(VinilCBT* cbt, const uint64_t* bitmap, int64_t offset) {
+  uint8_t buffer[CBT_IO_WORDS * 8];
+  uint64_t word = 0;
+  while (word < cbt->words) {
+    uint64_t count = cbt->words - word < CBT_IO_WORDS ? cbt->words - word : CBT_IO_WORDS;
+    uint64_t i;
+    for (i = 0; i < count; i++)
+      cbt_put(buffer + i * 8, bitmap[word + i], 8);
+
+    if (!vinil_pwrite(cbt->fd, buffer, (size_t)(count * 8), offset))
+      return FALSE;
+
+    word += count;
+    offset += (int64_t)(count * 8);
+  }
+
+  return TRUE;
+}
+
+static int cbt_read_bitmap(VinilCBT* cbt, uint64_t* bitmap, int64_t offset) {
+  uint8_t buffer[CBT_IO_WORDS * 8];
+  uint64_t word = 0;
+  while (word < cbt->words) {
+    uint64_t count = cbt->words - word < CBT_IO_WORDS ? cbt->words - word : CBT_IO_WORDS;
+    if (!vinil_pread(cbt->fd, buffer, (size_t)(count * 8), offset))
+      return FALSE;
+
+    uint64_t i;
+    for (i = 0; i < count; i++)
+      bitmap[word + i] = cbt_get(buffer + i * 8, 8);
+
+    word += count;
+    offset += (int64_t)(count * 8);
+  }
+
+  return TRUE;
+}
+
+// loads the checkpoints and bitmaps of a file which was closed cleanly and describes the same disk
+static int cbt_load(VinilCBT* cbt) {
+  uint8_t header[CBT_HEADER_SIZE];
+  if (!vinil_pread(cbt->fd, header, CBT_HEADER_SIZE, 0) || memcmp(header, "VNLCBTMP", 8) != 0)
+    return FALSE;
+
+  // the epoch survives, so a stale file is never mistaken for the current one
+  cbt->epoch = cbt_get(header + 32, 8);
+
+  int checkpoints = (int)cbt_get(header + 28, 4);
+  if (cbt_get(header + 8, 4) != VINIL_CBT_VERSION || !cbt_get(header + 12, 4) ||
+      cbt_get(header + 16, 8) != cbt->sectors || cbt_get(header + 24, 4) != cbt->granularity ||
+      cbt_get(header + 40, 8) != cbt->words || checkpoints < 0 || checkpoints > VINIL_CBT_CHECKPOINTS)
+    return FALSE;
+
+  int64_t offset = CBT_HEADER_SIZE;
+  int i;
+  for (i = 0; i < checkpoints; i++) {
+    if (!vinil_pread(cbt->fd, cbt->names[i], VINIL_CBT_NAME_SIZE, offset))
+      return FALSE;
+    cbt->names[i][VINIL_CBT_NAME_SIZE - 1] = '\0';
+    offset += VINIL_CBT_NAME_SIZE;
+  }
+
+  for (i = 0; i <= checkpoints; i++) {
+    if (cbt->bitmaps[i] == NULL) {
+      cbt->bitmaps[i] = (uint64_t*)calloc((size_t)cbt->words, sizeof(uint64_t));
+      if (cbt->bitmaps[i] == NULL)
+        return FALSE;
+    }
+
+    if (!cbt_read_bitmap(cbt, cbt->bitmaps[i], offset))
+      return FALSE;
+    offset += (int64_t)(cbt->words * 8);
+  }
+
+  cbt->checkpoints = checkpoints;
+  cbt->live = cbt->bitmaps[checkpoints];
+
+  return TRUE;
+}
+
+static int cbt_save(VinilCBT* cbt) {
+  if (!cbt_write_header(cbt, FALSE))
+    return FALSE;
+
+  int64_t offset = CBT_HEADER_SIZE;
+  int i;
+  for (i = 0; i < cbt->checkpoints; i++) {
+    if (!vinil_pwrite(cbt->fd, cbt->names[i], VINIL_CBT_NAME_SIZE, offset))
+      return FALSE;
+    offset += VINIL_CBT_NAME_SIZE;
+  }
+
+  for (i = 0; i <= cbt->checkpoints; i++) {
+    if (!cbt_write_bitmap(cbt, cbt->bitmaps[i], offset))
+      return FALSE;
+    offset += (int64_t)(cbt->words * 8);
+  }
+
+  // the file is only marked as clean once everything else is on the disk
+  return vinil_truncate(cbt->fd, offset) && vinil_fsync(cbt->fd) &&
+         cbt_write_header(cbt, TRUE) && vinil_fsync(cbt->fd);
+}
+
+static void cbt_free_bitmaps(VinilCBT* cbt) {
+  int i;
+  for (i = 0; i <= VINIL_CBT_CHECKPOINTS; i++) {
+    free(cbt->bitmaps[i]);
+    cbt->bitmaps[i] = NULL;
+  }
+}
+
+static int cbt_find(VinilCBT* cbt, const char* name) {
+  int i;
+  for (i = 0; i < cbt->checkpoints; i++) {
+    if (strcmp(cbt->names[i], name) == 0)
+      return i;
+  }
+
+  return -1;
+}
+
+static int cbt_emit(VinilCBT* cbt, uint64_t first, uint64_t end, vinil_cbt_fn fn, void* arg) {
+  uint64_t sector = first << cbt->shift;
+  uint64_t last = end << cbt->shift < cbt->sectors ? end << cbt->shift : cbt->sectors;
+
+  return fn(arg, sector, last - sector);
+}
+
+VinilCBT* vinil_cbt_open(const char* filename, uint64_t sectors, uint32_t granularity) {
+  if (granularity == 0)
+    granularity = VINIL_CBT_DEFAULT_GRANULARITY;
+  if (granularity < 512 || (granularity & (granularity - 1)) != 0 || sectors == 0)
+    return NULL;
+
+  VinilCBT* cbt = (VinilCBT*)calloc(1, sizeof(VinilCBT));
+  if (cbt == NULL)
+    return NULL;
+
+  cbt->sectors = sectors;
+  cbt->granularity = granularity;
+  while ((512u << cbt->shift) < granularity)
+    cbt->shift++;
+  cbt->bits = ((sectors - 1) >> cbt->shift) + 1;
+  cbt->words = (cbt->bits + 63) / 64;
+
+  cbt->fd = vinil_open(filename, O_RDWR | O_CREAT);
+  if (cbt->fd < 0) {
+    free(cbt);
+    return NULL;
+  }
+
+  if (!cbt_load(cbt)) {
+    cbt_free_bitmaps(cbt);
+    cbt->checkpoints = 0;
+    cbt->epoch++;
+    cbt->bitmaps[0] = (uint64_t*)calloc((size_t)cbt->words, sizeof(uint64_t));
+    cbt->live = cbt->bitmaps[0];
+  }
+
+  // until it is closed the file does not describe the changes
+  if (cbt->live == NULL || !cbt_write_header(cbt, FALSE) || !vinil_fsync(cbt->fd)) {
+    vinil_close(cbt->fd);
+    cbt_free_bitmaps(cbt);
+    free(cbt);
+    return NULL;
+  }
+
+  return cbt;
+}
+
+void vinil_cbt_mark(VinilCBT* cbt, uint64_t sector, uint64_t count) {
+  if (count == 0 || sector >= cbt->sectors)
+    return;
+  if (count > cbt->sectors - sector)
+    count = cbt->sectors - sector;
+
+  uint64_t first = sector >> cbt->shift;
+  uint64_t last = (sector + count - 1) >> cbt->shift;
+
+  uint64_t word;
+  for (word = first / 64; word <= last / 64; word++) {
+    uint64_t mask = ~(uint64_t)0;
+    if (word == first / 64)
+      mask &= ~(uint64_t)0 << (first % 64);
+    if (word == last / 64)
+      mask &= ~(uint64_t)0 >> (63 - last % 64);
+
+    // bits which are already set do not take the cache line away from other writers
+    if ((vinil_atomic_load(&cbt->live[word]) & mask) != mask)
+      vinil_atomic_or(&cbt->live[word], mask);
+  }
+}
+
+int vinil_cbt_checkpoint(VinilCBT* cbt, const char* name) {
+  if (strlen(name) >= VINIL_CBT_NAME_SIZE || cbt_find(cbt, name) >= 0)
+    return FALSE;
+
+  uint64_t* bitmap = (uint64_t*)calloc((size_t)cbt->words, sizeof(uint64_t));
+  if (bitmap == NULL)
+    return FALSE;
+
+  // the oldest checkpoint is forgotten, its changes still count for the whole epoch
+  if (cbt->checkpoints == VINIL_CBT_CHECKPOINTS) {
+    uint64_t word;
+    for (word = 0; word < cbt->words; word++)
+      cbt->bitmaps[0][word] |= cbt->bitmaps[1][word];
+    free(cbt->bitmaps[1]);
+
+    memmove(cbt->names[0], cbt->names[1], (VINIL_CBT_CHECKPOINTS - 1) * VINIL_CBT_NAME_SIZE);
+    memmove(&cbt->bitmaps[1], &cbt->bitmaps[2], (VINIL_CBT_CHECKPOINTS - 1) * sizeof(uint64_t*));
+    cbt->checkpoints--;
+  }
+
+  strcpy(cbt->names[cbt->checkpoints], name);
+  cbt->checkpoints++;
+  cbt->bitmaps[cbt->checkpoints] = bitmap;
+  cbt->live = bitmap;
+
+  return TRUE;
+}
+
+int vinil_cbt_changes(VinilCBT* cbt, const char* since, vinil_cbt_fn fn, void* arg) {
+  int from = 0;
+  if (since) {
+    from = cbt_find(cbt, since) + 1;
+    if (from == 0)
+      return FALSE;
+  }
+
+  uint64_t run = 0;
+  int in_run = FALSE;
+
+  uint64_t word;
+  for (word = 0; word < cbt->words; word++) {
+    uint64_t changed = 0;
+    int i;
+    for (i = from; i <= cbt->checkpoints; i++)
+      changed |= vinil_atomic_load(&cbt->bitmaps[i][word]);
+
+    if ((changed == 0 && !in_run) || (changed == ~(uint64_t)0 && in_run))
+      continue;
+
+    int bit;
+    for (bit = 0; bit < 64; bit++) {
+      int set = (int)((changed >> bit) & 1);
+      if (set && !in_run) {
+        run = word * 64 + bit;
+        in_run = TRUE;
+      } else if (!set && in_run) {
+        if (!cbt_emit(cbt, run, word * 64 + bit, fn, arg))
+          return FALSE;
+        in_run = FALSE;
+      }
+    }
+  }
+
+  return !in_run || cbt_emit(cbt, run, cbt->bits, fn, arg);
+}
+
+void vinil_cbt_reset(VinilCBT* cbt) {
+  int i;
+  for (i = 1; i <= VINIL_CBT_CHECKPOINTS; i++) {
+    free(cbt->bitmaps[i]);
+    cbt->bitmaps[i] = NULL;
+  }
+
+  memset(cbt->bitmaps[0], 0, (size_t)(cbt->words * sizeof(uint64_t)));
+  cbt->live = cbt->bitmaps[0];
+  cbt->checkpoints = 0;
+  cbt->epoch++;
+}
+
+uint64_t vinil_cbt_epoch(VinilCBT* cbt) {
+  return cbt->epoch;
+}
+
+int vinil_cbt_close(VinilCBT* cbt) {
+  int ok = cbt_save(cbt);
+
+  ok = vinil_close(cbt->fd) && ok;
+  cbt_free_bitmaps(cbt);
+  free(cbt);
+
+  return ok;
+}
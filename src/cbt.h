@@ -0,0 +1,114 @@
+/**
+ *  @file       cbt.h
+ *  @brief      Changed block tracking of Virtual Hard Disks for incremental backups.
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#ifndef VINIL_CBT_H_
+#define VINIL_CBT_H_
+
+#include <stdint.h>
+
+#include "crossplatform.h"
+
+/** @brief Bytes tracked by each bit of the bitmap when no granularity is given (64KB) */
+#define VINIL_CBT_DEFAULT_GRANULARITY   (64*1024)
+
+/** @brief Number of checkpoints kept, creating another one forgets the oldest */
+#define VINIL_CBT_CHECKPOINTS           8
+
+/** @brief Size of the name of a checkpoint, including the terminating null character */
+#define VINIL_CBT_NAME_SIZE             64
+
+/** @brief Version of the tracking files written by this library */
+#define VINIL_CBT_VERSION               1
+
+/** @brief Changed blocks of a VHD, kept in memory and persisted to a tracking file */
+typedef struct VinilCBT VinilCBT;
+
+/** @brief Receives the changed extents, it returns FALSE to stop the iteration */
+typedef int (*vinil_cbt_fn)(void* arg, uint64_t sector, uint64_t count);
+
+/** @brief  Opens a tracking file, or creates it if it does not exist. The tracked changes
+ *          are kept only if the file describes a disk of the same size and granularity and
+ *          was saved by vinil_cbt_close: otherwise writes may have been missed and a new
+ *          epoch is started without any checkpoint. The file is marked as being in use until
+ *          it is closed, so a crash also starts a new epoch the next time it is opened.
+ *
+ *  @param    filename      C string containing the name of the tracking file
+ *
+ *  @param    sectors       number of sectors of the disk
+ *
+ *  @param    granularity   bytes tracked by each bit, a power of two which is at least 512,
+ *                          VINIL_CBT_DEFAULT_GRANULARITY if it is 0
+ *
+ *  @return   a new VinilCBT object or a null pointer if an error occurs
+ */
+VINILAPI VinilCBT* vinil_cbt_open(const char* filename, uint64_t sectors, uint32_t granularity);
+
+/** @brief  Marks sectors as changed. It takes no lock (bits are set with atomic operations)
+ *          and can be called by several threads at once.
+ *
+ *  @param    cbt       VinilCBT object
+ *
+ *  @param    sector    first sector
+ *
+ *  @param    count     number of sectors
+ */
+VINILAPI void vinil_cbt_mark(VinilCBT* cbt, uint64_t sector, uint64_t count);
+
+/** @brief  Creates a named checkpoint: the changes made from now on are reported by
+ *          vinil_cbt_changes since this name. It must not be called while other threads mark sectors
+ *          or list changes, vinil_vhd_cbt_checkpoint waits for them.
+ *
+ *  @param    cbt       VinilCBT object
+ *
+ *  @param    name      C string with less than VINIL_CBT_NAME_SIZE characters, it must not be in use
+ *
+ *  @return   If the operation was succesfully executed this function will return TRUE.
+ *            Otherwise, FALSE will be returned.
+ */
+VINILAPI int vinil_cbt_checkpoint(VinilCBT* cbt, const char* name);
+
+/** @brief  Calls fn with every extent changed since a checkpoint, in increasing order.
+ *          Extents are aligned to the granularity and merged when they touch. Other threads
+ *          may mark sectors meanwhile, but must not create checkpoints or reset the changes.
+ *
+ *  @param    cbt       VinilCBT object
+ *
+ *  @param    since     name of the checkpoint, or a null pointer for every change of the epoch
+ *
+ *  @param    fn        function called with each extent
+ *
+ *  @param    arg       passed to fn
+ *
+ *  @return   FALSE if the checkpoint is unknown (a full backup is needed) or fn stopped
+ *            the iteration, TRUE otherwise.
+ */
+VINILAPI int vinil_cbt_changes(VinilCBT* cbt, const char* since, vinil_cbt_fn fn, void* arg);
+
+/** @brief  Forgets every checkpoint and change, and starts a new epoch.
+ *          It must not be called while other threads mark sectors.
+ *
+ *  @param    cbt       VinilCBT object
+ */
+VINILAPI void vinil_cbt_reset(VinilCBT* cbt);
+
+/** @brief  Returns the number of the current epoch, it grows every time the changes are forgotten
+ *
+ *  @param    cbt       VinilCBT object
+ *
+ *  @return   the epoch
+ */
+VINILAPI uint64_t vinil_cbt_epoch(VinilCBT* cbt);
+
+/** @brief  Saves the changes to the tracking file and closes it
+ *
+ *  @param    cbt       VinilCBT object
+ *
+ *  @return   TRUE if the file was saved, FALSE otherwise (it will start a new epoch).
+ */
+VINILAPI int vinil_cbt_close(VinilCBT* cbt);
+
+#endif
@@ -0,0 +1,182 @@
+/**
+ *  @file       convert.c
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#include "convert.h"
+#include "vhd.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define CONVERT_MAX_THREADS 64
+
+typedef struct {
+  VinilVHD* source;
+  VinilVHD* destination;
+  uint64_t sectors;
+  uint64_t block_sectors;
+  uint64_t blocks;
+  uint64_t next_block;
+  uint64_t failed;
+  VinilConvertStats stats;
+} ConvertJob;
+
+// TRUE if no layer of a dynamic or differencing source has data in [sector, sector + count)
+static int convert_unallocated(VinilVHD* source, uint64_t sector, uint64_t count) {
+  uint64_t sectors_per_block = source->header->block_size / 512;
+  uint64_t block;
+  for (block = sector / sectors_per_block; block <= (sector + count - 1) / sectors_per_block; block++) {
+    if (block >= source->header->max_table_entries)
+      return FALSE;
+
+    if (source->owners ? source->owners[block] != NULL : source->bat[block] != VINIL_VHD_UNUSED_BLOCK)
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+// reads a block of a fixed source, only the extents which hold data are read and the holes are zeroed
+static int convert_read_fixed(ConvertJob* job, uint8_t* buffer, uint64_t sector, uint64_t count, int* hole) {
+  int64_t offset = (int64_t)(sector * 512);
+  int64_t end = (int64_t)((sector + count) * 512);
+
+  int64_t data, data_end;
+  *hole = !vinil_next_data(job->source->fd, offset, &data, &data_end) || data >= end;
+  if (*hole)
+    return TRUE;
+
+  while (offset < end) {
+    if (offset > data && (!vinil_next_data(job->source->fd, offset, &data, &data_end) || data >= end))
+      data = data_end = end;
+    if (data_end > end)
+      data_end = end;
+
+    memset(buffer + (offset - (int64_t)(sector * 512)), 0, (size_t)(data - offset));
+    if (data_end > data) {
+      // the extents of the file are not aligned to sectors
+      uint64_t first = (uint64_t)data / 512;
+      uint64_t last = ((uint64_t)data_end + 511) / 512;
+      if (!vinil_vhd_pread(job->source, buffer + (first - sector) * 512, first, last - first))
+        return FALSE;
+
+      vinil_atomic_add(&job->stats.bytes_read, (last - first) * 512);
+      data_end = (int64_t)(last * 512);
+    }
+
+    offset = data_end;
+  }
+
+  return TRUE;
+}
+
+static int convert_block(ConvertJob* job, uint8_t* buffer, uint64_t block) {
+  uint64_t sector = block * job->block_sectors;
+  uint64_t count = job->sectors - sector < job->block_sectors ? job->sectors - sector : job->block_sectors;
+  int hole;
+
+  if (job->source->header) {
+    hole = convert_unallocated(job->source, sector, count);
+    if (!hole) {
+      if (!vinil_vhd_pread(job->source, buffer, sector, count))
+        return FALSE;
+      vinil_atomic_add(&job->stats.bytes_read, count * 512);
+    }
+  } else if (!convert_read_fixed(job, buffer, sector, count, &hole)) {
+    return FALSE;
+  }
+
+  if (hole) {
+    vinil_atomic_add(&job->stats.hole_blocks, 1);
+    return TRUE;
+  }
+
+  if (vinil_is_zero(buffer, (size_t)(count * 512))) {
+    vinil_atomic_add(&job->stats.zero_blocks, 1);
+    return TRUE;
+  }
+
+  if (!vinil_vhd_pwrite(job->destination, buffer, sector, count))
+    return FALSE;
+
+  vinil_atomic_add(&job->stats.written_blocks, 1);
+
+  return TRUE;
+}
+
+static void* convert_worker(void* arg) {
+  ConvertJob* job = (ConvertJob*)arg;
+
+  uint8_t* buffer = (uint8_t*)vinil_alloc_aligned_buffer((size_t)(job->block_sectors * 512));
+  if (buffer == NULL) {
+    vinil_atomic_store(&job->failed, 1);
+    return NULL;
+  }
+
+  // blocks are handed out one at a time, so a thread which hits data does not hold the others back
+  while (!vinil_atomic_load(&job->failed)) {
+    uint64_t block = vinil_atomic_add(&job->next_block, 1);
+    if (block >= job->blocks)
+      break;
+
+    if (!convert_block(job, buffer, block))
+      vinil_atomic_store(&job->failed, 1);
+  }
+
+  vinil_free_aligned_buffer(buffer);
+
+  return NULL;
+}
+
+int vinil_convert(const char* source, const char* destination, int threads, VinilConvertStats* stats) {
+  if (threads <= 0)
+    threads = VINIL_CONVERT_DEFAULT_THREADS;
+  if (threads > CONVERT_MAX_THREADS)
+    threads = CONVERT_MAX_THREADS;
+
+  ConvertJob job;
+  memset(&job, 0, sizeof(job));
+
+  job.source = vinil_vhd_open_with_flags(source, VINIL_VHD_OPEN_READ_ONLY);
+  if (job.source == NULL)
+    return FALSE;
+
+  job.destination = vinil_vhd_create(destination, job.source->footer->current_size, VINIL_VHD_DYNAMIC,
+                                     VINIL_VHD_PREALLOC_SPARSE);
+  if (job.destination == NULL) {
+    vinil_vhd_close(job.source);
+    return FALSE;
+  }
+
+  job.sectors = job.source->footer->current_size / 512;
+  job.block_sectors = job.destination->header->block_size / 512;
+  job.blocks = (job.sectors + job.block_sectors - 1) / job.block_sectors;
+  job.stats.blocks = job.blocks;
+
+  vinil_thread workers[CONVERT_MAX_THREADS];
+  int started = 0;
+  while (started < threads && vinil_thread_create(&workers[started], convert_worker, &job))
+    started++;
+
+  if (started == 0)
+    convert_worker(&job);
+
+  int i;
+  for (i = 0; i < started; i++)
+    vinil_thread_join(workers[i]);
+
+  int ok = !job.failed && vinil_vhd_flush(job.destination);
+
+  vinil_vhd_close(job.destination);
+  vinil_vhd_close(job.source);
+
+  if (!ok)
+    remove(destination);
+
+  if (stats)
+    *stats = job.stats;
+
+  return ok;
+}
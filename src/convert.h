@@ -0,0 +1,46 @@
+/**
+ *  @file       convert.h
+ *  @brief      Conversion of Virtual Hard Disks into sparse dynamic VHDs.
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#ifndef VINIL_CONVERT_H_
+#define VINIL_CONVERT_H_
+
+#include <stdint.h>
+
+#include "crossplatform.h"
+
+/** @brief Number of threads used by vinil_convert when none is given */
+#define VINIL_CONVERT_DEFAULT_THREADS   4
+
+/** @brief What vinil_convert did, every block has the size of a block of the new VHD */
+typedef struct {
+  uint64_t  blocks;           /**< blocks of the new VHD */
+  uint64_t  written_blocks;   /**< blocks with data, copied to the new VHD */
+  uint64_t  hole_blocks;      /**< blocks skipped without being read (holes of the source file or unallocated blocks) */
+  uint64_t  zero_blocks;      /**< blocks which were read and only contained zeros */
+  uint64_t  bytes_read;       /**< bytes read from the source */
+} VinilConvertStats;
+
+/** @brief  Copies a VHD into a new dynamic VHD which only allocates the blocks with data.
+ *          Blocks are read in parallel by several threads. The holes of a fixed source
+ *          (SEEK_DATA/SEEK_HOLE) and the unallocated blocks of a dynamic source are skipped
+ *          without being read, and blocks which only contain zeros are not written, so the
+ *          time it takes depends on the data of the source, not on its virtual size.
+ *
+ *  @param    source        C string containing the name of the VHD to be converted
+ *
+ *  @param    destination   C string containing the name of the dynamic VHD to be created, it must not exist
+ *
+ *  @param    threads       number of threads, VINIL_CONVERT_DEFAULT_THREADS if it is not positive
+ *
+ *  @param    stats         receives what was done, it may be a null pointer
+ *
+ *  @return   If the operation was succesfully executed this function will return TRUE.
+ *            Otherwise, FALSE will be returned and the destination is removed.
+ */
+VINILAPI int vinil_convert(const char* source, const char* destination, int threads, VinilConvertStats* stats);
+
+#endif
@@ -0,0 +1,651 @@
+/**
+ *  @file       crc.c
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#include "crc.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+  #include <nmmintrin.h>
+  #define VINIL_CRC_SSE42
+#elif defined(_M_X64)
+  #include <nmmintrin.h>
+  #include <intrin.h>
+  #define VINIL_CRC_SSE42
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+  #include <arm_acle.h>
+  #define VINIL_CRC_ARM
+#endif
+
+#define CRC_POLYNOMIAL    0x82F63B78
+#define CRC_HEADER_SIZE   40
+#define CRC_IO_SIZE       4096
+#define CRC_STRIPES       256
+
+// the writes in flight of every CRC_STRIPES-th block, the sequence changes with their data
+typedef struct {
+  vinil_mutex lock;
+  uint64_t writes;
+  uint64_t sequence;        // ticket of the last write which began, or of none if writes overlapped
+} CRCStripe;
+
+struct VinilCRC {
+  int fd;
+  int read_only;
+  uint64_t sectors;
+  uint32_t block_size;
+  uint32_t block_sectors;
+  uint64_t blocks;
+  uint64_t words;
+  uint32_t* values;
+  uint64_t* stale;          // one bit per block, set before the block is written
+  uint64_t* persisted;      // bits which are set in the file, see crc_mark
+  uint64_t* previous;       // bits of the file before vinil_crc_save
+  uint64_t* saving;         // bits written by vinil_crc_save
+  uint32_t zero;
+  uint64_t tickets;
+  int locks_ready;          // stripes whose mutex was initialized, then the mutex of the file
+  vinil_mutex file_lock;    // serializes the writes of the bits
+  CRCStripe stripes[CRC_STRIPES];
+};
+
+static uint32_t crc_table[8][256];
+static uint64_t crc_table_ready = 0;
+
+// slicing-by-8: eight bytes are folded by eight lookups
+static void crc_build_table(void) {
+  uint32_t i;
+  for (i = 0; i < 256; i++) {
+    uint32_t c = i;
+    int bit;
+    for (bit = 0; bit < 8; bit++)
+      c = c & 1 ? (c >> 1) ^ CRC_POLYNOMIAL : c >> 1;
+    crc_table[0][i] = c;
+  }
+
+  for (i = 0; i < 256; i++) {
+    int k;
+    for (k = 1; k < 8; k++)
+      crc_table[k][i] = (crc_table[k - 1][i] >> 8) ^ crc_table[0][crc_table[k - 1][i] & 0xFF];
+  }
+}
+
+static uint32_t crc_software(uint32_t crc, const uint8_t* p, size_t size) {
+  // every thread which gets here first builds the same table
+  if (!vinil_atomic_load(&crc_table_ready)) {
+    crc_build_table();
+    vinil_atomic_store(&crc_table_ready, 1);
+  }
+
+  while (size >= 8) {
+    uint32_t lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+    uint32_t hi = (uint32_t)p[4] | (uint32_t)p[5] << 8 | (uint32_t)p[6] << 16 | (uint32_t)p[7] << 24;
+    crc = crc_table[7][lo & 0xFF] ^ crc_table[6][(lo >> 8) & 0xFF] ^ crc_table[5][(lo >> 16) & 0xFF] ^
+          crc_table[4][lo >> 24] ^ crc_table[3][hi & 0xFF] ^ crc_table[2][(hi >> 8) & 0xFF] ^
+          crc_table[1][(hi >> 16) & 0xFF] ^ crc_table[0][hi >> 24];
+    p += 8;
+    size -= 8;
+  }
+
+  while (size > 0) {
+    crc = crc_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    size--;
+  }
+
+  return crc;
+}
+
+#if defined(VINIL_CRC_SSE42)
+#if !defined(_MSC_VER)
+__attribute__((target("sse4.2")))
+#endif
+static uint32_t crc_sse42(uint32_t crc, const uint8_t* p, size_t size) {
+  uint64_t c = crc;
+  while (size >= 8) {
+    uint64_t value;
+    memcpy(&value, p, 8);
+    c = _mm_crc32_u64(c, value);
+    p += 8;
+    size -= 8;
+  }
+
+  crc = (uint32_t)c;
+  while (size > 0) {
+    crc = _mm_crc32_u8(crc, *p++);
+    size--;
+  }
+
+  return crc;
+}
+
+static int crc_has_sse42(void) {
+#if defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 1);
+  return (info[2] & (1 << 20)) != 0;
+#else
+  return __builtin_cpu_supports("sse4.2");
+#endif
+}
+#elif defined(VINIL_CRC_ARM)
+static uint32_t crc_arm(uint32_t crc, const uint8_t* p, size_t size) {
+  while (size >= 8) {
+    uint64_t value;
+    memcpy(&value, p, 8);
+    crc = __crc32cd(crc, value);
+    p += 8;
+    size -= 8;
+  }
+
+  while (size > 0) {
+    crc = __crc32cb(crc, *p++);
+    size--;
+  }
+
+  return crc;
+}
+#endif
+
+uint32_t vinil_crc32c(uint32_t crc, const void* buffer, size_t size) {
+  const uint8_t* p = (const uint8_t*)buffer;
+
+#if defined(VINIL_CRC_SSE42)
+  // 0 until the CPU was probed, then 1 without SSE4.2 and 2 with it, every thread which probes it stores the same value
+  static uint64_t sse42 = 0;
+  uint64_t probed = vinil_atomic_load(&sse42);
+  if (probed == 0) {
+    probed = crc_has_sse42() ? 2 : 1;
+    vinil_atomic_store(&sse42, probed);
+  }
+  if (probed == 2)
+    return ~crc_sse42(~crc, p, size);
+#elif defined(VINIL_CRC_ARM)
+  return ~crc_arm(~crc, p, size);
+#endif
+
+  return ~crc_software(~crc, p, size);
+}
+
+static void crc_put(uint8_t* p, uint64_t value, int size) {
+  int i;
+  for (i = 0; i < size; i++)
+    p[i] = (uint8_t)(value >> (8 * i));
+}
+
+static uint64_t crc_get(const uint8_t* p, int size) {
+  uint64_t value = 0;
+  int i;
+  for (i = size - 1; i >= 0; i--)
+    value = (value << 8) | p[i];
+  return value;
+}
+
+static int64_t crc_stale_offset(VinilCRC* crc) {
+  return CRC_HEADER_SIZE + (int64_t)(crc->blocks * 4);
+}
+
+static int crc_write_header(VinilCRC* crc, int state) {
+  uint8_t header[CRC_HEADER_SIZE];
+  memset(header, 0, sizeof(header));
+  memcpy(header, "VNLCRC32", 8);
+  crc_put(header + 8, VINIL_CRC_VERSION, 4);
+  crc_put(header + 12, state, 4);
+  crc_put(header + 16, crc->sectors, 8);
+  crc_put(header + 24, crc->block_size, 4);
+  crc_put(header + 32, crc->blocks, 8);
+
+  return vinil_pwrite(crc->fd, header, CRC_HEADER_SIZE, 0);
+}
+
+// returns the state of the file, VINIL_CRC_FILE_INVALID unless it is a checksum file
+static int crc_read_header(int fd, uint8_t* header) {
+  if (!vinil_pread(fd, header, CRC_HEADER_SIZE, 0) || memcmp(header, "VNLCRC32", 8) != 0 ||
+      crc_get(header + 8, 4) != VINIL_CRC_VERSION)
+    return VINIL_CRC_FILE_INVALID;
+
+  int state = (int)crc_get(header + 12, 4);
+  return state == VINIL_CRC_FILE_CLOSED || state == VINIL_CRC_FILE_OPEN ? state : VINIL_CRC_FILE_INVALID;
+}
+
+// values are stored as 4 little-endian bytes and stale words as 8
+static int crc_write_array(VinilCRC* crc, const void* array, uint64_t count, int size, int64_t offset) {
+  uint8_t buffer[CRC_IO_SIZE];
+  uint64_t per_write = CRC_IO_SIZE / size;
+  uint64_t done = 0;
+  while (done < count) {
+    uint64_t n = count - done < per_write ? count - done : per_write;
+    uint64_t i;
+    for (i = 0; i < n; i++) {
+      uint64_t value = size == 4 ? ((const uint32_t*)array)[done + i] : ((const uint64_t*)array)[done + i];
+      crc_put(buffer + i * size, value, size);
+    }
+
+    if (!vinil_pwrite(crc->fd, buffer, (size_t)(n * size), offset))
+      return FALSE;
+
+    done += n;
+    offset += (int64_t)(n * size);
+  }
+
+  return TRUE;
+}
+
+static int crc_read_array(VinilCRC* crc, void* array, uint64_t count, int size, int64_t offset) {
+  uint8_t buffer[CRC_IO_SIZE];
+  uint64_t per_read = CRC_IO_SIZE / size;
+  uint64_t done = 0;
+  while (done < count) {
+    uint64_t n = count - done < per_read ? count - done : per_read;
+    if (!vinil_pread(crc->fd, buffer, (size_t)(n * size), offset))
+      return FALSE;
+
+    uint64_t i;
+    for (i = 0; i < n; i++) {
+      if (size == 4)
+        ((uint32_t*)array)[done + i] = (uint32_t)crc_get(buffer + i * size, size);
+      else
+        ((uint64_t*)array)[done + i] = crc_get(buffer + i * size, size);
+    }
+
+    done += n;
+    offset += (int64_t)(n * size);
+  }
+
+  return TRUE;
+}
+
+// loads the checksums of a file which describes the same disk: one which was closed, or whose
+// writer crashed (its stale bits were written before the blocks, see crc_mark)
+static int crc_load(VinilCRC* crc) {
+  uint8_t header[CRC_HEADER_SIZE];
+  if (crc_read_header(crc->fd, header) == VINIL_CRC_FILE_INVALID || crc_get(header + 16, 8) != crc->sectors ||
+      crc_get(header + 24, 4) != crc->block_size || crc_get(header + 32, 8) != crc->blocks)
+    return FALSE;
+
+  return crc_read_array(crc, crc->values, crc->blocks, 4, CRC_HEADER_SIZE) &&
+         crc_read_array(crc, crc->stale, crc->words, 8, crc_stale_offset(crc));
+}
+
+static void crc_destroy(VinilCRC* crc) {
+  int i;
+  for (i = 0; i < crc->locks_ready; i++)
+    vinil_mutex_destroy(i == CRC_STRIPES ? &crc->file_lock : &crc->stripes[i].lock);
+
+  free(crc->values);
+  free(crc->stale);
+  free(crc->persisted);
+  free(crc->previous);
+  free(crc->saving);
+  free(crc);
+}
+
+static VinilCRC* crc_create(uint64_t sectors, uint32_t block_size) {
+  if (block_size < 512 || (block_size & (block_size - 1)) != 0 || sectors == 0)
+    return NULL;
+
+  VinilCRC* crc = (VinilCRC*)calloc(1, sizeof(VinilCRC));
+  if (crc == NULL)
+    return NULL;
+
+  crc->fd = -1;
+  crc->sectors = sectors;
+  crc->block_size = block_size;
+  crc->block_sectors = block_size / 512;
+  crc->blocks = (sectors + crc->block_sectors - 1) / crc->block_sectors;
+  crc->words = (crc->blocks + 63) / 64;
+  crc->values = (uint32_t*)calloc((size_t)crc->blocks, sizeof(uint32_t));
+  crc->stale = (uint64_t*)calloc((size_t)crc->words, sizeof(uint64_t));
+  crc->persisted = (uint64_t*)calloc((size_t)crc->words, sizeof(uint64_t));
+  crc->previous = (uint64_t*)calloc((size_t)crc->words, sizeof(uint64_t));
+  crc->saving = (uint64_t*)calloc((size_t)crc->words, sizeof(uint64_t));
+  if (crc->values == NULL || crc->stale == NULL || crc->persisted == NULL || crc->previous == NULL ||
+      crc->saving == NULL) {
+    crc_destroy(crc);
+    return NULL;
+  }
+
+  // the stripes start at the first ticket, which no write gets
+  crc->tickets = 1;
+  for (; crc->locks_ready <= CRC_STRIPES; crc->locks_ready++) {
+    if (crc->locks_ready < CRC_STRIPES)
+      crc->stripes[crc->locks_ready].sequence = crc->tickets;
+    if (!vinil_mutex_init(crc->locks_ready == CRC_STRIPES ? &crc->file_lock : &crc->stripes[crc->locks_ready].lock)) {
+      crc_destroy(crc);
+      return NULL;
+    }
+  }
+
+  uint8_t zeros[CRC_IO_SIZE];
+  memset(zeros, 0, sizeof(zeros));
+  uint32_t done;
+  for (done = 0; done < block_size; done += sizeof(zeros))
+    crc->zero = vinil_crc32c(crc->zero, zeros, block_size - done < sizeof(zeros) ? block_size - done : sizeof(zeros));
+
+  return crc;
+}
+
+VinilCRC* vinil_crc_open(const char* filename, uint64_t sectors, uint32_t block_size) {
+  VinilCRC* crc = crc_create(sectors, block_size == 0 ? VINIL_CRC_DEFAULT_BLOCK_SIZE : block_size);
+  if (crc == NULL)
+    return NULL;
+
+  crc->fd = vinil_open(filename, O_RDWR | O_CREAT);
+  if (crc->fd < 0) {
+    crc_destroy(crc);
+    return NULL;
+  }
+
+  // nothing is known about the blocks of a new file, or of one which describes another disk,
+  // and the file holds all of them before its header says that it describes this one
+  int ok = crc_load(crc);
+  if (!ok) {
+    memset(crc->values, 0, (size_t)(crc->blocks * sizeof(uint32_t)));
+    memset(crc->stale, 0xFF, (size_t)(crc->words * sizeof(uint64_t)));
+    ok = crc_write_array(crc, crc->values, crc->blocks, 4, CRC_HEADER_SIZE) &&
+         crc_write_array(crc, crc->stale, crc->words, 8, crc_stale_offset(crc)) &&
+         vinil_truncate(crc->fd, crc_stale_offset(crc) + (int64_t)(crc->words * 8)) && vinil_fsync(crc->fd);
+  }
+
+  memcpy(crc->persisted, crc->stale, (size_t)(crc->words * sizeof(uint64_t)));
+
+  if (!ok || !crc_write_header(crc, VINIL_CRC_FILE_OPEN) || !vinil_fsync(crc->fd)) {
+    vinil_close(crc->fd);
+    crc_destroy(crc);
+    return NULL;
+  }
+
+  return crc;
+}
+
+VinilCRC* vinil_crc_open_read_only(const char* filename, uint64_t sectors) {
+  int fd = vinil_open(filename, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+
+  uint8_t header[CRC_HEADER_SIZE];
+  VinilCRC* crc = NULL;
+  if (crc_read_header(fd, header) == VINIL_CRC_FILE_CLOSED)
+    crc = crc_create(sectors, (uint32_t)crc_get(header + 24, 4));
+
+  if (crc == NULL) {
+    vinil_close(fd);
+    return NULL;
+  }
+
+  crc->fd = fd;
+  crc->read_only = TRUE;
+  if (!crc_load(crc)) {
+    vinil_close(fd);
+    crc_destroy(crc);
+    return NULL;
+  }
+
+  return crc;
+}
+
+int vinil_crc_file_state(const char* filename) {
+  int fd = vinil_open(filename, O_RDONLY);
+  if (fd < 0)
+    return VINIL_CRC_FILE_INVALID;
+
+  uint8_t header[CRC_HEADER_SIZE];
+  int state = crc_read_header(fd, header);
+  vinil_close(fd);
+
+  return state;
+}
+
+uint64_t vinil_crc_blocks(VinilCRC* crc) {
+  return crc->blocks;
+}
+
+uint32_t vinil_crc_block_sectors(VinilCRC* crc) {
+  return crc->block_sectors;
+}
+
+// finds the blocks of sectors, FALSE if there are none
+static int crc_range(VinilCRC* crc, uint64_t sector, uint64_t count, uint64_t* first, uint64_t* last) {
+  if (count == 0 || sector >= crc->sectors)
+    return FALSE;
+  if (count > crc->sectors - sector)
+    count = crc->sectors - sector;
+
+  *first = sector / crc->block_sectors;
+  *last = (sector + count - 1) / crc->block_sectors;
+
+  return TRUE;
+}
+
+static uint64_t crc_mask(uint64_t first, uint64_t last, uint64_t word) {
+  uint64_t mask = ~(uint64_t)0;
+  if (word == first / 64)
+    mask &= ~(uint64_t)0 << (first % 64);
+  if (word == last / 64)
+    mask &= ~(uint64_t)0 >> (63 - last % 64);
+
+  return mask;
+}
+
+// marks blocks as stale, in the file too unless it already says so: a crash leaves a file whose
+// clear bits still describe their blocks. Whole words are marked in the file, so the next
+// writes of their blocks do not wait for it until the next vinil_crc_save
+static int crc_mark(VinilCRC* crc, uint64_t first, uint64_t last) {
+  if (crc->read_only)
+    return FALSE;
+
+  uint64_t word;
+  for (word = first / 64; word <= last / 64; word++) {
+    uint64_t mask = crc_mask(first, last, word);
+    if ((vinil_atomic_load(&crc->stale[word]) & mask) != mask)
+      vinil_atomic_or(&crc->stale[word], mask);
+  }
+
+  // pairs with vinil_crc_save, which clears the bits of the file before it reads the stale ones
+  vinil_atomic_fence();
+
+  int persisted = TRUE;
+  for (word = first / 64; word <= last / 64 && persisted; word++) {
+    uint64_t mask = crc_mask(first, last, word);
+    persisted = (vinil_atomic_load(&crc->persisted[word]) & mask) == mask;
+  }
+
+  if (persisted)
+    return TRUE;
+
+  uint8_t ones[8];
+  memset(ones, 0xFF, sizeof(ones));
+
+  vinil_mutex_lock(&crc->file_lock);
+
+  int ok = TRUE;
+  for (word = first / 64; word <= last / 64 && ok; word++) {
+    if (crc->persisted[word] != ~(uint64_t)0)
+      ok = vinil_pwrite(crc->fd, ones, sizeof(ones), crc_stale_offset(crc) + (int64_t)(word * 8));
+  }
+
+  ok = ok && vinil_fsync(crc->fd);
+  for (word = first / 64; word <= last / 64 && ok; word++)
+    vinil_atomic_store(&crc->persisted[word], ~(uint64_t)0);
+
+  vinil_mutex_unlock(&crc->file_lock);
+
+  return ok;
+}
+
+int vinil_crc_invalidate(VinilCRC* crc, uint64_t sector, uint64_t count) {
+  uint64_t first, last;
+  return !crc_range(crc, sector, count, &first, &last) || crc_mark(crc, first, last);
+}
+
+uint64_t vinil_crc_begin_write(VinilCRC* crc, uint64_t sector, uint64_t count) {
+  uint64_t ticket = vinil_atomic_add(&crc->tickets, 1) + 1;
+  uint64_t first, last;
+  if (!crc_range(crc, sector, count, &first, &last))
+    return ticket;
+
+  uint64_t block;
+  for (block = first; block <= last && block - first < CRC_STRIPES; block++) {
+    CRCStripe* stripe = &crc->stripes[block % CRC_STRIPES];
+    vinil_mutex_lock(&stripe->lock);
+    stripe->writes++;
+    stripe->sequence = ticket;
+    vinil_mutex_unlock(&stripe->lock);
+  }
+
+  if (!crc_mark(crc, first, last)) {
+    vinil_crc_end_write(crc, sector, count, ticket);
+    return 0;
+  }
+
+  return ticket;
+}
+
+void vinil_crc_end_write(VinilCRC* crc, uint64_t sector, uint64_t count, uint64_t ticket) {
+  uint64_t first, last;
+  if (!crc_range(crc, sector, count, &first, &last))
+    return;
+
+  uint64_t block;
+  for (block = first; block <= last && block - first < CRC_STRIPES; block++) {
+    CRCStripe* stripe = &crc->stripes[block % CRC_STRIPES];
+    vinil_mutex_lock(&stripe->lock);
+    stripe->writes--;
+
+    // the blocks only hold the data of the write if no other write of the stripe overlapped it
+    if (stripe->sequence != ticket || stripe->writes > 0)
+      stripe->sequence = vinil_atomic_add(&crc->tickets, 1) + 1;
+    vinil_mutex_unlock(&stripe->lock);
+  }
+}
+
+uint64_t vinil_crc_sequence(VinilCRC* crc, uint64_t block) {
+  CRCStripe* stripe = &crc->stripes[block % CRC_STRIPES];
+  vinil_mutex_lock(&stripe->lock);
+  uint64_t sequence = stripe->writes == 0 ? stripe->sequence : 0;
+  vinil_mutex_unlock(&stripe->lock);
+
+  return sequence;
+}
+
+int vinil_crc_stale(VinilCRC* crc, uint64_t block) {
+  return (vinil_atomic_load(&crc->stale[block / 64]) >> (block % 64)) & 1;
+}
+
+uint64_t vinil_crc_next_stale(VinilCRC* crc, uint64_t block) {
+  while (block < crc->blocks) {
+    uint64_t word = vinil_atomic_load(&crc->stale[block / 64]) >> (block % 64);
+    if (word != 0) {
+      while (!(word & 1)) {
+        word >>= 1;
+        block++;
+      }
+      return block < crc->blocks ? block : crc->blocks;
+    }
+
+    block = (block / 64 + 1) * 64;
+  }
+
+  return crc->blocks;
+}
+
+uint32_t vinil_crc_get(VinilCRC* crc, uint64_t block) {
+  return crc->values[block];
+}
+
+void vinil_crc_set(VinilCRC* crc, uint64_t block, uint32_t value) {
+  crc->values[block] = value;
+  vinil_atomic_fence();
+  vinil_atomic_and(&crc->stale[block / 64], ~((uint64_t)1 << (block % 64)));
+}
+
+int vinil_crc_update(VinilCRC* crc, uint64_t block, uint32_t value, uint64_t sequence) {
+  CRCStripe* stripe = &crc->stripes[block % CRC_STRIPES];
+  vinil_mutex_lock(&stripe->lock);
+  int current = stripe->writes == 0 && stripe->sequence == sequence;
+  if (current)
+    vinil_crc_set(crc, block, value);
+  vinil_mutex_unlock(&stripe->lock);
+
+  return current;
+}
+
+uint32_t vinil_crc_zero_block(VinilCRC* crc) {
+  return crc->zero;
+}
+
+// tells whether a word of bits changed since the last save, or whether some of its blocks
+// stopped being stale (so their checksums are written)
+static int crc_changed(VinilCRC* crc, uint64_t word, int values) {
+  return values ? (crc->previous[word] & ~crc->saving[word]) != 0 : crc->previous[word] != crc->saving[word];
+}
+
+// writes the runs of changed words, or the checksums of their blocks
+static int crc_write_changes(VinilCRC* crc, int values, int* written) {
+  uint64_t start = 0;
+  while (start < crc->words) {
+    for (; start < crc->words && !crc_changed(crc, start, values); start++);
+
+    uint64_t end;
+    for (end = start; end < crc->words && crc_changed(crc, end, values); end++);
+
+    if (start == end)
+      break;
+
+    uint64_t blocks = end * 64 < crc->blocks ? end * 64 - start * 64 : crc->blocks - start * 64;
+    int ok = values ? crc_write_array(crc, crc->values + start * 64, blocks, 4, CRC_HEADER_SIZE + (int64_t)(start * 64 * 4))
+                    : crc_write_array(crc, crc->saving + start, end - start, 8, crc_stale_offset(crc) + (int64_t)(start * 8));
+    if (!ok)
+      return FALSE;
+
+    *written = TRUE;
+    start = end;
+  }
+
+  return TRUE;
+}
+
+int vinil_crc_save(VinilCRC* crc, vinil_crc_flush_fn flush, void* arg) {
+  if (crc->read_only)
+    return FALSE;
+
+  vinil_mutex_lock(&crc->file_lock);
+
+  // the writes which begin from now on wait in crc_mark until the bits of the file are rewritten
+  uint64_t word;
+  for (word = 0; word < crc->words; word++) {
+    crc->previous[word] = crc->persisted[word];
+    vinil_atomic_store(&crc->persisted[word], 0);
+  }
+  vinil_atomic_fence();
+  for (word = 0; word < crc->words; word++)
+    crc->saving[word] = vinil_atomic_load(&crc->stale[word]);
+
+  // the data is on the disk before its checksums, and the checksums before their bits are cleared
+  int values = FALSE, bits = FALSE;
+  int ok = (flush == NULL || flush(arg)) &&
+           crc_write_changes(crc, TRUE, &values) && (!values || vinil_fsync(crc->fd)) &&
+           crc_write_changes(crc, FALSE, &bits) && (!bits || vinil_fsync(crc->fd));
+
+  // even if the bits were not written, the file has the ones which are set in memory
+  for (word = 0; word < crc->words; word++)
+    vinil_atomic_store(&crc->persisted[word], crc->saving[word]);
+
+  vinil_mutex_unlock(&crc->file_lock);
+
+  return ok;
+}
+
+int vinil_crc_close(VinilCRC* crc) {
+  // the file is only marked as closed once the checksums are on the disk
+  int ok = crc->read_only ||
+           (vinil_crc_save(crc, NULL, NULL) && crc_write_header(crc, VINIL_CRC_FILE_CLOSED) && vinil_fsync(crc->fd));
+
+  ok = vinil_close(crc->fd) && ok;
+  crc_destroy(crc);
+
+  return ok;
+}
@@ -0,0 +1,247 @@
+/**
+ *  @file       crc.h
+ *  @brief      CRC32C checksums of the blocks of Virtual Hard Disks.
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#ifndef VINIL_CRC_H_
+#define VINIL_CRC_H_
+
+#include <stdint.h>
+
+#include "crossplatform.h"
+
+/** @brief Bytes covered by each checksum when no block size is given (64KB) */
+#define VINIL_CRC_DEFAULT_BLOCK_SIZE    (64*1024)
+
+/** @brief Version of the checksum files written by this library */
+#define VINIL_CRC_VERSION               1
+
+/** @brief The checksum file cannot be read, or it is not one */
+#define VINIL_CRC_FILE_INVALID          0
+
+/** @brief The checksum file was closed by vinil_crc_close */
+#define VINIL_CRC_FILE_CLOSED           1
+
+/** @brief The checksum file is open for writes, or its writer crashed */
+#define VINIL_CRC_FILE_OPEN             2
+
+/** @brief Writes the data described by the checksums to the disk, it returns FALSE if it fails */
+typedef int (*vinil_crc_flush_fn)(void* arg);
+
+/** @brief Checksums of the blocks of a VHD, kept in memory and persisted to a checksum file */
+typedef struct VinilCRC VinilCRC;
+
+/** @brief  Computes a CRC32C (Castagnoli) checksum. It uses the CRC32 instructions of SSE4.2
+ *          (detected at run time) or ARMv8 when they are available, and tables otherwise.
+ *
+ *  @param    crc       checksum of the previous bytes, 0 for the first ones
+ *
+ *  @param    buffer    bytes to be added to the checksum
+ *
+ *  @param    size      number of bytes
+ *
+ *  @return   the checksum of the previous bytes followed by the buffer
+ */
+VINILAPI uint32_t vinil_crc32c(uint32_t crc, const void* buffer, size_t size);
+
+/** @brief  Opens a checksum file for the writes of its disk, or creates it if it does not
+ *          exist. Blocks whose checksum is not known are stale: every block of a new file, or
+ *          of a file which describes a disk of another size or block size. The file is marked
+ *          as open until vinil_crc_close, and it is kept consistent meanwhile: a block is
+ *          marked as stale in the file before it is written, so after a crash it is opened
+ *          again with the checksums of vinil_crc_save which still hold.
+ *
+ *  @param    filename      C string containing the name of the checksum file
+ *
+ *  @param    sectors       number of sectors of the disk
+ *
+ *  @param    block_size    bytes covered by each checksum, a power of two which is at least 512,
+ *                          VINIL_CRC_DEFAULT_BLOCK_SIZE if it is 0
+ *
+ *  @return   a new VinilCRC object or a null pointer if an error occurs
+ */
+VINILAPI VinilCRC* vinil_crc_open(const char* filename, uint64_t sectors, uint32_t block_size);
+
+/** @brief  Opens a checksum file which was closed by vinil_crc_close without writing it, to
+ *          verify a disk which nobody writes. vinil_crc_file_state tells why it cannot be opened.
+ *
+ *  @param    filename      C string containing the name of the checksum file
+ *
+ *  @param    sectors       number of sectors of the disk, the block size is the one of the file
+ *
+ *  @return   a new VinilCRC object or a null pointer if the file cannot be read, is open for
+ *            writes (or its writer crashed) or describes a disk of another size.
+ */
+VINILAPI VinilCRC* vinil_crc_open_read_only(const char* filename, uint64_t sectors);
+
+/** @brief  Reads the state of a checksum file without opening it
+ *
+ *  @param    filename      C string containing the name of the checksum file
+ *
+ *  @return   VINIL_CRC_FILE_CLOSED, VINIL_CRC_FILE_OPEN, or VINIL_CRC_FILE_INVALID if it cannot
+ *            be read or is not a checksum file.
+ */
+VINILAPI int vinil_crc_file_state(const char* filename);
+
+/** @brief  Returns the number of blocks, the last one may be smaller than the others
+ *
+ *  @param    crc       VinilCRC object
+ *
+ *  @return   the number of blocks
+ */
+VINILAPI uint64_t vinil_crc_blocks(VinilCRC* crc);
+
+/** @brief  Returns the number of sectors of each block
+ *
+ *  @param    crc       VinilCRC object
+ *
+ *  @return   the number of sectors
+ */
+VINILAPI uint32_t vinil_crc_block_sectors(VinilCRC* crc);
+
+/** @brief  Marks the blocks of sectors as stale, in the checksum file too
+ *
+ *  @param    crc       VinilCRC object
+ *
+ *  @param    sector    first sector
+ *
+ *  @param    count     number of sectors
+ *
+ *  @return   TRUE if the blocks were marked, FALSE if the file could not be written.
+ */
+VINILAPI int vinil_crc_invalidate(VinilCRC* crc, uint64_t sector, uint64_t count);
+
+/** @brief  Begins a write of sectors: their blocks are marked as stale (see vinil_crc_invalidate)
+ *          until their checksums are given to vinil_crc_update. It can be called by several
+ *          threads at once, and every call is followed by vinil_crc_end_write once the data
+ *          was written (or failed to be).
+ *
+ *  @param    crc       VinilCRC object
+ *
+ *  @param    sector    first sector
+ *
+ *  @param    count     number of sectors
+ *
+ *  @return   a ticket for vinil_crc_end_write and vinil_crc_update, 0 if the blocks could not
+ *            be marked in the file or it was opened by vinil_crc_open_read_only (the write
+ *            must fail, and vinil_crc_end_write is not called).
+ */
+VINILAPI uint64_t vinil_crc_begin_write(VinilCRC* crc, uint64_t sector, uint64_t count);
+
+/** @brief  Ends a write which was begun by vinil_crc_begin_write
+ *
+ *  @param    crc       VinilCRC object
+ *
+ *  @param    sector    first sector
+ *
+ *  @param    count     number of sectors
+ *
+ *  @param    ticket    returned by vinil_crc_begin_write
+ */
+VINILAPI void vinil_crc_end_write(VinilCRC* crc, uint64_t sector, uint64_t count, uint64_t ticket);
+
+/** @brief  Returns the sequence of a block, which changes whenever a write of the block
+ *          begins or overlaps another one (or a write of another block which shares its lock).
+ *          Data read between two equal sequences is the data of a single moment.
+ *
+ *  @param    crc       VinilCRC object
+ *
+ *  @param    block     number of the block
+ *
+ *  @return   the sequence, 0 while the block is being written
+ */
+VINILAPI uint64_t vinil_crc_sequence(VinilCRC* crc, uint64_t block);
+
+/** @brief  Tells whether the checksum of a block is stale
+ *
+ *  @param    crc       VinilCRC object
+ *
+ *  @param    block     number of the block
+ *
+ *  @return   TRUE if the block was written since its checksum was computed, FALSE otherwise.
+ */
+VINILAPI int vinil_crc_stale(VinilCRC* crc, uint64_t block);
+
+/** @brief  Finds the next stale block
+ *
+ *  @param    crc       VinilCRC object
+ *
+ *  @param    block     number of the first block to be checked
+ *
+ *  @return   the number of the first stale block from block on, vinil_crc_blocks if there is none
+ */
+VINILAPI uint64_t vinil_crc_next_stale(VinilCRC* crc, uint64_t block);
+
+/** @brief  Returns the checksum of a block, it is meaningless if the block is stale
+ *
+ *  @param    crc       VinilCRC object
+ *
+ *  @param    block     number of the block
+ *
+ *  @return   the checksum
+ */
+VINILAPI uint32_t vinil_crc_get(VinilCRC* crc, uint64_t block);
+
+/** @brief  Stores the checksum of a block, which is no longer stale.
+ *          It must not be called while other threads write to the block, see vinil_crc_update.
+ *
+ *  @param    crc       VinilCRC object
+ *
+ *  @param    block     number of the block
+ *
+ *  @param    value     checksum of the data of the block
+ */
+VINILAPI void vinil_crc_set(VinilCRC* crc, uint64_t block, uint32_t value);
+
+/** @brief  Stores the checksum of a block unless it was written since its data was taken:
+ *          after a write, with the ticket of vinil_crc_begin_write (and after vinil_crc_end_write),
+ *          or after a read, with the vinil_crc_sequence taken before it.
+ *
+ *  @param    crc       VinilCRC object
+ *
+ *  @param    block     number of the block
+ *
+ *  @param    value     checksum of the data of the block
+ *
+ *  @param    sequence  ticket of the write, or sequence of the block before the read
+ *
+ *  @return   TRUE if the checksum was stored, FALSE if the block stays stale.
+ */
+VINILAPI int vinil_crc_update(VinilCRC* crc, uint64_t block, uint32_t value, uint64_t sequence);
+
+/** @brief  Returns the checksum of a whole block of zeros
+ *
+ *  @param    crc       VinilCRC object
+ *
+ *  @return   the checksum
+ */
+VINILAPI uint32_t vinil_crc_zero_block(VinilCRC* crc);
+
+/** @brief  Saves the checksums to the checksum file, which then describes every block which is
+ *          not stale. The writes which begin meanwhile wait for it.
+ *
+ *  @param    crc       VinilCRC object
+ *
+ *  @param    flush     called once the stale blocks were taken and before the checksums are
+ *                      written, to put their data on the disk first; it may be a null pointer
+ *
+ *  @param    arg       passed to flush
+ *
+ *  @return   TRUE if the file was saved, FALSE otherwise (it still holds the previous checksums,
+ *            and a file opened by vinil_crc_open_read_only is never saved).
+ */
+VINILAPI int vinil_crc_save(VinilCRC* crc, vinil_crc_flush_fn flush, void* arg);
+
+/** @brief  Saves the checksums to the checksum file, marks it as closed and closes it. The
+ *          data must already be on the disk, and no write may be in flight. A file opened by
+ *          vinil_crc_open_read_only is closed without being written.
+ *
+ *  @param    crc       VinilCRC object
+ *
+ *  @return   TRUE if the file was saved, FALSE otherwise (it stays marked as open).
+ */
+VINILAPI int vinil_crc_close(VinilCRC* crc);
+
+#endif
@@ -4,8 +4,45 @@
  *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+  #define _GNU_SOURCE
+#endif
+
 #include "crossplatform.h"
 
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#ifdef _WIN32
+  #include <malloc.h>
+#else
+  #include <unistd.h>
+  #include <sys/mman.h>
+#endif
+
+#ifdef __linux__
+  #include <sys/ioctl.h>
+  #include <linux/fs.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+  #include <emmintrin.h>
+  #define VINIL_ZERO_SSE2
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+  #include <arm_neon.h>
+  #define VINIL_ZERO_NEON
+#endif
+
+// the AVX2 loop is compiled for any x86-64 target and chosen at run time
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+  #include <immintrin.h>
+  #define VINIL_MISMATCH_AVX2
+#endif
+
 void vinil_uuid_generate(vinil_uuid* uuid) {
 #ifdef _WIN32
   CoCreateGuid(uuid);
@@ -30,10 +67,801 @@ VINILAPI int64_t vinil_ftell(FILE *fd) {
 #endif
 }
 
-VINILAPI int vinil_truncate(FILE *fd, int64_t new_length) {
+VINILAPI int vinil_truncate(int fd, int64_t new_length) {
+#ifdef _WIN32
+  return _chsize_s(fd, new_length) == 0 ? TRUE : FALSE;
+#else
+  return ftruncate(fd, new_length) == 0 ? TRUE : FALSE;
+#endif
+}
+
+VINILAPI int vinil_fallocate(int fd, int64_t length) {
+#if defined(_WIN32)
+  FILE_ALLOCATION_INFO info;
+  info.AllocationSize.QuadPart = length;
+  if (!SetFileInformationByHandle((HANDLE)_get_osfhandle(fd), FileAllocationInfo, &info, sizeof(info)))
+    return FALSE;
+  
+  return _chsize_s(fd, length) == 0 ? TRUE : FALSE;
+#elif defined(__linux__)
+  return fallocate(fd, 0, 0, length) == 0 ? TRUE : FALSE;
+#elif defined(__APPLE__)
+  // a contiguous extent is preferred, but any extent is accepted
+  fstore_t store;
+  store.fst_flags = F_ALLOCATECONTIG | F_ALLOCATEALL;
+  store.fst_posmode = F_PEOFPOSMODE;
+  store.fst_offset = 0;
+  store.fst_length = length;
+  store.fst_bytesalloc = 0;
+  if (fcntl(fd, F_PREALLOCATE, &store) == -1) {
+    store.fst_flags = F_ALLOCATEALL;
+    if (fcntl(fd, F_PREALLOCATE, &store) == -1)
+      return FALSE;
+  }
+  
+  return ftruncate(fd, length) == 0 ? TRUE : FALSE;
+#else
+  return posix_fallocate(fd, 0, length) == 0 ? TRUE : FALSE;
+#endif
+}
+
+VINILAPI int vinil_punch_hole(int fd, int64_t offset, int64_t length) {
+#if defined(__linux__)
+  return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0 ? TRUE : FALSE;
+#elif defined(__APPLE__) && defined(F_PUNCHHOLE)
+  fpunchhole_t hole;
+  memset(&hole, 0, sizeof(hole));
+  hole.fp_offset = offset;
+  hole.fp_length = length;
+  
+  return fcntl(fd, F_PUNCHHOLE, &hole) != -1;
+#else
+  return FALSE;
+#endif
+}
+
+VINILAPI int vinil_next_data(int fd, int64_t offset, int64_t* data, int64_t* hole) {
+#if !defined(_WIN32) && defined(SEEK_DATA) && defined(SEEK_HOLE)
+  off_t start = lseek(fd, (off_t)offset, SEEK_DATA);
+  if (start < 0 && errno == ENXIO)
+    return FALSE;
+  
+  if (start >= 0) {
+    off_t end = lseek(fd, start, SEEK_HOLE);
+    if (end >= 0) {
+      *data = start;
+      *hole = end;
+      return TRUE;
+    }
+  }
+#endif
+  // without SEEK_DATA the whole file is data
+  int64_t size = vinil_file_size(fd);
+  if (size < 0 || offset >= size)
+    return FALSE;
+  
+  *data = offset;
+  *hole = size;
+  return TRUE;
+}
+
+VINILAPI int vinil_is_zero(const void* buffer, size_t size) {
+  const uint8_t* p = (const uint8_t*)buffer;
+  
+  // 64 bytes are or-ed together before each test, so the loop runs at memory bandwidth
+#if defined(VINIL_ZERO_SSE2)
+  while (size >= 64) {
+    __m128i x = _mm_or_si128(_mm_or_si128(_mm_loadu_si128((const __m128i*)p), _mm_loadu_si128((const __m128i*)(p + 16))),
+                             _mm_or_si128(_mm_loadu_si128((const __m128i*)(p + 32)), _mm_loadu_si128((const __m128i*)(p + 48))));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128())) != 0xFFFF)
+      return FALSE;
+    p += 64;
+    size -= 64;
+  }
+#elif defined(VINIL_ZERO_NEON)
+  while (size >= 64) {
+    uint8x16_t x = vorrq_u8(vorrq_u8(vld1q_u8(p), vld1q_u8(p + 16)), vorrq_u8(vld1q_u8(p + 32), vld1q_u8(p + 48)));
+    if (vmaxvq_u8(x) != 0)
+      return FALSE;
+    p += 64;
+    size -= 64;
+  }
+#endif
+  
+  while (size >= 8) {
+    uint64_t value;
+    memcpy(&value, p, 8);
+    if (value != 0)
+      return FALSE;
+    p += 8;
+    size -= 8;
+  }
+  
+  while (size > 0) {
+    if (*p != 0)
+      return FALSE;
+    p++;
+    size--;
+  }
+  
+  return TRUE;
+}
+
+#if defined(VINIL_MISMATCH_AVX2)
+__attribute__((target("avx2")))
+static size_t mismatch_avx2(const uint8_t* p, const uint8_t* q, size_t size) {
+  size_t offset = 0;
+  while (size - offset >= 64) {
+    __m256i x = _mm256_or_si256(_mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(p + offset)),
+                                                 _mm256_loadu_si256((const __m256i*)(q + offset))),
+                                _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(p + offset + 32)),
+                                                 _mm256_loadu_si256((const __m256i*)(q + offset + 32))));
+    if (!_mm256_testz_si256(x, x))
+      break;
+    offset += 64;
+  }
+  
+  return offset;
+}
+#endif
+
+VINILAPI size_t vinil_mismatch(const void* a, const void* b, size_t size) {
+  const uint8_t* p = (const uint8_t*)a;
+  const uint8_t* q = (const uint8_t*)b;
+  size_t offset = 0;
+  
+  // 64 bytes are compared before each test, the scalar loops find the byte which differs
+#if defined(VINIL_MISMATCH_AVX2)
+  // 0 until the CPU was probed, then 1 without AVX2 and 2 with it, every thread which probes it stores the same value
+  static uint64_t avx2 = 0;
+  uint64_t probed = vinil_atomic_load(&avx2);
+  if (probed == 0) {
+    probed = __builtin_cpu_supports("avx2") ? 2 : 1;
+    vinil_atomic_store(&avx2, probed);
+  }
+  if (probed == 2)
+    offset = mismatch_avx2(p, q, size);
+#endif
+#if defined(VINIL_ZERO_SSE2)
+  while (size - offset >= 64) {
+    __m128i x = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + offset)),
+                                                           _mm_loadu_si128((const __m128i*)(q + offset))),
+                                            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + offset + 16)),
+                                                           _mm_loadu_si128((const __m128i*)(q + offset + 16)))),
+                              _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + offset + 32)),
+                                                           _mm_loadu_si128((const __m128i*)(q + offset + 32))),
+                                            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + offset + 48)),
+                                                           _mm_loadu_si128((const __m128i*)(q + offset + 48)))));
+    if (_mm_movemask_epi8(x) != 0xFFFF)
+      break;
+    offset += 64;
+  }
+#elif defined(VINIL_ZERO_NEON)
+  while (size - offset >= 64) {
+    uint8x16_t x = vorrq_u8(vorrq_u8(veorq_u8(vld1q_u8(p + offset), vld1q_u8(q + offset)),
+                                     veorq_u8(vld1q_u8(p + offset + 16), vld1q_u8(q + offset + 16))),
+                            vorrq_u8(veorq_u8(vld1q_u8(p + offset + 32), vld1q_u8(q + offset + 32)),
+                                     veorq_u8(vld1q_u8(p + offset + 48), vld1q_u8(q + offset + 48))));
+    if (vmaxvq_u8(x) != 0)
+      break;
+    offset += 64;
+  }
+#endif
+  
+  while (size - offset >= 8) {
+    uint64_t x, y;
+    memcpy(&x, p + offset, 8);
+    memcpy(&y, q + offset, 8);
+    if (x != y)
+      break;
+    offset += 8;
+  }
+  
+  while (offset < size && p[offset] == q[offset])
+    offset++;
+  
+  return offset;
+}
+
+VINILAPI int vinil_open(const char* filename, int flags) {
+#ifdef _WIN32
+  return _open(filename, flags | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+  return open(filename, flags, 0666);
+#endif
+}
+
+VINILAPI int vinil_close(int fd) {
+#ifdef _WIN32
+  return _close(fd) == 0 ? TRUE : FALSE;
+#else
+  return close(fd) == 0 ? TRUE : FALSE;
+#endif
+}
+
+#ifdef _WIN32
+static int64_t windows_positional_io(int fd, void* buffer, size_t size, int64_t offset, int write) {
+  OVERLAPPED overlapped;
+  DWORD bytes = 0;
+  BOOL ok;
+  
+  memset(&overlapped, 0, sizeof(overlapped));
+  overlapped.Offset = (DWORD)(offset & 0xFFFFFFFF);
+  overlapped.OffsetHigh = (DWORD)(offset >> 32);
+  
+  if (size > 0x40000000)
+    size = 0x40000000;
+  
+  HANDLE handle = (HANDLE)_get_osfhandle(fd);
+  if (write)
+    ok = WriteFile(handle, buffer, (DWORD)size, &bytes, &overlapped);
+  else
+    ok = ReadFile(handle, buffer, (DWORD)size, &bytes, &overlapped);
+  
+  return ok ? (int64_t)bytes : -1;
+}
+#endif
+
+VINILAPI int vinil_pread(int fd, void* buffer, size_t size, int64_t offset) {
+  char* p = (char*)buffer;
+  
+  while (size > 0) {
+#ifdef _WIN32
+    int64_t n = windows_positional_io(fd, p, size, offset, FALSE);
+#else
+    ssize_t n = pread(fd, p, size, offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+#endif
+    if (n <= 0)
+      return FALSE;
+    
+    p += n;
+    size -= n;
+    offset += n;
+  }
+  
+  return TRUE;
+}
+
+VINILAPI int64_t vinil_pread_partial(int fd, void* buffer, size_t size, int64_t offset) {
+#ifdef _WIN32
+  return windows_positional_io(fd, buffer, size, offset, FALSE);
+#else
+  ssize_t n;
+  do {
+    n = pread(fd, buffer, size, offset);
+  } while (n < 0 && errno == EINTR);
+  
+  return n;
+#endif
+}
+
+VINILAPI int64_t vinil_read_stream(int fd, void* buffer, size_t size) {
+  char* p = (char*)buffer;
+  size_t done = 0;
+  
+  // pipes and sockets return what they have, the buffer is only short at the end of the stream
+  while (done < size) {
+#ifdef _WIN32
+    int n = _read(fd, p + done, size - done > 0x40000000 ? 0x40000000 : (unsigned int)(size - done));
+#else
+    ssize_t n = read(fd, p + done, size - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+#endif
+    if (n < 0)
+      return -1;
+    if (n == 0)
+      break;
+    
+    done += n;
+  }
+  
+  return (int64_t)done;
+}
+
+VINILAPI int vinil_write_stream(int fd, const void* buffer, size_t size) {
+  const char* p = (const char*)buffer;
+  
+  while (size > 0) {
+#ifdef _WIN32
+    int n = _write(fd, p, size > 0x40000000 ? 0x40000000 : (unsigned int)size);
+#else
+    ssize_t n = write(fd, p, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+#endif
+    if (n <= 0)
+      return FALSE;
+    
+    p += n;
+    size -= n;
+  }
+  
+  return TRUE;
+}
+
+VINILAPI int vinil_pwrite(int fd, const void* buffer, size_t size, int64_t offset) {
+  const char* p = (const char*)buffer;
+  
+  while (size > 0) {
+#ifdef _WIN32
+    int64_t n = windows_positional_io(fd, (void*)p, size, offset, TRUE);
+#else
+    ssize_t n = pwrite(fd, p, size, offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+#endif
+    if (n <= 0)
+      return FALSE;
+    
+    p += n;
+    size -= n;
+    offset += n;
+  }
+  
+  return TRUE;
+}
+
+static int positional_iov(int fd, const vinil_iovec* iov, int count, int64_t offset, int write) {
+#ifdef _WIN32
+  int i;
+  for (i = 0; i < count; i++) {
+    int ok = write ? vinil_pwrite(fd, iov[i].iov_base, iov[i].iov_len, offset)
+                   : vinil_pread(fd, iov[i].iov_base, iov[i].iov_len, offset);
+    if (!ok)
+      return FALSE;
+    offset += iov[i].iov_len;
+  }
+  
+  return TRUE;
+#else
+  vinil_iovec local[VINIL_IOV_BATCH];
+  
+  while (count > 0) {
+    int n = 0;
+    while (n < VINIL_IOV_BATCH && count > 0) {
+      if (iov->iov_len > 0)
+        local[n++] = *iov;
+      iov++;
+      count--;
+    }
+    
+    // short transfers are resumed from the first unfinished entry
+    vinil_iovec* current = local;
+    while (n > 0) {
+      ssize_t done = write ? pwritev(fd, current, n, offset) : preadv(fd, current, n, offset);
+      if (done < 0 && errno == EINTR)
+        continue;
+      if (done <= 0)
+        return FALSE;
+      
+      offset += done;
+      while (n > 0 && (size_t)done >= current->iov_len) {
+        done -= current->iov_len;
+        current++;
+        n--;
+      }
+      
+      if (n > 0) {
+        current->iov_base = (char*)current->iov_base + done;
+        current->iov_len -= done;
+      }
+    }
+  }
+  
+  return TRUE;
+#endif
+}
+
+VINILAPI int vinil_preadv(int fd, const vinil_iovec* iov, int count, int64_t offset) {
+  return positional_iov(fd, iov, count, offset, FALSE);
+}
+
+VINILAPI int vinil_pwritev(int fd, const vinil_iovec* iov, int count, int64_t offset) {
+  return positional_iov(fd, iov, count, offset, TRUE);
+}
+
+VINILAPI int vinil_fsync(int fd) {
+#ifdef _WIN32
+  return _commit(fd) == 0 ? TRUE : FALSE;
+#elif defined(__linux__)
+  return fdatasync(fd) == 0 ? TRUE : FALSE;
+#else
+  return fsync(fd) == 0 ? TRUE : FALSE;
+#endif
+}
+
+VINILAPI int64_t vinil_file_size(int fd) {
+#ifdef _WIN32
+  struct _stat64 st;
+  if (_fstat64(fd, &st) != 0)
+    return -1;
+#else
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+    return -1;
+#endif
+  return st.st_size;
+}
+
+VINILAPI int vinil_direct_io(int fd, uint32_t* alignment) {
+#if defined(__linux__)
+  int flags = fcntl(fd, F_GETFL);
+  if (flags < 0 || fcntl(fd, F_SETFL, flags | O_DIRECT) < 0)
+    return FALSE;
+  
+  void* buffer = vinil_alloc_aligned_buffer(VINIL_DIRECT_ALIGNMENT);
+  if (buffer == NULL)
+    return FALSE;
+  
+  // the smallest read accepted by the file system is its logical block size, 
+  // empty files can't be probed and get the largest supported alignment
+  *alignment = VINIL_DIRECT_ALIGNMENT;
+  uint32_t size;
+  for (size = 512; size < VINIL_DIRECT_ALIGNMENT; size *= 2) {
+    ssize_t n = pread(fd, buffer, size, 0);
+    if (n >= 0) {
+      if (n > 0)
+        *alignment = size;
+      break;
+    }
+  }
+  
+  vinil_free_aligned_buffer(buffer);
+  
+  return TRUE;
+#elif defined(__APPLE__)
+  *alignment = 512;
+  return fcntl(fd, F_NOCACHE, 1) != -1;
+#else
+  return FALSE;
+#endif
+}
+
+VINILAPI void* vinil_alloc_aligned_buffer(size_t size) {
+  size = (size + VINIL_DIRECT_ALIGNMENT - 1) / VINIL_DIRECT_ALIGNMENT * VINIL_DIRECT_ALIGNMENT;
+  
+#ifdef _WIN32
+  return _aligned_malloc(size, VINIL_DIRECT_ALIGNMENT);
+#else
+  void* buffer;
+  if (posix_memalign(&buffer, VINIL_DIRECT_ALIGNMENT, size) != 0)
+    return NULL;
+  
+  return buffer;
+#endif
+}
+
+VINILAPI void vinil_free_aligned_buffer(void* buffer) {
+#ifdef _WIN32
+  _aligned_free(buffer);
+#else
+  free(buffer);
+#endif
+}
+
+VINILAPI void* vinil_mmap(int fd, uint64_t size) {
 #ifdef _WIN32
-  return _chsize_s(_fileno(fd), new_length) == 0 ? TRUE : FALSE;
+  HANDLE mapping = CreateFileMapping((HANDLE)_get_osfhandle(fd), NULL, PAGE_READONLY, 0, 0, NULL);
+  if (mapping == NULL)
+    return NULL;
+  
+  void* address = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, (SIZE_T)size);
+  CloseHandle(mapping);
+  return address;
 #else
-  return ftruncate(fileno(fd), new_length) == 0 ? TRUE : FALSE;
+  void* address = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  return address == MAP_FAILED ? NULL : address;
 #endif
-}
\ No newline at end of file
+}
+
+VINILAPI void vinil_munmap(void* address, uint64_t size) {
+#ifdef _WIN32
+  UnmapViewOfFile(address);
+#else
+  munmap(address, size);
+#endif
+}
+
+VINILAPI int vinil_madvise(void* address, uint64_t size, int advice) {
+#ifdef _WIN32
+  // there is no equivalent of madvise, the hints are simply ignored
+  return TRUE;
+#else
+  static const int advices[] = {MADV_NORMAL, MADV_SEQUENTIAL, MADV_RANDOM, MADV_WILLNEED, MADV_DONTNEED};
+  if (advice < 0 || advice > VINIL_ADVICE_DONTNEED)
+    return FALSE;
+  
+  // madvise works on whole pages
+  uintptr_t page_size = (uintptr_t)sysconf(_SC_PAGESIZE);
+  uintptr_t start = (uintptr_t)address & ~(page_size - 1);
+  size += (uintptr_t)address - start;
+  
+  return madvise((void*)start, size, advices[advice]) == 0 ? TRUE : FALSE;
+#endif
+}
+
+VINILAPI int vinil_fadvise(int fd, uint64_t offset, uint64_t size, int advice) {
+  if (advice < 0 || advice > VINIL_ADVICE_DONTNEED)
+    return FALSE;
+  
+#if defined(_WIN32)
+  // the cache manager does its own readahead, the hints are simply ignored
+  return TRUE;
+#elif defined(__APPLE__)
+  // only WILLNEED has an equivalent (F_RDADVISE), the other hints are ignored
+  if (advice != VINIL_ADVICE_WILLNEED)
+    return TRUE;
+  
+  struct radvisory ra;
+  ra.ra_offset = (off_t)offset;
+  ra.ra_count = size > INT_MAX ? INT_MAX : (int)size;
+  
+  return fcntl(fd, F_RDADVISE, &ra) != -1;
+#else
+  static const int advices[] = {POSIX_FADV_NORMAL, POSIX_FADV_SEQUENTIAL, POSIX_FADV_RANDOM, 
+                                POSIX_FADV_WILLNEED, POSIX_FADV_DONTNEED};
+  
+  return posix_fadvise(fd, (off_t)offset, (off_t)size, advices[advice]) == 0 ? TRUE : FALSE;
+#endif
+}
+
+VINILAPI int vinil_clone_file(int fd_in, int fd_out) {
+  // the new file shares the extents of the old one until either is written (XFS, Btrfs)
+#if defined(__linux__) && defined(FICLONE)
+  return ioctl(fd_out, FICLONE, fd_in) == 0 ? TRUE : FALSE;
+#else
+  return FALSE;
+#endif
+}
+
+VINILAPI uint64_t vinil_copy_range(int fd_in, uint64_t offset_in, int fd_out, uint64_t offset_out, uint64_t size) {
+  uint64_t copied = 0;
+  
+  // the data does not go through user space, file systems with reflinks may even share the extents
+#if defined(__linux__) && defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+  while (copied < size) {
+    loff_t in = (loff_t)(offset_in + copied);
+    loff_t out = (loff_t)(offset_out + copied);
+    size_t length = size - copied > (1 << 30) ? (1 << 30) : (size_t)(size - copied);
+    
+    ssize_t n = copy_file_range(fd_in, &in, fd_out, &out, length, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    
+    copied += (uint64_t)n;
+  }
+#endif
+  
+  // the caller copies what is left (everything without copy_file_range) by itself
+  return copied;
+}
+
+VINILAPI int vinil_mutex_init(vinil_mutex* mutex) {
+#ifdef _WIN32
+  InitializeCriticalSection(mutex);
+  return TRUE;
+#else
+  return pthread_mutex_init(mutex, NULL) == 0 ? TRUE : FALSE;
+#endif
+}
+
+VINILAPI void vinil_mutex_destroy(vinil_mutex* mutex) {
+#ifdef _WIN32
+  DeleteCriticalSection(mutex);
+#else
+  pthread_mutex_destroy(mutex);
+#endif
+}
+
+VINILAPI void vinil_mutex_lock(vinil_mutex* mutex) {
+#ifdef _WIN32
+  EnterCriticalSection(mutex);
+#else
+  pthread_mutex_lock(mutex);
+#endif
+}
+
+VINILAPI void vinil_mutex_unlock(vinil_mutex* mutex) {
+#ifdef _WIN32
+  LeaveCriticalSection(mutex);
+#else
+  pthread_mutex_unlock(mutex);
+#endif
+}
+
+VINILAPI int vinil_cond_init(vinil_cond* cond) {
+#ifdef _WIN32
+  InitializeConditionVariable(cond);
+  return TRUE;
+#else
+  return pthread_cond_init(cond, NULL) == 0 ? TRUE : FALSE;
+#endif
+}
+
+VINILAPI void vinil_cond_destroy(vinil_cond* cond) {
+#ifndef _WIN32
+  pthread_cond_destroy(cond);
+#endif
+}
+
+VINILAPI void vinil_cond_wait(vinil_cond* cond, vinil_mutex* mutex) {
+#ifdef _WIN32
+  SleepConditionVariableCS(cond, mutex, INFINITE);
+#else
+  pthread_cond_wait(cond, mutex);
+#endif
+}
+
+// waits at most nanoseconds, it may also return early like vinil_cond_wait
+VINILAPI void vinil_cond_timed_wait(vinil_cond* cond, vinil_mutex* mutex, uint64_t nanoseconds) {
+#ifdef _WIN32
+  uint64_t ms = (nanoseconds + 999999) / 1000000;
+  SleepConditionVariableCS(cond, mutex, ms < INFINITE ? (DWORD)ms : INFINITE - 1);
+#else
+  // the default clock of a condition is the real time one
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  uint64_t nsec = (uint64_t)ts.tv_nsec + nanoseconds % 1000000000ULL;
+  ts.tv_sec += (time_t)(nanoseconds / 1000000000ULL + nsec / 1000000000ULL);
+  ts.tv_nsec = (long)(nsec % 1000000000ULL);
+  pthread_cond_timedwait(cond, mutex, &ts);
+#endif
+}
+
+VINILAPI void vinil_cond_signal(vinil_cond* cond) {
+#ifdef _WIN32
+  WakeConditionVariable(cond);
+#else
+  pthread_cond_signal(cond);
+#endif
+}
+
+VINILAPI void vinil_cond_broadcast(vinil_cond* cond) {
+#ifdef _WIN32
+  WakeAllConditionVariable(cond);
+#else
+  pthread_cond_broadcast(cond);
+#endif
+}
+
+VINILAPI int vinil_rwlock_init(vinil_rwlock* rwlock) {
+#ifdef _WIN32
+  InitializeSRWLock(rwlock);
+  return TRUE;
+#elif defined(__GLIBC__)
+  // glibc lets readers in while a writer waits, so a steady stream of them would starve it
+  pthread_rwlockattr_t attr;
+  if (pthread_rwlockattr_init(&attr) != 0)
+    return FALSE;
+  pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  int ok = pthread_rwlock_init(rwlock, &attr) == 0;
+  pthread_rwlockattr_destroy(&attr);
+  return ok ? TRUE : FALSE;
+#else
+  return pthread_rwlock_init(rwlock, NULL) == 0 ? TRUE : FALSE;
+#endif
+}
+
+VINILAPI void vinil_rwlock_destroy(vinil_rwlock* rwlock) {
+#ifndef _WIN32
+  pthread_rwlock_destroy(rwlock);
+#endif
+}
+
+VINILAPI void vinil_rwlock_read_lock(vinil_rwlock* rwlock) {
+#ifdef _WIN32
+  AcquireSRWLockShared(rwlock);
+#else
+  pthread_rwlock_rdlock(rwlock);
+#endif
+}
+
+VINILAPI void vinil_rwlock_read_unlock(vinil_rwlock* rwlock) {
+#ifdef _WIN32
+  ReleaseSRWLockShared(rwlock);
+#else
+  pthread_rwlock_unlock(rwlock);
+#endif
+}
+
+VINILAPI void vinil_rwlock_write_lock(vinil_rwlock* rwlock) {
+#ifdef _WIN32
+  AcquireSRWLockExclusive(rwlock);
+#else
+  pthread_rwlock_wrlock(rwlock);
+#endif
+}
+
+VINILAPI void vinil_rwlock_write_unlock(vinil_rwlock* rwlock) {
+#ifdef _WIN32
+  ReleaseSRWLockExclusive(rwlock);
+#else
+  pthread_rwlock_unlock(rwlock);
+#endif
+}
+
+#ifdef _WIN32
+typedef struct {
+  vinil_thread_function function;
+  void* arg;
+} WindowsThreadStart;
+
+static DWORD WINAPI windows_thread_start(LPVOID param) {
+  WindowsThreadStart start = *(WindowsThreadStart*)param;
+  free(param);
+  start.function(start.arg);
+  return 0;
+}
+#endif
+
+VINILAPI int vinil_thread_create(vinil_thread* thread, vinil_thread_function function, void* arg) {
+#ifdef _WIN32
+  WindowsThreadStart* start = (WindowsThreadStart*)malloc(sizeof(WindowsThreadStart));
+  if (start == NULL)
+    return FALSE;
+  
+  start->function = function;
+  start->arg = arg;
+  
+  *thread = CreateThread(NULL, 0, windows_thread_start, start, 0, NULL);
+  if (*thread == NULL) {
+    free(start);
+    return FALSE;
+  }
+  
+  return TRUE;
+#else
+  return pthread_create(thread, NULL, function, arg) == 0 ? TRUE : FALSE;
+#endif
+}
+
+VINILAPI void vinil_thread_join(vinil_thread thread) {
+#ifdef _WIN32
+  WaitForSingleObject(thread, INFINITE);
+  CloseHandle(thread);
+#else
+  pthread_join(thread, NULL);
+#endif
+}
+
+VINILAPI uint64_t vinil_clock_ns(void) {
+#ifdef _WIN32
+  LARGE_INTEGER counter, frequency;
+  QueryPerformanceCounter(&counter);
+  QueryPerformanceFrequency(&frequency);
+  return (uint64_t)(counter.QuadPart * 1000000000.0 / frequency.QuadPart);
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+VINILAPI void vinil_sleep_ns(uint64_t nanoseconds) {
+#ifdef _WIN32
+  Sleep((DWORD)(nanoseconds / 1000000));
+#else
+  struct timespec ts;
+  ts.tv_sec = (time_t)(nanoseconds / 1000000000ULL);
+  ts.tv_nsec = (long)(nanoseconds % 1000000000ULL);
+  while (nanosleep(&ts, &ts) != 0 && errno == EINTR);
+#endif
+}
+
+VINILAPI int vinil_absolute_path(const char* path, char* resolved_path, size_t size) {
+#ifdef _WIN32
+  return _fullpath(resolved_path, path, size) ? TRUE : FALSE;
+#else
+  char buffer[PATH_MAX];
+  if (realpath(path, buffer) == NULL || strlen(buffer) >= size)
+    return FALSE;
+  
+  strcpy(resolved_path, buffer);
+  return TRUE;
+#endif
+}
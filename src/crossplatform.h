@@ -23,19 +23,130 @@
   #include <io.h>
 #else
   #include <uuid/uuid.h>
+  #include <pthread.h>
+  #include <sys/uio.h>
 #endif
 
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdint.h>
 
 #include "util.h"
 
+#define VINIL_MAX_PATH 4096
+
 typedef uuid_t vinil_uuid;
 
+#ifdef _WIN32
+  typedef CRITICAL_SECTION vinil_mutex;
+  typedef CONDITION_VARIABLE vinil_cond;
+  typedef SRWLOCK vinil_rwlock;
+  typedef HANDLE vinil_thread;
+#else
+  typedef pthread_mutex_t vinil_mutex;
+  typedef pthread_cond_t vinil_cond;
+  typedef pthread_rwlock_t vinil_rwlock;
+  typedef pthread_t vinil_thread;
+#endif
+
+typedef void* (*vinil_thread_function)(void* arg);
+
+#ifdef _WIN32
+  typedef struct {
+    void*   iov_base;
+    size_t  iov_len;
+  } vinil_iovec;
+#else
+  typedef struct iovec vinil_iovec;
+#endif
+
+/** @brief Maximum number of vinil_iovec entries passed to a single system call */
+#define VINIL_IOV_BATCH 256
+
+/** @brief Alignment of the buffers returned by vinil_alloc_aligned_buffer */
+#define VINIL_DIRECT_ALIGNMENT 4096
+
+#define VINIL_ADVICE_NORMAL       0
+#define VINIL_ADVICE_SEQUENTIAL   1
+#define VINIL_ADVICE_RANDOM       2
+#define VINIL_ADVICE_WILLNEED     3
+#define VINIL_ADVICE_DONTNEED     4
+
+#ifdef _MSC_VER
+  #define vinil_atomic_load(ptr)          (*(ptr))
+  #define vinil_atomic_store(ptr, value)  do { MemoryBarrier(); *(ptr) = (value); } while (0)
+  #define vinil_atomic_add(ptr, value)    InterlockedExchangeAdd64((volatile LONG64*)(ptr), (LONG64)(value))
+  #define vinil_atomic_or(ptr, value)     InterlockedOr64((volatile LONG64*)(ptr), (LONG64)(value))
+  #define vinil_atomic_and(ptr, value)    InterlockedAnd64((volatile LONG64*)(ptr), (LONG64)(value))
+  #define vinil_atomic_fence()            MemoryBarrier()
+  #define vinil_thread_local              __declspec(thread)
+#else
+  #define vinil_atomic_load(ptr)          __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+  #define vinil_atomic_store(ptr, value)  __atomic_store_n(ptr, value, __ATOMIC_RELEASE)
+  #define vinil_atomic_add(ptr, value)    __atomic_fetch_add(ptr, value, __ATOMIC_RELAXED)
+  #define vinil_atomic_or(ptr, value)     __atomic_fetch_or(ptr, value, __ATOMIC_RELAXED)
+  #define vinil_atomic_and(ptr, value)    __atomic_fetch_and(ptr, value, __ATOMIC_RELAXED)
+  #define vinil_atomic_fence()            __atomic_thread_fence(__ATOMIC_SEQ_CST)
+  #define vinil_thread_local              __thread
+#endif
+
 VINILAPI void vinil_uuid_generate(vinil_uuid* uuid);
 VINILAPI int vinil_fseek(FILE *fd, int64_t offset, int origin);
 VINILAPI int64_t vinil_ftell(FILE *fd);
-VINILAPI int vinil_truncate(FILE *fd, int64_t new_length);
+VINILAPI int vinil_truncate(int fd, int64_t new_length);
+VINILAPI int vinil_fallocate(int fd, int64_t length);
+VINILAPI int vinil_punch_hole(int fd, int64_t offset, int64_t length);
+VINILAPI int vinil_next_data(int fd, int64_t offset, int64_t* data, int64_t* hole);
+VINILAPI int vinil_is_zero(const void* buffer, size_t size);
+VINILAPI size_t vinil_mismatch(const void* a, const void* b, size_t size);
+
+VINILAPI int vinil_open(const char* filename, int flags);
+VINILAPI int vinil_close(int fd);
+VINILAPI int vinil_pread(int fd, void* buffer, size_t size, int64_t offset);
+VINILAPI int64_t vinil_pread_partial(int fd, void* buffer, size_t size, int64_t offset);
+VINILAPI int vinil_pwrite(int fd, const void* buffer, size_t size, int64_t offset);
+VINILAPI int64_t vinil_read_stream(int fd, void* buffer, size_t size);
+VINILAPI int vinil_write_stream(int fd, const void* buffer, size_t size);
+VINILAPI int vinil_preadv(int fd, const vinil_iovec* iov, int count, int64_t offset);
+VINILAPI int vinil_pwritev(int fd, const vinil_iovec* iov, int count, int64_t offset);
+VINILAPI int vinil_fsync(int fd);
+VINILAPI int64_t vinil_file_size(int fd);
+VINILAPI int vinil_direct_io(int fd, uint32_t* alignment);
+
+VINILAPI void* vinil_alloc_aligned_buffer(size_t size);
+VINILAPI void vinil_free_aligned_buffer(void* buffer);
+
+VINILAPI void* vinil_mmap(int fd, uint64_t size);
+VINILAPI void vinil_munmap(void* address, uint64_t size);
+VINILAPI int vinil_madvise(void* address, uint64_t size, int advice);
+VINILAPI int vinil_fadvise(int fd, uint64_t offset, uint64_t size, int advice);
+VINILAPI int vinil_clone_file(int fd_in, int fd_out);
+VINILAPI uint64_t vinil_copy_range(int fd_in, uint64_t offset_in, int fd_out, uint64_t offset_out, uint64_t size);
+
+VINILAPI int vinil_mutex_init(vinil_mutex* mutex);
+VINILAPI void vinil_mutex_destroy(vinil_mutex* mutex);
+VINILAPI void vinil_mutex_lock(vinil_mutex* mutex);
+VINILAPI void vinil_mutex_unlock(vinil_mutex* mutex);
+
+VINILAPI int vinil_cond_init(vinil_cond* cond);
+VINILAPI void vinil_cond_destroy(vinil_cond* cond);
+VINILAPI void vinil_cond_wait(vinil_cond* cond, vinil_mutex* mutex);
+VINILAPI void vinil_cond_timed_wait(vinil_cond* cond, vinil_mutex* mutex, uint64_t nanoseconds);
+VINILAPI void vinil_cond_signal(vinil_cond* cond);
+VINILAPI void vinil_cond_broadcast(vinil_cond* cond);
+
+VINILAPI int vinil_rwlock_init(vinil_rwlock* rwlock);
+VINILAPI void vinil_rwlock_destroy(vinil_rwlock* rwlock);
+VINILAPI void vinil_rwlock_read_lock(vinil_rwlock* rwlock);
+VINILAPI void vinil_rwlock_read_unlock(vinil_rwlock* rwlock);
+VINILAPI void vinil_rwlock_write_lock(vinil_rwlock* rwlock);
+VINILAPI void vinil_rwlock_write_unlock(vinil_rwlock* rwlock);
+
+VINILAPI int vinil_thread_create(vinil_thread* thread, vinil_thread_function function, void* arg);
+VINILAPI void vinil_thread_join(vinil_thread thread);
+VINILAPI uint64_t vinil_clock_ns(void);
+VINILAPI void vinil_sleep_ns(uint64_t nanoseconds);
+VINILAPI int vinil_absolute_path(const char* path, char* resolved_path, size_t size);
 
 
 #endif
\ No newline at end of file
@@ -0,0 +1,279 @@
+/**
+ *  @file       diff.c
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#include "diff.h"
+#include "vhd.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define DIFF_MAX_THREADS 64
+
+typedef struct {
+  uint64_t sector;
+  uint64_t count;
+} DiffExtent;
+
+typedef struct {
+  VinilVHD* a;
+  VinilVHD* b;
+  uint64_t sectors;
+  uint64_t chunk_sectors;
+  uint64_t chunks;
+  uint64_t next_chunk;
+  uint64_t failed;
+  vinil_diff_fn fn;
+  void* arg;
+  vinil_mutex lock;
+  vinil_cond turn;
+  uint64_t emitted;         // chunks whose extents were passed to fn
+  DiffExtent pending;       // last extent found, the next chunk may continue it
+  VinilDiffStats stats;
+} DiffJob;
+
+typedef struct {
+  uint8_t* a;
+  uint8_t* b;
+  DiffExtent* extents;
+  size_t count;
+  size_t capacity;
+} DiffWorker;
+
+static void diff_fail(DiffJob* job) {
+  vinil_mutex_lock(&job->lock);
+  job->failed = 1;
+  vinil_cond_broadcast(&job->turn);
+  vinil_mutex_unlock(&job->lock);
+}
+
+static int diff_add(DiffWorker* worker, uint64_t sector, uint64_t count) {
+  if (worker->count > 0) {
+    DiffExtent* last = &worker->extents[worker->count - 1];
+    if (last->sector + last->count == sector) {
+      last->count += count;
+      return TRUE;
+    }
+  }
+
+  if (worker->count == worker->capacity) {
+    size_t capacity = worker->capacity ? worker->capacity * 2 : 64;
+    DiffExtent* extents = (DiffExtent*)realloc(worker->extents, capacity * sizeof(DiffExtent));
+    if (extents == NULL)
+      return FALSE;
+    worker->extents = extents;
+    worker->capacity = capacity;
+  }
+
+  worker->extents[worker->count].sector = sector;
+  worker->extents[worker->count].count = count;
+  worker->count++;
+
+  return TRUE;
+}
+
+// equal bytes are skipped by the vectorized kernel, a differing run ends at the first equal sector
+static int diff_compare(DiffWorker* worker, const uint8_t* a, const uint8_t* b, uint64_t sector, uint64_t count) {
+  size_t size = (size_t)(count * 512);
+  size_t offset = 0;
+
+  while (offset < size) {
+    offset += vinil_mismatch(a + offset, b + offset, size - offset);
+    if (offset >= size)
+      break;
+
+    uint64_t first = offset / 512;
+    uint64_t last = first + 1;
+    while (last < count && vinil_mismatch(a + last * 512, b + last * 512, 512) != 512)
+      last++;
+
+    if (!diff_add(worker, sector + first, last - first))
+      return FALSE;
+
+    offset = (size_t)(last * 512);
+  }
+
+  return TRUE;
+}
+
+// an unallocated side reads as zeros without touching the file
+static int diff_read(DiffJob* job, VinilVHD* vhd, int allocated, uint8_t* buffer, uint64_t sector, uint64_t count) {
+  if (!allocated) {
+    memset(buffer, 0, (size_t)(count * 512));
+    return TRUE;
+  }
+
+  if (!vinil_vhd_pread(vhd, buffer, sector, count))
+    return FALSE;
+
+  vinil_atomic_add(&job->stats.bytes_read, count * 512);
+
+  return TRUE;
+}
+
+static int diff_chunk(DiffJob* job, DiffWorker* worker, uint64_t chunk) {
+  uint64_t sector = chunk * job->chunk_sectors;
+  uint64_t count = job->sectors - sector < job->chunk_sectors ? job->sectors - sector : job->chunk_sectors;
+  uint64_t done = 0;
+
+  worker->count = 0;
+  while (done < count) {
+    int allocated_a, allocated_b;
+    uint64_t run_a, run_b;
+    if (!vinil_vhd_block_status(job->a, sector + done, count - done, &allocated_a, &run_a) ||
+        !vinil_vhd_block_status(job->b, sector + done, count - done, &allocated_b, &run_b))
+      return FALSE;
+
+    uint64_t run = run_a < run_b ? run_a : run_b;
+    if (!allocated_a && !allocated_b) {
+      vinil_atomic_add(&job->stats.skipped_sectors, run);
+    } else {
+      uint8_t* a = worker->a + done * 512;
+      uint8_t* b = worker->b + done * 512;
+      if (!diff_read(job, job->a, allocated_a, a, sector + done, run) ||
+          !diff_read(job, job->b, allocated_b, b, sector + done, run) ||
+          !diff_compare(worker, a, b, sector + done, run))
+        return FALSE;
+    }
+
+    done += run;
+  }
+
+  return TRUE;
+}
+
+// chunks are emitted in order, so the extents reach fn sorted and merged across chunks
+static int diff_emit(DiffJob* job, DiffWorker* worker, uint64_t chunk) {
+  vinil_mutex_lock(&job->lock);
+  while (job->emitted != chunk && !job->failed)
+    vinil_cond_wait(&job->turn, &job->lock);
+
+  int ok = !job->failed;
+  size_t i;
+  for (i = 0; ok && i < worker->count; i++) {
+    DiffExtent* extent = &worker->extents[i];
+    job->stats.differing_sectors += extent->count;
+
+    if (job->pending.count > 0 && job->pending.sector + job->pending.count == extent->sector) {
+      job->pending.count += extent->count;
+      continue;
+    }
+
+    if (job->pending.count > 0) {
+      job->stats.extents++;
+      ok = job->fn == NULL || job->fn(job->arg, job->pending.sector, job->pending.count);
+    }
+    job->pending = *extent;
+  }
+
+  job->emitted++;
+  if (!ok)
+    job->failed = 1;
+  vinil_cond_broadcast(&job->turn);
+  vinil_mutex_unlock(&job->lock);
+
+  return ok;
+}
+
+static void* diff_worker(void* arg) {
+  DiffJob* job = (DiffJob*)arg;
+
+  DiffWorker worker;
+  memset(&worker, 0, sizeof(worker));
+  worker.a = (uint8_t*)vinil_alloc_aligned_buffer((size_t)(job->chunk_sectors * 512));
+  worker.b = (uint8_t*)vinil_alloc_aligned_buffer((size_t)(job->chunk_sectors * 512));
+
+  if (worker.a == NULL || worker.b == NULL)
+    diff_fail(job);
+
+  while (!vinil_atomic_load(&job->failed)) {
+    uint64_t chunk = vinil_atomic_add(&job->next_chunk, 1);
+    if (chunk >= job->chunks)
+      break;
+
+    if (!diff_chunk(job, &worker, chunk)) {
+      diff_fail(job);
+      break;
+    }
+
+    if (!diff_emit(job, &worker, chunk))
+      break;
+  }
+
+  if (worker.a)
+    vinil_free_aligned_buffer(worker.a);
+  if (worker.b)
+    vinil_free_aligned_buffer(worker.b);
+  free(worker.extents);
+
+  return NULL;
+}
+
+static int diff_run(DiffJob* job, int threads) {
+  vinil_thread workers[DIFF_MAX_THREADS];
+  int started = 0;
+  while (started < threads && vinil_thread_create(&workers[started], diff_worker, job))
+    started++;
+
+  if (started == 0)
+    diff_worker(job);
+
+  int i;
+  for (i = 0; i < started; i++)
+    vinil_thread_join(workers[i]);
+
+  if (job->failed)
+    return FALSE;
+
+  if (job->pending.count > 0) {
+    job->stats.extents++;
+    return job->fn == NULL || job->fn(job->arg, job->pending.sector, job->pending.count);
+  }
+
+  return TRUE;
+}
+
+int vinil_diff(const char* a, const char* b, int threads, vinil_diff_fn fn, void* arg, VinilDiffStats* stats) {
+  if (threads <= 0)
+    threads = VINIL_DIFF_DEFAULT_THREADS;
+  if (threads > DIFF_MAX_THREADS)
+    threads = DIFF_MAX_THREADS;
+
+  DiffJob job;
+  memset(&job, 0, sizeof(job));
+  job.fn = fn;
+  job.arg = arg;
+
+  job.a = vinil_vhd_open_with_flags(a, VINIL_VHD_OPEN_READ_ONLY);
+  job.b = vinil_vhd_open_with_flags(b, VINIL_VHD_OPEN_READ_ONLY);
+
+  int ok = job.a && job.b && job.a->footer->current_size == job.b->footer->current_size;
+  if (ok && vinil_mutex_init(&job.lock)) {
+    if (vinil_cond_init(&job.turn)) {
+      job.sectors = job.a->footer->current_size / 512;
+      job.chunk_sectors = VINIL_DIFF_CHUNK_SIZE / 512;
+      job.chunks = (job.sectors + job.chunk_sectors - 1) / job.chunk_sectors;
+      job.stats.sectors = job.sectors;
+
+      ok = diff_run(&job, threads);
+      vinil_cond_destroy(&job.turn);
+    } else {
+      ok = FALSE;
+    }
+    vinil_mutex_destroy(&job.lock);
+  } else {
+    ok = FALSE;
+  }
+
+  if (job.a)
+    vinil_vhd_close(job.a);
+  if (job.b)
+    vinil_vhd_close(job.b);
+
+  if (stats)
+    *stats = job.stats;
+
+  return ok;
+}
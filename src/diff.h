@@ -0,0 +1,56 @@
+/**
+ *  @file       diff.h
+ *  @brief      Comparison of the data of two Virtual Hard Disks.
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#ifndef VINIL_DIFF_H_
+#define VINIL_DIFF_H_
+
+#include <stdint.h>
+
+#include "crossplatform.h"
+
+/** @brief Number of threads used by vinil_diff when none is given */
+#define VINIL_DIFF_DEFAULT_THREADS    4
+
+/** @brief Bytes of each VHD compared at once by a thread of vinil_diff (4MB) */
+#define VINIL_DIFF_CHUNK_SIZE         (4*1024*1024)
+
+/** @brief What vinil_diff did */
+typedef struct {
+  uint64_t  sectors;            /**< sectors of each VHD */
+  uint64_t  skipped_sectors;    /**< sectors which read as zeros in both VHDs, skipped without being read */
+  uint64_t  bytes_read;         /**< bytes read from both VHDs */
+  uint64_t  differing_sectors;  /**< sectors whose data is not the same */
+  uint64_t  extents;            /**< extents passed to the callback */
+} VinilDiffStats;
+
+/** @brief Receives the extents which differ, it returns FALSE to stop the comparison */
+typedef int (*vinil_diff_fn)(void* arg, uint64_t sector, uint64_t count);
+
+/** @brief  Compares the data of two VHDs of the same size (of any type) and calls fn with
+ *          every extent of sectors which differ, in increasing order. Chunks are read and
+ *          compared in parallel by several threads, sectors which are unallocated (or holes)
+ *          in both VHDs are skipped without being read and an unallocated side is not read
+ *          when the other one has data.
+ *
+ *  @param    a         C string containing the name of the first VHD
+ *
+ *  @param    b         C string containing the name of the second VHD
+ *
+ *  @param    threads   number of threads, VINIL_DIFF_DEFAULT_THREADS if it is not positive
+ *
+ *  @param    fn        function called with each extent, it may be a null pointer
+ *
+ *  @param    arg       passed to fn
+ *
+ *  @param    stats     receives what was done, it may be a null pointer
+ *
+ *  @return   TRUE if the whole VHDs were compared (even if they differ), FALSE if they could not
+ *            be read, have other sizes or fn stopped the comparison.
+ */
+VINILAPI int vinil_diff(const char* a, const char* b, int threads, vinil_diff_fn fn, void* arg, VinilDiffStats* stats);
+
+#endif
@@ -0,0 +1,197 @@
+/**
+ *  @file       export.c
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#include "export.h"
+#include "vhd.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define EXPORT_CHUNK_SIZE (2*1024*1024)
+
+typedef struct {
+  uint8_t* data;
+  size_t length;
+  int full;                 // filled by the reader, not yet written
+  int last;                 // nothing follows it
+} ExportBuffer;
+
+// the reader fills a buffer from the VHD while the writer sends the other one to the sink
+typedef struct {
+  VinilVHD* vhd;
+  ExportBuffer buffers[2];
+  int failed;               // the VHD could not be read
+  int stop;                 // the sink failed, the reader gives up
+  VinilExportStats stats;
+  vinil_mutex lock;
+  vinil_cond cond;
+} ExportPipeline;
+
+// only the sectors which may hold data are read, the others are zeroed in memory
+static int export_fill(ExportPipeline* pipeline, uint8_t* data, uint64_t sector, uint64_t count) {
+  while (count > 0) {
+    int allocated;
+    uint64_t run;
+    if (!vinil_vhd_block_status(pipeline->vhd, sector, count, &allocated, &run))
+      return FALSE;
+    
+    if (allocated) {
+      if (!vinil_vhd_pread(pipeline->vhd, data, sector, run))
+        return FALSE;
+      pipeline->stats.bytes_read += run * 512;
+    } else {
+      memset(data, 0, (size_t)(run * 512));
+      pipeline->stats.zero_bytes += run * 512;
+    }
+    
+    data += run * 512;
+    sector += run;
+    count -= run;
+  }
+  
+  return TRUE;
+}
+
+static void* export_reader(void* arg) {
+  ExportPipeline* pipeline = (ExportPipeline*)arg;
+  uint64_t sectors = pipeline->vhd->footer->current_size / 512;
+  uint64_t sector = 0;
+  int i = 0;
+  
+  for (;;) {
+    ExportBuffer* buffer = &pipeline->buffers[i];
+    
+    vinil_mutex_lock(&pipeline->lock);
+    while (buffer->full && !pipeline->stop)
+      vinil_cond_wait(&pipeline->cond, &pipeline->lock);
+    int stop = pipeline->stop;
+    vinil_mutex_unlock(&pipeline->lock);
+    
+    if (stop)
+      break;
+    
+    uint64_t count = sectors - sector < EXPORT_CHUNK_SIZE / 512 ? sectors - sector : EXPORT_CHUNK_SIZE / 512;
+    int failed = !export_fill(pipeline, buffer->data, sector, count);
+    sector += count;
+    int last = failed || sector == sectors;
+    
+    vinil_mutex_lock(&pipeline->lock);
+    buffer->length = failed ? 0 : (size_t)(count * 512);
+    buffer->last = last;
+    buffer->full = TRUE;
+    if (failed)
+      pipeline->failed = TRUE;
+    vinil_cond_broadcast(&pipeline->cond);
+    vinil_mutex_unlock(&pipeline->lock);
+    
+    if (last)
+      break;
+    
+    i ^= 1;
+  }
+  
+  return NULL;
+}
+
+static int export_stream(ExportPipeline* pipeline, int fd) {
+  vinil_thread reader;
+  if (!vinil_thread_create(&reader, export_reader, pipeline))
+    return FALSE;
+  
+  int ok = TRUE;
+  int i = 0;
+  
+  for (;;) {
+    ExportBuffer* buffer = &pipeline->buffers[i];
+    
+    vinil_mutex_lock(&pipeline->lock);
+    while (!buffer->full)
+      vinil_cond_wait(&pipeline->cond, &pipeline->lock);
+    int last = buffer->last;
+    vinil_mutex_unlock(&pipeline->lock);
+    
+    ok = buffer->length == 0 || vinil_write_stream(fd, buffer->data, buffer->length);
+    if (ok)
+      pipeline->stats.bytes_written += buffer->length;
+    
+    vinil_mutex_lock(&pipeline->lock);
+    buffer->full = FALSE;
+    if (!ok)
+      pipeline->stop = TRUE;
+    vinil_cond_broadcast(&pipeline->cond);
+    vinil_mutex_unlock(&pipeline->lock);
+    
+    if (!ok || last)
+      break;
+    
+    i ^= 1;
+  }
+  
+  vinil_thread_join(reader);
+  
+  return ok && !pipeline->failed;
+}
+
+// the footer of a fixed copy of the VHD, it gets its own identity
+static int export_footer(VinilVHD* vhd, int fd) {
+  VinilVHDFooter footer;
+  memcpy(&footer, vhd->footer, sizeof(VinilVHDFooter));
+  
+  footer.disk_type = VINIL_VHD_FIXED;
+  footer.data_offset = 0xFFFFFFFFFFFFFFFFULL;
+  vinil_uuid_generate(&footer.uuid);
+  footer.checksum = vinil_checksum_vhd_footer(&footer);
+  vinil_vhd_footer_byte_swap(&footer);
+  
+  return vinil_write_stream(fd, &footer, sizeof(VinilVHDFooter));
+}
+
+int vinil_export(const char* source, int fd, int format, VinilExportStats* stats) {
+  if (format != VINIL_EXPORT_RAW && format != VINIL_EXPORT_VHD)
+    return FALSE;
+  
+  ExportPipeline pipeline;
+  memset(&pipeline, 0, sizeof(pipeline));
+  
+  pipeline.vhd = vinil_vhd_open_with_flags(source, VINIL_VHD_OPEN_READ_ONLY);
+  if (pipeline.vhd == NULL)
+    return FALSE;
+  
+  pipeline.buffers[0].data = (uint8_t*)vinil_alloc_aligned_buffer(EXPORT_CHUNK_SIZE);
+  pipeline.buffers[1].data = (uint8_t*)vinil_alloc_aligned_buffer(EXPORT_CHUNK_SIZE);
+  
+  // an empty disk only has a footer
+  int ok = pipeline.buffers[0].data && pipeline.buffers[1].data;
+  if (ok && pipeline.vhd->footer->current_size > 0) {
+    ok = vinil_mutex_init(&pipeline.lock);
+    if (ok) {
+      ok = vinil_cond_init(&pipeline.cond);
+      if (ok) {
+        ok = export_stream(&pipeline, fd);
+        vinil_cond_destroy(&pipeline.cond);
+      }
+      vinil_mutex_destroy(&pipeline.lock);
+    }
+  }
+  
+  if (ok && format == VINIL_EXPORT_VHD) {
+    ok = export_footer(pipeline.vhd, fd);
+    if (ok)
+      pipeline.stats.bytes_written += sizeof(VinilVHDFooter);
+  }
+  
+  if (pipeline.buffers[0].data)
+    vinil_free_aligned_buffer(pipeline.buffers[0].data);
+  if (pipeline.buffers[1].data)
+    vinil_free_aligned_buffer(pipeline.buffers[1].data);
+  
+  vinil_vhd_close(pipeline.vhd);
+  
+  if (stats)
+    *stats = pipeline.stats;
+  
+  return ok;
+}
@@ -0,0 +1,46 @@
+/**
+ *  @file       export.h
+ *  @brief      Streaming export of VHDs to pipes and other non-seekable sinks.
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#ifndef VINIL_EXPORT_H_
+#define VINIL_EXPORT_H_
+
+#include <stdint.h>
+
+#include "crossplatform.h"
+
+/** @brief vinil_export writes the raw sectors of the disk */
+#define VINIL_EXPORT_RAW  0
+
+/** @brief vinil_export writes a fixed VHD (the raw sectors followed by a footer) */
+#define VINIL_EXPORT_VHD  1
+
+/** @brief What vinil_export did */
+typedef struct {
+  uint64_t  bytes_written;    /**< bytes written to the sink, the footer included */
+  uint64_t  bytes_read;       /**< bytes read from the VHD */
+  uint64_t  zero_bytes;       /**< bytes of unallocated blocks or holes, written as zeros without being read */
+} VinilExportStats;
+
+/** @brief  Writes the disk of a VHD to a file descriptor in strictly increasing offset
+ *          order, so the sink may be a pipe (to a compressor, ssh or an upload) or a
+ *          socket. A thread reads the next 2MB while the previous ones are written, and
+ *          the sectors vinil_vhd_block_status reports as zeros are not read.
+ *
+ *  @param    source    C string containing the name of the VHD to be exported
+ *
+ *  @param    fd        file descriptor which receives the data
+ *
+ *  @param    format    VINIL_EXPORT_RAW or VINIL_EXPORT_VHD
+ *
+ *  @param    stats     receives what was done, it may be a null pointer
+ *
+ *  @return   If the operation was succesfully executed this function will return TRUE.
+ *            Otherwise, FALSE will be returned.
+ */
+VINILAPI int vinil_export(const char* source, int fd, int format, VinilExportStats* stats);
+
+#endif
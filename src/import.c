@@ -0,0 +1,201 @@
+/**
+ *  @file       import.c
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#include "import.h"
+#include "vhd.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define IMPORT_BLOCK_SIZE VINIL_VHD_DEFAULT_BLOCK_SIZE
+
+typedef struct {
+  uint8_t* data;
+  size_t length;            // bytes read from the stream
+  int full;                 // filled by the reader, not yet written
+  int last;                 // nothing follows it in the stream
+} ImportBuffer;
+
+// the reader fills a buffer while the writer empties the other one
+typedef struct {
+  int fd;
+  uint64_t limit;           // bytes of the virtual disk, 0 if it takes the size of the stream
+  ImportBuffer buffers[2];
+  int failed;               // the stream could not be read (or was longer than the disk)
+  int stop;                 // the writer failed, the reader gives up
+  vinil_mutex lock;
+  vinil_cond cond;
+} ImportPipeline;
+
+static void* import_reader(void* arg) {
+  ImportPipeline* pipeline = (ImportPipeline*)arg;
+  uint64_t total = 0;
+  int i = 0;
+  
+  for (;;) {
+    ImportBuffer* buffer = &pipeline->buffers[i];
+    
+    vinil_mutex_lock(&pipeline->lock);
+    while (buffer->full && !pipeline->stop)
+      vinil_cond_wait(&pipeline->cond, &pipeline->lock);
+    int stop = pipeline->stop;
+    vinil_mutex_unlock(&pipeline->lock);
+    
+    if (stop)
+      break;
+    
+    size_t wanted = IMPORT_BLOCK_SIZE;
+    if (pipeline->limit && pipeline->limit - total < wanted)
+      wanted = (size_t)(pipeline->limit - total);
+    
+    int64_t n = wanted ? vinil_read_stream(pipeline->fd, buffer->data, wanted) : 0;
+    int failed = n < 0;
+    int last = failed || (size_t)n < wanted;
+    
+    // a stream which goes on after the last sector of the disk does not fit in it
+    if (!last && pipeline->limit && total + n == pipeline->limit) {
+      uint8_t extra;
+      failed = vinil_read_stream(pipeline->fd, &extra, 1) != 0;
+      last = TRUE;
+    }
+    
+    vinil_mutex_lock(&pipeline->lock);
+    buffer->length = failed ? 0 : (size_t)n;
+    buffer->last = last;
+    buffer->full = TRUE;
+    if (failed)
+      pipeline->failed = TRUE;
+    vinil_cond_broadcast(&pipeline->cond);
+    vinil_mutex_unlock(&pipeline->lock);
+    
+    if (last)
+      break;
+    
+    total += n;
+    i ^= 1;
+  }
+  
+  return NULL;
+}
+
+static int import_block(VinilVHD* vhd, uint8_t* data, size_t length, uint64_t offset, VinilImportStats* stats) {
+  // the last sector of the stream may be incomplete
+  size_t size = (length + 511) / 512 * 512;
+  memset(data + length, 0, size - length);
+  
+  stats->blocks++;
+  stats->bytes_read += length;
+  
+  if (vinil_is_zero(data, size)) {
+    stats->zero_blocks++;
+    return TRUE;
+  }
+  
+  stats->written_blocks++;
+  
+  // the data of a fixed VHD starts at the beginning of the file, its size is only known at the end
+  if (vhd->header == NULL)
+    return vinil_pwrite(vhd->fd, data, size, (int64_t)offset);
+  
+  return vinil_vhd_pwrite(vhd, data, offset / 512, size / 512);
+}
+
+static int import_stream(ImportPipeline* pipeline, VinilVHD* vhd, VinilImportStats* stats) {
+  vinil_thread reader;
+  if (!vinil_thread_create(&reader, import_reader, pipeline))
+    return FALSE;
+  
+  uint64_t offset = 0;
+  int ok = TRUE;
+  int i = 0;
+  
+  for (;;) {
+    ImportBuffer* buffer = &pipeline->buffers[i];
+    
+    vinil_mutex_lock(&pipeline->lock);
+    while (!buffer->full)
+      vinil_cond_wait(&pipeline->cond, &pipeline->lock);
+    vinil_mutex_unlock(&pipeline->lock);
+    
+    ok = !pipeline->failed && (buffer->length == 0 || import_block(vhd, buffer->data, buffer->length, offset, stats));
+    offset += buffer->length;
+    
+    vinil_mutex_lock(&pipeline->lock);
+    buffer->full = FALSE;
+    if (!ok)
+      pipeline->stop = TRUE;
+    vinil_cond_broadcast(&pipeline->cond);
+    vinil_mutex_unlock(&pipeline->lock);
+    
+    if (!ok || buffer->last)
+      break;
+    
+    i ^= 1;
+  }
+  
+  vinil_thread_join(reader);
+  
+  return ok && !pipeline->failed;
+}
+
+int vinil_import(int fd, const char* destination, uint64_t size, int disk_type, VinilImportStats* stats) {
+  VinilImportStats done;
+  memset(&done, 0, sizeof(done));
+  
+  if (size % 512 != 0 || (disk_type == VINIL_VHD_DYNAMIC && size == 0))
+    return FALSE;
+  
+  // a fixed VHD starts empty, it gets its size and its footer after the data
+  VinilVHD* vhd = vinil_vhd_create(destination, disk_type == VINIL_VHD_FIXED ? 0 : size, disk_type,
+                                   VINIL_VHD_PREALLOC_SPARSE);
+  if (vhd == NULL)
+    return FALSE;
+  
+  ImportPipeline pipeline;
+  memset(&pipeline, 0, sizeof(pipeline));
+  pipeline.fd = fd;
+  pipeline.limit = size;
+  pipeline.buffers[0].data = (uint8_t*)vinil_alloc_aligned_buffer(IMPORT_BLOCK_SIZE);
+  pipeline.buffers[1].data = (uint8_t*)vinil_alloc_aligned_buffer(IMPORT_BLOCK_SIZE);
+  
+  int ok = pipeline.buffers[0].data && pipeline.buffers[1].data && (vhd->header || vinil_truncate(vhd->fd, 0));
+  if (ok && vinil_mutex_init(&pipeline.lock)) {
+    if (vinil_cond_init(&pipeline.cond)) {
+      ok = import_stream(&pipeline, vhd, &done);
+      vinil_cond_destroy(&pipeline.cond);
+    } else {
+      ok = FALSE;
+    }
+    vinil_mutex_destroy(&pipeline.lock);
+  } else {
+    ok = FALSE;
+  }
+  
+  if (ok && vhd->header == NULL) {
+    uint64_t disk_size = size ? size : (done.bytes_read + 511) / 512 * 512;
+    vhd->footer->original_size = disk_size;
+    vhd->footer->current_size = disk_size;
+    vhd->footer->disk_geometry = vinil_compute_chs(disk_size);
+    ok = vinil_vhd_commit_structural_changes(vhd);
+  }
+  
+  ok = ok && vinil_vhd_flush(vhd);
+  
+  if (pipeline.buffers[0].data)
+    vinil_free_aligned_buffer(pipeline.buffers[0].data);
+  if (pipeline.buffers[1].data)
+    vinil_free_aligned_buffer(pipeline.buffers[1].data);
+  
+  vinil_vhd_close(vhd);
+  
+  if (!ok)
+    remove(destination);
+  
+  if (stats)
+    *stats = done;
+  
+  return ok;
+}
@@ -0,0 +1,46 @@
+/**
+ *  @file       import.h
+ *  @brief      Streaming import of raw disk images into VHDs.
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#ifndef VINIL_IMPORT_H_
+#define VINIL_IMPORT_H_
+
+#include <stdint.h>
+
+#include "crossplatform.h"
+
+/** @brief What vinil_import did, every block has the size of a block of a dynamic VHD (2MB) */
+typedef struct {
+  uint64_t  blocks;           /**< blocks read from the stream */
+  uint64_t  written_blocks;   /**< blocks with data, written to the VHD */
+  uint64_t  zero_blocks;      /**< blocks which only contained zeros and were skipped */
+  uint64_t  bytes_read;       /**< bytes read from the stream */
+} VinilImportStats;
+
+/** @brief  Writes a raw disk image read from a file descriptor into a new VHD, in a single
+ *          pass. The descriptor does not have to be seekable (a pipe, a socket or stdin):
+ *          a thread reads the next block while the previous one is written. Blocks which
+ *          only contain zeros are skipped, they are left unallocated in a dynamic VHD and
+ *          as holes in a fixed one. The footer is written once, after the data.
+ *
+ *  @param    fd            file descriptor of the raw image, it is read until its end
+ *
+ *  @param    destination   C string containing the name of the VHD to be created, it must not exist
+ *
+ *  @param    size          size of the virtual disk in bytes (multiple of 512), the stream may be
+ *                          shorter but not longer. A fixed VHD takes the size of the stream
+ *                          (rounded up to a sector) if it is 0.
+ *
+ *  @param    disk_type     VINIL_VHD_FIXED or VINIL_VHD_DYNAMIC
+ *
+ *  @param    stats         receives what was done, it may be a null pointer
+ *
+ *  @return   If the operation was succesfully executed this function will return TRUE.
+ *            Otherwise, FALSE will be returned and the destination is removed.
+ */
+VINILAPI int vinil_import(int fd, const char* destination, uint64_t size, int disk_type, VinilImportStats* stats);
+
+#endif
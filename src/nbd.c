@@ -0,0 +1,1195 @@
+/**
+ *  @file       nbd.c
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#include "nbd.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#ifndef MSG_NOSIGNAL
+  #define MSG_NOSIGNAL 0
+#endif
+
+// handshake
+#define NBD_MAGIC                     0x4e42444d41474943ULL   // "NBDMAGIC"
+#define NBD_OPTION_MAGIC              0x49484156454f5054ULL   // "IHAVEOPT"
+#define NBD_REPLY_OPTION_MAGIC        0x0003e889045565a9ULL
+#define NBD_FLAG_FIXED_NEWSTYLE       (1 << 0)
+#define NBD_FLAG_NO_ZEROES            (1 << 1)
+
+#define NBD_OPT_EXPORT_NAME           1
+#define NBD_OPT_ABORT                 2
+#define NBD_OPT_LIST                  3
+#define NBD_OPT_INFO                  6
+#define NBD_OPT_GO                    7
+#define NBD_OPT_STRUCTURED_REPLY      8
+#define NBD_OPT_LIST_META_CONTEXT     9
+#define NBD_OPT_SET_META_CONTEXT      10
+
+#define NBD_REP_ACK                   1
+#define NBD_REP_SERVER                2
+#define NBD_REP_INFO                  3
+#define NBD_REP_META_CONTEXT          4
+#define NBD_REP_ERR_UNSUP             0x80000001
+#define NBD_REP_ERR_INVALID           0x80000003
+#define NBD_REP_ERR_UNKNOWN           0x80000006
+
+#define NBD_INFO_EXPORT               0
+#define NBD_INFO_BLOCK_SIZE           3
+
+// transmission
+#define NBD_REQUEST_MAGIC             0x25609513
+#define NBD_SIMPLE_REPLY_MAGIC        0x67446698
+#define NBD_STRUCTURED_REPLY_MAGIC    0x668e33ef
+
+#define NBD_FLAG_HAS_FLAGS            (1 << 0)
+#define NBD_FLAG_READ_ONLY            (1 << 1)
+#define NBD_FLAG_SEND_FLUSH           (1 << 2)
+#define NBD_FLAG_SEND_FUA             (1 << 3)
+#define NBD_FLAG_SEND_TRIM            (1 << 5)
+#define NBD_FLAG_SEND_WRITE_ZEROES    (1 << 6)
+#define NBD_FLAG_SEND_DF              (1 << 7)
+#define NBD_FLAG_CAN_MULTI_CONN       (1 << 8)
+
+#define NBD_CMD_READ                  0
+#define NBD_CMD_WRITE                 1
+#define NBD_CMD_DISC                  2
+#define NBD_CMD_FLUSH                 3
+#define NBD_CMD_TRIM                  4
+#define NBD_CMD_WRITE_ZEROES          6
+#define NBD_CMD_BLOCK_STATUS          7
+
+#define NBD_CMD_FLAG_FUA              (1 << 0)
+#define NBD_CMD_FLAG_NO_HOLE          (1 << 1)
+#define NBD_CMD_FLAG_DF               (1 << 2)
+#define NBD_CMD_FLAG_REQ_ONE          (1 << 3)
+
+#define NBD_REPLY_FLAG_DONE           (1 << 0)
+#define NBD_REPLY_TYPE_NONE           0
+#define NBD_REPLY_TYPE_OFFSET_DATA    1
+#define NBD_REPLY_TYPE_OFFSET_HOLE    2
+#define NBD_REPLY_TYPE_BLOCK_STATUS   5
+#define NBD_REPLY_TYPE_ERROR          0x8001
+
+#define NBD_STATE_HOLE                (1 << 0)
+#define NBD_STATE_ZERO                (1 << 1)
+
+#define NBD_EPERM                     1
+#define NBD_EIO                       5
+#define NBD_ENOMEM                    12
+#define NBD_EINVAL                    22
+#define NBD_ENOSPC                    28
+
+#define NBD_MAX_THREADS               64
+#define NBD_MAX_OPTION                65536
+#define NBD_MAX_DESCRIPTORS           512
+#define NBD_ZERO_SIZE                 (1024*1024)
+#define NBD_META_CONTEXT              "base:allocation"
+#define NBD_META_CONTEXT_ID           1
+
+typedef struct {
+  char* name;
+  VinilVHD* vhd;
+  int read_only;
+  uint64_t size;
+} NBDExport;
+
+typedef struct NBDConnection {
+  VinilNBD* server;
+  int fd;
+  NBDExport* image;
+  int no_zeroes;
+  int structured;
+  int block_status;         // base:allocation was selected
+  uint64_t failed;          // the socket was shut down
+  uint64_t finished;        // the thread can be joined
+  uint64_t in_flight;
+  vinil_mutex send_lock;    // replies are sent whole, in any order
+  vinil_mutex lock;
+  vinil_cond idle;
+  vinil_thread thread;
+  struct NBDConnection* next;
+} NBDConnection;
+
+typedef struct NBDRequest {
+  NBDConnection* conn;
+  uint16_t flags;
+  uint16_t type;
+  uint64_t cookie;
+  uint64_t offset;
+  uint32_t length;
+  uint8_t* data;            // payload of writes
+  struct NBDRequest* next;
+} NBDRequest;
+
+typedef struct {
+  uint8_t* data;
+  size_t size;
+} NBDBuffer;
+
+struct VinilNBD {
+  NBDExport exports[VINIL_NBD_MAX_EXPORTS];
+  int export_count;
+  int listeners[VINIL_NBD_MAX_LISTENERS];
+  char* socket_paths[VINIL_NBD_MAX_LISTENERS];
+  int listener_count;
+  int stop_pipe[2];
+  uint64_t stopping;
+  int threads;
+  uint8_t* zeros;
+  vinil_mutex lock;         // protects the queue
+  vinil_cond work;
+  NBDRequest* head;
+  NBDRequest* tail;
+  int quit;
+  NBDConnection* connections;
+  VinilNBDStats stats;
+};
+
+static void nbd_put16(uint8_t* p, uint16_t value) {
+  p[0] = (uint8_t)(value >> 8);
+  p[1] = (uint8_t)value;
+}
+
+static void nbd_put32(uint8_t* p, uint32_t value) {
+  nbd_put16(p, (uint16_t)(value >> 16));
+  nbd_put16(p + 2, (uint16_t)value);
+}
+
+static void nbd_put64(uint8_t* p, uint64_t value) {
+  nbd_put32(p, (uint32_t)(value >> 32));
+  nbd_put32(p + 4, (uint32_t)value);
+}
+
+static uint16_t nbd_get16(const uint8_t* p) {
+  return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static uint32_t nbd_get32(const uint8_t* p) {
+  return ((uint32_t)nbd_get16(p) << 16) | nbd_get16(p + 2);
+}
+
+static uint64_t nbd_get64(const uint8_t* p) {
+  return ((uint64_t)nbd_get32(p) << 32) | nbd_get32(p + 4);
+}
+
+static int nbd_receive_all(NBDConnection* conn, void* buffer, size_t size) {
+  return vinil_read_stream(conn->fd, buffer, size) == (int64_t)size;
+}
+
+// a socket which fails is shut down, so the thread which reads its requests stops too
+static int nbd_send(NBDConnection* conn, struct iovec* iov, int count) {
+  vinil_mutex_lock(&conn->send_lock);
+
+  int ok = !vinil_atomic_load(&conn->failed);
+  while (ok && count > 0) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+
+    ssize_t n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+    if (n < 0) {
+      ok = errno == EINTR;
+      continue;
+    }
+
+    while (count > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char*)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+
+  if (!ok && !vinil_atomic_load(&conn->failed)) {
+    vinil_atomic_store(&conn->failed, 1);
+    shutdown(conn->fd, SHUT_RDWR);
+  }
+
+  vinil_mutex_unlock(&conn->send_lock);
+
+  return ok;
+}
+
+static int nbd_send_buffer(NBDConnection* conn, const void* buffer, size_t size) {
+  struct iovec iov;
+  iov.iov_base = (void*)buffer;
+  iov.iov_len = size;
+
+  return nbd_send(conn, &iov, 1);
+}
+
+static int nbd_option_reply(NBDConnection* conn, uint32_t option, uint32_t type, const void* data, uint32_t size) {
+  uint8_t header[20];
+  nbd_put64(header, NBD_REPLY_OPTION_MAGIC);
+  nbd_put32(header + 8, option);
+  nbd_put32(header + 12, type);
+  nbd_put32(header + 16, size);
+
+  struct iovec iov[2];
+  iov[0].iov_base = header;
+  iov[0].iov_len = sizeof(header);
+  iov[1].iov_base = (void*)data;
+  iov[1].iov_len = size;
+
+  return nbd_send(conn, iov, size ? 2 : 1);
+}
+
+static NBDExport* nbd_find_export(VinilNBD* nbd, const char* name, size_t size) {
+  if (size == 0)
+    return nbd->export_count > 0 ? &nbd->exports[0] : NULL;
+
+  int i;
+  for (i = 0; i < nbd->export_count; i++) {
+    if (strlen(nbd->exports[i].name) == size && memcmp(nbd->exports[i].name, name, size) == 0)
+      return &nbd->exports[i];
+  }
+
+  return NULL;
+}
+
+static uint16_t nbd_transmission_flags(NBDConnection* conn, NBDExport* image) {
+  uint16_t flags = NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA | NBD_FLAG_SEND_TRIM |
+                   NBD_FLAG_SEND_WRITE_ZEROES | NBD_FLAG_CAN_MULTI_CONN;
+  if (image->read_only)
+    flags |= NBD_FLAG_READ_ONLY;
+  if (conn->structured)
+    flags |= NBD_FLAG_SEND_DF;
+
+  return flags;
+}
+
+static int nbd_info_reply(NBDConnection* conn, uint32_t option, NBDExport* image) {
+  uint8_t info[12];
+  nbd_put16(info, NBD_INFO_EXPORT);
+  nbd_put64(info + 2, image->size);
+  nbd_put16(info + 10, nbd_transmission_flags(conn, image));
+
+  // writes must be whole sectors, reads may start and end anywhere
+  uint8_t block_size[14];
+  nbd_put16(block_size, NBD_INFO_BLOCK_SIZE);
+  nbd_put32(block_size + 2, 512);
+  nbd_put32(block_size + 6, 4096);
+  nbd_put32(block_size + 10, VINIL_NBD_MAX_REQUEST);
+
+  return nbd_option_reply(conn, option, NBD_REP_INFO, info, sizeof(info)) &&
+         nbd_option_reply(conn, option, NBD_REP_INFO, block_size, sizeof(block_size)) &&
+         nbd_option_reply(conn, option, NBD_REP_ACK, NULL, 0);
+}
+
+// NBD_OPT_INFO and NBD_OPT_GO: the name of the image followed by the information requested
+static int nbd_option_go(NBDConnection* conn, uint32_t option, const uint8_t* data, uint32_t size, int* done) {
+  uint32_t name_size = size >= 4 ? nbd_get32(data) : UINT32_MAX;
+  if (name_size > size - 4 || size - 4 - name_size < 2 ||
+      size - 4 - name_size - 2 != 2 * (uint32_t)nbd_get16(data + 4 + name_size))
+    return nbd_option_reply(conn, option, NBD_REP_ERR_INVALID, NULL, 0);
+
+  NBDExport* image = nbd_find_export(conn->server, (const char*)data + 4, name_size);
+  if (image == NULL)
+    return nbd_option_reply(conn, option, NBD_REP_ERR_UNKNOWN, NULL, 0);
+
+  if (!nbd_info_reply(conn, option, image))
+    return FALSE;
+
+  if (option == NBD_OPT_GO) {
+    conn->image = image;
+    *done = TRUE;
+  }
+
+  return TRUE;
+}
+
+// the only metadata context is base:allocation, built from vinil_vhd_block_status
+static int nbd_option_meta_context(NBDConnection* conn, uint32_t option, const uint8_t* data, uint32_t size) {
+  if (option == NBD_OPT_SET_META_CONTEXT && !conn->structured)
+    return nbd_option_reply(conn, option, NBD_REP_ERR_INVALID, NULL, 0);
+
+  uint32_t name_size = size >= 4 ? nbd_get32(data) : UINT32_MAX;
+  if (name_size > size - 4 || size - 4 - name_size < 4)
+    return nbd_option_reply(conn, option, NBD_REP_ERR_INVALID, NULL, 0);
+
+  if (nbd_find_export(conn->server, (const char*)data + 4, name_size) == NULL)
+    return nbd_option_reply(conn, option, NBD_REP_ERR_UNKNOWN, NULL, 0);
+
+  const uint8_t* p = data + 4 + name_size;
+  const uint8_t* end = data + size;
+  uint32_t queries = nbd_get32(p);
+  p += 4;
+
+  int found = option == NBD_OPT_LIST_META_CONTEXT && queries == 0;
+  uint32_t i;
+  for (i = 0; i < queries; i++) {
+    uint32_t query_size = end - p >= 4 ? nbd_get32(p) : UINT32_MAX;
+    if (query_size > (uint32_t)(end - p) - 4)
+      return nbd_option_reply(conn, option, NBD_REP_ERR_INVALID, NULL, 0);
+
+    const char* query = (const char*)p + 4;
+    if ((query_size == strlen(NBD_META_CONTEXT) && memcmp(query, NBD_META_CONTEXT, query_size) == 0) ||
+        (option == NBD_OPT_LIST_META_CONTEXT && query_size == 5 && memcmp(query, "base:", 5) == 0))
+      found = TRUE;
+    p += 4 + query_size;
+  }
+
+  if (option == NBD_OPT_SET_META_CONTEXT)
+    conn->block_status = found;
+
+  if (found) {
+    uint8_t context[4 + sizeof(NBD_META_CONTEXT) - 1];
+    nbd_put32(context, NBD_META_CONTEXT_ID);
+    memcpy(context + 4, NBD_META_CONTEXT, sizeof(NBD_META_CONTEXT) - 1);
+    if (!nbd_option_reply(conn, option, NBD_REP_META_CONTEXT, context, sizeof(context)))
+      return FALSE;
+  }
+
+  return nbd_option_reply(conn, option, NBD_REP_ACK, NULL, 0);
+}
+
+static int nbd_option_list(NBDConnection* conn, uint32_t size) {
+  if (size != 0)
+    return nbd_option_reply(conn, NBD_OPT_LIST, NBD_REP_ERR_INVALID, NULL, 0);
+
+  int i;
+  for (i = 0; i < conn->server->export_count; i++) {
+    uint8_t server[4 + 256];
+    uint32_t name_size = (uint32_t)strlen(conn->server->exports[i].name);
+    nbd_put32(server, name_size);
+    memcpy(server + 4, conn->server->exports[i].name, name_size);
+    if (!nbd_option_reply(conn, NBD_OPT_LIST, NBD_REP_SERVER, server, 4 + name_size))
+      return FALSE;
+  }
+
+  return nbd_option_reply(conn, NBD_OPT_LIST, NBD_REP_ACK, NULL, 0);
+}
+
+// fixed newstyle handshake, it ends when the client picks an image
+static int nbd_negotiate(NBDConnection* conn) {
+  uint8_t hello[18];
+  nbd_put64(hello, NBD_MAGIC);
+  nbd_put64(hello + 8, NBD_OPTION_MAGIC);
+  nbd_put16(hello + 16, NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+
+  uint8_t client_flags[4];
+  if (!nbd_send_buffer(conn, hello, sizeof(hello)) || !nbd_receive_all(conn, client_flags, 4) ||
+      (nbd_get32(client_flags) & ~(NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES)) != 0)
+    return FALSE;
+  conn->no_zeroes = (nbd_get32(client_flags) & NBD_FLAG_NO_ZEROES) != 0;
+
+  int done = FALSE;
+  while (!done) {
+    uint8_t header[16];
+    if (!nbd_receive_all(conn, header, sizeof(header)) || nbd_get64(header) != NBD_OPTION_MAGIC)
+      return FALSE;
+
+    uint32_t option = nbd_get32(header + 8);
+    uint32_t size = nbd_get32(header + 12);
+    if (size > NBD_MAX_OPTION)
+      return FALSE;
+
+    uint8_t* data = (uint8_t*)malloc(size + 1);
+    if (data == NULL || !nbd_receive_all(conn, data, size)) {
+      free(data);
+      return FALSE;
+    }
+
+    int ok;
+    switch (option) {
+      case NBD_OPT_EXPORT_NAME: {
+        // there is no way to refuse an unknown name but closing the connection
+        conn->image = nbd_find_export(conn->server, (const char*)data, size);
+        ok = conn->image != NULL;
+        if (ok) {
+          uint8_t reply[10 + 124];
+          memset(reply, 0, sizeof(reply));
+          nbd_put64(reply, conn->image->size);
+          nbd_put16(reply + 8, nbd_transmission_flags(conn, conn->image));
+          ok = nbd_send_buffer(conn, reply, conn->no_zeroes ? 10 : sizeof(reply));
+        }
+        done = TRUE;
+        break;
+      }
+      case NBD_OPT_ABORT:
+        nbd_option_reply(conn, option, NBD_REP_ACK, NULL, 0);
+        ok = FALSE;
+        break;
+      case NBD_OPT_LIST:
+        ok = nbd_option_list(conn, size);
+        break;
+      case NBD_OPT_STRUCTURED_REPLY:
+        conn->structured = conn->structured || size == 0;
+        ok = nbd_option_reply(conn, option, size == 0 ? NBD_REP_ACK : NBD_REP_ERR_INVALID, NULL, 0);
+        break;
+      case NBD_OPT_INFO:
+      case NBD_OPT_GO:
+        ok = nbd_option_go(conn, option, data, size, &done);
+        break;
+      case NBD_OPT_LIST_META_CONTEXT:
+      case NBD_OPT_SET_META_CONTEXT:
+        ok = nbd_option_meta_context(conn, option, data, size);
+        break;
+      default:
+        ok = nbd_option_reply(conn, option, NBD_REP_ERR_UNSUP, NULL, 0);
+        break;
+    }
+
+    free(data);
+    if (!ok)
+      return FALSE;
+  }
+
+  return conn->image != NULL;
+}
+
+static int nbd_simple_reply(NBDConnection* conn, NBDRequest* req, uint32_t error, const void* data, uint32_t size) {
+  uint8_t header[16];
+  nbd_put32(header, NBD_SIMPLE_REPLY_MAGIC);
+  nbd_put32(header + 4, error);
+  nbd_put64(header + 8, req->cookie);
+
+  struct iovec iov[2];
+  iov[0].iov_base = header;
+  iov[0].iov_len = sizeof(header);
+  iov[1].iov_base = (void*)data;
+  iov[1].iov_len = size;
+
+  return nbd_send(conn, iov, size ? 2 : 1);
+}
+
+// the payload is a prefix (offset, context or error) followed by the data
+static int nbd_chunk(NBDConnection* conn, NBDRequest* req, uint16_t flags, uint16_t type, const void* prefix,
+                     uint32_t prefix_size, const void* data, uint32_t size) {
+  uint8_t header[20 + 8];
+  nbd_put32(header, NBD_STRUCTURED_REPLY_MAGIC);
+  nbd_put16(header + 4, flags);
+  nbd_put16(header + 6, type);
+  nbd_put64(header + 8, req->cookie);
+  nbd_put32(header + 16, prefix_size + size);
+  memcpy(header + 20, prefix, prefix_size);
+
+  struct iovec iov[2];
+  iov[0].iov_base = header;
+  iov[0].iov_len = 20 + prefix_size;
+  iov[1].iov_base = (void*)data;
+  iov[1].iov_len = size;
+
+  return nbd_send(conn, iov, size ? 2 : 1);
+}
+
+static int nbd_error_chunk(NBDConnection* conn, NBDRequest* req, uint32_t error) {
+  uint8_t payload[6];
+  nbd_put32(payload, error);
+  nbd_put16(payload + 4, 0);
+
+  return nbd_chunk(conn, req, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_ERROR, payload, sizeof(payload), NULL, 0);
+}
+
+static int nbd_reserve(NBDBuffer* buffer, size_t size) {
+  if (buffer->size >= size)
+    return TRUE;
+
+  if (buffer->data)
+    vinil_free_aligned_buffer(buffer->data);
+  buffer->data = (uint8_t*)vinil_alloc_aligned_buffer(size);
+  buffer->size = buffer->data ? size : 0;
+
+  return buffer->data != NULL;
+}
+
+// reads may start and end in the middle of sectors, the whole sectors are read
+static int nbd_read_range(NBDExport* image, NBDBuffer* buffer, uint64_t offset, uint32_t length, uint8_t** data) {
+  uint64_t first = offset / 512;
+  uint64_t last = (offset + length + 511) / 512;
+  if (!nbd_reserve(buffer, (size_t)((last - first) * 512)))
+    return FALSE;
+
+  *data = buffer->data + offset % 512;
+
+  return last == first || vinil_vhd_pread(image->vhd, buffer->data, first, last - first);
+}
+
+// without structured replies (or with NBD_CMD_FLAG_DF) the holes are sent as zeros
+static int nbd_read_whole(NBDConnection* conn, NBDRequest* req, NBDBuffer* buffer) {
+  VinilNBD* nbd = conn->server;
+  uint8_t* data;
+  if (!nbd_read_range(conn->image, buffer, req->offset, req->length, &data)) {
+    if (conn->structured)
+      nbd_error_chunk(conn, req, NBD_EIO);
+    else
+      nbd_simple_reply(conn, req, NBD_EIO, NULL, 0);
+    return FALSE;
+  }
+
+  vinil_atomic_add(&nbd->stats.bytes_read, req->length);
+  if (!conn->structured)
+    return nbd_simple_reply(conn, req, 0, data, req->length);
+
+  uint8_t offset[8];
+  nbd_put64(offset, req->offset);
+
+  return nbd_chunk(conn, req, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_OFFSET_DATA, offset, 8, data, req->length);
+}
+
+// every run of sectors which reads as zeros becomes a hole chunk, only the data is read and sent
+static int nbd_read_sparse(NBDConnection* conn, NBDRequest* req, NBDBuffer* buffer) {
+  VinilNBD* nbd = conn->server;
+  uint64_t position = req->offset;
+  uint64_t end = req->offset + req->length;
+
+  while (position < end) {
+    int allocated;
+    uint64_t run;
+    uint64_t sector = position / 512;
+    if (!vinil_vhd_block_status(conn->image->vhd, sector, (end + 511) / 512 - sector, &allocated, &run)) {
+      nbd_error_chunk(conn, req, NBD_EIO);
+      return FALSE;
+    }
+
+    uint64_t run_end = (sector + run) * 512 < end ? (sector + run) * 512 : end;
+    uint32_t size = (uint32_t)(run_end - position);
+    uint16_t flags = run_end == end ? NBD_REPLY_FLAG_DONE : 0;
+
+    uint8_t prefix[12];
+    nbd_put64(prefix, position);
+    int ok;
+    if (!allocated) {
+      nbd_put32(prefix + 8, size);
+      vinil_atomic_add(&nbd->stats.hole_bytes, size);
+      ok = nbd_chunk(conn, req, flags, NBD_REPLY_TYPE_OFFSET_HOLE, prefix, 12, NULL, 0);
+    } else {
+      uint8_t* data;
+      if (!nbd_read_range(conn->image, buffer, position, size, &data)) {
+        nbd_error_chunk(conn, req, NBD_EIO);
+        return FALSE;
+      }
+      vinil_atomic_add(&nbd->stats.bytes_read, size);
+      ok = nbd_chunk(conn, req, flags, NBD_REPLY_TYPE_OFFSET_DATA, prefix, 8, data, size);
+    }
+
+    if (!ok)
+      return FALSE;
+
+    position = run_end;
+  }
+
+  return TRUE;
+}
+
+static int nbd_read(NBDConnection* conn, NBDRequest* req, NBDBuffer* buffer) {
+  NBDExport* image = conn->image;
+  if (req->length > VINIL_NBD_MAX_REQUEST || req->offset > image->size || req->length > image->size - req->offset) {
+    if (conn->structured)
+      nbd_error_chunk(conn, req, NBD_EINVAL);
+    else
+      nbd_simple_reply(conn, req, NBD_EINVAL, NULL, 0);
+    return FALSE;
+  }
+
+  if (conn->structured && req->length == 0)
+    return nbd_chunk(conn, req, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_NONE, NULL, 0, NULL, 0);
+
+  if (!conn->structured || (req->flags & NBD_CMD_FLAG_DF))
+    return nbd_read_whole(conn, req, buffer);
+
+  return nbd_read_sparse(conn, req, buffer);
+}
+
+static int nbd_block_status(NBDConnection* conn, NBDRequest* req) {
+  NBDExport* image = conn->image;
+  if (!conn->block_status || req->length == 0 || req->offset > image->size ||
+      req->length > image->size - req->offset) {
+    nbd_error_chunk(conn, req, NBD_EINVAL);
+    return FALSE;
+  }
+
+  uint8_t* payload = (uint8_t*)malloc(4 + NBD_MAX_DESCRIPTORS * 8);
+  if (payload == NULL) {
+    nbd_error_chunk(conn, req, NBD_ENOMEM);
+    return FALSE;
+  }
+  nbd_put32(payload, NBD_META_CONTEXT_ID);
+
+  uint32_t max = (req->flags & NBD_CMD_FLAG_REQ_ONE) ? 1 : NBD_MAX_DESCRIPTORS;
+  uint32_t count = 0;
+  uint64_t position = req->offset;
+  uint64_t end = req->offset + req->length;
+  while (position < end && count < max) {
+    int allocated;
+    uint64_t run;
+    uint64_t sector = position / 512;
+    if (!vinil_vhd_block_status(image->vhd, sector, (end + 511) / 512 - sector, &allocated, &run)) {
+      free(payload);
+      nbd_error_chunk(conn, req, NBD_EIO);
+      return FALSE;
+    }
+
+    uint64_t run_end = (sector + run) * 512 < end ? (sector + run) * 512 : end;
+    nbd_put32(payload + 4 + count * 8, (uint32_t)(run_end - position));
+    nbd_put32(payload + 8 + count * 8, allocated ? 0 : NBD_STATE_HOLE | NBD_STATE_ZERO);
+    count++;
+    position = run_end;
+  }
+
+  int ok = nbd_chunk(conn, req, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_BLOCK_STATUS, payload, 4, payload + 4, count * 8);
+  free(payload);
+
+  return ok;
+}
+
+// the writes of NBD_CMD_WRITE_ZEROES with NBD_CMD_FLAG_NO_HOLE, other zeroes are discards
+static int nbd_write_zeros(VinilNBD* nbd, NBDExport* image, uint64_t sector, uint64_t count) {
+  while (count > 0) {
+    uint64_t n = count < NBD_ZERO_SIZE / 512 ? count : NBD_ZERO_SIZE / 512;
+    if (!vinil_vhd_pwrite(image->vhd, nbd->zeros, sector, n))
+      return FALSE;
+    sector += n;
+    count -= n;
+  }
+
+  return TRUE;
+}
+
+// the commands which do not return data, they get an error code
+static uint32_t nbd_execute(NBDConnection* conn, NBDRequest* req) {
+  VinilNBD* nbd = conn->server;
+  NBDExport* image = conn->image;
+  int in_range = req->offset <= image->size && req->length <= image->size - req->offset;
+  int aligned = req->offset % 512 == 0 && req->length % 512 == 0;
+  uint64_t sector = req->offset / 512;
+  uint64_t count = req->length / 512;
+
+  switch (req->type) {
+    case NBD_CMD_FLUSH:
+      return vinil_vhd_flush(image->vhd) ? 0 : NBD_EIO;
+
+    case NBD_CMD_WRITE:
+      if (image->read_only)
+        return NBD_EPERM;
+      if (!in_range)
+        return NBD_ENOSPC;
+      if (!aligned)
+        return NBD_EINVAL;
+      if (count > 0 && !vinil_vhd_pwrite(image->vhd, req->data, sector, count))
+        return NBD_EIO;
+      vinil_atomic_add(&nbd->stats.bytes_written, req->length);
+      break;
+
+    case NBD_CMD_TRIM: {
+      if (image->read_only)
+        return NBD_EPERM;
+      if (!in_range)
+        return NBD_EINVAL;
+
+      // a trim is advisory, the partial sectors at its ends are kept
+      uint64_t first = (req->offset + 511) / 512;
+      uint64_t last = (req->offset + req->length) / 512;
+      if (last > first && !vinil_vhd_discard(image->vhd, first, last - first))
+        return NBD_EIO;
+      break;
+    }
+
+    case NBD_CMD_WRITE_ZEROES:
+      if (image->read_only)
+        return NBD_EPERM;
+      if (!in_range)
+        return NBD_ENOSPC;
+      if (!aligned)
+        return NBD_EINVAL;
+      if (count > 0 && !((req->flags & NBD_CMD_FLAG_NO_HOLE) ? nbd_write_zeros(nbd, image, sector, count)
+                                                             : vinil_vhd_discard(image->vhd, sector, count)))
+        return NBD_EIO;
+      break;
+
+    default:
+      return NBD_EINVAL;
+  }
+
+  if ((req->flags & NBD_CMD_FLAG_FUA) && !vinil_vhd_flush(image->vhd))
+    return NBD_EIO;
+
+  return 0;
+}
+
+static void nbd_process(NBDRequest* req, NBDBuffer* buffer) {
+  NBDConnection* conn = req->conn;
+
+  int ok;
+  if (req->type == NBD_CMD_READ) {
+    ok = nbd_read(conn, req, buffer);
+  } else if (req->type == NBD_CMD_BLOCK_STATUS && conn->structured) {
+    ok = nbd_block_status(conn, req);
+  } else {
+    uint32_t error = nbd_execute(conn, req);
+    nbd_simple_reply(conn, req, error, NULL, 0);
+    ok = error == 0;
+  }
+
+  if (!ok)
+    vinil_atomic_add(&conn->server->stats.errors, 1);
+}
+
+static void* nbd_worker(void* arg) {
+  VinilNBD* nbd = (VinilNBD*)arg;
+  NBDBuffer buffer;
+  memset(&buffer, 0, sizeof(buffer));
+
+  for (;;) {
+    vinil_mutex_lock(&nbd->lock);
+    while (nbd->head == NULL && !nbd->quit)
+      vinil_cond_wait(&nbd->work, &nbd->lock);
+
+    NBDRequest* req = nbd->head;
+    if (req) {
+      nbd->head = req->next;
+      if (nbd->head == NULL)
+        nbd->tail = NULL;
+    }
+    vinil_mutex_unlock(&nbd->lock);
+
+    if (req == NULL)
+      break;
+
+    nbd_process(req, &buffer);
+
+    NBDConnection* conn = req->conn;
+    vinil_mutex_lock(&conn->lock);
+    conn->in_flight--;
+    vinil_cond_broadcast(&conn->idle);
+    vinil_mutex_unlock(&conn->lock);
+
+    if (req->data)
+      vinil_free_aligned_buffer(req->data);
+    free(req);
+  }
+
+  if (buffer.data)
+    vinil_free_aligned_buffer(buffer.data);
+
+  return NULL;
+}
+
+static void nbd_enqueue(VinilNBD* nbd, NBDRequest* req) {
+  vinil_mutex_lock(&nbd->lock);
+  if (nbd->tail)
+    nbd->tail->next = req;
+  else
+    nbd->head = req;
+  nbd->tail = req;
+  vinil_cond_signal(&nbd->work);
+  vinil_mutex_unlock(&nbd->lock);
+}
+
+// requests are read in order and queued, the pool replies to them as they finish
+static void nbd_receive_requests(NBDConnection* conn) {
+  VinilNBD* nbd = conn->server;
+
+  for (;;) {
+    uint8_t header[28];
+    if (!nbd_receive_all(conn, header, sizeof(header)) || nbd_get32(header) != NBD_REQUEST_MAGIC)
+      return;
+
+    NBDRequest* req = (NBDRequest*)calloc(1, sizeof(NBDRequest));
+    if (req == NULL)
+      return;
+
+    req->conn = conn;
+    req->flags = nbd_get16(header + 4);
+    req->type = nbd_get16(header + 6);
+    req->cookie = nbd_get64(header + 8);
+    req->offset = nbd_get64(header + 16);
+    req->length = nbd_get32(header + 24);
+
+    if (req->type == NBD_CMD_DISC) {
+      free(req);
+      return;
+    }
+
+    // the payload of a write which is too large cannot be skipped safely
+    if (req->type == NBD_CMD_WRITE) {
+      req->data = req->length <= VINIL_NBD_MAX_REQUEST ?
+                  (uint8_t*)vinil_alloc_aligned_buffer(req->length ? req->length : 512) : NULL;
+      if (req->data == NULL || !nbd_receive_all(conn, req->data, req->length)) {
+        if (req->data)
+          vinil_free_aligned_buffer(req->data);
+        free(req);
+        return;
+      }
+    }
+
+    vinil_atomic_add(&nbd->stats.requests, 1);
+
+    vinil_mutex_lock(&conn->lock);
+    while (conn->in_flight >= VINIL_NBD_MAX_IN_FLIGHT)
+      vinil_cond_wait(&conn->idle, &conn->lock);
+    conn->in_flight++;
+    vinil_mutex_unlock(&conn->lock);
+
+    nbd_enqueue(nbd, req);
+  }
+}
+
+static void* nbd_connection_main(void* arg) {
+  NBDConnection* conn = (NBDConnection*)arg;
+
+  if (nbd_negotiate(conn)) {
+    vinil_atomic_add(&conn->server->stats.connections, 1);
+    nbd_receive_requests(conn);
+  }
+
+  // the replies of the requests in flight are sent before the socket is shut down
+  vinil_mutex_lock(&conn->lock);
+  while (conn->in_flight > 0)
+    vinil_cond_wait(&conn->idle, &conn->lock);
+  vinil_mutex_unlock(&conn->lock);
+
+  shutdown(conn->fd, SHUT_RDWR);
+  vinil_atomic_store(&conn->finished, 1);
+
+  return NULL;
+}
+
+static void nbd_accept(VinilNBD* nbd, int fd) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags >= 0)
+    fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+
+  // small replies must not wait for more data, it fails harmlessly on Unix sockets
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+#ifdef SO_NOSIGPIPE
+  setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+
+  NBDConnection* conn = (NBDConnection*)calloc(1, sizeof(NBDConnection));
+  if (conn == NULL) {
+    close(fd);
+    return;
+  }
+
+  conn->server = nbd;
+  conn->fd = fd;
+  if (!vinil_mutex_init(&conn->send_lock)) {
+    free(conn);
+    close(fd);
+    return;
+  }
+  if (!vinil_mutex_init(&conn->lock)) {
+    vinil_mutex_destroy(&conn->send_lock);
+    free(conn);
+    close(fd);
+    return;
+  }
+  if (!vinil_cond_init(&conn->idle) || !vinil_thread_create(&conn->thread, nbd_connection_main, conn)) {
+    vinil_mutex_destroy(&conn->lock);
+    vinil_mutex_destroy(&conn->send_lock);
+    free(conn);
+    close(fd);
+    return;
+  }
+
+  conn->next = nbd->connections;
+  nbd->connections = conn;
+}
+
+// finished connections are joined and freed, all of them when the server stops
+static void nbd_reap(VinilNBD* nbd, int all) {
+  NBDConnection** link = &nbd->connections;
+  while (*link) {
+    NBDConnection* conn = *link;
+    if (!all && !vinil_atomic_load(&conn->finished)) {
+      link = &conn->next;
+      continue;
+    }
+
+    *link = conn->next;
+    vinil_thread_join(conn->thread);
+    close(conn->fd);
+    vinil_cond_destroy(&conn->idle);
+    vinil_mutex_destroy(&conn->lock);
+    vinil_mutex_destroy(&conn->send_lock);
+    free(conn);
+  }
+}
+
+static int nbd_add_listener(VinilNBD* nbd, int fd, const char* path) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0 || listen(fd, 64) < 0) {
+    close(fd);
+    return FALSE;
+  }
+
+  nbd->socket_paths[nbd->listener_count] = NULL;
+  if (path) {
+    nbd->socket_paths[nbd->listener_count] = (char*)malloc(strlen(path) + 1);
+    if (nbd->socket_paths[nbd->listener_count] == NULL) {
+      close(fd);
+      unlink(path);
+      return FALSE;
+    }
+    strcpy(nbd->socket_paths[nbd->listener_count], path);
+  }
+
+  nbd->listeners[nbd->listener_count++] = fd;
+
+  return TRUE;
+}
+
+VinilNBD* vinil_nbd_create(int threads) {
+  VinilNBD* nbd = (VinilNBD*)calloc(1, sizeof(VinilNBD));
+  if (nbd == NULL)
+    return NULL;
+
+  nbd->threads = threads > 0 ? threads : VINIL_NBD_DEFAULT_THREADS;
+  if (nbd->threads > NBD_MAX_THREADS)
+    nbd->threads = NBD_MAX_THREADS;
+
+  nbd->zeros = (uint8_t*)vinil_alloc_aligned_buffer(NBD_ZERO_SIZE);
+  if (nbd->zeros == NULL) {
+    free(nbd);
+    return NULL;
+  }
+  memset(nbd->zeros, 0, NBD_ZERO_SIZE);
+
+  // vinil_nbd_stop only writes a byte to the pipe, so it is safe in a signal handler
+  if (pipe(nbd->stop_pipe) < 0) {
+    vinil_free_aligned_buffer(nbd->zeros);
+    free(nbd);
+    return NULL;
+  }
+  fcntl(nbd->stop_pipe[1], F_SETFL, O_NONBLOCK);
+
+  if (!vinil_mutex_init(&nbd->lock)) {
+    close(nbd->stop_pipe[0]);
+    close(nbd->stop_pipe[1]);
+    vinil_free_aligned_buffer(nbd->zeros);
+    free(nbd);
+    return NULL;
+  }
+  if (!vinil_cond_init(&nbd->work)) {
+    vinil_mutex_destroy(&nbd->lock);
+    close(nbd->stop_pipe[0]);
+    close(nbd->stop_pipe[1]);
+    vinil_free_aligned_buffer(nbd->zeros);
+    free(nbd);
+    return NULL;
+  }
+
+  return nbd;
+}
+
+int vinil_nbd_add_export(VinilNBD* nbd, const char* name, VinilVHD* vhd, int read_only) {
+  size_t size = strlen(name);
+  if (nbd->export_count == VINIL_NBD_MAX_EXPORTS || size > 255 || (size > 0 && nbd_find_export(nbd, name, size)))
+    return FALSE;
+
+  NBDExport* image = &nbd->exports[nbd->export_count];
+  image->name = (char*)malloc(size + 1);
+  if (image->name == NULL)
+    return FALSE;
+
+  strcpy(image->name, name);
+  image->vhd = vhd;
+  image->read_only = read_only || (vhd->flags & VINIL_VHD_OPEN_READ_ONLY);
+  image->size = vhd->footer->current_size;
+  nbd->export_count++;
+
+  return TRUE;
+}
+
+int vinil_nbd_listen_unix(VinilNBD* nbd, const char* path) {
+  struct sockaddr_un address;
+  if (nbd->listener_count == VINIL_NBD_MAX_LISTENERS || strlen(path) >= sizeof(address.sun_path))
+    return FALSE;
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, path);
+
+  // a socket left by a server which did not exit cleanly
+  struct stat st;
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    unlink(path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return FALSE;
+
+  if (bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+    close(fd);
+    return FALSE;
+  }
+
+  return nbd_add_listener(nbd, fd, path);
+}
+
+int vinil_nbd_listen_tcp(VinilNBD* nbd, const char* address, int port) {
+  if (nbd->listener_count == VINIL_NBD_MAX_LISTENERS || port <= 0 || port > 65535)
+    return FALSE;
+
+  struct sockaddr_in sin;
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons((uint16_t)port);
+  if (inet_pton(AF_INET, address ? address : "127.0.0.1", &sin.sin_addr) != 1)
+    return FALSE;
+
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    return FALSE;
+
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (bind(fd, (struct sockaddr*)&sin, sizeof(sin)) < 0) {
+    close(fd);
+    return FALSE;
+  }
+
+  return nbd_add_listener(nbd, fd, NULL);
+}
+
+int vinil_nbd_run(VinilNBD* nbd) {
+  if (nbd->export_count == 0 || nbd->listener_count == 0)
+    return FALSE;
+
+  vinil_thread workers[NBD_MAX_THREADS];
+  int started = 0;
+  nbd->quit = FALSE;
+  while (started < nbd->threads && vinil_thread_create(&workers[started], nbd_worker, nbd))
+    started++;
+
+  if (started == 0)
+    return FALSE;
+
+  struct pollfd fds[VINIL_NBD_MAX_LISTENERS + 1];
+  while (!vinil_atomic_load(&nbd->stopping)) {
+    fds[0].fd = nbd->stop_pipe[0];
+    fds[0].events = POLLIN;
+    int i;
+    for (i = 0; i < nbd->listener_count; i++) {
+      fds[i + 1].fd = nbd->listeners[i];
+      fds[i + 1].events = POLLIN;
+    }
+
+    // the timeout only lets closed connections be reaped
+    int n = poll(fds, nbd->listener_count + 1, 1000);
+    nbd_reap(nbd, FALSE);
+    if (n < 0 && errno != EINTR)
+      break;
+    if (n <= 0 || fds[0].revents)
+      continue;
+
+    for (i = 0; i < nbd->listener_count; i++) {
+      if (fds[i + 1].revents & POLLIN) {
+        int fd = accept(nbd->listeners[i], NULL, NULL);
+        if (fd >= 0)
+          nbd_accept(nbd, fd);
+      }
+    }
+  }
+
+  NBDConnection* conn;
+  for (conn = nbd->connections; conn; conn = conn->next)
+    shutdown(conn->fd, SHUT_RDWR);
+  nbd_reap(nbd, TRUE);
+
+  vinil_mutex_lock(&nbd->lock);
+  nbd->quit = TRUE;
+  vinil_cond_broadcast(&nbd->work);
+  vinil_mutex_unlock(&nbd->lock);
+
+  int i;
+  for (i = 0; i < started; i++)
+    vinil_thread_join(workers[i]);
+
+  return TRUE;
+}
+
+void vinil_nbd_stop(VinilNBD* nbd) {
+  vinil_atomic_store(&nbd->stopping, 1);
+  if (write(nbd->stop_pipe[1], "", 1) < 0) {
+    // the pipe is full, the server is already waking up
+  }
+}
+
+void vinil_nbd_get_stats(VinilNBD* nbd, VinilNBDStats* stats) {
+  stats->connections = vinil_atomic_load(&nbd->stats.connections);
+  stats->requests = vinil_atomic_load(&nbd->stats.requests);
+  stats->errors = vinil_atomic_load(&nbd->stats.errors);
+  stats->bytes_read = vinil_atomic_load(&nbd->stats.bytes_read);
+  stats->bytes_written = vinil_atomic_load(&nbd->stats.bytes_written);
+  stats->hole_bytes = vinil_atomic_load(&nbd->stats.hole_bytes);
+}
+
+void vinil_nbd_destroy(VinilNBD* nbd) {
+  int i;
+  for (i = 0; i < nbd->listener_count; i++) {
+    close(nbd->listeners[i]);
+    if (nbd->socket_paths[i]) {
+      unlink(nbd->socket_paths[i]);
+      free(nbd->socket_paths[i]);
+    }
+  }
+
+  for (i = 0; i < nbd->export_count; i++)
+    free(nbd->exports[i].name);
+
+  vinil_cond_destroy(&nbd->work);
+  vinil_mutex_destroy(&nbd->lock);
+  close(nbd->stop_pipe[0]);
+  close(nbd->stop_pipe[1]);
+  vinil_free_aligned_buffer(nbd->zeros);
+  free(nbd);
+}
+
+#else
+
+// the server needs Unix domain sockets and poll, it is not built on Windows
+
+VinilNBD* vinil_nbd_create(int threads) {
+  return NULL;
+}
+
+int vinil_nbd_add_export(VinilNBD* nbd, const char* name, VinilVHD* vhd, int read_only) {
+  return FALSE;
+}
+
+int vinil_nbd_listen_unix(VinilNBD* nbd, const char* path) {
+  return FALSE;
+}
+
+int vinil_nbd_listen_tcp(VinilNBD* nbd, const char* address, int port) {
+  return FALSE;
+}
+
+int vinil_nbd_run(VinilNBD* nbd) {
+  return FALSE;
+}
+
+void vinil_nbd_stop(VinilNBD* nbd) {
+}
+
+void vinil_nbd_get_stats(VinilNBD* nbd, VinilNBDStats* stats) {
+  memset(stats, 0, sizeof(VinilNBDStats));
+}
+
+void vinil_nbd_destroy(VinilNBD* nbd) {
+}
+
+#endif
@@ -0,0 +1,125 @@
+/**
+ *  @file       nbd.h
+ *  @brief      Network Block Device server which exposes Virtual Hard Disks to nbd-client and QEMU.
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#ifndef VINIL_NBD_H_
+#define VINIL_NBD_H_
+
+#include <stdint.h>
+
+#include "crossplatform.h"
+#include "vhd.h"
+
+/** @brief Number of threads which execute the requests when none is given */
+#define VINIL_NBD_DEFAULT_THREADS     8
+
+/** @brief Largest request accepted by the server (32MB), it is announced to the clients */
+#define VINIL_NBD_MAX_REQUEST         (32*1024*1024)
+
+/** @brief Requests of a connection which may be in flight at once */
+#define VINIL_NBD_MAX_IN_FLIGHT       128
+
+/** @brief Maximum number of exports and of listening sockets of a server */
+#define VINIL_NBD_MAX_EXPORTS         16
+#define VINIL_NBD_MAX_LISTENERS       8
+
+/** @brief What a server did */
+typedef struct {
+  uint64_t  connections;        /**< connections which reached the transmission phase */
+  uint64_t  requests;           /**< requests received */
+  uint64_t  errors;             /**< requests which failed */
+  uint64_t  bytes_read;         /**< bytes sent by reads, holes excluded */
+  uint64_t  bytes_written;      /**< bytes received by writes */
+  uint64_t  hole_bytes;         /**< bytes of reads sent as holes, without being read */
+} VinilNBDStats;
+
+/** @brief A server with its exports, listening sockets and threads */
+typedef struct VinilNBD VinilNBD;
+
+/** @brief  Creates a server. Every connection has a thread which reads its requests and
+ *          a shared pool of threads executes them, so the replies of a connection are
+ *          sent as soon as they are ready, out of order. It is not available on Windows.
+ *
+ *  @param    threads   number of threads of the pool, VINIL_NBD_DEFAULT_THREADS if it is not positive
+ *
+ *  @return   a new VinilNBD object or a null pointer if an error occurs
+ */
+VINILAPI VinilNBD* vinil_nbd_create(int threads);
+
+/** @brief  Adds an export. Every connection to it shares the VinilVHD object (so a flush on
+ *          one connection covers the writes of all of them and clients may use several
+ *          connections). It must be called before vinil_nbd_run.
+ *
+ *  @param    nbd         VinilNBD object
+ *
+ *  @param    name        C string containing the name of the export, clients which ask for
+ *                        an empty name get the first export
+ *
+ *  @param    vhd         VinilVHD object, it must stay open until vinil_nbd_destroy
+ *
+ *  @param    read_only   TRUE to refuse writes, trims and zeroes
+ *
+ *  @return   If the operation was succesfully executed this function will return TRUE.
+ *            Otherwise, FALSE will be returned.
+ */
+VINILAPI int vinil_nbd_add_export(VinilNBD* nbd, const char* name, VinilVHD* vhd, int read_only);
+
+/** @brief  Listens on a Unix domain socket. A stale socket file is replaced, and the file is
+ *          removed by vinil_nbd_destroy.
+ *
+ *  @param    nbd       VinilNBD object
+ *
+ *  @param    path      C string containing the name of the socket file
+ *
+ *  @return   If the operation was succesfully executed this function will return TRUE.
+ *            Otherwise, FALSE will be returned.
+ */
+VINILAPI int vinil_nbd_listen_unix(VinilNBD* nbd, const char* path);
+
+/** @brief  Listens on a TCP port
+ *
+ *  @param    nbd       VinilNBD object
+ *
+ *  @param    address   C string containing the IPv4 address to be bound, "127.0.0.1" if it
+ *                      is a null pointer
+ *
+ *  @param    port      TCP port, 10809 is the one of the NBD protocol
+ *
+ *  @return   If the operation was succesfully executed this function will return TRUE.
+ *            Otherwise, FALSE will be returned.
+ */
+VINILAPI int vinil_nbd_listen_tcp(VinilNBD* nbd, const char* address, int port);
+
+/** @brief  Accepts and serves connections until vinil_nbd_stop is called. Then the connections
+ *          are shut down and their requests in flight are finished before it returns.
+ *
+ *  @param    nbd       VinilNBD object
+ *
+ *  @return   TRUE if the server was stopped, FALSE if it could not start.
+ */
+VINILAPI int vinil_nbd_run(VinilNBD* nbd);
+
+/** @brief  Makes vinil_nbd_run return. It may be called by another thread or by a signal handler.
+ *
+ *  @param    nbd       VinilNBD object
+ */
+VINILAPI void vinil_nbd_stop(VinilNBD* nbd);
+
+/** @brief  Returns what the server did so far
+ *
+ *  @param    nbd       VinilNBD object
+ *
+ *  @param    stats     receives the statistics
+ */
+VINILAPI void vinil_nbd_get_stats(VinilNBD* nbd, VinilNBDStats* stats);
+
+/** @brief  Closes the listening sockets and destroys the server, the VHDs stay open
+ *
+ *  @param    nbd       VinilNBD object
+ */
+VINILAPI void vinil_nbd_destroy(VinilNBD* nbd);
+
+#endif
@@ -0,0 +1,241 @@
+/**
+ *  @file       readahead.c
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#include "readahead.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  uint64_t next;            // sector which follows the last read
+  uint64_t window;          // sectors of the next prefetch, 0 until the stream is sequential
+  uint64_t prefetched;      // sector which follows the prefetched ones
+  uint64_t used;            // clock of the last read, 0 for a free stream
+  uint8_t* buffer;          // max_window sectors, allocated by the first fill
+  uint64_t buffer_sector;
+  uint64_t buffer_count;
+  uint64_t fill_sector;     // sectors being read into the buffer without the lock
+  uint64_t fill_count;      // 0 if the buffer is not being filled
+  int fill_stale;           // some of them were invalidated during the fill
+} ReadaheadStream;
+
+struct VinilReadahead {
+  ReadaheadStream streams[VINIL_READAHEAD_STREAMS];
+  uint64_t sectors;
+  uint64_t min_window;
+  uint64_t max_window;
+  uint64_t clock;
+  int pool;
+  VinilStats* stats;
+};
+
+static void readahead_scatter(const vinil_iovec* iov, int count, const uint8_t* src) {
+  int i;
+  for (i = 0; i < count; i++) {
+    memcpy(iov[i].iov_base, src, iov[i].iov_len);
+    src += iov[i].iov_len;
+  }
+}
+
+// reads with the lock of the caller released
+static int readahead_pass(vinil_mutex* lock, uint64_t sector, const vinil_iovec* iov, int count,
+                          vinil_readahead_fn fn, void* arg) {
+  if (lock)
+    vinil_mutex_unlock(lock);
+  int ok = fn(arg, sector, iov, count);
+  if (lock)
+    vinil_mutex_lock(lock);
+
+  return ok;
+}
+
+// finds the stream continued by a read, or recycles the least recently used one
+static ReadaheadStream* readahead_stream(VinilReadahead* ra, uint64_t sector, int* sequential) {
+  ReadaheadStream* oldest = &ra->streams[0];
+
+  int i;
+  for (i = 0; i < VINIL_READAHEAD_STREAMS; i++) {
+    ReadaheadStream* stream = &ra->streams[i];
+    if (stream->used && (stream->next == sector ||
+        (sector >= stream->buffer_sector && sector < stream->buffer_sector + stream->buffer_count))) {
+      stream->used = ++ra->clock;
+      *sequential = TRUE;
+      return stream;
+    }
+
+    if (stream->used < oldest->used)
+      oldest = stream;
+  }
+
+  oldest->window = 0;
+  oldest->prefetched = 0;
+  oldest->buffer_count = 0;
+  oldest->used = ++ra->clock;
+  *sequential = FALSE;
+
+  return oldest;
+}
+
+// the window of a stream starts small and doubles every time it is prefetched
+static uint64_t readahead_next_window(VinilReadahead* ra, ReadaheadStream* stream) {
+  if (stream->window == 0)
+    stream->window = ra->min_window;
+  else if (stream->window < ra->max_window)
+    stream->window = stream->window * 2 < ra->max_window ? stream->window * 2 : ra->max_window;
+
+  return stream->window;
+}
+
+VinilReadahead* vinil_readahead_create(uint64_t sectors, uint64_t min_window, uint64_t max_window,
+                                       int pool, VinilStats* stats) {
+  VinilReadahead* ra = (VinilReadahead*)calloc(1, sizeof(VinilReadahead));
+  if (ra == NULL)
+    return NULL;
+
+  ra->sectors = sectors;
+  ra->pool = pool;
+  ra->stats = stats;
+  vinil_readahead_set_windows(ra, min_window, max_window);
+
+  return ra;
+}
+
+void vinil_readahead_destroy(VinilReadahead* ra) {
+  int i;
+  for (i = 0; i < VINIL_READAHEAD_STREAMS; i++)
+    free(ra->streams[i].buffer);
+
+  free(ra);
+}
+
+void vinil_readahead_set_windows(VinilReadahead* ra, uint64_t min_window, uint64_t max_window) {
+  int i;
+  for (i = 0; i < VINIL_READAHEAD_STREAMS; i++) {
+    // a buffer being filled is freed by its fill, which sees it was taken away
+    if (ra->streams[i].fill_count == 0)
+      free(ra->streams[i].buffer);
+    memset(&ra->streams[i], 0, sizeof(ReadaheadStream));
+  }
+
+  ra->min_window = min_window > 0 ? min_window : 1;
+  ra->max_window = max_window > ra->min_window ? max_window : ra->min_window;
+}
+
+int vinil_readahead_read(VinilReadahead* ra, vinil_mutex* lock, uint64_t sector, const vinil_iovec* iov,
+                         int count, vinil_readahead_fn fn, void* arg) {
+  uint64_t size = 0;
+  int i;
+  for (i = 0; i < count; i++)
+    size += iov[i].iov_len;
+
+  uint64_t end = sector + size / 512;
+
+  int sequential;
+  ReadaheadStream* stream = readahead_stream(ra, sector, &sequential);
+  stream->next = end;
+
+  if (sequential && sector >= stream->buffer_sector && end <= stream->buffer_sector + stream->buffer_count) {
+    readahead_scatter(iov, count, stream->buffer + (sector - stream->buffer_sector) * 512);
+    if (ra->stats)
+      vinil_stats_count(ra->stats, VINIL_STATS_READAHEAD_HIT);
+    return TRUE;
+  }
+
+  // another read is filling the buffer of the stream
+  if (!sequential || size / 512 >= ra->max_window || stream->fill_count)
+    return readahead_pass(lock, sector, iov, count, fn, arg);
+
+  if (stream->buffer == NULL) {
+    stream->buffer = (uint8_t*)malloc((size_t)(ra->max_window * 512));
+    if (stream->buffer == NULL)
+      return readahead_pass(lock, sector, iov, count, fn, arg);
+  }
+
+  uint64_t fill = readahead_next_window(ra, stream);
+  if (fill < size / 512)
+    fill = size / 512;
+  if (fill > ra->sectors - sector)
+    fill = ra->sectors - sector;
+
+  vinil_iovec buffer;
+  buffer.iov_base = stream->buffer;
+  buffer.iov_len = (size_t)(fill * 512);
+
+  stream->buffer_count = 0;
+  stream->fill_sector = sector;
+  stream->fill_count = fill;
+  stream->fill_stale = FALSE;
+
+  int ok = readahead_pass(lock, sector, &buffer, 1, fn, arg);
+
+  // vinil_readahead_set_windows took the buffer away during the fill
+  if (stream->buffer != buffer.iov_base) {
+    if (ok)
+      readahead_scatter(iov, count, (uint8_t*)buffer.iov_base);
+    free(buffer.iov_base);
+    return ok ? TRUE : readahead_pass(lock, sector, iov, count, fn, arg);
+  }
+
+  stream->fill_count = 0;
+  if (!ok)
+    return readahead_pass(lock, sector, iov, count, fn, arg);
+
+  // the read itself may return the sectors written during the fill, but they are not kept
+  if (!stream->fill_stale) {
+    stream->buffer_sector = sector;
+    stream->buffer_count = fill;
+  }
+  if (ra->stats)
+    vinil_stats_readahead(ra->stats, fill);
+
+  readahead_scatter(iov, count, stream->buffer);
+
+  return TRUE;
+}
+
+uint64_t vinil_readahead_advise(VinilReadahead* ra, uint64_t sector, uint64_t count, uint64_t* from) {
+  uint64_t end = sector + count;
+
+  int sequential;
+  ReadaheadStream* stream = readahead_stream(ra, sector, &sequential);
+  stream->next = end;
+  if (!sequential)
+    return 0;
+
+  if (ra->stats && end <= stream->prefetched)
+    vinil_stats_count(ra->stats, VINIL_STATS_READAHEAD_HIT);
+
+  if (stream->prefetched > end && stream->prefetched - end >= stream->window / 2)
+    return 0;
+
+  uint64_t start = stream->prefetched > end ? stream->prefetched : end;
+  if (start >= ra->sectors)
+    return 0;
+
+  uint64_t window = readahead_next_window(ra, stream);
+  if (window > ra->sectors - start)
+    window = ra->sectors - start;
+
+  stream->prefetched = start + window;
+  if (ra->stats)
+    vinil_stats_readahead(ra->stats, window);
+
+  *from = start;
+  return window;
+}
+
+void vinil_readahead_invalidate(VinilReadahead* ra, uint64_t sector, uint64_t count) {
+  int i;
+  for (i = 0; i < VINIL_READAHEAD_STREAMS; i++) {
+    ReadaheadStream* stream = &ra->streams[i];
+    if (stream->buffer_count && sector < stream->buffer_sector + stream->buffer_count &&
+        stream->buffer_sector < sector + count)
+      stream->buffer_count = 0;
+    if (stream->fill_count && sector < stream->fill_sector + stream->fill_count &&
+        stream->fill_sector < sector + count)
+      stream->fill_stale = TRUE;
+  }
+}
@@ -0,0 +1,115 @@
+/**
+ *  @file       readahead.h
+ *  @brief      Detection of sequential read streams and prefetching of their next sectors.
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#ifndef VINIL_READAHEAD_H_
+#define VINIL_READAHEAD_H_
+
+#include <stdint.h>
+
+#include "crossplatform.h"
+#include "stats.h"
+
+/** @brief Number of interleaved sequential streams followed at the same time */
+#define VINIL_READAHEAD_STREAMS   8
+
+/** @brief Reads sectors into a list of buffers, returns TRUE if successful or FALSE otherwise */
+typedef int (*vinil_readahead_fn)(void* arg, uint64_t sector, const vinil_iovec* iov, int count);
+
+/** @brief Sequential streams of a disk. A read which continues a stream makes its window
+ *         grow (it doubles up to the maximum every time it is prefetched) and any other read
+ *         replaces the least recently used stream, so random reads never prefetch anything.
+ *         It is not thread-safe, the caller serializes the calls with a lock, which
+ *         vinil_readahead_read releases while it reads the disk. */
+typedef struct VinilReadahead VinilReadahead;
+
+/** @brief  Creates the streams of a disk
+ *
+ *  @param    sectors       size of the disk in sectors, nothing is prefetched after it
+ *
+ *  @param    min_window    sectors prefetched when a stream is detected
+ *
+ *  @param    max_window    maximum number of sectors prefetched at once
+ *
+ *  @param    pool          TRUE to prefetch into buffers (see vinil_readahead_read),
+ *                          FALSE to only advise (see vinil_readahead_advise)
+ *
+ *  @param    stats         receives the readahead windows and hits, it may be a null pointer
+ *
+ *  @return   a new VinilReadahead object or a null pointer if an error occurs
+ */
+VINILAPI VinilReadahead* vinil_readahead_create(uint64_t sectors, uint64_t min_window, uint64_t max_window,
+                                                int pool, VinilStats* stats);
+
+/** @brief  Destroys a VinilReadahead object and its buffers
+ *
+ *  @param    ra        VinilReadahead object
+ */
+VINILAPI void vinil_readahead_destroy(VinilReadahead* ra);
+
+/** @brief  Changes the windows, the prefetched sectors are dropped
+ *
+ *  @param    ra            VinilReadahead object
+ *
+ *  @param    min_window    sectors prefetched when a stream is detected
+ *
+ *  @param    max_window    maximum number of sectors prefetched at once
+ */
+VINILAPI void vinil_readahead_set_windows(VinilReadahead* ra, uint64_t min_window, uint64_t max_window);
+
+/** @brief  Reads sectors through the buffers. A read which continues a stream is copied from
+ *          its buffer, which is filled with the next window when it does not hold the read.
+ *          Other reads (and reads larger than the maximum window) go straight to fn, and so
+ *          do the reads of a stream whose buffer is being filled by another thread.
+ *
+ *  @param    ra        VinilReadahead object created with pool TRUE
+ *
+ *  @param    lock      mutex held by the caller, it is released while fn is called so the
+ *                      other threads are not serialized behind the disk (it may be a null pointer)
+ *
+ *  @param    sector    number of the first sector
+ *
+ *  @param    iov       buffers to be filled
+ *
+ *  @param    count     number of entries in iov
+ *
+ *  @param    fn        reads sectors from the disk
+ *
+ *  @param    arg       first argument of fn
+ *
+ *  @return   TRUE if successful or FALSE otherwise.
+ */
+VINILAPI int vinil_readahead_read(VinilReadahead* ra, vinil_mutex* lock, uint64_t sector, const vinil_iovec* iov,
+                                  int count, vinil_readahead_fn fn, void* arg);
+
+/** @brief  Follows a read and tells which sectors should be prefetched by the operating system.
+ *          The next window is requested when less than half of the current one is ahead
+ *          of the stream, so the prefetch overlaps the reads.
+ *
+ *  @param    ra        VinilReadahead object created with pool FALSE
+ *
+ *  @param    sector    number of the first sector read
+ *
+ *  @param    count     number of sectors read
+ *
+ *  @param    from      receives the first sector to be prefetched
+ *
+ *  @return   number of sectors to be prefetched, 0 if none
+ */
+VINILAPI uint64_t vinil_readahead_advise(VinilReadahead* ra, uint64_t sector, uint64_t count, uint64_t* from);
+
+/** @brief  Drops the prefetched copies of sectors which were written or discarded, including
+ *          the ones of a fill in progress
+ *
+ *  @param    ra        VinilReadahead object
+ *
+ *  @param    sector    number of the first sector
+ *
+ *  @param    count     number of sectors
+ */
+VINILAPI void vinil_readahead_invalidate(VinilReadahead* ra, uint64_t sector, uint64_t count);
+
+#endif
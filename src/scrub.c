@@ -0,0 +1,205 @@
+/**
+ *  @file       scrub.c
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#include "scrub.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define SCRUB_MAX_THREADS 64
+
+typedef struct {
+  VinilVHD* vhd;
+  VinilCRC* crc;
+  uint64_t sectors;
+  uint64_t blocks;
+  uint64_t block_sectors;
+  uint64_t chunk_blocks;
+  uint64_t chunks;
+  uint64_t next_chunk;
+  uint64_t failed;
+  uint64_t max_bytes_per_second;
+  uint64_t start;
+  uint64_t reserved_ns;     // time, from start, at which the next read may start
+  vinil_scrub_fn fn;
+  void* arg;
+  vinil_mutex lock;         // serializes fn
+  VinilScrubStats stats;
+} ScrubJob;
+
+// every read reserves the time it takes at the maximum rate, and waits until its turn comes
+static void scrub_throttle(ScrubJob* job, uint64_t bytes) {
+  if (job->max_bytes_per_second == 0)
+    return;
+
+  uint64_t cost = bytes * 1000000000ULL / job->max_bytes_per_second;
+  uint64_t due = vinil_atomic_add(&job->reserved_ns, cost);
+  uint64_t now = vinil_clock_ns() - job->start;
+  if (due > now)
+    vinil_sleep_ns(due - now);
+}
+
+// sectors which were never allocated are not read, they are zeros
+static int scrub_read(ScrubJob* job, uint8_t* buffer, uint64_t sector, uint64_t count) {
+  uint64_t done = 0;
+  while (done < count) {
+    int allocated;
+    uint64_t run;
+    if (!vinil_vhd_block_status(job->vhd, sector + done, count - done, &allocated, &run))
+      return FALSE;
+
+    if (!allocated) {
+      memset(buffer + done * 512, 0, (size_t)(run * 512));
+    } else {
+      scrub_throttle(job, run * 512);
+      if (!vinil_vhd_pread(job->vhd, buffer + done * 512, sector + done, run))
+        return FALSE;
+      vinil_atomic_add(&job->stats.bytes_read, run * 512);
+    }
+
+    done += run;
+  }
+
+  return TRUE;
+}
+
+static int scrub_chunk(ScrubJob* job, uint8_t* buffer, uint64_t* sequences, uint64_t chunk) {
+  uint64_t first = chunk * job->chunk_blocks;
+  uint64_t last = first + job->chunk_blocks < job->blocks ? first + job->chunk_blocks : job->blocks;
+  uint64_t sector = first * job->block_sectors;
+  uint64_t end = last * job->block_sectors < job->sectors ? last * job->block_sectors : job->sectors;
+
+  // the sequences are taken before the stale bits, which a write may clear once it is done
+  uint64_t block;
+  for (block = first; block < last; block++)
+    sequences[block - first] = vinil_crc_sequence(job->crc, block);
+
+  // a chunk which was written since its checksums were computed is not even read
+  for (block = first; block < last && vinil_crc_stale(job->crc, block); block++);
+  if (block == last) {
+    vinil_atomic_add(&job->stats.stale_blocks, last - first);
+    return TRUE;
+  }
+
+  if (!scrub_read(job, buffer, sector, end - sector))
+    return FALSE;
+
+  for (block = first; block < last; block++) {
+    // a block which was written while it was read has another sequence, which is checked
+    // after the checksum is taken (a later write may replace it)
+    int stale = vinil_crc_stale(job->crc, block);
+    uint32_t expected = vinil_crc_get(job->crc, block);
+    if (stale || sequences[block - first] == 0 || vinil_crc_sequence(job->crc, block) != sequences[block - first]) {
+      vinil_atomic_add(&job->stats.stale_blocks, 1);
+      continue;
+    }
+
+    uint64_t block_sector = block * job->block_sectors;
+    uint64_t count = end - block_sector < job->block_sectors ? end - block_sector : job->block_sectors;
+    uint32_t actual = vinil_crc32c(0, buffer + (block_sector - sector) * 512, (size_t)(count * 512));
+
+    if (actual == expected) {
+      vinil_atomic_add(&job->stats.verified_blocks, 1);
+      continue;
+    }
+
+    vinil_atomic_add(&job->stats.bad_blocks, 1);
+    if (job->fn) {
+      vinil_mutex_lock(&job->lock);
+      int ok = job->fn(job->arg, block, block_sector, count, expected, actual);
+      vinil_mutex_unlock(&job->lock);
+
+      if (!ok)
+        return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+static void* scrub_worker(void* arg) {
+  ScrubJob* job = (ScrubJob*)arg;
+
+  uint8_t* buffer = (uint8_t*)vinil_alloc_aligned_buffer((size_t)(job->chunk_blocks * job->block_sectors * 512));
+  uint64_t* sequences = (uint64_t*)malloc((size_t)(job->chunk_blocks * sizeof(uint64_t)));
+  if (buffer == NULL || sequences == NULL) {
+    if (buffer)
+      vinil_free_aligned_buffer(buffer);
+    free(sequences);
+    vinil_atomic_store(&job->failed, 1);
+    return NULL;
+  }
+
+  while (!vinil_atomic_load(&job->failed)) {
+    uint64_t chunk = vinil_atomic_add(&job->next_chunk, 1);
+    if (chunk >= job->chunks)
+      break;
+
+    if (!scrub_chunk(job, buffer, sequences, chunk))
+      vinil_atomic_store(&job->failed, 1);
+  }
+
+  vinil_free_aligned_buffer(buffer);
+  free(sequences);
+
+  return NULL;
+}
+
+int vinil_scrub_checksums(VinilVHD* vhd, VinilCRC* crc, int threads, uint64_t max_bytes_per_second, vinil_scrub_fn fn,
+                          void* arg, VinilScrubStats* stats) {
+  uint64_t sectors = vhd->footer->current_size / 512;
+  if (crc == NULL || vinil_crc_blocks(crc) != (sectors + vinil_crc_block_sectors(crc) - 1) / vinil_crc_block_sectors(crc))
+    return FALSE;
+
+  if (threads <= 0)
+    threads = VINIL_SCRUB_DEFAULT_THREADS;
+  if (threads > SCRUB_MAX_THREADS)
+    threads = SCRUB_MAX_THREADS;
+
+  ScrubJob job;
+  memset(&job, 0, sizeof(job));
+  if (!vinil_mutex_init(&job.lock))
+    return FALSE;
+
+  job.vhd = vhd;
+  job.crc = crc;
+  job.fn = fn;
+  job.arg = arg;
+  job.max_bytes_per_second = max_bytes_per_second;
+  job.sectors = sectors;
+  job.blocks = vinil_crc_blocks(crc);
+  job.block_sectors = vinil_crc_block_sectors(crc);
+  job.chunk_blocks = VINIL_SCRUB_CHUNK_SIZE / 512 / job.block_sectors;
+  if (job.chunk_blocks == 0)
+    job.chunk_blocks = 1;
+  job.chunks = (job.blocks + job.chunk_blocks - 1) / job.chunk_blocks;
+  job.stats.blocks = job.blocks;
+  job.start = vinil_clock_ns();
+
+  vinil_thread workers[SCRUB_MAX_THREADS];
+  int started = 0;
+  while (started < threads && vinil_thread_create(&workers[started], scrub_worker, &job))
+    started++;
+
+  if (started == 0)
+    scrub_worker(&job);
+
+  int i;
+  for (i = 0; i < started; i++)
+    vinil_thread_join(workers[i]);
+
+  vinil_mutex_destroy(&job.lock);
+
+  if (stats)
+    *stats = job.stats;
+
+  return !job.failed;
+}
+
+int vinil_scrub(VinilVHD* vhd, int threads, uint64_t max_bytes_per_second, vinil_scrub_fn fn, void* arg,
+                VinilScrubStats* stats) {
+  return vinil_scrub_checksums(vhd, vhd->crc, threads, max_bytes_per_second, fn, arg, stats);
+}
@@ -0,0 +1,85 @@
+/**
+ *  @file       scrub.h
+ *  @brief      Verification of the data of Virtual Hard Disks against their block checksums.
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#ifndef VINIL_SCRUB_H_
+#define VINIL_SCRUB_H_
+
+#include <stdint.h>
+
+#include "crossplatform.h"
+#include "vhd.h"
+
+/** @brief Number of threads used by vinil_scrub when none is given */
+#define VINIL_SCRUB_DEFAULT_THREADS   4
+
+/** @brief Bytes read at once by a thread of vinil_scrub (4MB) */
+#define VINIL_SCRUB_CHUNK_SIZE        (4*1024*1024)
+
+/** @brief What vinil_scrub did */
+typedef struct {
+  uint64_t  blocks;             /**< checksum blocks of the VHD */
+  uint64_t  verified_blocks;    /**< blocks whose data matched their checksum */
+  uint64_t  bad_blocks;         /**< blocks whose data did not match their checksum */
+  uint64_t  stale_blocks;       /**< blocks without a checksum, or written while they were read, not verified */
+  uint64_t  bytes_read;         /**< bytes read from the VHD */
+} VinilScrubStats;
+
+/** @brief Receives a bad block (and the first and number of its sectors), it returns FALSE to stop the scrub */
+typedef int (*vinil_scrub_fn)(void* arg, uint64_t block, uint64_t sector, uint64_t count, uint32_t expected,
+                              uint32_t actual);
+
+/** @brief  Verifies every block of a VHD against the checksums of vinil_vhd_start_crc. Chunks
+ *          are read and verified in parallel by several threads and the reads can be limited
+ *          to a rate, so a VHD can be scrubbed while it is used: the blocks written before
+ *          they are read are verified against the checksums of their writes, and the blocks
+ *          which have no checksum yet or are written while they are read are skipped.
+ *
+ *  @param    vhd                   VinilVHD object with checksums
+ *
+ *  @param    threads               number of threads, VINIL_SCRUB_DEFAULT_THREADS if it is not positive
+ *
+ *  @param    max_bytes_per_second  limit of the reads of all the threads, 0 for no limit
+ *
+ *  @param    fn                    function called with each bad block (by one thread at a time,
+ *                                  in no particular order), it may be a null pointer
+ *
+ *  @param    arg                   passed to fn
+ *
+ *  @param    stats                 receives what was done, it may be a null pointer
+ *
+ *  @return   TRUE if every block was checked (even if some were bad), FALSE if the VHD has no
+ *            checksums, could not be read or fn stopped the scrub.
+ */
+VINILAPI int vinil_scrub(VinilVHD* vhd, int threads, uint64_t max_bytes_per_second, vinil_scrub_fn fn, void* arg,
+                         VinilScrubStats* stats);
+
+/** @brief  Verifies every block of a VHD against checksums which it does not keep, like the
+ *          ones of vinil_crc_open_read_only: the VHD must not be written meanwhile, by this
+ *          process or another one (a checksum file which is open for writes is not trusted).
+ *          It is otherwise like vinil_scrub.
+ *
+ *  @param    vhd                   VinilVHD object
+ *
+ *  @param    crc                   checksums of the VHD
+ *
+ *  @param    threads               number of threads, VINIL_SCRUB_DEFAULT_THREADS if it is not positive
+ *
+ *  @param    max_bytes_per_second  limit of the reads of all the threads, 0 for no limit
+ *
+ *  @param    fn                    function called with each bad block, it may be a null pointer
+ *
+ *  @param    arg                   passed to fn
+ *
+ *  @param    stats                 receives what was done, it may be a null pointer
+ *
+ *  @return   TRUE if every block was checked (even if some were bad), FALSE if the checksums
+ *            describe a disk of another size, the VHD could not be read or fn stopped the scrub.
+ */
+VINILAPI int vinil_scrub_checksums(VinilVHD* vhd, VinilCRC* crc, int threads, uint64_t max_bytes_per_second,
+                                   vinil_scrub_fn fn, void* arg, VinilScrubStats* stats);
+
+#endif
@@ -0,0 +1,112 @@
+/**
+ *  @file       stats.c
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#include "stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define STATS_SHARDS 16
+
+// the padding keeps the hot counters of two shards out of the same cache line
+typedef struct {
+  VinilVHDStats counters;
+  char padding[64];
+} StatsShard;
+
+struct VinilStats {
+  StatsShard shards[STATS_SHARDS];
+};
+
+static uint64_t stats_next_shard = 0;
+static vinil_thread_local unsigned stats_thread_shard = 0;
+
+static VinilVHDStats* stats_shard(VinilStats* stats) {
+  // threads get their shard (plus one, zero means none yet) the first time they record something
+  if (stats_thread_shard == 0)
+    stats_thread_shard = (unsigned)vinil_atomic_add(&stats_next_shard, 1) % STATS_SHARDS + 1;
+
+  return &stats->shards[stats_thread_shard - 1].counters;
+}
+
+static int stats_bucket(uint64_t nanoseconds) {
+  uint64_t microseconds = nanoseconds / 1000;
+  int bucket = 0;
+
+  while (microseconds > 0 && bucket < VINIL_STATS_BUCKETS - 1) {
+    microseconds >>= 1;
+    bucket++;
+  }
+
+  return bucket;
+}
+
+VinilStats* vinil_stats_create(void) {
+  return (VinilStats*)calloc(1, sizeof(VinilStats));
+}
+
+void vinil_stats_destroy(VinilStats* stats) {
+  free(stats);
+}
+
+void vinil_stats_record(VinilStats* stats, int op, uint64_t bytes, uint64_t nanoseconds) {
+  VinilVHDStats* shard = stats_shard(stats);
+
+  vinil_atomic_add(&shard->ops[op], 1);
+  vinil_atomic_add(&shard->bytes[op], bytes);
+  vinil_atomic_add(&shard->latency[op][stats_bucket(nanoseconds)], 1);
+}
+
+void vinil_stats_count(VinilStats* stats, int counter) {
+  VinilVHDStats* shard = stats_shard(stats);
+
+  switch (counter) {
+    case VINIL_STATS_SPLIT:
+      vinil_atomic_add(&shard->split_requests, 1);
+      break;
+    case VINIL_STATS_MERGED:
+      vinil_atomic_add(&shard->merged_requests, 1);
+      break;
+    case VINIL_STATS_METADATA_READ:
+      vinil_atomic_add(&shard->metadata_reads, 1);
+      break;
+    case VINIL_STATS_METADATA_WRITE:
+      vinil_atomic_add(&shard->metadata_writes, 1);
+      break;
+    case VINIL_STATS_READAHEAD_HIT:
+      vinil_atomic_add(&shard->readahead_hits, 1);
+      break;
+  }
+}
+
+void vinil_stats_readahead(VinilStats* stats, uint64_t sectors) {
+  VinilVHDStats* shard = stats_shard(stats);
+
+  uint64_t n = sectors;
+  int bucket = 0;
+  while (n > 1 && bucket < VINIL_STATS_BUCKETS - 1) {
+    n >>= 1;
+    bucket++;
+  }
+
+  vinil_atomic_add(&shard->readahead_bytes, sectors * 512);
+  vinil_atomic_add(&shard->readahead_windows[bucket], 1);
+}
+
+void vinil_stats_snapshot(VinilStats* stats, VinilVHDStats* snapshot) {
+  // every field is a uint64_t, so the shards are summed as flat arrays
+  size_t fields = sizeof(VinilVHDStats) / sizeof(uint64_t);
+  uint64_t* sum = (uint64_t*)snapshot;
+  memset(snapshot, 0, sizeof(VinilVHDStats));
+
+  int i;
+  size_t j;
+  for (i = 0; i < STATS_SHARDS; i++) {
+    uint64_t* counters = (uint64_t*)&stats->shards[i].counters;
+    for (j = 0; j < fields; j++)
+      sum[j] += vinil_atomic_load(&counters[j]);
+  }
+}
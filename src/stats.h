@@ -0,0 +1,116 @@
+/**
+ *  @file       stats.h
+ *  @brief      I/O statistics of a Virtual Hard Disk handle.
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#ifndef VINIL_STATS_H_
+#define VINIL_STATS_H_
+
+#include <stdint.h>
+
+#include "crossplatform.h"
+
+/** @brief Reads (vinil_vhd_read, vinil_vhd_pread, vinil_vhd_preadv and asynchronous reads) */
+#define VINIL_STATS_READ          0
+
+/** @brief Writes (vinil_vhd_write, vinil_vhd_pwrite, vinil_vhd_pwritev and asynchronous writes) */
+#define VINIL_STATS_WRITE         1
+
+/** @brief Flushes */
+#define VINIL_STATS_FLUSH         2
+
+/** @brief Discards */
+#define VINIL_STATS_DISCARD       3
+
+/** @brief Number of operation types */
+#define VINIL_STATS_OPS           4
+
+/** @brief Number of latency buckets. Bucket 0 counts operations faster than 1us and
+ *         bucket i (i > 0) the ones in [2^(i-1), 2^i) us, the last bucket has no upper bound. */
+#define VINIL_STATS_BUCKETS       32
+
+/** @brief Requests split in several I/Os because they cross block boundaries */
+#define VINIL_STATS_SPLIT         0
+
+/** @brief Requests whose buffers were merged into fewer I/Os */
+#define VINIL_STATS_MERGED        1
+
+/** @brief Metadata (footer, header, BAT and bitmap) reads */
+#define VINIL_STATS_METADATA_READ   2
+
+/** @brief Metadata (footer, header, BAT and bitmap) writes */
+#define VINIL_STATS_METADATA_WRITE  3
+
+/** @brief Reads served by sectors which were prefetched, see VINIL_VHD_OPEN_READAHEAD */
+#define VINIL_STATS_READAHEAD_HIT   4
+
+/** @brief A snapshot of the statistics of a VinilVHD object. Every counter only grows. */
+typedef struct {
+  uint64_t ops[VINIL_STATS_OPS];                            /**< Operations of each type */
+  uint64_t bytes[VINIL_STATS_OPS];                          /**< Bytes transferred (or discarded) */
+  uint64_t split_requests;                                  /**< see VINIL_STATS_SPLIT */
+  uint64_t merged_requests;                                 /**< see VINIL_STATS_MERGED */
+  uint64_t metadata_reads;                                  /**< see VINIL_STATS_METADATA_READ */
+  uint64_t metadata_writes;                                 /**< see VINIL_STATS_METADATA_WRITE */
+  uint64_t latency[VINIL_STATS_OPS][VINIL_STATS_BUCKETS];   /**< Latency histogram of each type */
+  uint64_t readahead_hits;                                  /**< see VINIL_STATS_READAHEAD_HIT */
+  uint64_t readahead_bytes;                                 /**< Bytes prefetched */
+  uint64_t readahead_windows[VINIL_STATS_BUCKETS];          /**< Prefetch windows, bucket i counts the
+                                                                 ones of [2^i, 2^(i+1)) sectors */
+} VinilVHDStats;
+
+/** @brief Counters shared by all the threads which use a VinilVHD object */
+typedef struct VinilStats VinilStats;
+
+/** @brief  Creates a zeroed set of counters
+ *
+ *  @return   a new VinilStats object or a null pointer if an error occurs
+ */
+VINILAPI VinilStats* vinil_stats_create(void);
+
+/** @brief  Destroys a VinilStats object
+ *
+ *  @param    stats     VinilStats object
+ */
+VINILAPI void vinil_stats_destroy(VinilStats* stats);
+
+/** @brief  Records an operation. It never blocks: each thread updates its own
+ *          shard of counters with relaxed atomic additions.
+ *
+ *  @param    stats         VinilStats object
+ *
+ *  @param    op            one of the VINIL_STATS_READ..VINIL_STATS_DISCARD types
+ *
+ *  @param    bytes         bytes transferred by the operation
+ *
+ *  @param    nanoseconds   duration of the operation
+ */
+VINILAPI void vinil_stats_record(VinilStats* stats, int op, uint64_t bytes, uint64_t nanoseconds);
+
+/** @brief  Records a prefetch window chosen by the readahead
+ *
+ *  @param    stats     VinilStats object
+ *
+ *  @param    sectors   size of the window
+ */
+VINILAPI void vinil_stats_readahead(VinilStats* stats, uint64_t sectors);
+
+/** @brief  Increments one of the VINIL_STATS_SPLIT..VINIL_STATS_READAHEAD_HIT counters
+ *
+ *  @param    stats     VinilStats object
+ *
+ *  @param    counter   counter to be incremented
+ */
+VINILAPI void vinil_stats_count(VinilStats* stats, int counter);
+
+/** @brief  Sums the shards of every thread into a snapshot
+ *
+ *  @param    stats     VinilStats object
+ *
+ *  @param    snapshot  receives the counters
+ */
+VINILAPI void vinil_stats_snapshot(VinilStats* stats, VinilVHDStats* snapshot);
+
+#endif
@@ -0,0 +1,152 @@
+/**
+ *  @file       trace.c
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TRACE_HEADER_SIZE   16
+#define TRACE_RECORD_SIZE   32
+#define TRACE_BUFFER_SIZE   (1024*1024)
+
+struct VinilTrace {
+  FILE* file;
+  uint64_t start;
+  vinil_mutex lock;
+  int ok;
+};
+
+struct VinilTraceReader {
+  FILE* file;
+  uint32_t record_size;
+};
+
+static uint64_t trace_next_thread = 0;
+static vinil_thread_local unsigned trace_thread = 0;
+
+static void trace_put(uint8_t* p, uint64_t value, int size) {
+  int i;
+  for (i = 0; i < size; i++)
+    p[i] = (uint8_t)(value >> (8 * i));
+}
+
+static uint64_t trace_get(const uint8_t* p, int size) {
+  uint64_t value = 0;
+  int i;
+  for (i = size - 1; i >= 0; i--)
+    value = (value << 8) | p[i];
+  return value;
+}
+
+VinilTrace* vinil_trace_create(const char* filename) {
+  VinilTrace* trace = (VinilTrace*)malloc(sizeof(VinilTrace));
+  if (trace == NULL)
+    return NULL;
+
+  trace->file = fopen(filename, "wb");
+  if (trace->file == NULL || !vinil_mutex_init(&trace->lock)) {
+    if (trace->file)
+      fclose(trace->file);
+    free(trace);
+    return NULL;
+  }
+
+  // records are small, a large stdio buffer keeps the calls out of the kernel
+  setvbuf(trace->file, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+
+  uint8_t header[TRACE_HEADER_SIZE];
+  memcpy(header, "VNLTRACE", 8);
+  trace_put(header + 8, VINIL_TRACE_VERSION, 4);
+  trace_put(header + 12, TRACE_RECORD_SIZE, 4);
+
+  trace->ok = fwrite(header, TRACE_HEADER_SIZE, 1, trace->file) == 1;
+  trace->start = vinil_clock_ns();
+
+  return trace;
+}
+
+void vinil_trace_record(VinilTrace* trace, int op, uint64_t sector, uint64_t count, uint64_t start, int result) {
+  uint64_t now = vinil_clock_ns();
+  uint64_t duration = (now - start) / 1000;
+
+  if (trace_thread == 0)
+    trace_thread = (unsigned)vinil_atomic_add(&trace_next_thread, 1) + 1;
+
+  uint8_t record[TRACE_RECORD_SIZE];
+  memset(record, 0, TRACE_RECORD_SIZE);
+  trace_put(record, start > trace->start ? start - trace->start : 0, 8);
+  trace_put(record + 8, sector, 8);
+  trace_put(record + 16, count > UINT32_MAX ? UINT32_MAX : count, 4);
+  trace_put(record + 20, duration > UINT32_MAX ? UINT32_MAX : duration, 4);
+  trace_put(record + 24, trace_thread, 4);
+  record[28] = (uint8_t)op;
+  record[29] = result ? TRUE : FALSE;
+
+  vinil_mutex_lock(&trace->lock);
+  if (fwrite(record, TRACE_RECORD_SIZE, 1, trace->file) != 1)
+    trace->ok = FALSE;
+  vinil_mutex_unlock(&trace->lock);
+}
+
+int vinil_trace_close(VinilTrace* trace) {
+  int ok = trace->ok;
+  if (fclose(trace->file) != 0)
+    ok = FALSE;
+
+  vinil_mutex_destroy(&trace->lock);
+  free(trace);
+
+  return ok;
+}
+
+VinilTraceReader* vinil_trace_reader_open(const char* filename) {
+  VinilTraceReader* reader = (VinilTraceReader*)malloc(sizeof(VinilTraceReader));
+  if (reader == NULL)
+    return NULL;
+
+  reader->file = fopen(filename, "rb");
+  if (reader->file == NULL) {
+    free(reader);
+    return NULL;
+  }
+
+  // newer versions may only append fields to the records
+  uint8_t header[TRACE_HEADER_SIZE];
+  if (fread(header, TRACE_HEADER_SIZE, 1, reader->file) != 1 || memcmp(header, "VNLTRACE", 8) != 0 ||
+      (reader->record_size = (uint32_t)trace_get(header + 12, 4)) < TRACE_RECORD_SIZE) {
+    vinil_trace_reader_close(reader);
+    return NULL;
+  }
+
+  return reader;
+}
+
+int vinil_trace_reader_next(VinilTraceReader* reader, VinilTraceRecord* record) {
+  uint8_t data[TRACE_RECORD_SIZE];
+  if (fread(data, TRACE_RECORD_SIZE, 1, reader->file) != 1)
+    return FALSE;
+
+  if (reader->record_size > TRACE_RECORD_SIZE &&
+      vinil_fseek(reader->file, reader->record_size - TRACE_RECORD_SIZE, SEEK_CUR) != 0)
+    return FALSE;
+
+  record->timestamp = trace_get(data, 8);
+  record->sector = trace_get(data + 8, 8);
+  record->count = (uint32_t)trace_get(data + 16, 4);
+  record->duration = (uint32_t)trace_get(data + 20, 4);
+  record->thread = (uint32_t)trace_get(data + 24, 4);
+  record->op = data[28];
+  record->result = data[29];
+
+  return TRUE;
+}
+
+void vinil_trace_reader_close(VinilTraceReader* reader) {
+  fclose(reader->file);
+  free(reader);
+}
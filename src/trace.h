@@ -0,0 +1,110 @@
+/**
+ *  @file       trace.h
+ *  @brief      Recording and reading of Virtual Hard Disk I/O traces.
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#ifndef VINIL_TRACE_H_
+#define VINIL_TRACE_H_
+
+#include <stdint.h>
+
+#include "crossplatform.h"
+#include "stats.h"
+
+/** @brief A read (vinil_vhd_read, vinil_vhd_pread or vinil_vhd_preadv) */
+#define VINIL_TRACE_READ          VINIL_STATS_READ
+
+/** @brief A write (vinil_vhd_write, vinil_vhd_pwrite or vinil_vhd_pwritev) */
+#define VINIL_TRACE_WRITE         VINIL_STATS_WRITE
+
+/** @brief A vinil_vhd_flush call */
+#define VINIL_TRACE_FLUSH         VINIL_STATS_FLUSH
+
+/** @brief A vinil_vhd_discard call */
+#define VINIL_TRACE_DISCARD       VINIL_STATS_DISCARD
+
+/** @brief A vinil_vhd_seek call, sector is the new position indicator */
+#define VINIL_TRACE_SEEK          VINIL_STATS_OPS
+
+/** @brief Version of the trace files written by this library */
+#define VINIL_TRACE_VERSION       1
+
+/** @brief A traced call. In the file every record takes 32 little-endian bytes
+ *         which follow a 16 bytes header ("VNLTRACE", version and record size). */
+typedef struct {
+  uint64_t  timestamp;    /**< nanoseconds between the start of the trace and the call */
+  uint64_t  sector;       /**< first sector (the new position of seeks) */
+  uint32_t  count;        /**< number of sectors */
+  uint32_t  duration;     /**< microseconds spent in the call */
+  uint32_t  thread;       /**< small number which identifies the calling thread */
+  uint8_t   op;           /**< one of the VINIL_TRACE_* operations */
+  uint8_t   result;       /**< TRUE if the call succeeded */
+} VinilTraceRecord;
+
+/** @brief A trace file being written */
+typedef struct VinilTrace VinilTrace;
+
+/** @brief A trace file being read */
+typedef struct VinilTraceReader VinilTraceReader;
+
+/** @brief  Creates a trace file
+ *
+ *  @param    filename  C string containing the name of the file to be created
+ *
+ *  @return   a new VinilTrace object or a null pointer if an error occurs
+ */
+VINILAPI VinilTrace* vinil_trace_create(const char* filename);
+
+/** @brief  Appends a record to a trace. It can be called by several threads at once, and
+ *          records are appended when the calls return, so the records of different threads
+ *          are not in the order in which the calls started (vinil_replay sorts them).
+ *
+ *  @param    trace     VinilTrace object
+ *
+ *  @param    op        one of the VINIL_TRACE_* operations
+ *
+ *  @param    sector    first sector
+ *
+ *  @param    count     number of sectors
+ *
+ *  @param    start     vinil_clock_ns() when the call started
+ *
+ *  @param    result    TRUE if the call succeeded
+ */
+VINILAPI void vinil_trace_record(VinilTrace* trace, int op, uint64_t sector, uint64_t count, uint64_t start, int result);
+
+/** @brief  Writes the buffered records and closes the trace file
+ *
+ *  @param    trace     VinilTrace object
+ *
+ *  @return   TRUE if every record was written, FALSE otherwise.
+ */
+VINILAPI int vinil_trace_close(VinilTrace* trace);
+
+/** @brief  Opens a trace file for reading
+ *
+ *  @param    filename  C string containing the name of the file to be opened
+ *
+ *  @return   a new VinilTraceReader object or a null pointer if the file is not a trace
+ */
+VINILAPI VinilTraceReader* vinil_trace_reader_open(const char* filename);
+
+/** @brief  Reads the next record of a trace
+ *
+ *  @param    reader    VinilTraceReader object
+ *
+ *  @param    record    receives the record
+ *
+ *  @return   TRUE if a record was read, FALSE at the end of the trace.
+ */
+VINILAPI int vinil_trace_reader_next(VinilTraceReader* reader, VinilTraceRecord* record);
+
+/** @brief  Closes a trace file opened with vinil_trace_reader_open
+ *
+ *  @param    reader    VinilTraceReader object
+ */
+VINILAPI void vinil_trace_reader_close(VinilTraceReader* reader);
+
+#endif
@@ -7,6 +7,34 @@
 #include "vhd.h"
 
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define VHD_OPEN_AS_PARENT    0x10000
+#define VHD_OPEN_MERGE        0x20000
+
+#define VHD_MERGE_MAX_THREADS 64
+
+#define VHD_MAX_CHAIN_DEPTH   256
+
+#define VHD_BOUNCE_SIZE       (1024*1024)
+
+#define VHD_ZERO_FILL_THREADS 4
+#define VHD_ZERO_FILL_CHUNK   (8*1024*1024)
+
+#define VHD_CLONE_THREADS     4
+#define VHD_CLONE_CHUNK       (8*1024*1024)
+
+#define VHD_PLATFORM_W2KU     0x57326B75
+#define VHD_PLATFORM_W2RU     0x57327275
+#define VHD_PLATFORM_MACX     0x4D616358
+
+static VinilVHD* vhd_open(const char* filename, int flags, int depth);
+static int vhd_write_back(VinilVHD* vhd);
+static int vhd_start_write_back(VinilVHD* vhd);
+static void vhd_stop_write_back(VinilVHD* vhd);
+static void vhd_crc_end(VinilVHD* vhd, const vinil_iovec* iov, int count, uint64_t sector, uint64_t sectors,
+                        uint64_t ticket, int ok);
 
 uint32_t vinil_checksum_vhd_footer(VinilVHDFooter* vhd_footer) {
   unsigned char* buffer;
@@ -99,6 +127,11 @@ static inline uint64_t byte_swap_64(uint64_t x)
      (((x) & 0x00000000000000ffULL) << 56));
 }
 
+static inline uint16_t byte_swap_16(uint16_t x)
+{
+    return (uint16_t)((((x) & 0xff00) >> 8) | (((x) & 0x00ff) << 8));
+}
+
 void vinil_vhd_footer_byte_swap(VinilVHDFooter* vhd_footer) {
   vhd_footer->features = byte_swap_32(vhd_footer->features);
   vhd_footer->file_format_version = byte_swap_32(vhd_footer->file_format_version);
@@ -113,159 +146,2915 @@ void vinil_vhd_footer_byte_swap(VinilVHDFooter* vhd_footer) {
   vhd_footer->checksum = byte_swap_32(vhd_footer->checksum);
 }
 
-VinilVHD* vinil_vhd_open(const char* filename) {
-  int error;
-  int file_exists = 0;
+uint32_t vinil_checksum_vhd_dynamic_header(VinilVHDDynamicHeader* vhd_header) {
+  unsigned char* buffer;
+  buffer = (unsigned char*)vhd_header;
   
-  FILE* f = fopen(filename, "r");
-  if (f) {
-    file_exists = 1;
-    fclose(f);
-  } else {
-    f = fopen(filename, "w");
-    if (f)
-      fclose(f);
-    else
-      return NULL;
-  }
+  uint32_t temp_checksum = vhd_header->checksum;
+  vhd_header->checksum = 0;
   
-  VinilVHD* vhd = (VinilVHD*)malloc(sizeof(VinilVHD));
-  if (vhd == NULL)
-    return NULL;
+  uint32_t checksum = 0;
+  int i;
+  for (i = 0; i < (int)sizeof(VinilVHDDynamicHeader); i++)
+    checksum += (uint32_t)buffer[i];
   
-  vhd->fd = fopen(filename, "rb+");
-  if (vhd->fd == NULL) {
-    vinil_vhd_close(vhd);
-    return NULL;
-  }
+  vhd_header->checksum = temp_checksum;
   
-  vhd->footer = vinil_vhd_footer_create();
-  if (vhd->footer == NULL) {
-    vinil_vhd_close(vhd);
-    return NULL;
-  }
+  return ~checksum;
+}
+
+void vinil_vhd_dynamic_header_byte_swap(VinilVHDDynamicHeader* vhd_header) {
+  vhd_header->data_offset = byte_swap_64(vhd_header->data_offset);
+  vhd_header->table_offset = byte_swap_64(vhd_header->table_offset);
+  vhd_header->header_version = byte_swap_32(vhd_header->header_version);
+  vhd_header->max_table_entries = byte_swap_32(vhd_header->max_table_entries);
+  vhd_header->block_size = byte_swap_32(vhd_header->block_size);
+  vhd_header->checksum = byte_swap_32(vhd_header->checksum);
+  vhd_header->parent_timestamp = byte_swap_32(vhd_header->parent_timestamp);
   
-  if (file_exists) {
-    if (!vinil_vhd_footer_read(vhd->fd, vhd->footer)) {
-      vinil_vhd_close(vhd);
-      return NULL;
-    }
+  int i;
+  for (i = 0; i < 256; i++)
+    vhd_header->parent_unicode_name[i] = byte_swap_16(vhd_header->parent_unicode_name[i]);
+  
+  for (i = 0; i < 8; i++) {
+    VinilVHDParentLocator* locator = &vhd_header->parent_locators[i];
+    locator->platform_code = byte_swap_32(locator->platform_code);
+    locator->platform_data_space = byte_swap_32(locator->platform_data_space);
+    locator->platform_data_length = byte_swap_32(locator->platform_data_length);
+    locator->platform_data_offset = byte_swap_64(locator->platform_data_offset);
+  }
+}
+
+typedef struct {
+  const vinil_iovec* iov;
+  int count;
+  int index;
+  size_t offset;
+} VhdIOCursor;
+
+static void vhd_cursor_zero(VhdIOCursor* cursor, size_t size) {
+  while (size > 0 && cursor->index < cursor->count) {
+    const vinil_iovec* iov = &cursor->iov[cursor->index];
+    size_t n = iov->iov_len - cursor->offset;
+    if (n > size)
+      n = size;
     
-    if (vinil_checksum_vhd_footer(vhd->footer) != vhd->footer->checksum) {
-      vinil_vhd_close(vhd);
-      return NULL;
+    memset((char*)iov->iov_base + cursor->offset, 0, n);
+    size -= n;
+    cursor->offset += n;
+    if (cursor->offset == iov->iov_len) {
+      cursor->index++;
+      cursor->offset = 0;
     }
   }
-  
-  
-  error = vinil_fseek(vhd->fd, 0, SEEK_SET);
-  if (error) {
-    vinil_vhd_close(vhd);
-    return NULL;
+}
+
+static void vhd_cursor_copy(VhdIOCursor* cursor, const uint8_t* src, size_t size) {
+  while (size > 0 && cursor->index < cursor->count) {
+    const vinil_iovec* iov = &cursor->iov[cursor->index];
+    size_t n = iov->iov_len - cursor->offset;
+    if (n > size)
+      n = size;
+    
+    memcpy((char*)iov->iov_base + cursor->offset, src, n);
+    src += n;
+    size -= n;
+    cursor->offset += n;
+    if (cursor->offset == iov->iov_len) {
+      cursor->index++;
+      cursor->offset = 0;
+    }
   }
-  
-  return vhd;
 }
 
-void vinil_vhd_close(VinilVHD* vhd) {
-  fclose(vhd->fd);
-  vinil_vhd_footer_destroy(vhd->footer);
-  free(vhd);
+static void vhd_cursor_gather(VhdIOCursor* cursor, uint8_t* dst, size_t size) {
+  while (size > 0 && cursor->index < cursor->count) {
+    const vinil_iovec* iov = &cursor->iov[cursor->index];
+    size_t n = iov->iov_len - cursor->offset;
+    if (n > size)
+      n = size;
+    
+    memcpy(dst, (const char*)iov->iov_base + cursor->offset, n);
+    dst += n;
+    size -= n;
+    cursor->offset += n;
+    if (cursor->offset == iov->iov_len) {
+      cursor->index++;
+      cursor->offset = 0;
+    }
+  }
 }
 
-int vinil_vhd_footer_read(FILE* fd, VinilVHDFooter* vhd_footer) {
-  int size = sizeof(VinilVHDFooter);
-  int error = vinil_fseek(fd, 0-size, SEEK_END);
-  if (error)
+static int vhd_direct_aligned(VinilVHD* vhd, const vinil_iovec* iov, int count, uint64_t offset) {
+  if (offset % vhd->alignment != 0)
     return FALSE;
   
-  int b = fread(vhd_footer, sizeof(char), sizeof(VinilVHDFooter), fd);
-  if (b != sizeof(VinilVHDFooter))
+  int i;
+  for (i = 0; i < count; i++)
+    if ((uintptr_t)iov[i].iov_base % vhd->alignment != 0 || iov[i].iov_len % vhd->alignment != 0)
+      return FALSE;
+  
+  return TRUE;
+}
+
+static int vhd_direct_read_span(VinilVHD* vhd, uint8_t* buffer, size_t span, uint64_t start, int64_t file_size) {
+  size_t valid = 0;
+  if ((int64_t)start < file_size)
+    valid = (uint64_t)file_size - start < span ? (size_t)(file_size - start) : span;
+  
+  size_t whole = valid / vhd->alignment * vhd->alignment;
+  memset(buffer + whole, 0, span - whole);
+  
+  if (whole > 0 && !vinil_pread(vhd->fd, buffer, whole, start))
     return FALSE;
   
-  vinil_vhd_footer_byte_swap(vhd_footer);
+  // the last unit ends past the end of the file
+  if (whole < valid && vinil_pread_partial(vhd->fd, buffer + whole, vhd->alignment, start + whole) < (int64_t)(valid - whole))
+    return FALSE;
   
   return TRUE;
 }
 
-VinilVHDFooter* vinil_vhd_footer_create() {
-  int error;
+static int vhd_direct_bounce(VinilVHD* vhd, const vinil_iovec* iov, int count, uint64_t offset, int write) {
+  uint32_t alignment = vhd->alignment;
+  size_t size = 0;
+  int i;
+  for (i = 0; i < count; i++)
+    size += iov[i].iov_len;
   
-  VinilVHDFooter* footer = (VinilVHDFooter*)malloc(sizeof(VinilVHDFooter));
-  if (footer == NULL) {
-    vinil_vhd_footer_destroy(footer);
-    return NULL;
+  uint8_t* bounce = (uint8_t*)vinil_alloc_aligned_buffer(VHD_BOUNCE_SIZE);
+  if (bounce == NULL)
+    return FALSE;
+  
+  VhdIOCursor cursor;
+  cursor.iov = iov;
+  cursor.count = count;
+  cursor.index = 0;
+  cursor.offset = 0;
+  
+  // writes which share a unit would undo each other's read-modify-write
+  if (write)
+    vinil_mutex_lock(&vhd->rmw_lock);
+  
+  int64_t file_size = vinil_file_size(vhd->fd);
+  int ok = file_size >= 0;
+  
+  while (ok && size > 0) {
+    uint64_t start = offset / alignment * alignment;
+    size_t head = (size_t)(offset - start);
+    size_t n = VHD_BOUNCE_SIZE - alignment - head;
+    if (n > size)
+      n = size;
+    size_t span = (head + n + alignment - 1) / alignment * alignment;
+    
+    if (!write || head != 0 || (head + n) % alignment != 0)
+      ok = vhd_direct_read_span(vhd, bounce, span, start, file_size);
+    
+    if (ok && write) {
+      vhd_cursor_gather(&cursor, bounce + head, n);
+      ok = vinil_pwrite(vhd->fd, bounce, span, start);
+      
+      // the padding written past the end of the file is cut off
+      if (ok && start + span > (uint64_t)file_size) {
+        if (offset + n > (uint64_t)file_size)
+          file_size = offset + n;
+        ok = vinil_truncate(vhd->fd, file_size);
+      }
+    } else if (ok) {
+      vhd_cursor_copy(&cursor, bounce + head, n);
+    }
+    
+    size -= n;
+    offset += n;
   }
   
-  return footer;
+  if (write)
+    vinil_mutex_unlock(&vhd->rmw_lock);
+  
+  vinil_free_aligned_buffer(bounce);
+  
+  return ok;
 }
 
-void vinil_vhd_footer_destroy(VinilVHDFooter* vhd_footer) {
-  free(vhd_footer);
+static int vhd_pio(VinilVHD* vhd, const vinil_iovec* iov, int count, uint64_t offset, int write) {
+  if ((vhd->flags & VINIL_VHD_OPEN_DIRECT) && !vhd_direct_aligned(vhd, iov, count, offset))
+    return vhd_direct_bounce(vhd, iov, count, offset, write);
+  
+  return write ? vinil_pwritev(vhd->fd, iov, count, offset) : vinil_preadv(vhd->fd, iov, count, offset);
 }
 
-int vinil_vhd_read(VinilVHD* vhd, void* buffer, int count) {
-  if (vinil_ftell(vhd->fd) > (vhd->footer->current_size - 512*count))
+static int vhd_read_at(VinilVHD* vhd, uint64_t offset, void* buffer, size_t size) {
+  if (vhd->stats)
+    vinil_stats_count(vhd->stats, VINIL_STATS_METADATA_READ);
+  
+  vinil_iovec iov;
+  iov.iov_base = buffer;
+  iov.iov_len = size;
+  
+  return vhd_pio(vhd, &iov, 1, offset, FALSE);
+}
+
+static int vhd_write_at(VinilVHD* vhd, uint64_t offset, const void* buffer, size_t size) {
+  if (vhd->stats)
+    vinil_stats_count(vhd->stats, VINIL_STATS_METADATA_WRITE);
+  
+  vinil_iovec iov;
+  iov.iov_base = (void*)buffer;
+  iov.iov_len = size;
+  
+  return vhd_pio(vhd, &iov, 1, offset, TRUE);
+}
+
+static int vhd_write_footer_at(VinilVHD* vhd, uint64_t offset) {
+  VinilVHDFooter footer;
+  
+  vhd->footer->checksum = vinil_checksum_vhd_footer(vhd->footer);
+  
+  memcpy(&footer, vhd->footer, sizeof(VinilVHDFooter));
+  vinil_vhd_footer_byte_swap(&footer);
+  
+  return vhd_write_at(vhd, offset, &footer, sizeof(VinilVHDFooter));
+}
+
+static int vhd_write_dynamic_header(VinilVHD* vhd) {
+  VinilVHDDynamicHeader header;
+  
+  vhd->header->checksum = vinil_checksum_vhd_dynamic_header(vhd->header);
+  
+  memcpy(&header, vhd->header, sizeof(VinilVHDDynamicHeader));
+  vinil_vhd_dynamic_header_byte_swap(&header);
+  
+  return vhd_write_at(vhd, vhd->footer->data_offset, &header, sizeof(VinilVHDDynamicHeader));
+}
+
+static inline uint32_t vhd_sectors_per_block(VinilVHD* vhd) {
+  return vhd->header->block_size / 512;
+}
+
+static inline uint32_t vhd_bitmap_size(VinilVHD* vhd) {
+  uint32_t bytes = (vhd_sectors_per_block(vhd) + 7) / 8;
+  return (bytes + 511) / 512 * 512;
+}
+
+static inline uint64_t vhd_bat_size(uint32_t entries) {
+  return ((uint64_t)entries * 4 + 511) / 512 * 512;
+}
+
+static inline int vhd_bitmap_test(const uint8_t* bitmap, uint32_t sector) {
+  return (bitmap[sector >> 3] >> (7 - (sector & 7))) & 1;
+}
+
+static int vhd_write_bat_entries(VinilVHD* vhd, uint32_t first, uint32_t count) {
+  uint32_t* entries = (uint32_t*)malloc(count * sizeof(uint32_t));
+  if (entries == NULL)
     return FALSE;
   
-  int bytes = fread(buffer, sizeof(char), 512*count, vhd->fd);
+  uint32_t i;
+  for (i = 0; i < count; i++)
+    entries[i] = byte_swap_32(vhd->bat[first + i]);
   
-  return bytes == 512*count ? TRUE : FALSE;
+  int ok = vhd_write_at(vhd, vhd->header->table_offset + (uint64_t)first * 4, entries, count * sizeof(uint32_t));
+  free(entries);
+  
+  return ok;
 }
 
-int vinil_vhd_write(VinilVHD* vhd, void* buffer, int count) {
-  if (vinil_ftell(vhd->fd) > (vhd->footer->current_size - 512*count))
+static int vhd_load_dynamic_header(VinilVHD* vhd) {
+  vhd->header = (VinilVHDDynamicHeader*)malloc(sizeof(VinilVHDDynamicHeader));
+  if (vhd->header == NULL)
+    return FALSE;
+  
+  if (!vhd_read_at(vhd, vhd->footer->data_offset, vhd->header, sizeof(VinilVHDDynamicHeader)))
+    return FALSE;
+  
+  vinil_vhd_dynamic_header_byte_swap(vhd->header);
+  
+  if (memcmp(vhd->header->cookie, "cxsparse", 8) != 0)
+    return FALSE;
+  
+  if (vinil_checksum_vhd_dynamic_header(vhd->header) != vhd->header->checksum)
+    return FALSE;
+  
+  if (vhd->header->block_size < 512 || vhd->header->block_size % 512 != 0)
+    return FALSE;
+  
+  uint32_t entries = vhd->header->max_table_entries;
+  vhd->bat = (uint32_t*)malloc((entries ? entries : 1) * sizeof(uint32_t));
+  vhd->bitmaps = (uint8_t**)calloc(entries ? entries : 1, sizeof(uint8_t*));
+  vhd->writers = (uint64_t*)calloc(entries ? entries : 1, sizeof(uint64_t));
+  vhd->readers = (uint64_t*)calloc(entries ? entries : 1, sizeof(uint64_t));
+  if (vhd->bat == NULL || vhd->bitmaps == NULL || vhd->writers == NULL || vhd->readers == NULL)
+    return FALSE;
+  
+  if (!vhd_read_at(vhd, vhd->header->table_offset, vhd->bat, entries * sizeof(uint32_t)))
+    return FALSE;
+  
+  uint32_t i;
+  for (i = 0; i < entries; i++)
+    vhd->bat[i] = byte_swap_32(vhd->bat[i]);
+  
+  int64_t file_size = vinil_file_size(vhd->fd);
+  if (file_size < (int64_t)sizeof(VinilVHDFooter))
     return FALSE;
   
-  int bytes = fwrite(buffer, sizeof(char), 512*count, vhd->fd);
+  vhd->next_block_offset = (file_size - sizeof(VinilVHDFooter)) / 512 * 512;
   
-  return bytes == 512*count ? TRUE : FALSE;
+  return TRUE;
 }
 
-int64_t vinil_vhd_tell(VinilVHD* vhd) {
-  return vinil_ftell(vhd->fd)/512;
+static uint8_t* vhd_load_bitmap(VinilVHD* vhd, uint32_t block) {
+  uint8_t* bitmap = vinil_atomic_load(&vhd->bitmaps[block]);
+  if (bitmap)
+    return bitmap;
+  
+  vinil_mutex_lock(&vhd->lock);
+  
+  bitmap = vhd->bitmaps[block];
+  if (bitmap == NULL) {
+    uint32_t size = vhd_bitmap_size(vhd);
+    
+    // a discard may have freed the block since the caller looked it up
+    if (vhd->bat[block] == VINIL_VHD_UNUSED_BLOCK)
+      bitmap = (uint8_t*)calloc(1, size);
+    else
+      bitmap = (uint8_t*)malloc(size);
+    
+    if (bitmap && vhd->bat[block] != VINIL_VHD_UNUSED_BLOCK &&
+        !vhd_read_at(vhd, (uint64_t)vhd->bat[block] * 512, bitmap, size)) {
+      free(bitmap);
+      bitmap = NULL;
+    }
+    
+    if (bitmap)
+      vinil_atomic_store(&vhd->bitmaps[block], bitmap);
+  }
+  
+  vinil_mutex_unlock(&vhd->lock);
+  
+  return bitmap;
 }
 
-int vinil_vhd_seek(VinilVHD* vhd, int64_t offset, int origin) {
-  if (origin == SEEK_END) {
-    int error = 0;
-    int size = sizeof(VinilVHDFooter);
-    error = vinil_fseek(vhd->fd, 0 - size - offset*512, SEEK_END);
-    if (error) {
-      return FALSE;
+static int vhd_allocate_block(VinilVHD* vhd, uint32_t block) {
+  uint32_t bitmap_size = vhd_bitmap_size(vhd);
+  uint64_t offset = vhd->next_block_offset;
+  uint64_t end = offset + bitmap_size + vhd->header->block_size;
+  
+  // a block freed before keeps its bitmap, readers may still be scanning it
+  // without the lock, so it is zeroed and reused instead of being replaced
+  uint8_t* bitmap = vhd->bitmaps[block];
+  uint8_t* fresh = NULL;
+  if (bitmap)
+    memset(bitmap, 0, bitmap_size);
+  else
+    bitmap = fresh = (uint8_t*)calloc(1, bitmap_size);
+  if (bitmap == NULL)
+    return FALSE;
+  
+  // the data block is zero filled by extending the file, so only the
+  // bitmap (which overwrites the old footer) has to be written explicitly
+  if (!vinil_truncate(vhd->fd, end + sizeof(VinilVHDFooter)) ||
+      !vhd_write_at(vhd, offset, bitmap, bitmap_size) ||
+      !vhd_write_footer_at(vhd, end)) {
+    free(fresh);
+    return FALSE;
+  }
+  
+  uint32_t entry = byte_swap_32((uint32_t)(offset / 512));
+  if (!vhd_write_at(vhd, vhd->header->table_offset + (uint64_t)block * 4, &entry, sizeof(entry))) {
+    free(fresh);
+    return FALSE;
+  }
+  
+  // readers look the block up without the lock, so it is published only
+  // after its bitmap is in place
+  if (fresh)
+    vinil_atomic_store(&vhd->bitmaps[block], fresh);
+  vinil_atomic_store(&vhd->bat[block], (uint32_t)(offset / 512));
+  vhd->next_block_offset = end;
+  
+  if (vhd->owners)
+    vinil_atomic_store(&vhd->owners[block], vhd);
+  
+  return TRUE;
+}
+
+static VinilVHD* vhd_find_owner(VinilVHD* layer, uint32_t block) {
+  while (layer) {
+    if (layer->header == NULL)
+      return layer;
+    
+    if (block < layer->header->max_table_entries && 
+        vinil_atomic_load(&layer->bat[block]) != VINIL_VHD_UNUSED_BLOCK)
+      return layer;
+    
+    layer = layer->parent;
+  }
+  
+  return NULL;
+}
+
+static int vhd_cursor_transfer(VinilVHD* vhd, VhdIOCursor* cursor, size_t size, uint64_t offset, int write) {
+  vinil_iovec local[VINIL_IOV_BATCH];
+  
+  if (!write && vhd->map && offset + size <= vhd->map_size) {
+    vhd_cursor_copy(cursor, vhd->map + offset, size);
+    return TRUE;
+  }
+  
+  // gathers the next size bytes of the request, VINIL_IOV_BATCH entries at a time
+  while (size > 0) {
+    int n = 0;
+    size_t batch = 0;
+    while (n < VINIL_IOV_BATCH && size > batch && cursor->index < cursor->count) {
+      const vinil_iovec* iov = &cursor->iov[cursor->index];
+      size_t length = iov->iov_len - cursor->offset;
+      if (length > size - batch)
+        length = size - batch;
+      
+      local[n].iov_base = (char*)iov->iov_base + cursor->offset;
+      local[n].iov_len = length;
+      n++;
+      batch += length;
+      
+      cursor->offset += length;
+      if (cursor->offset == iov->iov_len) {
+        cursor->index++;
+        cursor->offset = 0;
+      }
     }
     
+    if (batch == 0)
+      return FALSE;
+    
+    if (!vhd_pio(vhd, local, n, offset, write))
+      return FALSE;
+    
+    size -= batch;
+    offset += batch;
+  }
+  
+  return TRUE;
+}
+
+static int vhd_read_layer_block(VinilVHD* layer, uint32_t sectors_per_block, uint32_t block, 
+                                uint32_t first, uint32_t count, VhdIOCursor* cursor) {
+  if (layer == NULL) {
+    vhd_cursor_zero(cursor, (size_t)count * 512);
+    return TRUE;
+  }
+  
+  // fixed layers have no blocks, so everything up to their size is present
+  if (layer->header == NULL) {
+    uint64_t sector = (uint64_t)block * sectors_per_block + first;
+    uint64_t sectors = layer->footer->current_size / 512;
+    uint64_t n = sector < sectors ? sectors - sector : 0;
+    if (n > count)
+      n = count;
+    
+    if (n > 0 && !vhd_cursor_transfer(layer, cursor, (size_t)n * 512, sector * 512, FALSE))
+      return FALSE;
+    
+    vhd_cursor_zero(cursor, (size_t)(count - n) * 512);
     return TRUE;
-  }  
-  return vinil_fseek(vhd->fd, offset*512, origin) ? FALSE : TRUE;
+  }
+  
+  // the reader is counted before the block is looked up, so a discard which frees
+  // the block meanwhile does not give its space to another block (see vhd_free_block)
+  vinil_atomic_add(&layer->readers[block], 1);
+  vinil_atomic_fence();
+  
+  uint32_t entry = vinil_atomic_load(&layer->bat[block]);
+  if (entry == VINIL_VHD_UNUSED_BLOCK) {
+    vinil_atomic_add(&layer->readers[block], (uint64_t)-1);
+    return vhd_read_layer_block(vhd_find_owner(layer->parent, block), sectors_per_block, block, first, count, cursor);
+  }
+  
+  uint8_t* bitmap = vhd_load_bitmap(layer, block);
+  uint64_t data_offset = (uint64_t)entry * 512 + vhd_bitmap_size(layer);
+  
+  // reads runs of sectors which share the same bitmap state, the missing
+  // ones come from the next layer which owns this block
+  int ok = bitmap != NULL;
+  uint32_t sector = first;
+  while (ok && sector < first + count) {
+    int present = vhd_bitmap_test(bitmap, sector);
+    uint32_t end = sector + 1;
+    while (end < first + count && vhd_bitmap_test(bitmap, end) == present)
+      end++;
+    
+    if (present) {
+      ok = vhd_cursor_transfer(layer, cursor, (size_t)(end - sector) * 512, data_offset + (uint64_t)sector * 512, FALSE);
+    } else {
+      VinilVHD* owner = vhd_find_owner(layer->parent, block);
+      ok = vhd_read_layer_block(owner, sectors_per_block, block, sector, end - sector, cursor);
+    }
+    
+    sector = end;
+  }
+  
+  vinil_atomic_add(&layer->readers[block], (uint64_t)-1);
+  
+  return ok;
 }
 
-int vinil_vhd_flush(VinilVHD* vhd) {
-  return fflush(vhd->fd) ? FALSE : TRUE;
+static int vhd_read_block(VinilVHD* vhd, uint32_t block, uint32_t first, uint32_t count, VhdIOCursor* cursor) {
+  VinilVHD* owner = vhd->owners ? vinil_atomic_load(&vhd->owners[block]) : vhd_find_owner(vhd, block);
+  
+  return vhd_read_layer_block(owner, vhd_sectors_per_block(vhd), block, first, count, cursor);
 }
 
-int vinil_vhd_commit_structural_changes(VinilVHD* vhd) {
-  if (!vinil_truncate(vhd->fd, vhd->footer->current_size))
+static int vhd_write_block_data(VinilVHD* vhd, uint32_t block, uint32_t first, uint32_t count, VhdIOCursor* cursor) {
+  uint8_t* bitmap = vhd_load_bitmap(vhd, block);
+  if (bitmap == NULL)
     return FALSE;
   
-  int error = vinil_fseek(vhd->fd, vhd->footer->current_size, SEEK_SET);
-  if (error)
+  uint64_t block_offset = (uint64_t)vinil_atomic_load(&vhd->bat[block]) * 512;
+  uint64_t data_offset = block_offset + vhd_bitmap_size(vhd);
+  
+  if (!vhd_cursor_transfer(vhd, cursor, (size_t)count * 512, data_offset + (uint64_t)first * 512, TRUE))
     return FALSE;
   
-  vhd->footer->checksum = vinil_checksum_vhd_footer(vhd->footer);
+  uint32_t sector = first;
+  while (sector < first + count && vhd_bitmap_test(bitmap, sector))
+    sector++;
   
-  vinil_vhd_footer_byte_swap(vhd->footer);
+  if (sector == first + count)
+    return TRUE;
   
-  int b = fwrite(vhd->footer, 1, sizeof(VinilVHDFooter), vhd->fd);
-  if (b != sizeof(VinilVHDFooter))
-    return FALSE;
+  // marks the written sectors and rewrites only the bitmap sectors which changed
+  vinil_mutex_lock(&vhd->lock);
   
-  vinil_vhd_footer_byte_swap(vhd->footer);
+  uint32_t changed_first = UINT32_MAX, changed_last = 0;
+  for (; sector < first + count; sector++) {
+    if (!vhd_bitmap_test(bitmap, sector)) {
+      bitmap[sector >> 3] |= (uint8_t)(0x80 >> (sector & 7));
+      if (changed_first == UINT32_MAX)
+        changed_first = sector >> 3;
+      changed_last = sector >> 3;
+    }
+  }
+  
+  int ok = TRUE;
+  if (changed_first != UINT32_MAX) {
+    uint32_t from = changed_first / 512 * 512;
+    uint32_t to = (changed_last / 512 + 1) * 512;
+    ok = vhd_write_at(vhd, block_offset + from, bitmap + from, to - from);
+  }
+  
+  vinil_mutex_unlock(&vhd->lock);
   
-  error = vinil_fseek(vhd->fd, 0, SEEK_SET);
-  if (error) {
+  return ok;
+}
+
+static int vhd_write_block(VinilVHD* vhd, uint32_t block, uint32_t first, uint32_t count, VhdIOCursor* cursor) {
+  // the writer is counted before the block is looked up, so a discard cannot free
+  // the block between the write of the data and the update of the bitmap
+  vinil_mutex_lock(&vhd->lock);
+  int ok = vhd->bat[block] != VINIL_VHD_UNUSED_BLOCK || vhd_allocate_block(vhd, block);
+  if (ok)
+    vhd->writers[block]++;
+  vinil_mutex_unlock(&vhd->lock);
+  
+  if (!ok)
     return FALSE;
+  
+  ok = vhd_write_block_data(vhd, block, first, count, cursor);
+  vinil_atomic_add(&vhd->writers[block], (uint64_t)-1);
+  
+  return ok;
+}
+
+static int vhd_dynamic_io(VinilVHD* vhd, uint64_t sector, VhdIOCursor* cursor, uint64_t count, int write) {
+  uint32_t sectors_per_block = vhd_sectors_per_block(vhd);
+  
+  if (vhd->stats && sector % sectors_per_block + count > sectors_per_block)
+    vinil_stats_count(vhd->stats, VINIL_STATS_SPLIT);
+  
+  // requests are split at block boundaries, each part goes to its own block
+  while (count > 0) {
+    uint32_t block = (uint32_t)(sector / sectors_per_block);
+    uint32_t first = (uint32_t)(sector % sectors_per_block);
+    uint32_t n = sectors_per_block - first;
+    if (n > count)
+      n = (uint32_t)count;
+    
+    if (block >= vhd->header->max_table_entries)
+      return FALSE;
+    
+    int ok = write ? vhd_write_block(vhd, block, first, n, cursor)
+                   : vhd_read_block(vhd, block, first, n, cursor);
+    if (!ok)
+      return FALSE;
+    
+    sector += n;
+    count -= n;
   }
   
   return TRUE;
 }
+
+static int vhd_create_dynamic_header(VinilVHD* vhd, uint32_t block_size, uint64_t locators_size) {
+  uint32_t entries = (uint32_t)((vhd->footer->current_size + block_size - 1) / block_size);
+  
+  vhd->header = (VinilVHDDynamicHeader*)calloc(1, sizeof(VinilVHDDynamicHeader));
+  if (vhd->header == NULL)
+    return FALSE;
+  
+  memcpy(vhd->header->cookie, "cxsparse", 8);
+  vhd->header->data_offset = 0xFFFFFFFFFFFFFFFFULL;
+  vhd->header->table_offset = 512 + sizeof(VinilVHDDynamicHeader);
+  vhd->header->header_version = 0x00010000;
+  vhd->header->block_size = block_size;
+  vhd->footer->data_offset = 512;
+  
+  // the BAT is sized (and written) by vhd_commit_dynamic, parent locators go right after it
+  vhd->header->max_table_entries = 0;
+  vhd->next_block_offset = vhd->header->table_offset + vhd_bat_size(entries) + locators_size;
+  
+  return TRUE;
+}
+
+static int vhd_commit_dynamic(VinilVHD* vhd) {
+  if (vhd->header == NULL) {
+    if (vhd->footer->disk_type != VINIL_VHD_DYNAMIC)
+      return FALSE;
+    
+    if (!vhd_create_dynamic_header(vhd, VINIL_VHD_DEFAULT_BLOCK_SIZE, 0))
+      return FALSE;
+  } else if (vhd->bat != NULL) {
+    uint32_t capacity = (uint32_t)(vhd_bat_size(vhd->header->max_table_entries) / 4);
+    if (vhd->footer->current_size > (uint64_t)capacity * vhd->header->block_size)
+      return FALSE;
+  }
+  
+  uint32_t block_size = vhd->header->block_size;
+  uint32_t entries = (uint32_t)((vhd->footer->current_size + block_size - 1) / block_size);
+  uint32_t old_entries = vhd->header->max_table_entries;
+  
+  if (entries > old_entries) {
+    uint32_t* bat = (uint32_t*)realloc(vhd->bat, entries * sizeof(uint32_t));
+    if (bat == NULL)
+      return FALSE;
+    vhd->bat = bat;
+    
+    uint8_t** bitmaps = (uint8_t**)realloc(vhd->bitmaps, entries * sizeof(uint8_t*));
+    if (bitmaps == NULL)
+      return FALSE;
+    vhd->bitmaps = bitmaps;
+    
+    uint64_t* writers = (uint64_t*)realloc(vhd->writers, entries * sizeof(uint64_t));
+    if (writers == NULL)
+      return FALSE;
+    vhd->writers = writers;
+    
+    uint64_t* readers = (uint64_t*)realloc(vhd->readers, entries * sizeof(uint64_t));
+    if (readers == NULL)
+      return FALSE;
+    vhd->readers = readers;
+    
+    uint32_t i;
+    for (i = old_entries; i < entries; i++) {
+      vhd->bat[i] = VINIL_VHD_UNUSED_BLOCK;
+      vhd->bitmaps[i] = NULL;
+      vhd->writers[i] = 0;
+      vhd->readers[i] = 0;
+    }
+    
+    if (vhd->owners) {
+      VinilVHD** owners = (VinilVHD**)realloc(vhd->owners, entries * sizeof(VinilVHD*));
+      if (owners == NULL)
+        return FALSE;
+      vhd->owners = owners;
+      
+      for (i = old_entries; i < entries; i++)
+        vhd->owners[i] = vhd_find_owner(vhd->parent, i);
+    }
+    
+    vhd->header->max_table_entries = entries;
+    if (!vhd_write_bat_entries(vhd, old_entries, entries - old_entries))
+      return FALSE;
+  } else {
+    vhd->header->max_table_entries = entries;
+  }
+  
+  if (!vinil_truncate(vhd->fd, vhd->next_block_offset + sizeof(VinilVHDFooter)))
+    return FALSE;
+  
+  if (!vhd_write_footer_at(vhd, 0) ||
+      !vhd_write_dynamic_header(vhd) ||
+      !vhd_write_footer_at(vhd, vhd->next_block_offset))
+    return FALSE;
+  
+  return TRUE;
+}
+
+static int vhd_utf16_to_utf8(const uint16_t* src, size_t length, char* dst, size_t size) {
+  size_t i, j = 0;
+  
+  for (i = 0; i < length && src[i]; i++) {
+    uint32_t c = src[i];
+    if (c >= 0xD800 && c < 0xDC00 && i + 1 < length && src[i + 1] >= 0xDC00 && src[i + 1] < 0xE000) {
+      c = 0x10000 + ((c - 0xD800) << 10) + (src[i + 1] - 0xDC00);
+      i++;
+    }
+    
+    if (j + 4 >= size)
+      return FALSE;
+    
+    if (c < 0x80) {
+      dst[j++] = (char)c;
+    } else if (c < 0x800) {
+      dst[j++] = (char)(0xC0 | (c >> 6));
+      dst[j++] = (char)(0x80 | (c & 0x3F));
+    } else if (c < 0x10000) {
+      dst[j++] = (char)(0xE0 | (c >> 12));
+      dst[j++] = (char)(0x80 | ((c >> 6) & 0x3F));
+      dst[j++] = (char)(0x80 | (c & 0x3F));
+    } else {
+      dst[j++] = (char)(0xF0 | (c >> 18));
+      dst[j++] = (char)(0x80 | ((c >> 12) & 0x3F));
+      dst[j++] = (char)(0x80 | ((c >> 6) & 0x3F));
+      dst[j++] = (char)(0x80 | (c & 0x3F));
+    }
+  }
+  
+  dst[j] = 0;
+  
+  return j > 0 ? TRUE : FALSE;
+}
+
+static size_t vhd_utf8_to_utf16(const char* src, uint16_t* dst, size_t size) {
+  const unsigned char* s = (const unsigned char*)src;
+  size_t j = 0;
+  
+  while (*s) {
+    uint32_t c;
+    if (*s < 0x80) {
+      c = *s++;
+    } else if ((*s & 0xE0) == 0xC0 && s[1]) {
+      c = ((s[0] & 0x1F) << 6) | (s[1] & 0x3F);
+      s += 2;
+    } else if ((*s & 0xF0) == 0xE0 && s[1] && s[2]) {
+      c = ((s[0] & 0x0F) << 12) | ((s[1] & 0x3F) << 6) | (s[2] & 0x3F);
+      s += 3;
+    } else if ((*s & 0xF8) == 0xF0 && s[1] && s[2] && s[3]) {
+      c = ((s[0] & 0x07) << 18) | ((s[1] & 0x3F) << 12) | ((s[2] & 0x3F) << 6) | (s[3] & 0x3F);
+      s += 4;
+    } else {
+      return 0;
+    }
+    
+    if (c >= 0x10000) {
+      if (j + 2 > size)
+        return 0;
+      c -= 0x10000;
+      dst[j++] = (uint16_t)(0xD800 + (c >> 10));
+      dst[j++] = (uint16_t)(0xDC00 + (c & 0x3FF));
+    } else {
+      if (j + 1 > size)
+        return 0;
+      dst[j++] = (uint16_t)c;
+    }
+  }
+  
+  return j;
+}
+
+static const char* vhd_basename(const char* path) {
+  const char* name = path;
+  const char* p;
+  for (p = path; *p; p++)
+    if (*p == '/' || *p == '\\')
+      name = p + 1;
+  
+  return name;
+}
+
+static int vhd_is_absolute_path(const char* path) {
+  if (path[0] == '/' || path[0] == '\\')
+    return TRUE;
+  
+  return path[0] && path[1] == ':' ? TRUE : FALSE;
+}
+
+static VinilVHD* vhd_open_parent_path(VinilVHD* vhd, const char* child_filename, char* path, int depth) {
+  char full_path[VINIL_MAX_PATH];
+  
+  if (strncmp(path, "file://", 7) == 0)
+    path += 7;
+  
+#ifndef _WIN32
+  char* p;
+  for (p = path; *p; p++)
+    if (*p == '\\')
+      *p = '/';
+#endif
+  
+  if (vhd_is_absolute_path(path)) {
+    if (strlen(path) >= sizeof(full_path))
+      return NULL;
+    strcpy(full_path, path);
+  } else {
+    size_t dir_length = vhd_basename(child_filename) - child_filename;
+    if (path[0] == '.' && (path[1] == '/' || path[1] == '\\'))
+      path += 2;
+    
+    if (dir_length + strlen(path) >= sizeof(full_path))
+      return NULL;
+    
+    memcpy(full_path, child_filename, dir_length);
+    strcpy(full_path + dir_length, path);
+  }
+  
+  // vinil_vhd_merge writes to the parent of the child it opens
+  int flags = (vhd->flags & (VINIL_VHD_OPEN_MMAP | VINIL_VHD_OPEN_DIRECT)) | VHD_OPEN_AS_PARENT;
+  if (!(vhd->flags & VHD_OPEN_MERGE))
+    flags |= VINIL_VHD_OPEN_READ_ONLY;
+  VinilVHD* parent = vhd_open(full_path, flags, depth + 1);
+  if (parent == NULL)
+    return NULL;
+  
+  if (memcmp(parent->footer->uuid, vhd->header->parent_uuid, sizeof(vinil_uuid)) != 0) {
+    vinil_vhd_close(parent);
+    return NULL;
+  }
+  
+  return parent;
+}
+
+static int vhd_open_parent(VinilVHD* vhd, const char* filename, int depth) {
+  const uint32_t platforms[] = {VHD_PLATFORM_W2RU, VHD_PLATFORM_W2KU, VHD_PLATFORM_MACX};
+  char path[VINIL_MAX_PATH];
+  
+  if (depth >= VHD_MAX_CHAIN_DEPTH)
+    return FALSE;
+  
+  uint16_t* data = (uint16_t*)malloc(VINIL_MAX_PATH * sizeof(uint16_t));
+  if (data == NULL)
+    return FALSE;
+  
+  int i, j;
+  for (i = 0; i < 3 && vhd->parent == NULL; i++) {
+    for (j = 0; j < 8 && vhd->parent == NULL; j++) {
+      VinilVHDParentLocator* locator = &vhd->header->parent_locators[j];
+      uint32_t length = locator->platform_data_length;
+      if (locator->platform_code != platforms[i] || length == 0 || length >= VINIL_MAX_PATH)
+        continue;
+      
+      if (!vhd_read_at(vhd, locator->platform_data_offset, data, length))
+        continue;
+      
+      int ok;
+      if (platforms[i] == VHD_PLATFORM_MACX) {
+        memcpy(path, data, length);
+        path[length] = 0;
+        ok = TRUE;
+      } else {
+        ok = vhd_utf16_to_utf8(data, length / 2, path, sizeof(path));
+      }
+      
+      if (ok)
+        vhd->parent = vhd_open_parent_path(vhd, filename, path, depth);
+    }
+  }
+  
+  free(data);
+  
+  // last resort: a parent with the same name in the child's directory
+  if (vhd->parent == NULL && vhd_utf16_to_utf8(vhd->header->parent_unicode_name, 256, path, sizeof(path)))
+    vhd->parent = vhd_open_parent_path(vhd, filename, path, depth);
+  
+  if (vhd->parent == NULL)
+    return FALSE;
+  
+  if (vhd->parent->header && vhd->parent->header->block_size != vhd->header->block_size)
+    return FALSE;
+  
+  return TRUE;
+}
+
+static int vhd_build_owners(VinilVHD* vhd) {
+  uint32_t entries = vhd->header->max_table_entries;
+  
+  vhd->owners = (VinilVHD**)malloc((entries ? entries : 1) * sizeof(VinilVHD*));
+  if (vhd->owners == NULL)
+    return FALSE;
+  
+  uint32_t i;
+  for (i = 0; i < entries; i++)
+    vhd->owners[i] = vhd_find_owner(vhd, i);
+  
+  return TRUE;
+}
+
+VinilVHD* vinil_vhd_create_differencing(const char* filename, const char* parent_filename) {
+  char parent_path[VINIL_MAX_PATH];
+  char child_path[VINIL_MAX_PATH];
+  char relative_path[VINIL_MAX_PATH];
+  
+  FILE* f = fopen(filename, "r");
+  if (f) {
+    fclose(f);
+    return NULL;
+  }
+  
+  if (!vinil_absolute_path(parent_filename, parent_path, sizeof(parent_path)))
+    return NULL;
+  
+  VinilVHD* parent = vhd_open(parent_path, VINIL_VHD_OPEN_READ_ONLY | VHD_OPEN_AS_PARENT, 0);
+  if (parent == NULL)
+    return NULL;
+  
+  VinilVHD* vhd = vinil_vhd_open(filename);
+  if (vhd == NULL || !vinil_absolute_path(filename, child_path, sizeof(child_path))) {
+    if (vhd)
+      vinil_vhd_close(vhd);
+    vinil_vhd_close(parent);
+    return NULL;
+  }
+  
+  memcpy(vhd->footer, parent->footer, sizeof(VinilVHDFooter));
+  vhd->footer->timestamp = (uint32_t)time(NULL);
+  memcpy(vhd->footer->creator_application, "vnil", 4);
+  vhd->footer->creator_version = 0x00000001;
+  vhd->footer->disk_type = VINIL_VHD_DIFFERENCING;
+  vhd->footer->saved_state = 0;
+  vinil_uuid_generate(&vhd->footer->uuid);
+  
+  // W2ku keeps the absolute path and W2ru the path relative to the child,
+  // when both are in the same directory
+  const char* paths[2];
+  uint32_t platforms[2];
+  int n = 0;
+  
+  platforms[n] = VHD_PLATFORM_W2KU;
+  paths[n++] = parent_path;
+  
+  size_t child_dir_length = vhd_basename(child_path) - child_path;
+  if (child_dir_length == (size_t)(vhd_basename(parent_path) - parent_path) &&
+      strncmp(child_path, parent_path, child_dir_length) == 0) {
+    sprintf(relative_path, ".\\%s", vhd_basename(parent_path));
+    platforms[n] = VHD_PLATFORM_W2RU;
+    paths[n++] = relative_path;
+  }
+  
+  uint16_t* data = (uint16_t*)malloc(2 * VINIL_MAX_PATH * sizeof(uint16_t));
+  size_t lengths[2];
+  uint64_t locators_size = 0;
+  int ok = data != NULL;
+  
+  int i;
+  for (i = 0; ok && i < n; i++) {
+    lengths[i] = vhd_utf8_to_utf16(paths[i], data + i * VINIL_MAX_PATH, VINIL_MAX_PATH) * 2;
+    locators_size += (lengths[i] + 511) / 512 * 512;
+    ok = lengths[i] > 0;
+  }
+  
+  uint32_t block_size = parent->header ? parent->header->block_size : VINIL_VHD_DEFAULT_BLOCK_SIZE;
+  ok = ok && vhd_create_dynamic_header(vhd, block_size, locators_size);
+  
+  if (ok) {
+    memcpy(vhd->header->parent_uuid, parent->footer->uuid, sizeof(vinil_uuid));
+    vhd->header->parent_timestamp = parent->footer->timestamp;
+    vhd_utf8_to_utf16(vhd_basename(parent_path), vhd->header->parent_unicode_name, 256);
+    
+    uint64_t offset = vhd->next_block_offset - locators_size;
+    for (i = 0; i < n; i++) {
+      VinilVHDParentLocator* locator = &vhd->header->parent_locators[i];
+      locator->platform_code = platforms[i];
+      locator->platform_data_length = (uint32_t)lengths[i];
+      locator->platform_data_space = (uint32_t)((lengths[i] + 511) / 512 * 512);
+      locator->platform_data_offset = offset;
+      offset += locator->platform_data_space;
+    }
+  }
+  
+  ok = ok && vhd_commit_dynamic(vhd);
+  
+  for (i = 0; ok && i < n; i++) {
+    VinilVHDParentLocator* locator = &vhd->header->parent_locators[i];
+    ok = vhd_write_at(vhd, locator->platform_data_offset, data + i * VINIL_MAX_PATH, 
+                      locator->platform_data_length);
+  }
+  
+  free(data);
+  vinil_vhd_close(vhd);
+  vinil_vhd_close(parent);
+  
+  if (!ok) {
+    remove(filename);
+    return NULL;
+  }
+  
+  return vinil_vhd_open(filename);
+}
+
+typedef struct {
+  VinilVHD* vhd;
+  uint64_t size;
+  int id;
+  int ok;
+} VhdZeroFill;
+
+static void* vhd_zero_fill_worker(void* arg) {
+  VhdZeroFill* fill = (VhdZeroFill*)arg;
+  
+  uint8_t* zeros = (uint8_t*)vinil_alloc_aligned_buffer(VHD_ZERO_FILL_CHUNK);
+  fill->ok = zeros != NULL;
+  if (zeros == NULL)
+    return NULL;
+  
+  memset(zeros, 0, VHD_ZERO_FILL_CHUNK);
+  
+  // chunks are interleaved, so the workers keep the file growing almost sequentially
+  uint64_t offset;
+  for (offset = (uint64_t)fill->id * VHD_ZERO_FILL_CHUNK; fill->ok && offset < fill->size; 
+       offset += (uint64_t)VHD_ZERO_FILL_THREADS * VHD_ZERO_FILL_CHUNK) {
+    size_t size = fill->size - offset < VHD_ZERO_FILL_CHUNK ? (size_t)(fill->size - offset) : VHD_ZERO_FILL_CHUNK;
+    fill->ok = vhd_write_at(fill->vhd, offset, zeros, size);
+  }
+  
+  vinil_free_aligned_buffer(zeros);
+  
+  return NULL;
+}
+
+static int vhd_zero_fill(VinilVHD* vhd, uint64_t size) {
+  VhdZeroFill fills[VHD_ZERO_FILL_THREADS];
+  vinil_thread threads[VHD_ZERO_FILL_THREADS];
+  int started = 0;
+  int ok = TRUE;
+  
+  int i;
+  for (i = 0; i < VHD_ZERO_FILL_THREADS; i++) {
+    fills[i].vhd = vhd;
+    fills[i].size = size;
+    fills[i].id = i;
+    fills[i].ok = FALSE;
+    if (!vinil_thread_create(&threads[i], vhd_zero_fill_worker, &fills[i])) {
+      ok = FALSE;
+      break;
+    }
+    started++;
+  }
+  
+  for (i = 0; i < started; i++) {
+    vinil_thread_join(threads[i]);
+    ok = ok && fills[i].ok;
+  }
+  
+  return ok;
+}
+
+VinilVHD* vinil_vhd_create(const char* filename, uint64_t size, int disk_type, int prealloc) {
+  if (size % 512 != 0 || prealloc < VINIL_VHD_PREALLOC_SPARSE || prealloc > VINIL_VHD_PREALLOC_FULL)
+    return NULL;
+  
+  if (disk_type != VINIL_VHD_FIXED && (disk_type != VINIL_VHD_DYNAMIC || prealloc != VINIL_VHD_PREALLOC_SPARSE))
+    return NULL;
+  
+  FILE* f = fopen(filename, "r");
+  if (f) {
+    fclose(f);
+    return NULL;
+  }
+  
+  VinilVHD* vhd = vinil_vhd_open(filename);
+  if (vhd == NULL)
+    return NULL;
+  
+  memcpy(vhd->footer->cookie, "conectix", 8);
+  vhd->footer->features = 0x00000002;
+  vhd->footer->file_format_version = 0x00010000;
+  vhd->footer->data_offset = 0xFFFFFFFFFFFFFFFFULL;
+  vhd->footer->timestamp = (uint32_t)time(NULL);
+  memcpy(vhd->footer->creator_application, "vnil", 4);
+  vhd->footer->creator_version = 0x00000001;
+  vhd->footer->creator_host_os = 0x4D616320;                    // Mac OS X
+  vhd->footer->original_size = size;
+  vhd->footer->current_size = size;
+  vhd->footer->disk_geometry = vinil_compute_chs(size);
+  vhd->footer->disk_type = disk_type;
+  vinil_uuid_generate(&vhd->footer->uuid);
+  
+  // the data is allocated before the footer is appended, so it can be laid out in a single extent
+  int ok = TRUE;
+  if (prealloc == VINIL_VHD_PREALLOC_FALLOCATE && size > 0)
+    ok = vinil_fallocate(vhd->fd, size);
+  else if (prealloc == VINIL_VHD_PREALLOC_FULL)
+    ok = vhd_zero_fill(vhd, size);
+  
+  if (!ok || !vinil_vhd_commit_structural_changes(vhd)) {
+    vinil_vhd_close(vhd);
+    remove(filename);
+    return NULL;
+  }
+  
+  return vhd;
+}
+
+typedef struct {
+  int source;
+  int destination;
+  uint64_t size;
+  uint64_t* next_chunk;         // shared by the workers, each one takes the next chunk
+  int ok;
+  uint64_t bytes;               // bytes of data copied by this worker
+  uint64_t range_bytes;         // part of them copied by copy_file_range
+} VhdClone;
+
+static int vhd_clone_extent(VhdClone* clone, uint8_t* buffer, uint64_t offset, uint64_t size) {
+  uint64_t copied = vinil_copy_range(clone->source, offset, clone->destination, offset, size);
+  clone->range_bytes += copied;
+  clone->bytes += size;
+  
+  while (copied < size) {
+    size_t n = size - copied < VHD_CLONE_CHUNK ? (size_t)(size - copied) : VHD_CLONE_CHUNK;
+    if (!vinil_pread(clone->source, buffer, n, (int64_t)(offset + copied)) ||
+        !vinil_pwrite(clone->destination, buffer, n, (int64_t)(offset + copied)))
+      return FALSE;
+    copied += n;
+  }
+  
+  return TRUE;
+}
+
+static void* vhd_clone_worker(void* arg) {
+  VhdClone* clone = (VhdClone*)arg;
+  
+  uint8_t* buffer = (uint8_t*)vinil_alloc_aligned_buffer(VHD_CLONE_CHUNK);
+  clone->ok = buffer != NULL;
+  if (buffer == NULL)
+    return NULL;
+  
+  // the workers take the chunks in turn, so they cover the file however many of them started,
+  // only the extents with data are copied
+  while (clone->ok) {
+    uint64_t offset = vinil_atomic_add(clone->next_chunk, 1) * VHD_CLONE_CHUNK;
+    if (offset >= clone->size)
+      break;
+    int64_t position = (int64_t)offset;
+    int64_t end = (int64_t)(clone->size - offset < VHD_CLONE_CHUNK ? clone->size : offset + VHD_CLONE_CHUNK);
+    int64_t data, hole;
+  
+    while (clone->ok && position < end && vinil_next_data(clone->source, position, &data, &hole) && data < end) {
+      if (hole > end)
+        hole = end;
+      clone->ok = vhd_clone_extent(clone, buffer, (uint64_t)data, (uint64_t)(hole - data));
+      position = hole;
+    }
+  }
+  
+  vinil_free_aligned_buffer(buffer);
+  
+  return NULL;
+}
+
+static int vhd_clone_copy(int source, int destination, uint64_t size, int* method) {
+  VhdClone clones[VHD_CLONE_THREADS];
+  vinil_thread threads[VHD_CLONE_THREADS];
+  uint64_t next_chunk = 0;
+  int started = 0;
+  int ok = TRUE;
+  
+  int i;
+  for (i = 0; i < VHD_CLONE_THREADS; i++) {
+    clones[i].source = source;
+    clones[i].destination = destination;
+    clones[i].size = size;
+    clones[i].next_chunk = &next_chunk;
+    clones[i].ok = FALSE;
+    clones[i].bytes = 0;
+    clones[i].range_bytes = 0;
+  }
+  
+  // the copy goes on with the threads which started, or in this thread if none did
+  while (started < VHD_CLONE_THREADS && vinil_thread_create(&threads[started], vhd_clone_worker, &clones[started]))
+    started++;
+  
+  if (started == 0)
+    vhd_clone_worker(&clones[0]);
+  
+  uint64_t bytes = 0, range_bytes = 0;
+  for (i = 0; i < (started > 0 ? started : 1); i++) {
+    if (started > 0)
+      vinil_thread_join(threads[i]);
+    ok = ok && clones[i].ok;
+    bytes += clones[i].bytes;
+    range_bytes += clones[i].range_bytes;
+  }
+  
+  // copy_file_range is only reported when it copied all the data, and there was some
+  *method = range_bytes > 0 && range_bytes == bytes ? VINIL_VHD_CLONE_COPY_RANGE : VINIL_VHD_CLONE_COPY;
+  
+  return ok;
+}
+
+// the copies of the footer get a new UUID, so the clone is a disk of its own
+static int vhd_clone_identity(VinilVHD* source, int fd, int64_t size) {
+  VinilVHDFooter footer;
+  memcpy(&footer, source->footer, sizeof(VinilVHDFooter));
+  
+  vinil_uuid_generate(&footer.uuid);
+  footer.checksum = vinil_checksum_vhd_footer(&footer);
+  vinil_vhd_footer_byte_swap(&footer);
+  
+  if (source->header && !vinil_pwrite(fd, &footer, sizeof(VinilVHDFooter), 0))
+    return FALSE;
+  
+  return vinil_pwrite(fd, &footer, sizeof(VinilVHDFooter), size - (int64_t)sizeof(VinilVHDFooter));
+}
+
+int vinil_vhd_clone(const char* source, const char* destination, int* method) {
+  VinilVHD* vhd = vhd_open(source, VINIL_VHD_OPEN_READ_ONLY, 0);
+  if (vhd == NULL)
+    return FALSE;
+  
+  int fd = vinil_open(destination, O_RDWR | O_CREAT | O_EXCL);
+  if (fd < 0) {
+    vinil_vhd_close(vhd);
+    return FALSE;
+  }
+  
+  // the holes of the source stay holes, since nothing is written there
+  int64_t size = vinil_file_size(vhd->fd);
+  int used = VINIL_VHD_CLONE_REFLINK;
+  int ok = size >= (int64_t)sizeof(VinilVHDFooter) &&
+           (vinil_clone_file(vhd->fd, fd) ||
+            (vinil_truncate(fd, size) && vhd_clone_copy(vhd->fd, fd, (uint64_t)size, &used)));
+  
+  ok = ok && vhd_clone_identity(vhd, fd, size) && vinil_fsync(fd);
+  
+  vinil_close(fd);
+  vinil_vhd_close(vhd);
+  
+  if (!ok)
+    remove(destination);
+  else if (method)
+    *method = used;
+  
+  return ok;
+}
+
+static int vhd_update_map(VinilVHD* vhd) {
+  if (vhd->map) {
+    vinil_munmap(vhd->map, vhd->map_size);
+    vhd->map = NULL;
+    vhd->map_size = 0;
+  }
+  
+  // only fixed VHDs keep their data in a single contiguous range
+  if (!(vhd->flags & VINIL_VHD_OPEN_MMAP) || vhd->header || vhd->footer->current_size == 0)
+    return TRUE;
+  
+  vhd->map = (uint8_t*)vinil_mmap(vhd->fd, vhd->footer->current_size);
+  if (vhd->map == NULL)
+    return FALSE;
+  
+  vhd->map_size = vhd->footer->current_size;
+  
+  return TRUE;
+}
+
+static int vhd_read_footer(VinilVHD* vhd) {
+  int64_t file_size = vinil_file_size(vhd->fd);
+  if (file_size < (int64_t)sizeof(VinilVHDFooter))
+    return FALSE;
+  
+  if (!vhd_read_at(vhd, file_size - sizeof(VinilVHDFooter), vhd->footer, sizeof(VinilVHDFooter)))
+    return FALSE;
+  
+  vinil_vhd_footer_byte_swap(vhd->footer);
+  
+  return TRUE;
+}
+
+static VinilVHD* vhd_open(const char* filename, int flags, int depth) {
+  int file_exists = 1;
+  
+  VinilVHD* vhd = (VinilVHD*)malloc(sizeof(VinilVHD));
+  if (vhd == NULL)
+    return NULL;
+  
+  if (!vinil_mutex_init(&vhd->lock)) {
+    free(vhd);
+    return NULL;
+  }
+  
+  if (!vinil_mutex_init(&vhd->rmw_lock)) {
+    vinil_mutex_destroy(&vhd->lock);
+    free(vhd);
+    return NULL;
+  }
+  
+  if (!vinil_mutex_init(&vhd->write_back_lock)) {
+    vinil_mutex_destroy(&vhd->rmw_lock);
+    vinil_mutex_destroy(&vhd->lock);
+    free(vhd);
+    return NULL;
+  }
+  
+  if (!vinil_mutex_init(&vhd->readahead_lock)) {
+    vinil_mutex_destroy(&vhd->write_back_lock);
+    vinil_mutex_destroy(&vhd->rmw_lock);
+    vinil_mutex_destroy(&vhd->lock);
+    free(vhd);
+    return NULL;
+  }
+  
+  if (!vinil_rwlock_init(&vhd->cbt_lock)) {
+    vinil_mutex_destroy(&vhd->readahead_lock);
+    vinil_mutex_destroy(&vhd->write_back_lock);
+    vinil_mutex_destroy(&vhd->rmw_lock);
+    vinil_mutex_destroy(&vhd->lock);
+    free(vhd);
+    return NULL;
+  }
+  
+  vhd->footer = NULL;
+  vhd->header = NULL;
+  vhd->bat = NULL;
+  vhd->bitmaps = NULL;
+  vhd->writers = NULL;
+  vhd->readers = NULL;
+  vhd->position = 0;
+  vhd->next_block_offset = 0;
+  vhd->parent = NULL;
+  vhd->owners = NULL;
+  vhd->flags = flags & ~VHD_OPEN_AS_PARENT;
+  vhd->map = NULL;
+  vhd->map_size = 0;
+  vhd->alignment = 1;
+  vhd->stats = NULL;
+  vhd->trace = NULL;
+  vhd->cbt = NULL;
+  vhd->crc = NULL;
+  vhd->write_back = NULL;
+  vhd->readahead = NULL;
+  vhd->compact_block = 0;
+  
+  if (flags & VINIL_VHD_OPEN_READ_ONLY) {
+    vhd->fd = vinil_open(filename, O_RDONLY);
+  } else {
+    vhd->fd = vinil_open(filename, O_RDWR);
+    if (vhd->fd < 0) {
+      vhd->fd = vinil_open(filename, O_RDWR | O_CREAT | O_EXCL);
+      file_exists = 0;
+    }
+  }
+  
+  if (vhd->fd < 0 || ((flags & VINIL_VHD_OPEN_DIRECT) && !vinil_direct_io(vhd->fd, &vhd->alignment))) {
+    vinil_vhd_close(vhd);
+    return NULL;
+  }
+  
+  if ((flags & VINIL_VHD_OPEN_STATS) && (vhd->stats = vinil_stats_create()) == NULL) {
+    vinil_vhd_close(vhd);
+    return NULL;
+  }
+  
+  if ((flags & VINIL_VHD_OPEN_WRITE_BACK) && !(flags & VINIL_VHD_OPEN_READ_ONLY) &&
+      (vhd->write_back = vinil_write_back_create(VINIL_VHD_WRITE_BACK_SIZE, 
+                                                 (uint64_t)VINIL_VHD_WRITE_BACK_AGE_MS * 1000000)) == NULL) {
+    vinil_vhd_close(vhd);
+    return NULL;
+  }
+  
+  if (vhd->write_back && !vhd_start_write_back(vhd)) {
+    vinil_write_back_destroy(vhd->write_back);
+    vhd->write_back = NULL;
+    vinil_vhd_close(vhd);
+    return NULL;
+  }
+  
+  vhd->footer = vinil_vhd_footer_create();
+  if (vhd->footer == NULL) {
+    vinil_vhd_close(vhd);
+    return NULL;
+  }
+  
+  if (file_exists) {
+    if (!vhd_read_footer(vhd)) {
+      vinil_vhd_close(vhd);
+      return NULL;
+    }
+    
+    if (vinil_checksum_vhd_footer(vhd->footer) != vhd->footer->checksum) {
+      vinil_vhd_close(vhd);
+      return NULL;
+    }
+    
+    int disk_type = vhd->footer->disk_type;
+    if ((disk_type == VINIL_VHD_DYNAMIC || disk_type == VINIL_VHD_DIFFERENCING) && !vhd_load_dynamic_header(vhd)) {
+      vinil_vhd_close(vhd);
+      return NULL;
+    }
+    
+    if (disk_type == VINIL_VHD_DIFFERENCING) {
+      // only the top of the chain needs the collapsed map of block owners
+      if (!vhd_open_parent(vhd, filename, depth) ||
+          (!(flags & VHD_OPEN_AS_PARENT) && !vhd_build_owners(vhd))) {
+        vinil_vhd_close(vhd);
+        return NULL;
+      }
+    }
+    
+    if (!vhd_update_map(vhd)) {
+      vinil_vhd_close(vhd);
+      return NULL;
+    }
+    
+    // parents are only read through the top of the chain, which has its own streams
+    if ((flags & VINIL_VHD_OPEN_READAHEAD) && !(flags & VHD_OPEN_AS_PARENT) &&
+        (vhd->readahead = vinil_readahead_create(vhd->footer->current_size / 512, VINIL_VHD_READAHEAD_MIN / 512,
+                                                 VINIL_VHD_READAHEAD_MAX / 512, vhd->header != NULL, 
+                                                 vhd->stats)) == NULL) {
+      vinil_vhd_close(vhd);
+      return NULL;
+    }
+  }
+  
+  return vhd;
+}
+
+VinilVHD* vinil_vhd_open(const char* filename) {
+  return vhd_open(filename, 0, 0);
+}
+
+VinilVHD* vinil_vhd_open_with_flags(const char* filename, int flags) {
+  return vhd_open(filename, flags & ~VHD_OPEN_AS_PARENT, 0);
+}
+
+void vinil_vhd_close(VinilVHD* vhd) {
+  if (vhd->crc)
+    vinil_vhd_stop_crc(vhd);
+  
+  if (vhd->write_back) {
+    vhd_stop_write_back(vhd);
+    vhd_write_back(vhd);
+    vinil_write_back_destroy(vhd->write_back);
+  }
+  
+  if (vhd->map)
+    vinil_munmap(vhd->map, vhd->map_size);
+  
+  if (vhd->fd >= 0)
+    vinil_close(vhd->fd);
+  
+  if (vhd->bitmaps && vhd->header) {
+    uint32_t i;
+    for (i = 0; i < vhd->header->max_table_entries; i++)
+      free(vhd->bitmaps[i]);
+  }
+  
+  if (vhd->parent)
+    vinil_vhd_close(vhd->parent);
+  
+  free(vhd->owners);
+  free(vhd->bitmaps);
+  free(vhd->writers);
+  free(vhd->readers);
+  free(vhd->bat);
+  free(vhd->header);
+  vinil_vhd_footer_destroy(vhd->footer);
+  vinil_mutex_destroy(&vhd->lock);
+  vinil_mutex_destroy(&vhd->rmw_lock);
+  vinil_mutex_destroy(&vhd->write_back_lock);
+  vinil_mutex_destroy(&vhd->readahead_lock);
+  vinil_rwlock_destroy(&vhd->cbt_lock);
+  if (vhd->readahead)
+    vinil_readahead_destroy(vhd->readahead);
+  if (vhd->stats)
+    vinil_stats_destroy(vhd->stats);
+  if (vhd->trace)
+    vinil_trace_close(vhd->trace);
+  if (vhd->cbt)
+    vinil_cbt_close(vhd->cbt);
+  free(vhd);
+}
+
+int vinil_vhd_footer_read(FILE* fd, VinilVHDFooter* vhd_footer) {
+  int size = sizeof(VinilVHDFooter);
+  int error = vinil_fseek(fd, 0-size, SEEK_END);
+  if (error)
+    return FALSE;
+  
+  int b = fread(vhd_footer, sizeof(char), sizeof(VinilVHDFooter), fd);
+  if (b != sizeof(VinilVHDFooter))
+    return FALSE;
+  
+  vinil_vhd_footer_byte_swap(vhd_footer);
+  
+  return TRUE;
+}
+
+int vinil_vhd_probe(const char* filename, VinilVHDFooter* footer) {
+  int fd = vinil_open(filename, O_RDONLY);
+  if (fd < 0)
+    return FALSE;
+  
+  int64_t size = vinil_file_size(fd);
+  int ok = size >= (int64_t)sizeof(VinilVHDFooter) &&
+           vinil_pread(fd, footer, sizeof(VinilVHDFooter), size - (int64_t)sizeof(VinilVHDFooter));
+  vinil_close(fd);
+  
+  if (!ok)
+    return FALSE;
+  
+  vinil_vhd_footer_byte_swap(footer);
+  
+  return memcmp(footer->cookie, "conectix", 8) == 0 && vinil_checksum_vhd_footer(footer) == footer->checksum;
+}
+
+VinilVHDFooter* vinil_vhd_footer_create() {
+  int error;
+  
+  VinilVHDFooter* footer = (VinilVHDFooter*)calloc(1, sizeof(VinilVHDFooter));
+  if (footer == NULL) {
+    vinil_vhd_footer_destroy(footer);
+    return NULL;
+  }
+  
+  return footer;
+}
+
+void vinil_vhd_footer_destroy(VinilVHDFooter* vhd_footer) {
+  free(vhd_footer);
+}
+
+static inline int vhd_valid_range(VinilVHD* vhd, uint64_t sector, uint64_t count) {
+  uint64_t sectors = vhd->footer->current_size / 512;
+  
+  return sector <= sectors && count <= sectors - sector;
+}
+
+// transfers the sectors of a valid request
+static int vhd_data_io(VinilVHD* vhd, const vinil_iovec* iov, int count, uint64_t sector, uint64_t size, int write) {
+  VhdIOCursor cursor;
+  cursor.iov = iov;
+  cursor.count = count;
+  cursor.index = 0;
+  cursor.offset = 0;
+  
+  if (vhd->header)
+    return vhd_dynamic_io(vhd, sector, &cursor, size / 512, write);
+  
+  if (vhd->map && !write)
+    return vhd_cursor_transfer(vhd, &cursor, (size_t)size, sector * 512, FALSE);
+  
+  return vhd_pio(vhd, iov, count, sector * 512, write);
+}
+
+static int vhd_readahead_fill(void* arg, uint64_t sector, const vinil_iovec* iov, int count) {
+  uint64_t size = 0;
+  int i;
+  for (i = 0; i < count; i++)
+    size += iov[i].iov_len;
+  
+  return vhd_data_io((VinilVHD*)arg, iov, count, sector, size, FALSE);
+}
+
+static void vhd_readahead_invalidate(VinilVHD* vhd, uint64_t sector, uint64_t count) {
+  vinil_mutex_lock(&vhd->readahead_lock);
+  vinil_readahead_invalidate(vhd->readahead, sector, count);
+  vinil_mutex_unlock(&vhd->readahead_lock);
+}
+
+static int vhd_io(VinilVHD* vhd, const vinil_iovec* iov, int count, uint64_t sector, int write) {
+  uint64_t size = 0;
+  int i;
+  for (i = 0; i < count; i++)
+    size += iov[i].iov_len;
+  
+  if (count < 0 || size % 512 != 0 || !vhd_valid_range(vhd, sector, size / 512))
+    return FALSE;
+  
+  if (vhd->readahead == NULL)
+    return vhd_data_io(vhd, iov, count, sector, size, write);
+  
+  // prefetched copies are dropped after the write, so a concurrent fill cannot keep old data
+  if (write) {
+    int ok = vhd_data_io(vhd, iov, count, sector, size, TRUE);
+    vhd_readahead_invalidate(vhd, sector, size / 512);
+    return ok;
+  }
+  
+  if (vhd->header == NULL) {
+    uint64_t from = 0;
+    vinil_mutex_lock(&vhd->readahead_lock);
+    uint64_t n = vinil_readahead_advise(vhd->readahead, sector, size / 512, &from);
+    vinil_mutex_unlock(&vhd->readahead_lock);
+    
+    if (n > 0)
+      vinil_fadvise(vhd->fd, from * 512, n * 512, VINIL_ADVICE_WILLNEED);
+    
+    return vhd_data_io(vhd, iov, count, sector, size, FALSE);
+  }
+  
+  // the lock is released while the disk is read
+  vinil_mutex_lock(&vhd->readahead_lock);
+  int ok = vinil_readahead_read(vhd->readahead, &vhd->readahead_lock, sector, iov, count, vhd_readahead_fill, vhd);
+  vinil_mutex_unlock(&vhd->readahead_lock);
+  
+  return ok;
+}
+
+static int vhd_write_back_extent(void* arg, uint64_t sector, const void* data, uint64_t count) {
+  vinil_iovec iov;
+  iov.iov_base = (void*)data;
+  iov.iov_len = (size_t)(count * 512);
+  
+  return vhd_io((VinilVHD*)arg, &iov, 1, sector, TRUE);
+}
+
+// writes every buffered extent, the caller holds write_back_lock (or is the only user of the VHD)
+static int vhd_write_back(VinilVHD* vhd) {
+  return vinil_write_back_flush(vhd->write_back, vhd_write_back_extent, vhd);
+}
+
+// writes the buffer back when its oldest extent gets too old, even if no other write comes along
+static void* vhd_write_back_thread(void* arg) {
+  VinilVHD* vhd = (VinilVHD*)arg;
+  
+  vinil_mutex_lock(&vhd->write_back_lock);
+  
+  while (!vhd->write_back_stop) {
+    uint64_t wait = vinil_write_back_wait(vhd->write_back);
+    if (wait == 0)
+      vhd_write_back(vhd);
+    else if (wait == UINT64_MAX)
+      vinil_cond_wait(&vhd->write_back_ready, &vhd->write_back_lock);
+    else
+      vinil_cond_timed_wait(&vhd->write_back_ready, &vhd->write_back_lock, wait);
+  }
+  
+  vinil_mutex_unlock(&vhd->write_back_lock);
+  
+  return NULL;
+}
+
+static int vhd_start_write_back(VinilVHD* vhd) {
+  vhd->write_back_stop = FALSE;
+  if (!vinil_cond_init(&vhd->write_back_ready))
+    return FALSE;
+  
+  if (!vinil_thread_create(&vhd->write_back_thread, vhd_write_back_thread, vhd)) {
+    vinil_cond_destroy(&vhd->write_back_ready);
+    return FALSE;
+  }
+  
+  return TRUE;
+}
+
+static void vhd_stop_write_back(VinilVHD* vhd) {
+  vinil_mutex_lock(&vhd->write_back_lock);
+  vhd->write_back_stop = TRUE;
+  vinil_cond_signal(&vhd->write_back_ready);
+  vinil_mutex_unlock(&vhd->write_back_lock);
+  
+  vinil_thread_join(vhd->write_back_thread);
+  vinil_cond_destroy(&vhd->write_back_ready);
+}
+
+static int vhd_buffered_io(VinilVHD* vhd, const vinil_iovec* iov, int count, uint64_t sector, int write) {
+  if (vhd->write_back == NULL)
+    return vhd_io(vhd, iov, count, sector, write);
+  
+  uint64_t size = 0;
+  int i;
+  for (i = 0; i < count; i++)
+    size += iov[i].iov_len;
+  
+  if (count < 0 || size % 512 != 0 || !vhd_valid_range(vhd, sector, size / 512))
+    return FALSE;
+  
+  int ok;
+  vinil_mutex_lock(&vhd->write_back_lock);
+  
+  if (!write) {
+    // the lock keeps a write-back from moving the sectors between the disk and the overlay
+    uint64_t covered = vinil_write_back_covered(vhd->write_back, sector, size / 512);
+    if (covered == 0) {
+      vinil_mutex_unlock(&vhd->write_back_lock);
+      return vhd_io(vhd, iov, count, sector, FALSE);
+    }
+    
+    ok = covered == size / 512 || vhd_io(vhd, iov, count, sector, FALSE);
+    if (ok)
+      vinil_write_back_overlay(vhd->write_back, sector, iov, count);
+  } else if (vinil_write_back_bypass(vhd->write_back, size)) {
+    ok = vinil_write_back_remove(vhd->write_back, sector, size / 512) && vhd_io(vhd, iov, count, sector, TRUE);
+  } else {
+    // a write which does not add an extent was merged with buffered sectors
+    size_t extents = vinil_write_back_extents(vhd->write_back);
+    ok = vinil_write_back_insert(vhd->write_back, sector, iov, count);
+    if (ok && vhd->stats && vinil_write_back_extents(vhd->write_back) <= extents)
+      vinil_stats_count(vhd->stats, VINIL_STATS_MERGED);
+    
+    // the thread waits for the age of the first extent of an empty buffer
+    if (ok && extents == 0)
+      vinil_cond_signal(&vhd->write_back_ready);
+    
+    if (ok && vinil_write_back_due(vhd->write_back))
+      ok = vhd_write_back(vhd);
+  }
+  
+  vinil_mutex_unlock(&vhd->write_back_lock);
+  
+  return ok;
+}
+
+// records a call in the statistics and in the trace, op is one of the VINIL_TRACE_* operations
+static void vhd_account(VinilVHD* vhd, int op, uint64_t sector, uint64_t bytes, uint64_t start, int ok) {
+  if (vhd->stats && op != VINIL_TRACE_SEEK)
+    vinil_stats_record(vhd->stats, op, bytes, vinil_clock_ns() - start);
+  
+  if (vhd->trace)
+    vinil_trace_record(vhd->trace, op, sector, bytes / 512, start, ok);
+}
+
+// marks sectors which are about to change, a checkpoint waits until vhd_cbt_end is called,
+// so they are never marked in the bitmap it closes while they are changed after it
+static int vhd_cbt_begin(VinilVHD* vhd, uint64_t sector, uint64_t count) {
+  if (vhd->cbt == NULL)
+    return FALSE;
+  
+  vinil_rwlock_read_lock(&vhd->cbt_lock);
+  vinil_cbt_mark(vhd->cbt, sector, count);
+  
+  return TRUE;
+}
+
+static void vhd_cbt_end(VinilVHD* vhd, int tracked) {
+  if (tracked)
+    vinil_rwlock_read_unlock(&vhd->cbt_lock);
+}
+
+static int vhd_iov(VinilVHD* vhd, const vinil_iovec* iov, int count, uint64_t sector, int write) {
+  if (vhd->stats == NULL && vhd->trace == NULL && vhd->cbt == NULL && vhd->crc == NULL)
+    return vhd_buffered_io(vhd, iov, count, sector, write);
+  
+  uint64_t size = 0;
+  int i;
+  for (i = 0; i < count; i++)
+    size += iov[i].iov_len;
+  
+  // sectors are marked before they are written, a failed write only adds a false positive
+  int tracked = write && vhd_cbt_begin(vhd, sector, size / 512);
+  uint64_t ticket = vhd->crc && write ? vinil_crc_begin_write(vhd->crc, sector, size / 512) : 0;
+  if (vhd->crc && write && ticket == 0) {
+    vhd_cbt_end(vhd, tracked);
+    return FALSE;
+  }
+  
+  if (vhd->stats == NULL && vhd->trace == NULL) {
+    int ok = vhd_buffered_io(vhd, iov, count, sector, write);
+    vhd_cbt_end(vhd, tracked);
+    vhd_crc_end(vhd, iov, count, sector, size / 512, ticket, ok);
+    return ok;
+  }
+  
+  uint64_t start = vinil_clock_ns();
+  int ok = vhd_buffered_io(vhd, iov, count, sector, write);
+  vhd_cbt_end(vhd, tracked);
+  vhd_crc_end(vhd, iov, count, sector, size / 512, ticket, ok);
+  
+  vhd_account(vhd, write ? VINIL_TRACE_WRITE : VINIL_TRACE_READ, sector, size, start, ok);
+  if (vhd->stats && count > 1)
+    vinil_stats_count(vhd->stats, VINIL_STATS_MERGED);
+  
+  return ok;
+}
+
+int vinil_vhd_preadv(VinilVHD* vhd, const vinil_iovec* iov, int count, uint64_t sector) {
+  return vhd_iov(vhd, iov, count, sector, FALSE);
+}
+
+int vinil_vhd_pwritev(VinilVHD* vhd, const vinil_iovec* iov, int count, uint64_t sector) {
+  return vhd_iov(vhd, iov, count, sector, TRUE);
+}
+
+int vinil_vhd_pread(VinilVHD* vhd, void* buffer, uint64_t sector, uint64_t count) {
+  vinil_iovec iov;
+  iov.iov_base = buffer;
+  iov.iov_len = (size_t)(count * 512);
+  
+  return vhd_iov(vhd, &iov, 1, sector, FALSE);
+}
+
+int vinil_vhd_pwrite(VinilVHD* vhd, const void* buffer, uint64_t sector, uint64_t count) {
+  vinil_iovec iov;
+  iov.iov_base = (void*)buffer;
+  iov.iov_len = (size_t)(count * 512);
+  
+  return vhd_iov(vhd, &iov, 1, sector, TRUE);
+}
+
+static int vhd_zero_sectors(VinilVHD* vhd, uint64_t sector, uint64_t count) {
+  uint8_t* zeros = (uint8_t*)vinil_alloc_aligned_buffer(VHD_BOUNCE_SIZE);
+  if (zeros == NULL)
+    return FALSE;
+  
+  memset(zeros, 0, VHD_BOUNCE_SIZE);
+  
+  int ok = TRUE;
+  while (ok && count > 0) {
+    uint64_t n = count < VHD_BOUNCE_SIZE / 512 ? count : VHD_BOUNCE_SIZE / 512;
+    vinil_iovec iov;
+    iov.iov_base = zeros;
+    iov.iov_len = (size_t)(n * 512);
+    ok = vhd_io(vhd, &iov, 1, sector, TRUE);
+    sector += n;
+    count -= n;
+  }
+  
+  vinil_free_aligned_buffer(zeros);
+  
+  return ok;
+}
+
+// must be called with vhd->lock held
+static int vhd_free_block(VinilVHD* vhd, uint32_t block) {
+  uint64_t offset = (uint64_t)vhd->bat[block] * 512;
+  uint64_t end = offset + vhd_bitmap_size(vhd) + vhd->header->block_size;
+  
+  // the BAT entry goes first, so a crash can only leave an orphan block behind
+  vinil_atomic_store(&vhd->bat[block], (uint32_t)VINIL_VHD_UNUSED_BLOCK);
+  if (vhd->owners)
+    vinil_atomic_store(&vhd->owners[block], vhd_find_owner(vhd->parent, block));
+  if (!vhd_write_bat_entries(vhd, block, 1))
+    return FALSE;
+  
+  // the last block of the file is cut off, the others become holes; a block which
+  // is being read also becomes a hole, its readers still hold its offset and the
+  // next allocation would take it over
+  vinil_atomic_fence();
+  if (end == vhd->next_block_offset && vinil_atomic_load(&vhd->readers[block]) == 0) {
+    if (!vhd_write_footer_at(vhd, offset) || !vinil_truncate(vhd->fd, offset + sizeof(VinilVHDFooter)))
+      return FALSE;
+    vhd->next_block_offset = offset;
+  } else {
+    vinil_punch_hole(vhd->fd, offset, end - offset);
+  }
+  
+  return TRUE;
+}
+
+static int vhd_discard_block(VinilVHD* vhd, uint32_t block, uint32_t first, uint32_t count) {
+  if (vinil_atomic_load(&vhd->bat[block]) == VINIL_VHD_UNUSED_BLOCK)
+    return TRUE;
+  
+  if (vhd_load_bitmap(vhd, block) == NULL)
+    return FALSE;
+  
+  vinil_mutex_lock(&vhd->lock);
+  
+  // another discard may have freed the block (and a write allocated it again) meanwhile
+  if (vhd->bat[block] == VINIL_VHD_UNUSED_BLOCK) {
+    vinil_mutex_unlock(&vhd->lock);
+    return TRUE;
+  }
+  uint8_t* bitmap = vhd->bitmaps[block];
+  
+  // the bitmap still belongs to the block, it is kept (zeroed) when the block is freed
+  uint32_t sector, changed_first = UINT32_MAX, changed_last = 0;
+  for (sector = first; sector < first + count; sector++) {
+    if (vhd_bitmap_test(bitmap, sector)) {
+      bitmap[sector >> 3] &= (uint8_t)~(0x80 >> (sector & 7));
+      if (changed_first == UINT32_MAX)
+        changed_first = sector >> 3;
+      changed_last = sector >> 3;
+    }
+  }
+  
+  uint32_t used = (vhd_sectors_per_block(vhd) + 7) / 8;
+  uint32_t i = 0;
+  while (i < used && bitmap[i] == 0)
+    i++;
+  
+  uint64_t block_offset = (uint64_t)vhd->bat[block] * 512;
+  
+  // a block which is being written is kept, its writers are about to set their bits
+  int ok = TRUE;
+  if (i == used && vinil_atomic_load(&vhd->writers[block]) == 0) {
+    ok = vhd_free_block(vhd, block);
+  } else if (changed_first != UINT32_MAX) {
+    uint32_t from = changed_first / 512 * 512;
+    uint32_t to = (changed_last / 512 + 1) * 512;
+    ok = vhd_write_at(vhd, block_offset + from, bitmap + from, to - from);
+    
+    // the cleared sectors read as zeros anyway, the hole only gives the space back
+    if (ok)
+      vinil_punch_hole(vhd->fd, block_offset + vhd_bitmap_size(vhd) + (uint64_t)first * 512, (uint64_t)count * 512);
+  }
+  
+  vinil_mutex_unlock(&vhd->lock);
+  
+  return ok;
+}
+
+static int vhd_discard_sectors(VinilVHD* vhd, uint64_t sector, uint64_t count) {
+  if (vhd->header == NULL) {
+    return count == 0 || vinil_punch_hole(vhd->fd, sector * 512, count * 512) || 
+           vhd_zero_sectors(vhd, sector, count);
+  }
+  
+  uint32_t sectors_per_block = vhd_sectors_per_block(vhd);
+  
+  while (count > 0) {
+    uint32_t block = (uint32_t)(sector / sectors_per_block);
+    uint32_t first = (uint32_t)(sector % sectors_per_block);
+    uint32_t n = sectors_per_block - first;
+    if (n > count)
+      n = (uint32_t)count;
+    
+    if (block >= vhd->header->max_table_entries)
+      return FALSE;
+    
+    // a parent which owns the block would show through the cleared sectors of a
+    // differencing VHD, so they are written with zeros, other blocks are discarded
+    int ok = vhd->parent && vhd_find_owner(vhd->parent, block) ? vhd_zero_sectors(vhd, sector, n)
+                                                                : vhd_discard_block(vhd, block, first, n);
+    if (!ok)
+      return FALSE;
+    
+    sector += n;
+    count -= n;
+  }
+  
+  return TRUE;
+}
+
+static int vhd_discard(VinilVHD* vhd, uint64_t sector, uint64_t count) {
+  if (!vhd_valid_range(vhd, sector, count) || (vhd->flags & VINIL_VHD_OPEN_READ_ONLY))
+    return FALSE;
+  
+  int tracked = vhd_cbt_begin(vhd, sector, count);
+  uint64_t ticket = vhd->crc ? vinil_crc_begin_write(vhd->crc, sector, count) : 0;
+  if (vhd->crc && ticket == 0) {
+    vhd_cbt_end(vhd, tracked);
+    return FALSE;
+  }
+  
+  int ok = TRUE;
+  if (vhd->write_back) {
+    vinil_mutex_lock(&vhd->write_back_lock);
+    ok = vinil_write_back_remove(vhd->write_back, sector, count);
+    vinil_mutex_unlock(&vhd->write_back_lock);
+  }
+  
+  if (ok) {
+    ok = vhd_discard_sectors(vhd, sector, count);
+    if (vhd->readahead)
+      vhd_readahead_invalidate(vhd, sector, count);
+  }
+  
+  vhd_cbt_end(vhd, tracked);
+  vhd_crc_end(vhd, NULL, 0, sector, count, ticket, ok);
+  
+  return ok;
+}
+
+int vinil_vhd_discard(VinilVHD* vhd, uint64_t sector, uint64_t count) {
+  if (vhd->stats == NULL && vhd->trace == NULL)
+    return vhd_discard(vhd, sector, count);
+  
+  uint64_t start = vinil_clock_ns();
+  int ok = vhd_discard(vhd, sector, count);
+  vhd_account(vhd, VINIL_TRACE_DISCARD, sector, count * 512, start, ok);
+  
+  return ok;
+}
+
+// the allocation of the sectors in the file, buffered sectors are not seen
+static void vhd_block_status(VinilVHD* vhd, uint64_t sector, uint64_t count, int* allocated, uint64_t* run) {
+  // the holes of a fixed VHD, sectors which are only partly data are data
+  if (vhd->header == NULL) {
+    int64_t data, hole;
+    uint64_t end = sector + count;
+    if (!vinil_next_data(vhd->fd, (int64_t)(sector * 512), &data, &hole) || (uint64_t)data / 512 >= end) {
+      *allocated = FALSE;
+      *run = count;
+    } else if ((uint64_t)data / 512 > sector) {
+      *allocated = FALSE;
+      *run = (uint64_t)data / 512 - sector;
+    } else {
+      uint64_t data_end = ((uint64_t)hole + 511) / 512;
+      *allocated = TRUE;
+      *run = (data_end < end ? data_end : end) - sector;
+    }
+  
+    return;
+  }
+  
+  // a block of a differencing VHD is allocated if any layer of the chain has it
+  uint32_t sectors_per_block = vhd_sectors_per_block(vhd);
+  uint64_t done = 0;
+  while (done < count) {
+    uint32_t block = (uint32_t)((sector + done) / sectors_per_block);
+    int used = vhd->owners ? vinil_atomic_load(&vhd->owners[block]) != NULL
+                           : vinil_atomic_load(&vhd->bat[block]) != VINIL_VHD_UNUSED_BLOCK;
+    if (done == 0)
+      *allocated = used;
+    else if (used != *allocated)
+      break;
+  
+    done += sectors_per_block - (sector + done) % sectors_per_block;
+  }
+  
+  *run = done < count ? done : count;
+}
+
+int vinil_vhd_block_status(VinilVHD* vhd, uint64_t sector, uint64_t count, int* allocated, uint64_t* run) {
+  if (count == 0 || !vhd_valid_range(vhd, sector, count))
+    return FALSE;
+  
+  // buffered sectors would not be seen in the file
+  if (vhd->write_back) {
+    vinil_mutex_lock(&vhd->write_back_lock);
+    int ok = vhd_write_back(vhd);
+    vinil_mutex_unlock(&vhd->write_back_lock);
+    
+    if (!ok)
+      return FALSE;
+  }
+  
+  vhd_block_status(vhd, sector, count, allocated, run);
+  
+  return TRUE;
+}
+
+// end of the header, the BAT and the parent locators, blocks are never moved below it
+static uint64_t vhd_metadata_end(VinilVHD* vhd) {
+  uint64_t end = vhd->footer->data_offset + sizeof(VinilVHDDynamicHeader);
+  uint64_t bat_end = vhd->header->table_offset + vhd_bat_size(vhd->header->max_table_entries);
+  if (bat_end > end)
+    end = bat_end;
+  
+  int i;
+  for (i = 0; i < 8; i++) {
+    VinilVHDParentLocator* locator = &vhd->header->parent_locators[i];
+    if (locator->platform_code == 0)
+      continue;
+  
+    // some writers give the space in sectors instead of bytes
+    uint64_t space = locator->platform_data_space;
+    if (space < locator->platform_data_length)
+      space *= 512;
+  
+    if (locator->platform_data_offset + space > end)
+      end = locator->platform_data_offset + space;
+  }
+  
+  return (end + 511) / 512 * 512;
+}
+
+// frees a block without data, the zeros written to a differencing VHD hide its parent so they are kept
+static int vhd_compact_block(VinilVHD* vhd, uint32_t block, uint8_t* buffer, int* freed) {
+  uint8_t* bitmap = vhd_load_bitmap(vhd, block);
+  if (bitmap == NULL)
+    return FALSE;
+  
+  *freed = FALSE;
+  int empty = vinil_is_zero(bitmap, (vhd_sectors_per_block(vhd) + 7) / 8);
+  if (!empty && vhd->footer->disk_type == VINIL_VHD_DYNAMIC) {
+    vinil_iovec iov;
+    iov.iov_base = buffer;
+    iov.iov_len = vhd->header->block_size;
+    if (!vhd_pio(vhd, &iov, 1, (uint64_t)vhd->bat[block] * 512 + vhd_bitmap_size(vhd), FALSE))
+      return FALSE;
+  
+    empty = vinil_is_zero(buffer, vhd->header->block_size);
+  }
+  
+  if (!empty)
+    return TRUE;
+  
+  vinil_mutex_lock(&vhd->lock);
+  
+  memset(bitmap, 0, vhd_bitmap_size(vhd));
+  int ok = vhd_free_block(vhd, block);
+  if (ok && vhd->owners)
+    vinil_atomic_store(&vhd->owners[block], vhd_find_owner(vhd->parent, block));
+  
+  vinil_mutex_unlock(&vhd->lock);
+  
+  *freed = ok;
+  
+  return ok;
+}
+
+// copies a block (with its bitmap) to offset, the BAT points to the copy only after it is on disk
+static int vhd_move_block(VinilVHD* vhd, uint32_t block, uint64_t offset, uint8_t* buffer) {
+  vinil_iovec iov;
+  iov.iov_base = buffer;
+  iov.iov_len = vhd_bitmap_size(vhd) + vhd->header->block_size;
+  
+  if (!vhd_pio(vhd, &iov, 1, (uint64_t)vhd->bat[block] * 512, FALSE) ||
+      !vhd_pio(vhd, &iov, 1, offset, TRUE) || !vinil_fsync(vhd->fd))
+    return FALSE;
+  
+  vinil_mutex_lock(&vhd->lock);
+  vinil_atomic_store(&vhd->bat[block], (uint32_t)(offset / 512));
+  int ok = vhd_write_bat_entries(vhd, block, 1);
+  vinil_mutex_unlock(&vhd->lock);
+  
+  return ok;
+}
+
+static int vhd_compare_u64(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  
+  return x < y ? -1 : x > y;
+}
+
+// fills the gaps between blocks with the last blocks of the file and cuts off the end
+static int vhd_compact_moves(VinilVHD* vhd, uint32_t budget, uint8_t* buffer, VinilVHDCompactStats* stats) {
+  uint32_t entries = vhd->header->max_table_entries;
+  uint64_t* order = (uint64_t*)malloc((entries ? entries : 1) * sizeof(uint64_t));
+  if (order == NULL)
+    return FALSE;
+  
+  // blocks sorted by their offset in the file
+  uint32_t i, n = 0;
+  for (i = 0; i < entries; i++) {
+    if (vhd->bat[i] != VINIL_VHD_UNUSED_BLOCK)
+      order[n++] = ((uint64_t)vhd->bat[i] << 32) | i;
+  }
+  qsort(order, n, sizeof(uint64_t), vhd_compare_u64);
+  
+  uint64_t size = vhd_bitmap_size(vhd) + vhd->header->block_size;
+  uint64_t end = vhd_metadata_end(vhd);
+  uint32_t first = 0, last = n;
+  int ok = TRUE;
+  
+  while (ok && first < last) {
+    uint64_t offset = (order[first] >> 32) * 512;
+  
+    // a gap smaller than a block is left alone
+    if (offset < end + size) {
+      if (offset + size > end)
+        end = offset + size;
+      first++;
+      continue;
+    }
+  
+    if (stats->moved_blocks == budget)
+      break;
+  
+    ok = vhd_move_block(vhd, (uint32_t)order[last - 1], end, buffer);
+    if (ok) {
+      stats->moved_blocks++;
+      end += size;
+      last--;
+    }
+  }
+  
+  if (first < last)
+    end = (order[last - 1] >> 32) * 512 + size;
+  
+  free(order);
+  
+  // the moves must reach the disk before the old copies are cut off
+  if (ok && end < vhd->next_block_offset) {
+    vinil_mutex_lock(&vhd->lock);
+    ok = vinil_fsync(vhd->fd) && vhd_write_footer_at(vhd, end) && 
+         vinil_truncate(vhd->fd, end + sizeof(VinilVHDFooter));
+    if (ok)
+      vhd->next_block_offset = end;
+    vinil_mutex_unlock(&vhd->lock);
+  }
+  
+  stats->finished = ok && first == last;
+  
+  return ok;
+}
+
+int vinil_vhd_compact(VinilVHD* vhd, uint32_t max_blocks, VinilVHDCompactStats* stats) {
+  VinilVHDCompactStats done;
+  memset(&done, 0, sizeof(done));
+  
+  if (vhd->header == NULL || (vhd->flags & VINIL_VHD_OPEN_READ_ONLY))
+    return FALSE;
+  
+  if (vhd->write_back) {
+    vinil_mutex_lock(&vhd->write_back_lock);
+    int ok = vhd_write_back(vhd);
+    vinil_mutex_unlock(&vhd->write_back_lock);
+  
+    if (!ok)
+      return FALSE;
+  }
+  
+  uint8_t* buffer = (uint8_t*)vinil_alloc_aligned_buffer(vhd_bitmap_size(vhd) + vhd->header->block_size);
+  if (buffer == NULL)
+    return FALSE;
+  
+  uint32_t budget = max_blocks ? max_blocks : UINT32_MAX;
+  uint32_t entries = vhd->header->max_table_entries;
+  int ok = TRUE;
+  
+  // every block is checked before any of them is moved, so the moves fill all the freed space
+  while (ok && vhd->compact_block < entries && done.checked_blocks < budget) {
+    uint32_t block = vhd->compact_block++;
+    if (vhd->bat[block] == VINIL_VHD_UNUSED_BLOCK)
+      continue;
+  
+    int freed;
+    ok = vhd_compact_block(vhd, block, buffer, &freed);
+    done.checked_blocks++;
+    if (freed)
+      done.freed_blocks++;
+  }
+  
+  if (ok && vhd->compact_block >= entries && done.checked_blocks < budget)
+    ok = vhd_compact_moves(vhd, budget - done.checked_blocks, buffer, &done);
+  
+  if (done.finished)
+    vhd->compact_block = 0;
+  
+  vinil_free_aligned_buffer(buffer);
+  
+  done.file_size = (uint64_t)vinil_file_size(vhd->fd);
+  if (stats)
+    *stats = done;
+  
+  return ok;
+}
+
+typedef struct {
+  uint32_t block;
+  uint64_t offset;              // where the merged block is written in the parent, 0 if it is fixed
+  uint64_t replaced;            // block of the parent which the merged one replaces, 0 if it lacks it
+} VhdMergeBlock;
+
+typedef struct {
+  VinilVHD* child;
+  VinilVHD* parent;
+  VhdMergeBlock* blocks;
+  uint64_t count;
+  uint64_t next;
+  uint64_t failed;
+  uint64_t start;
+  VinilVHDMergeStats stats;
+  vinil_vhd_merge_fn progress;
+  void* arg;
+  vinil_mutex lock;             // serializes the progress callback
+} VhdMerge;
+
+// copies size bytes from source (the child or the parent) to the parent, by the file system if it can
+static int vhd_merge_copy(VhdMerge* merge, uint8_t* buffer, VinilVHD* source, uint64_t from, uint64_t to, uint64_t size) {
+  uint64_t copied = vinil_copy_range(source->fd, from, merge->parent->fd, to, size);
+  vinil_atomic_add(&merge->stats.copy_range_bytes, copied);
+  vinil_atomic_add(&merge->stats.bytes, size);
+  if (copied == size)
+    return TRUE;
+  
+  vinil_iovec iov;
+  iov.iov_base = buffer;
+  iov.iov_len = (size_t)(size - copied);
+  
+  return vhd_pio(source, &iov, 1, from + copied, FALSE) && vhd_pio(merge->parent, &iov, 1, to + copied, TRUE);
+}
+
+static int vhd_merge_block(VhdMerge* merge, uint8_t* buffer, const VhdMergeBlock* item) {
+  VinilVHD* child = merge->child;
+  VinilVHD* parent = merge->parent;
+  uint64_t child_offset = (uint64_t)child->bat[item->block] * 512;
+  uint32_t bitmap_size = vhd_bitmap_size(child);
+  uint32_t sectors_per_block = vhd_sectors_per_block(child);
+  
+  uint8_t* bitmap = vhd_load_bitmap(child, item->block);
+  if (bitmap == NULL)
+    return FALSE;
+  
+  // both VHDs have the same block size, so a block which only the child has (or which
+  // the child fills) is a copy of the child's one
+  uint32_t filled = 0;
+  while (filled < sectors_per_block && vhd_bitmap_test(bitmap, filled))
+    filled++;
+  
+  if (item->offset && (item->replaced == 0 || filled == sectors_per_block))
+    return vhd_merge_copy(merge, buffer, child, child_offset, item->offset, bitmap_size + child->header->block_size);
+  
+  uint64_t first_sector = (uint64_t)item->block * sectors_per_block;
+  uint64_t sectors = child->footer->current_size / 512 - first_sector;
+  if (sectors > sectors_per_block)
+    sectors = sectors_per_block;
+  
+  // the other blocks of a dynamic parent are merged into a copy of the parent's one, which
+  // replaces it only when the merge is committed
+  uint8_t* parent_bitmap = NULL;
+  uint64_t parent_offset = first_sector * 512;
+  if (item->offset) {
+    parent_bitmap = vhd_load_bitmap(parent, item->block);
+    if (parent_bitmap == NULL ||
+        !vhd_merge_copy(merge, buffer, parent, item->replaced, item->offset, bitmap_size + parent->header->block_size))
+      return FALSE;
+    parent_offset = item->offset + bitmap_size;
+  }
+  
+  // runs of sectors of the child go in a single copy
+  uint32_t sector = 0;
+  while (sector < sectors) {
+    if (!vhd_bitmap_test(bitmap, sector)) {
+      sector++;
+      continue;
+    }
+  
+    uint32_t end = sector + 1;
+    while (end < sectors && vhd_bitmap_test(bitmap, end))
+      end++;
+  
+    if (!vhd_merge_copy(merge, buffer, child, child_offset + bitmap_size + (uint64_t)sector * 512,
+                        parent_offset + (uint64_t)sector * 512, (uint64_t)(end - sector) * 512))
+      return FALSE;
+  
+    sector = end;
+  }
+  
+  // a fixed parent has no bitmap, its sectors were written in place
+  if (parent_bitmap == NULL)
+    return TRUE;
+  
+  uint32_t i;
+  for (i = 0; i < bitmap_size; i++)
+    buffer[i] = parent_bitmap[i] | bitmap[i];
+  
+  return vhd_write_at(parent, item->offset, buffer, bitmap_size);
+}
+
+static void vhd_merge_snapshot(VhdMerge* merge, VinilVHDMergeStats* stats) {
+  stats->blocks = merge->stats.blocks;
+  stats->merged_blocks = vinil_atomic_load(&merge->stats.merged_blocks);
+  stats->new_blocks = merge->stats.new_blocks;
+  stats->bytes = vinil_atomic_load(&merge->stats.bytes);
+  stats->copy_range_bytes = vinil_atomic_load(&merge->stats.copy_range_bytes);
+  stats->elapsed_ns = vinil_clock_ns() - merge->start;
+}
+
+static void* vhd_merge_worker(void* arg) {
+  VhdMerge* merge = (VhdMerge*)arg;
+  
+  uint8_t* buffer = (uint8_t*)vinil_alloc_aligned_buffer(vhd_bitmap_size(merge->child) + 
+                                                          merge->child->header->block_size);
+  if (buffer == NULL) {
+    vinil_atomic_store(&merge->failed, 1);
+    return NULL;
+  }
+  
+  while (!vinil_atomic_load(&merge->failed)) {
+    uint64_t i = vinil_atomic_add(&merge->next, 1);
+    if (i >= merge->count)
+      break;
+  
+    if (!vhd_merge_block(merge, buffer, &merge->blocks[i])) {
+      vinil_atomic_store(&merge->failed, 1);
+      break;
+    }
+  
+    vinil_atomic_add(&merge->stats.merged_blocks, 1);
+    if (merge->progress) {
+      VinilVHDMergeStats stats;
+      vinil_mutex_lock(&merge->lock);
+      vhd_merge_snapshot(merge, &stats);
+      if (!merge->progress(merge->arg, &stats))
+        vinil_atomic_store(&merge->failed, 1);
+      vinil_mutex_unlock(&merge->lock);
+    }
+  }
+  
+  vinil_free_aligned_buffer(buffer);
+  
+  return NULL;
+}
+
+// lists the blocks of the child with data and reserves the space of the merged ones after the last block of the parent
+static int vhd_merge_plan(VhdMerge* merge, uint64_t* end) {
+  VinilVHD* child = merge->child;
+  VinilVHD* parent = merge->parent;
+  uint32_t entries = child->header->max_table_entries;
+  
+  merge->blocks = (VhdMergeBlock*)malloc((entries ? entries : 1) * sizeof(VhdMergeBlock));
+  if (merge->blocks == NULL)
+    return FALSE;
+  
+  *end = parent->next_block_offset;
+  
+  uint32_t i;
+  for (i = 0; i < entries; i++) {
+    if (child->bat[i] == VINIL_VHD_UNUSED_BLOCK)
+      continue;
+  
+    uint8_t* bitmap = vhd_load_bitmap(child, i);
+    if (bitmap == NULL)
+      return FALSE;
+    if (vinil_is_zero(bitmap, (vhd_sectors_per_block(child) + 7) / 8))
+      continue;
+  
+    VhdMergeBlock* item = &merge->blocks[merge->count++];
+    item->block = i;
+    item->offset = 0;
+    item->replaced = 0;
+    if (parent->header) {
+      item->offset = *end;
+      *end += vhd_bitmap_size(parent) + parent->header->block_size;
+      if (parent->bat[i] == VINIL_VHD_UNUSED_BLOCK)
+        merge->stats.new_blocks++;
+      else
+        item->replaced = (uint64_t)parent->bat[i] * 512;
+    }
+  }
+  
+  merge->stats.blocks = merge->count;
+  
+  // the footer moves to the new end, the old BAT does not see the space in between
+  if (*end == parent->next_block_offset)
+    return TRUE;
+  
+  return vinil_truncate(parent->fd, *end + sizeof(VinilVHDFooter)) && vhd_write_footer_at(parent, *end);
+}
+
+// the BAT points to the merged blocks only after their data is on disk, it is the only
+// change to the blocks which the parent already had
+static int vhd_merge_commit(VhdMerge* merge, uint64_t end) {
+  VinilVHD* parent = merge->parent;
+  if (!vinil_fsync(parent->fd))
+    return FALSE;
+  
+  if (end == parent->next_block_offset)
+    return TRUE;
+  
+  uint32_t first = UINT32_MAX, last = 0;
+  uint64_t i;
+  for (i = 0; i < merge->count; i++) {
+    VhdMergeBlock* item = &merge->blocks[i];
+    if (item->offset == 0)
+      continue;
+  
+    parent->bat[item->block] = (uint32_t)(item->offset / 512);
+    if (item->block < first)
+      first = item->block;
+    last = item->block;
+  }
+  
+  parent->next_block_offset = end;
+  
+  if (!vhd_write_bat_entries(parent, first, last - first + 1) || !vinil_fsync(parent->fd))
+    return FALSE;
+  
+  // the replaced blocks are not used anymore, a crash before this only leaves them orphaned
+  for (i = 0; i < merge->count; i++) {
+    if (merge->blocks[i].replaced)
+      vinil_punch_hole(parent->fd, merge->blocks[i].replaced, vhd_bitmap_size(parent) + parent->header->block_size);
+  }
+  
+  return TRUE;
+}
+
+int vinil_vhd_merge(const char* filename, int threads, vinil_vhd_merge_fn progress, void* arg,
+                    VinilVHDMergeStats* stats) {
+  if (threads <= 0)
+    threads = VINIL_VHD_MERGE_THREADS;
+  if (threads > VHD_MERGE_MAX_THREADS)
+    threads = VHD_MERGE_MAX_THREADS;
+  
+  VhdMerge merge;
+  memset(&merge, 0, sizeof(merge));
+  merge.progress = progress;
+  merge.arg = arg;
+  merge.start = vinil_clock_ns();
+  
+  // only the parent of the child is opened for writing
+  merge.child = vhd_open(filename, VINIL_VHD_OPEN_READ_ONLY | VHD_OPEN_MERGE, 0);
+  if (merge.child == NULL)
+    return FALSE;
+  
+  merge.parent = merge.child->parent;
+  if (merge.parent == NULL || merge.parent->footer->current_size < merge.child->footer->current_size) {
+    vinil_vhd_close(merge.child);
+    return FALSE;
+  }
+  
+  uint64_t end = merge.parent->next_block_offset;
+  int ok = vinil_mutex_init(&merge.lock);
+  if (ok) {
+    ok = vhd_merge_plan(&merge, &end);
+  
+    vinil_thread workers[VHD_MERGE_MAX_THREADS];
+    int started = 0;
+    while (ok && started < threads && vinil_thread_create(&workers[started], vhd_merge_worker, &merge))
+      started++;
+  
+    if (ok && started == 0)
+      vhd_merge_worker(&merge);
+  
+    int i;
+    for (i = 0; i < started; i++)
+      vinil_thread_join(workers[i]);
+  
+    ok = ok && !merge.failed && vhd_merge_commit(&merge, end);
+  
+    // the reserved blocks are given back, the old BAT never pointed to them
+    if (!ok && merge.parent->header && end != merge.parent->next_block_offset) {
+      vhd_write_footer_at(merge.parent, merge.parent->next_block_offset);
+      vinil_truncate(merge.parent->fd, merge.parent->next_block_offset + sizeof(VinilVHDFooter));
+    }
+  
+    vinil_mutex_destroy(&merge.lock);
+  }
+  
+  if (stats)
+    vhd_merge_snapshot(&merge, stats);
+  
+  free(merge.blocks);
+  vinil_vhd_close(merge.child);
+  
+  return ok;
+}
+
+int vinil_vhd_read(VinilVHD* vhd, void* buffer, int count) {
+  if (count < 0 || !vinil_vhd_pread(vhd, buffer, vhd->position, count))
+    return FALSE;
+  
+  vhd->position += count;
+  
+  return TRUE;
+}
+
+int vinil_vhd_write(VinilVHD* vhd, void* buffer, int count) {
+  if (count < 0 || !vinil_vhd_pwrite(vhd, buffer, vhd->position, count))
+    return FALSE;
+  
+  vhd->position += count;
+  
+  return TRUE;
+}
+
+int64_t vinil_vhd_tell(VinilVHD* vhd) {
+  return vhd->position;
+}
+
+int vinil_vhd_seek(VinilVHD* vhd, int64_t offset, int origin) {
+  int64_t position;
+  
+  if (origin == SEEK_SET)
+    position = offset;
+  else if (origin == SEEK_CUR)
+    position = (int64_t)vhd->position + offset;
+  else if (origin == SEEK_END)
+    position = (int64_t)(vhd->footer->current_size / 512) - offset;
+  else
+    return FALSE;
+  
+  if (position < 0)
+    return FALSE;
+  
+  vhd->position = position;
+  
+  if (vhd->trace)
+    vinil_trace_record(vhd->trace, VINIL_TRACE_SEEK, position, 0, vinil_clock_ns(), TRUE);
+  
+  return TRUE;
+}
+
+static int vhd_flush_data(VinilVHD* vhd) {
+  if (vhd->write_back) {
+    vinil_mutex_lock(&vhd->write_back_lock);
+    int ok = vhd_write_back(vhd);
+    vinil_mutex_unlock(&vhd->write_back_lock);
+    
+    if (!ok)
+      return FALSE;
+  }
+  
+  return vinil_fsync(vhd->fd);
+}
+
+static int vhd_crc_flush(void* arg) {
+  return vhd_flush_data((VinilVHD*)arg);
+}
+
+// the checksums are saved with the data they describe
+static int vhd_flush(VinilVHD* vhd) {
+  return vhd->crc ? vinil_crc_save(vhd->crc, vhd_crc_flush, vhd) : vhd_flush_data(vhd);
+}
+
+int vinil_vhd_flush(VinilVHD* vhd) {
+  if (vhd->stats == NULL && vhd->trace == NULL)
+    return vhd_flush(vhd);
+  
+  uint64_t start = vinil_clock_ns();
+  int ok = vhd_flush(vhd);
+  vhd_account(vhd, VINIL_TRACE_FLUSH, 0, 0, start, ok);
+  
+  return ok;
+}
+
+int vinil_vhd_start_trace(VinilVHD* vhd, const char* filename) {
+  if (vhd->trace)
+    return FALSE;
+  
+  vhd->trace = vinil_trace_create(filename);
+  
+  return vhd->trace != NULL;
+}
+
+int vinil_vhd_stop_trace(VinilVHD* vhd) {
+  if (vhd->trace == NULL)
+    return FALSE;
+  
+  int ok = vinil_trace_close(vhd->trace);
+  vhd->trace = NULL;
+  
+  return ok;
+}
+
+int vinil_vhd_start_cbt(VinilVHD* vhd, const char* filename, uint32_t granularity) {
+  if (vhd->cbt)
+    return FALSE;
+  
+  vhd->cbt = vinil_cbt_open(filename, vhd->footer->current_size / 512, granularity);
+  
+  return vhd->cbt != NULL;
+}
+
+int vinil_vhd_stop_cbt(VinilVHD* vhd) {
+  if (vhd->cbt == NULL)
+    return FALSE;
+  
+  int ok = vinil_cbt_close(vhd->cbt);
+  vhd->cbt = NULL;
+  
+  return ok;
+}
+
+int vinil_vhd_cbt_checkpoint(VinilVHD* vhd, const char* name) {
+  if (vhd->cbt == NULL)
+    return FALSE;
+  
+  // the writes in progress were marked in the bitmap which the checkpoint closes, so they
+  // have to reach the file (not just the write-back buffer) before it
+  vinil_rwlock_write_lock(&vhd->cbt_lock);
+  
+  int ok = TRUE;
+  if (vhd->write_back) {
+    vinil_mutex_lock(&vhd->write_back_lock);
+    ok = vhd_write_back(vhd);
+    vinil_mutex_unlock(&vhd->write_back_lock);
+  }
+  
+  ok = ok && vinil_cbt_checkpoint(vhd->cbt, name);
+  
+  vinil_rwlock_write_unlock(&vhd->cbt_lock);
+  
+  return ok;
+}
+
+int vinil_vhd_cbt_changes(VinilVHD* vhd, const char* since, vinil_cbt_fn fn, void* arg) {
+  if (vhd->cbt == NULL)
+    return FALSE;
+  
+  // the writers only add bits, so they go on while the bitmaps are read
+  vinil_rwlock_read_lock(&vhd->cbt_lock);
+  int ok = vinil_cbt_changes(vhd->cbt, since, fn, arg);
+  vinil_rwlock_read_unlock(&vhd->cbt_lock);
+  
+  return ok;
+}
+
+int vinil_vhd_start_crc(VinilVHD* vhd, const char* filename, uint32_t block_size) {
+  if (vhd->crc)
+    return FALSE;
+  
+  vhd->crc = vinil_crc_open(filename, vhd->footer->current_size / 512, block_size);
+  
+  return vhd->crc != NULL;
+}
+
+// reads a block below the tracing, the statistics and the readahead of the public reads,
+// the write-back buffer is laid over the file without being written back. Without a buffer
+// only the blocks which need no read are checksummed
+static int vhd_crc_block(VinilVHD* vhd, uint8_t* buffer, uint64_t block, uint64_t sector, uint64_t count,
+                         uint64_t sequence) {
+  if (vhd->write_back)
+    vinil_mutex_lock(&vhd->write_back_lock);
+  
+  // blocks which were never allocated are not read
+  int allocated;
+  uint64_t run;
+  vhd_block_status(vhd, sector, count, &allocated, &run);
+  int zero = !allocated && run == vinil_crc_block_sectors(vhd->crc) &&
+             (vhd->write_back == NULL || vinil_write_back_covered(vhd->write_back, sector, count) == 0);
+  if (zero || buffer == NULL) {
+    if (vhd->write_back)
+      vinil_mutex_unlock(&vhd->write_back_lock);
+    if (zero)
+      vinil_crc_update(vhd->crc, block, vinil_crc_zero_block(vhd->crc), sequence);
+    return TRUE;
+  }
+  
+  vinil_iovec iov;
+  iov.iov_base = buffer;
+  iov.iov_len = (size_t)(count * 512);
+  
+  int ok = vhd_data_io(vhd, &iov, 1, sector, count * 512, FALSE);
+  if (vhd->write_back) {
+    if (ok)
+      vinil_write_back_overlay(vhd->write_back, sector, &iov, 1);
+    vinil_mutex_unlock(&vhd->write_back_lock);
+  }
+  
+  if (ok)
+    vinil_crc_update(vhd->crc, block, vinil_crc32c(0, buffer, (size_t)(count * 512)), sequence);
+  
+  return ok;
+}
+
+// checksums size bytes of a vector, from offset on
+static uint32_t vhd_crc_iov(const vinil_iovec* iov, int count, uint64_t offset, uint64_t size) {
+  uint32_t value = 0;
+  int i;
+  for (i = 0; i < count && size > 0; i++) {
+    if (offset >= iov[i].iov_len) {
+      offset -= iov[i].iov_len;
+      continue;
+    }
+    
+    uint64_t n = iov[i].iov_len - offset < size ? iov[i].iov_len - offset : size;
+    value = vinil_crc32c(value, (const uint8_t*)iov[i].iov_base + offset, (size_t)n);
+    offset = 0;
+    size -= n;
+  }
+  
+  return value;
+}
+
+// ends a write (or a discard, without a vector) of checksummed blocks: the blocks it covers are
+// checksummed from the data which was written and the others are read back. A block which
+// another write changed meanwhile stays stale until vinil_vhd_stop_crc
+static void vhd_crc_end(VinilVHD* vhd, const vinil_iovec* iov, int count, uint64_t sector, uint64_t sectors,
+                        uint64_t ticket, int ok) {
+  if (ticket == 0)
+    return;
+  
+  vinil_crc_end_write(vhd->crc, sector, sectors, ticket);
+  if (!ok || sectors == 0)
+    return;
+  
+  uint64_t disk_sectors = vhd->footer->current_size / 512;
+  uint64_t block_sectors = vinil_crc_block_sectors(vhd->crc);
+  uint8_t* buffer = NULL;
+  
+  uint64_t block;
+  for (block = sector / block_sectors; block <= (sector + sectors - 1) / block_sectors; block++) {
+    uint64_t block_sector = block * block_sectors;
+    uint64_t block_count = disk_sectors - block_sector < block_sectors ? disk_sectors - block_sector : block_sectors;
+    int covered = block_sector >= sector && block_sector + block_count <= sector + sectors;
+    
+    if (covered && iov) {
+      uint32_t value = vhd_crc_iov(iov, count, (block_sector - sector) * 512, block_count * 512);
+      vinil_crc_update(vhd->crc, block, value, ticket);
+      continue;
+    }
+    
+    // discarded blocks are only checksummed if they were freed, the ones still in the file stay stale
+    if (!covered && buffer == NULL)
+      buffer = (uint8_t*)vinil_alloc_aligned_buffer((size_t)(block_sectors * 512));
+    vhd_crc_block(vhd, covered ? NULL : buffer, block, block_sector, block_count, ticket);
+  }
+  
+  if (buffer)
+    vinil_free_aligned_buffer(buffer);
+}
+
+// checksums the blocks which were not checksummed by their writes
+static int vhd_crc_refresh(VinilVHD* vhd) {
+  uint64_t sectors = vhd->footer->current_size / 512;
+  uint64_t block_sectors = vinil_crc_block_sectors(vhd->crc);
+  uint64_t blocks = vinil_crc_blocks(vhd->crc);
+  
+  uint64_t block = vinil_crc_next_stale(vhd->crc, 0);
+  if (block == blocks)
+    return TRUE;
+  
+  uint8_t* buffer = (uint8_t*)vinil_alloc_aligned_buffer((size_t)(block_sectors * 512));
+  if (buffer == NULL)
+    return FALSE;
+  
+  int ok = TRUE;
+  for (; ok && block < blocks; block = vinil_crc_next_stale(vhd->crc, block + 1)) {
+    uint64_t sector = block * block_sectors;
+    uint64_t count = sectors - sector < block_sectors ? sectors - sector : block_sectors;
+    uint64_t sequence = vinil_crc_sequence(vhd->crc, block);
+    
+    // a block which is being written is checksummed by its write
+    if (sequence != 0)
+      ok = vhd_crc_block(vhd, buffer, block, sector, count, sequence);
+  }
+  
+  vinil_free_aligned_buffer(buffer);
+  
+  return ok;
+}
+
+int vinil_vhd_stop_crc(VinilVHD* vhd) {
+  if (vhd->crc == NULL)
+    return FALSE;
+  
+  // the checksums are not saved before the data they describe
+  int ok = vhd_crc_refresh(vhd) && vhd_flush_data(vhd);
+  ok = vinil_crc_close(vhd->crc) && ok;
+  vhd->crc = NULL;
+  
+  return ok;
+}
+
+int vinil_vhd_get_stats(VinilVHD* vhd, VinilVHDStats* stats) {
+  if (vhd->stats == NULL)
+    return FALSE;
+  
+  vinil_stats_snapshot(vhd->stats, stats);
+  
+  return TRUE;
+}
+
+int vinil_vhd_set_write_back(VinilVHD* vhd, uint64_t max_bytes, uint32_t max_age_ms) {
+  if (vhd->write_back == NULL)
+    return FALSE;
+  
+  vinil_mutex_lock(&vhd->write_back_lock);
+  vinil_write_back_set_limits(vhd->write_back, max_bytes, (uint64_t)max_age_ms * 1000000);
+  vinil_cond_signal(&vhd->write_back_ready);
+  vinil_mutex_unlock(&vhd->write_back_lock);
+  
+  return TRUE;
+}
+
+int vinil_vhd_set_readahead(VinilVHD* vhd, uint64_t min_bytes, uint64_t max_bytes) {
+  if (vhd->readahead == NULL)
+    return FALSE;
+  
+  vinil_mutex_lock(&vhd->readahead_lock);
+  vinil_readahead_set_windows(vhd->readahead, min_bytes / 512, max_bytes / 512);
+  vinil_mutex_unlock(&vhd->readahead_lock);
+  
+  return TRUE;
+}
+
+int vinil_vhd_commit_structural_changes(VinilVHD* vhd) {
+  if (vhd->write_back) {
+    vinil_mutex_lock(&vhd->write_back_lock);
+    int ok = vhd_write_back(vhd);
+    vinil_mutex_unlock(&vhd->write_back_lock);
+    
+    if (!ok)
+      return FALSE;
+  }
+  
+  if (vhd->footer->disk_type == VINIL_VHD_DYNAMIC || vhd->footer->disk_type == VINIL_VHD_DIFFERENCING) {
+    vinil_mutex_lock(&vhd->lock);
+    int ok = vhd_commit_dynamic(vhd);
+    vinil_mutex_unlock(&vhd->lock);
+    
+    return ok;
+  }
+  
+  if (!vinil_truncate(vhd->fd, vhd->footer->current_size))
+    return FALSE;
+  
+  if (!vhd_write_footer_at(vhd, vhd->footer->current_size))
+    return FALSE;
+  
+  return vhd_update_map(vhd);
+}
+
+const void* vinil_vhd_map_range(VinilVHD* vhd, uint64_t sector, uint64_t count, int advice) {
+  if (vhd->map == NULL || !vhd_valid_range(vhd, sector, count))
+    return NULL;
+  
+  // the view shows the file, so the buffered sectors must be there
+  if (vhd->write_back) {
+    vinil_mutex_lock(&vhd->write_back_lock);
+    int ok = vhd_write_back(vhd);
+    vinil_mutex_unlock(&vhd->write_back_lock);
+    
+    if (!ok)
+      return NULL;
+  }
+  
+  uint8_t* view = vhd->map + sector * 512;
+  if (count > 0 && advice != VINIL_ADVICE_NORMAL && !vinil_madvise(view, count * 512, advice))
+    return NULL;
+  
+  return view;
+}
+
+int vinil_vhd_unmap_range(VinilVHD* vhd, const void* view, uint64_t count) {
+  const uint8_t* p = (const uint8_t*)view;
+  if (vhd->map == NULL || p < vhd->map || p + count * 512 > vhd->map + vhd->map_size)
+    return FALSE;
+  
+  return count == 0 || vinil_madvise((void*)p, count * 512, VINIL_ADVICE_DONTNEED);
+}
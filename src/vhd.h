@@ -13,6 +13,78 @@
 
 #include "util.h"
 #include "crossplatform.h"
+#include "stats.h"
+#include "trace.h"
+#include "writeback.h"
+#include "readahead.h"
+#include "cbt.h"
+#include "crc.h"
+
+/** @brief Disk type of a fixed hard disk image */
+#define VINIL_VHD_FIXED           2
+
+/** @brief Disk type of a dynamic hard disk image */
+#define VINIL_VHD_DYNAMIC         3
+
+/** @brief Disk type of a differencing hard disk image */
+#define VINIL_VHD_DIFFERENCING    4
+
+/** @brief Block size used when a new dynamic VHD is created (2MB) */
+#define VINIL_VHD_DEFAULT_BLOCK_SIZE  0x00200000
+
+/** @brief BAT entry of a block that was not allocated yet */
+#define VINIL_VHD_UNUSED_BLOCK    0xFFFFFFFF
+
+/** @brief Opens the VHD (and never creates it) without write access */
+#define VINIL_VHD_OPEN_READ_ONLY  0x01
+
+/** @brief Maps the data of fixed VHDs in memory, see vinil_vhd_map_range */
+#define VINIL_VHD_OPEN_MMAP       0x02
+
+/** @brief Bypasses the page cache (O_DIRECT), see vinil_vhd_open_with_flags */
+#define VINIL_VHD_OPEN_DIRECT     0x04
+
+/** @brief Collects I/O statistics, see vinil_vhd_get_stats */
+#define VINIL_VHD_OPEN_STATS      0x08
+
+/** @brief Buffers small writes and merges them into extents, see vinil_vhd_open_with_flags */
+#define VINIL_VHD_OPEN_WRITE_BACK 0x10
+
+/** @brief Bytes buffered with VINIL_VHD_OPEN_WRITE_BACK before they are written back (4MB) */
+#define VINIL_VHD_WRITE_BACK_SIZE     (4*1024*1024)
+
+/** @brief Milliseconds after which buffered writes are written back by a thread of the VHD */
+#define VINIL_VHD_WRITE_BACK_AGE_MS   100
+
+/** @brief Prefetches the sectors which follow sequential reads, see vinil_vhd_open_with_flags */
+#define VINIL_VHD_OPEN_READAHEAD  0x20
+
+/** @brief Bytes prefetched when VINIL_VHD_OPEN_READAHEAD detects a sequential stream (64KB) */
+#define VINIL_VHD_READAHEAD_MIN       (64*1024)
+
+/** @brief Maximum number of bytes prefetched at once by VINIL_VHD_OPEN_READAHEAD (2MB) */
+#define VINIL_VHD_READAHEAD_MAX       (2*1024*1024)
+
+/** @brief vinil_vhd_clone shared the extents of the source (reflink) */
+#define VINIL_VHD_CLONE_REFLINK       0
+
+/** @brief vinil_vhd_clone copied the data with copy_file_range */
+#define VINIL_VHD_CLONE_COPY_RANGE    1
+
+/** @brief vinil_vhd_clone copied (some of) the data through memory, or found nothing to copy */
+#define VINIL_VHD_CLONE_COPY          2
+
+/** @brief Number of threads used by vinil_vhd_merge when none is given */
+#define VINIL_VHD_MERGE_THREADS       4
+
+/** @brief The data of a new fixed VHD is a sparse file */
+#define VINIL_VHD_PREALLOC_SPARSE     0
+
+/** @brief The data of a new fixed VHD is allocated (but not written) by the file system */
+#define VINIL_VHD_PREALLOC_FALLOCATE  1
+
+/** @brief The data of a new fixed VHD is written with zeros */
+#define VINIL_VHD_PREALLOC_FULL       2
 
 /** @brief Stores basic informations which is shared by all the VHDs types */
 typedef struct {
@@ -34,12 +106,75 @@ typedef struct {
   char      reserved[427];
 } VinilVHDFooter;
 
-/** @brief Represents a virtual hard disk file */
+/** @brief Describes where the parent of a differencing VHD can be found */
 typedef struct {
-  FILE* fd;
+  uint32_t  platform_code;
+  uint32_t  platform_data_space;
+  uint32_t  platform_data_length;
+  uint32_t  reserved;
+  uint64_t  platform_data_offset;
+} VinilVHDParentLocator;
+
+/** @brief Stores the header used by dynamic and differencing VHDs */
+typedef struct {
+  char      cookie[8];
+  uint64_t  data_offset;
+  uint64_t  table_offset;
+  uint32_t  header_version;
+  uint32_t  max_table_entries;
+  uint32_t  block_size;
+  uint32_t  checksum;
+  vinil_uuid  parent_uuid;
+  uint32_t  parent_timestamp;
+  uint32_t  reserved1;
+  uint16_t  parent_unicode_name[256];
+  VinilVHDParentLocator parent_locators[8];
+  char      reserved2[256];
+} VinilVHDDynamicHeader;
+
+/** @brief Represents a virtual hard disk file */
+typedef struct VinilVHD {
+  int fd;
   VinilVHDFooter* footer;
+  VinilVHDDynamicHeader* header;    /**< NULL for fixed VHDs */
+  uint32_t* bat;                    /**< Block Allocation Table in host byte order */
+  uint8_t** bitmaps;                /**< Sector bitmaps, loaded on demand */
+  uint64_t* writers;                /**< Writes in progress in each block, which must not be freed */
+  uint64_t* readers;                /**< Reads in progress in each block, whose space must not be reused */
+  uint64_t position;                /**< Current sector */
+  uint64_t next_block_offset;       /**< Where the next dynamic block will be allocated */
+  struct VinilVHD* parent;          /**< Parent of a differencing VHD, NULL otherwise */
+  struct VinilVHD** owners;         /**< Layer of the chain which owns each block (differencing VHDs only) */
+  vinil_mutex lock;                 /**< Serializes BAT and bitmap updates */
+  int flags;                        /**< VINIL_VHD_OPEN_* flags used to open it */
+  uint8_t* map;                     /**< Data of a fixed VHD opened with VINIL_VHD_OPEN_MMAP */
+  uint64_t map_size;
+  uint32_t alignment;               /**< Alignment of direct I/O (1 without VINIL_VHD_OPEN_DIRECT) */
+  vinil_mutex rmw_lock;             /**< Serializes unaligned direct writes */
+  VinilStats* stats;                /**< NULL unless opened with VINIL_VHD_OPEN_STATS */
+  VinilTrace* trace;                /**< NULL unless vinil_vhd_start_trace was called */
+  VinilCBT* cbt;                    /**< NULL unless vinil_vhd_start_cbt was called */
+  vinil_rwlock cbt_lock;            /**< Shared by the tracked writes, exclusive for checkpoints */
+  VinilCRC* crc;                    /**< NULL unless vinil_vhd_start_crc was called */
+  VinilWriteBack* write_back;       /**< NULL unless opened with VINIL_VHD_OPEN_WRITE_BACK */
+  vinil_mutex write_back_lock;      /**< Serializes the write-back buffer */
+  vinil_cond write_back_ready;      /**< Wakes the thread which writes back the old buffered writes */
+  vinil_thread write_back_thread;
+  int write_back_stop;              /**< Tells that thread to return */
+  VinilReadahead* readahead;        /**< NULL unless opened with VINIL_VHD_OPEN_READAHEAD */
+  vinil_mutex readahead_lock;       /**< Serializes the readahead streams */
+  uint32_t compact_block;           /**< Next block checked by vinil_vhd_compact */
 } VinilVHD;
 
+/** @brief What a call to vinil_vhd_compact did */
+typedef struct {
+  uint32_t  checked_blocks;   /**< allocated blocks whose bitmap (and data) was checked */
+  uint32_t  freed_blocks;     /**< blocks freed because they held no data */
+  uint32_t  moved_blocks;     /**< blocks moved down into the space of freed ones */
+  uint64_t  file_size;        /**< size of the file afterwards */
+  int       finished;         /**< TRUE if the whole VHD was compacted, the next call starts over */
+} VinilVHDCompactStats;
+
 /** @brief  Creates a new VinilVHDFooter object
  *
  *  @return   a new VinilVHDFooter object
@@ -56,6 +191,18 @@ VINILAPI VinilVHDFooter* vinil_vhd_footer_create();
  */
 VINILAPI int vinil_vhd_footer_read(FILE* fd, VinilVHDFooter* vhd_footer);
 
+/** @brief  Reads and validates the footer of a VHD without opening it as a VinilVHD: the
+ *          file is opened once, only its last 512 bytes are read and nothing is allocated,
+ *          so it is cheap enough to scan whole directory trees.
+ *
+ *  @param    filename    C string containing the name of the file
+ *
+ *  @param    footer      receives the footer, in host byte order
+ *
+ *  @return   TRUE if the file ends with a valid VHD footer, FALSE otherwise.
+ */
+VINILAPI int vinil_vhd_probe(const char* filename, VinilVHDFooter* footer);
+
 /** @brief  Destroys a VinilVHDFooter object
  *
  *  @param    vhd_footer  a VinilVHDFooter object to be destroyed
@@ -121,8 +268,24 @@ VINILAPI uint32_t vinil_geometry_get_sectors_per_track(uint32_t geometry);
  */
 VINILAPI void vinil_vhd_footer_byte_swap(VinilVHDFooter* vhd_footer);
 
+/** @brief  Calculates dynamic disk header's checksum
+ *
+ *  @param    vhd_header      Dynamic disk header
+ *
+ *  @return   the checksum
+ */
+VINILAPI uint32_t vinil_checksum_vhd_dynamic_header(VinilVHDDynamicHeader* vhd_header);
+
+/** @brief  Function for byte order swapping
+ *
+ *  @param    vhd_header      Dynamic disk header
+ */
+VINILAPI void vinil_vhd_dynamic_header_byte_swap(VinilVHDDynamicHeader* vhd_header);
+
 
-/** @brief  Opens a VHD file
+/** @brief  Opens a VHD file.
+ *          When it is a differencing VHD, the whole chain of parents is opened
+ *          (read only) and each block is mapped to the layer which owns it.
  *
  *  @param    filename      C string containing the name of the file to be opened.
  *
@@ -131,13 +294,454 @@ VINILAPI void vinil_vhd_footer_byte_swap(VinilVHDFooter* vhd_footer);
  */
 VINILAPI VinilVHD* vinil_vhd_open(const char* filename);
 
+/** @brief  Opens a VHD file with some VINIL_VHD_OPEN_* flags.
+ *          With VINIL_VHD_OPEN_MMAP, the data of fixed VHDs (including the
+ *          fixed base of a differencing chain) is mapped in memory and
+ *          vinil_vhd_read/vinil_vhd_pread copy from the mapping instead of
+ *          calling read.
+ *          With VINIL_VHD_OPEN_DIRECT, the file bypasses the page cache and the open
+ *          fails if the file system does not support it. Buffers, sectors and sizes
+ *          aligned to vhd->alignment (see vinil_alloc_aligned_buffer) go straight to
+ *          the disk, other requests (and the metadata) are read-modify-written through
+ *          an aligned bounce buffer.
+ *          With VINIL_VHD_OPEN_WRITE_BACK, writes are copied to a buffer which merges
+ *          adjacent and overlapping sectors into extents (reads see the buffered data).
+ *          The extents are written back by vinil_vhd_flush, by vinil_vhd_close, by the
+ *          write which makes the buffer reach its size threshold and by a thread of the
+ *          VHD when the oldest of them reaches the age threshold, see vinil_vhd_set_write_back.
+ *          Errors of buffered writes are reported by the call which writes them back, the
+ *          extents which the thread cannot write stay in the buffer for the next attempt.
+ *          With VINIL_VHD_OPEN_READAHEAD, up to VINIL_READAHEAD_STREAMS interleaved
+ *          sequential streams are detected and the sectors which follow them are
+ *          prefetched in windows which grow from VINIL_VHD_READAHEAD_MIN to
+ *          VINIL_VHD_READAHEAD_MAX bytes, see vinil_vhd_set_readahead. Fixed VHDs ask the
+ *          operating system to prefetch them (posix_fadvise), dynamic and differencing
+ *          VHDs read them into a buffer per stream. The chosen windows are counted in
+ *          the statistics.
+ *
+ *  @param    filename      C string containing the name of the file to be opened.
+ *
+ *  @param    flags         bitwise or of VINIL_VHD_OPEN_* flags
+ *
+ *  @return   If the operation was succesfully opened this function will return a pointer to VHD object. 
+ *            Otherwise, a null pointer is returned.
+ */
+VINILAPI VinilVHD* vinil_vhd_open_with_flags(const char* filename, int flags);
+
+/** @brief  Creates a new fixed or dynamic VHD.
+ *          The preallocation policy decides how the data of a fixed VHD is laid out:
+ *          VINIL_VHD_PREALLOC_SPARSE only sets the file size, VINIL_VHD_PREALLOC_FALLOCATE
+ *          reserves the extents without writing them and VINIL_VHD_PREALLOC_FULL writes
+ *          zeros with several threads. Dynamic VHDs only accept VINIL_VHD_PREALLOC_SPARSE.
+ *
+ *  @param    filename      C string containing the name of the file to be created, it must not exist.
+ *
+ *  @param    size          size of the virtual disk in bytes (multiple of 512)
+ *
+ *  @param    disk_type     VINIL_VHD_FIXED or VINIL_VHD_DYNAMIC
+ *
+ *  @param    prealloc      one of the VINIL_VHD_PREALLOC_* policies
+ *
+ *  @return   If the operation was succesfully executed this function will return a pointer to VHD object. 
+ *            Otherwise, a null pointer is returned.
+ */
+VINILAPI VinilVHD* vinil_vhd_create(const char* filename, uint64_t size, int disk_type, int prealloc);
+
+/** @brief  Copies a VHD into a new file which gets a new UUID. The file is cloned (FICLONE)
+ *          when the file system can share extents, so the copy takes no time and no space
+ *          until one of them is written. Otherwise the extents with data are copied by
+ *          several threads with copy_file_range, or through memory, and the holes of the
+ *          source are kept. A differencing VHD keeps pointing to the same parent.
+ *
+ *  @param    source        C string containing the name of the VHD to be cloned
+ *
+ *  @param    destination   C string containing the name of the new VHD, it must not exist
+ *
+ *  @param    method        receives how the data was copied (one of the VINIL_VHD_CLONE_*
+ *                          values), it may be a null pointer
+ *
+ *  @return   If the operation was succesfully executed this function will return TRUE.
+ *            Otherwise, FALSE will be returned and the destination is removed.
+ */
+VINILAPI int vinil_vhd_clone(const char* source, const char* destination, int* method);
+
+/** @brief  Creates a differencing VHD on top of an existing VHD.
+ *          The parent is recorded through its UUID, its name and parent locators
+ *          which are resolved again every time the new VHD is opened.
+ *
+ *  @param    filename          C string containing the name of the file to be created.
+ *
+ *  @param    parent_filename   C string containing the name of the parent VHD.
+ *
+ *  @return   If the operation was succesfully executed this function will return a pointer to VHD object. 
+ *            Otherwise, a null pointer is returned.
+ */
+VINILAPI VinilVHD* vinil_vhd_create_differencing(const char* filename, const char* parent_filename);
+
 /** @brief  Closes and destroy the VinilVHD object
  *
  *  @param    vhd      VinilVHD object
  */
 VINILAPI void vinil_vhd_close(VinilVHD* vhd);
 
-/** @brief  Reads a sector from the VinilVHD object
+/** @brief  Reads sectors at a given position without using the position indicator.
+ *          It may be called concurrently from several threads on the same VinilVHD
+ *          object: data is transferred without locks and only the BAT and bitmap
+ *          updates of dynamic VHDs are serialized.
+ *
+ *  @param    vhd       VinilVHD object
+ *
+ *  @param    buffer    a (512*count) bytes buffer
+ *
+ *  @param    sector    number of the first sector to read
+ *
+ *  @param    count     number of sectors to read
+ *
+ *  @return   If the operation was succesfully executed this function will return TRUE.
+ *            Otherwise, FALSE will be returned.
+ */
+VINILAPI int vinil_vhd_pread(VinilVHD* vhd, void* buffer, uint64_t sector, uint64_t count);
+
+/** @brief  Writes sectors at a given position without using the position indicator.
+ *          Like vinil_vhd_pread, it is safe to call it from several threads.
+ *
+ *  @param    vhd       VinilVHD object
+ *
+ *  @param    buffer    a (512*count) bytes buffer
+ *
+ *  @param    sector    number of the first sector to write
+ *
+ *  @param    count     number of sectors to write
+ *
+ *  @return   If the operation was succesfully executed this function will return TRUE.
+ *            Otherwise, FALSE will be returned.
+ */
+VINILAPI int vinil_vhd_pwrite(VinilVHD* vhd, const void* buffer, uint64_t sector, uint64_t count);
+
+/** @brief  Reads sectors at a given position into a list of buffers (scatter).
+ *          Fixed VHDs map it to a single preadv call, dynamic and differencing
+ *          VHDs split the request at block boundaries. Like vinil_vhd_pread, it
+ *          does not use the position indicator and it is safe to call it from
+ *          several threads.
+ *
+ *  @param    vhd       VinilVHD object
+ *
+ *  @param    iov       buffers to be filled, their total length must be a
+ *                      multiple of 512 bytes
+ *
+ *  @param    count     number of entries in iov
+ *
+ *  @param    sector    number of the first sector to read
+ *
+ *  @return   If the operation was succesfully executed this function will return TRUE.
+ *            Otherwise, FALSE will be returned.
+ */
+VINILAPI int vinil_vhd_preadv(VinilVHD* vhd, const vinil_iovec* iov, int count, uint64_t sector);
+
+/** @brief  Writes sectors at a given position from a list of buffers (gather).
+ *
+ *  @param    vhd       VinilVHD object
+ *
+ *  @param    iov       buffers to be written, their total length must be a
+ *                      multiple of 512 bytes
+ *
+ *  @param    count     number of entries in iov
+ *
+ *  @param    sector    number of the first sector to write
+ *
+ *  @return   If the operation was succesfully executed this function will return TRUE.
+ *            Otherwise, FALSE will be returned.
+ */
+VINILAPI int vinil_vhd_pwritev(VinilVHD* vhd, const vinil_iovec* iov, int count, uint64_t sector);
+
+/** @brief  Discards sectors (TRIM), they are read as zeros afterwards.
+ *          Fixed VHDs punch a hole in the file. Dynamic VHDs clear the sectors in
+ *          the bitmaps and free the blocks which become empty. Differencing VHDs
+ *          write zeros in the blocks which a parent owns, otherwise the parent would
+ *          show through, and discard the other blocks like dynamic VHDs.
+ *
+ *  @param    vhd       VinilVHD object
+ *
+ *  @param    sector    number of the first sector to discard
+ *
+ *  @param    count     number of sectors
+ *
+ *  @return   If the operation was succesfully executed this function will return TRUE.
+ *            Otherwise, FALSE will be returned.
+ */
+VINILAPI int vinil_vhd_discard(VinilVHD* vhd, uint64_t sector, uint64_t count);
+
+/** @brief  Tells whether sectors hold data without reading them. The blocks of a dynamic
+ *          VHD (or of any layer of a differencing one) which were never allocated and the
+ *          holes of a fixed VHD read as zeros, everything else is reported as data.
+ *
+ *  @param    vhd         VinilVHD object
+ *
+ *  @param    sector      number of the first sector
+ *
+ *  @param    count       number of sectors
+ *
+ *  @param    allocated   receives TRUE if the first sector may hold data, FALSE if it reads as zeros
+ *
+ *  @param    run         receives the number of sectors (at most count) with the same status
+ *
+ *  @return   TRUE if the range is valid, FALSE otherwise.
+ */
+VINILAPI int vinil_vhd_block_status(VinilVHD* vhd, uint64_t sector, uint64_t count, int* allocated, uint64_t* run);
+
+/** @brief  Starts recording every read, write, seek, flush and discard (with its
+ *          timestamp, sectors and duration) in a trace file, see vinil_replay.
+ *          It must not be called while other threads use the VHD.
+ *
+ *  @param    vhd       VinilVHD object
+ *
+ *  @param    filename  C string containing the name of the trace file to be created
+ *
+ *  @return   If the operation was succesfully executed this function will return TRUE.
+ *            Otherwise, FALSE will be returned.
+ */
+VINILAPI int vinil_vhd_start_trace(VinilVHD* vhd, const char* filename);
+
+/** @brief  Stops the trace started by vinil_vhd_start_trace and closes its file.
+ *          It must not be called while other threads use the VHD.
+ *
+ *  @param    vhd       VinilVHD object
+ *
+ *  @return   TRUE if the whole trace was written, FALSE otherwise.
+ */
+VINILAPI int vinil_vhd_stop_trace(VinilVHD* vhd);
+
+/** @brief  Starts tracking the sectors changed by writes and discards in a bitmap which is
+ *          saved to a tracking file when the tracking stops. The changes since a checkpoint
+ *          are listed by vinil_vhd_cbt_changes, so an incremental backup only reads what
+ *          changed. Every writer of the VHD must track its changes.
+ *          It must not be called while other threads use the VHD.
+ *
+ *  @param    vhd           VinilVHD object
+ *
+ *  @param    filename      C string containing the name of the tracking file, see vinil_cbt_open
+ *
+ *  @param    granularity   bytes tracked by each bit, VINIL_CBT_DEFAULT_GRANULARITY if it is 0
+ *
+ *  @return   If the operation was succesfully executed this function will return TRUE.
+ *            Otherwise, FALSE will be returned.
+ */
+VINILAPI int vinil_vhd_start_cbt(VinilVHD* vhd, const char* filename, uint32_t granularity);
+
+/** @brief  Stops the tracking started by vinil_vhd_start_cbt and saves its file.
+ *          It must not be called while other threads use the VHD.
+ *
+ *  @param    vhd       VinilVHD object
+ *
+ *  @return   TRUE if the tracking file was saved, FALSE otherwise.
+ */
+VINILAPI int vinil_vhd_stop_cbt(VinilVHD* vhd);
+
+/** @brief  Creates a named checkpoint of the tracking, see vinil_cbt_checkpoint. It waits for
+ *          the writes and discards in progress (their sectors are already marked as changed
+ *          before it) and writes the write-back buffer to the file, so the VHD holds every
+ *          change made before the checkpoint. The writes which start meanwhile wait for it.
+ *          It can be called while other threads use the VHD.
+ *
+ *  @param    vhd       VinilVHD object
+ *
+ *  @param    name      C string with less than VINIL_CBT_NAME_SIZE characters, it must not be in use
+ *
+ *  @return   FALSE if the tracking was not started or the checkpoint cannot be created,
+ *            TRUE otherwise.
+ */
+VINILAPI int vinil_vhd_cbt_checkpoint(VinilVHD* vhd, const char* name);
+
+/** @brief  Calls fn with every extent changed since a checkpoint, see vinil_cbt_changes.
+ *          It can be called while other threads use the VHD (the extents being written
+ *          meanwhile may or may not be listed), but fn must not write to the VHD or
+ *          create checkpoints.
+ *
+ *  @param    vhd       VinilVHD object
+ *
+ *  @param    since     name of the checkpoint, or a null pointer for every change of the epoch
+ *
+ *  @param    fn        function called with each extent
+ *
+ *  @param    arg       passed to fn
+ *
+ *  @return   FALSE if the tracking was not started, the checkpoint is unknown (a full
+ *            backup is needed) or fn stopped the iteration, TRUE otherwise.
+ */
+VINILAPI int vinil_vhd_cbt_changes(VinilVHD* vhd, const char* since, vinil_cbt_fn fn, void* arg);
+
+/** @brief  Starts keeping a CRC32C checksum of every block of the VHD in a checksum file,
+ *          see vinil_scrub. The writes checksum their blocks once they are done: the blocks
+ *          they cover from the data which was written, the blocks they change partly by
+ *          reading them back, and the blocks freed by a discard as zeros. A block stays
+ *          stale when writes of it overlap, when it is written by the io_uring backend of
+ *          vinil_aio_create or discarded without being freed, and when the checksum file is
+ *          new, until vinil_vhd_stop_crc reads it back.
+ *          vinil_vhd_flush saves the checksums, and a block is marked as stale in the file
+ *          before it is written (once per 64 blocks between two saves), so a checksum file
+ *          left open by a crash is reopened with the checksums which still hold.
+ *          It must not be called while other threads use the VHD.
+ *
+ *  @param    vhd           VinilVHD object
+ *
+ *  @param    filename      C string containing the name of the checksum file, see vinil_crc_open
+ *
+ *  @param    block_size    bytes covered by each checksum, VINIL_CRC_DEFAULT_BLOCK_SIZE if it is 0
+ *
+ *  @return   If the operation was succesfully executed this function will return TRUE.
+ *            Otherwise, FALSE will be returned.
+ */
+VINILAPI int vinil_vhd_start_crc(VinilVHD* vhd, const char* filename, uint32_t block_size);
+
+/** @brief  Checksums the stale blocks, flushes the VHD, then saves and closes the checksum
+ *          file opened by vinil_vhd_start_crc. The blocks are read from the file (with the
+ *          sectors still in the write-back buffer laid over it), so the reads are neither
+ *          traced nor counted in the statistics. It must not be called while other threads
+ *          use the VHD.
+ *
+ *  @param    vhd       VinilVHD object
+ *
+ *  @return   TRUE if every block was checksummed and the file was saved, FALSE otherwise.
+ */
+VINILAPI int vinil_vhd_stop_crc(VinilVHD* vhd);
+
+/** @brief  Takes a snapshot of the I/O statistics of a VHD opened with
+ *          VINIL_VHD_OPEN_STATS. Without the flag no statistics are collected
+ *          and the I/O path does not pay for them.
+ *
+ *  @param    vhd       VinilVHD object
+ *
+ *  @param    stats     receives the counters
+ *
+ *  @return   TRUE if the VHD collects statistics, FALSE otherwise.
+ */
+VINILAPI int vinil_vhd_get_stats(VinilVHD* vhd, VinilVHDStats* stats);
+
+/** @brief  Changes the thresholds of the write-back buffer of a VHD opened with
+ *          VINIL_VHD_OPEN_WRITE_BACK. Writes of max_bytes or more skip the buffer.
+ *
+ *  @param    vhd         VinilVHD object
+ *
+ *  @param    max_bytes   buffered bytes which trigger a write-back (VINIL_VHD_WRITE_BACK_SIZE by default)
+ *
+ *  @param    max_age_ms  age of the oldest buffered write which triggers a write-back, 0 disables it
+ *                        (VINIL_VHD_WRITE_BACK_AGE_MS by default)
+ *
+ *  @return   TRUE if the VHD has a write-back buffer, FALSE otherwise.
+ */
+VINILAPI int vinil_vhd_set_write_back(VinilVHD* vhd, uint64_t max_bytes, uint32_t max_age_ms);
+
+/** @brief  Changes the windows of the readahead of a VHD opened with VINIL_VHD_OPEN_READAHEAD.
+ *          The sectors which were already prefetched are dropped.
+ *
+ *  @param    vhd         VinilVHD object
+ *
+ *  @param    min_bytes   bytes prefetched when a stream is detected (VINIL_VHD_READAHEAD_MIN by default)
+ *
+ *  @param    max_bytes   maximum number of bytes prefetched at once (VINIL_VHD_READAHEAD_MAX by default)
+ *
+ *  @return   TRUE if the VHD has a readahead, FALSE otherwise.
+ */
+VINILAPI int vinil_vhd_set_readahead(VinilVHD* vhd, uint64_t min_bytes, uint64_t max_bytes);
+
+/** @brief Progress of vinil_vhd_merge */
+typedef struct {
+  uint64_t  blocks;             /**< blocks of the child with data, which are merged */
+  uint64_t  merged_blocks;      /**< blocks copied into the parent so far */
+  uint64_t  new_blocks;         /**< blocks which only the child had, added to the parent */
+  uint64_t  bytes;              /**< bytes copied so far */
+  uint64_t  copy_range_bytes;   /**< part of the bytes copied by the file system (copy_file_range) */
+  uint64_t  elapsed_ns;         /**< time since the merge started, bytes / elapsed_ns is the throughput */
+} VinilVHDMergeStats;
+
+/** @brief Called by vinil_vhd_merge after each block, the merge is cancelled if it returns FALSE */
+typedef int (*vinil_vhd_merge_fn)(void* arg, const VinilVHDMergeStats* stats);
+
+/** @brief  Merges a differencing VHD into its parent. The blocks of the child are copied
+ *          by several threads, a block at a time (with copy_file_range when the system
+ *          has it). Each merged block is written after the last block of a dynamic parent
+ *          (blocks the parent has are copied there first) and the BAT of the parent points
+ *          to them in a single update at the end, so a cancelled or failed merge leaves the
+ *          parent as it was. The blocks they replace become holes in the file. A fixed parent
+ *          has no BAT, so its sectors are overwritten in place and a cancelled or failed merge
+ *          leaves some of them with the data of the child. The child is not changed and
+ *          still shows the same data, it can be removed afterwards. Other children of the
+ *          parent are invalidated. Neither VHD may be open elsewhere during the merge.
+ *
+ *  @param    filename  C string containing the name of the differencing VHD
+ *
+ *  @param    threads   number of threads, VINIL_VHD_MERGE_THREADS if it is not positive
+ *
+ *  @param    progress  called after each block (by one thread at a time), it may be a null pointer
+ *
+ *  @param    arg       passed to progress
+ *
+ *  @param    stats     receives what was done, it may be a null pointer
+ *
+ *  @return   If the operation was succesfully executed this function will return TRUE.
+ *            Otherwise (or if it was cancelled), FALSE will be returned.
+ */
+VINILAPI int vinil_vhd_merge(const char* filename, int threads, vinil_vhd_merge_fn progress, void* arg,
+                             VinilVHDMergeStats* stats);
+
+/** @brief  Compacts a dynamic or differencing VHD. Blocks with an empty bitmap (and, in
+ *          dynamic VHDs, blocks which only contain zeros) are freed, the blocks at the end
+ *          of the file are moved down into the freed space and the file is truncated.
+ *          The work is split into steps of max_blocks blocks, so an open VHD can be
+ *          compacted a little at a time: each call continues where the previous one
+ *          stopped, until stats->finished. Only one block is held in memory.
+ *          Other threads must not use the VHD during a call.
+ *
+ *  @param    vhd         VinilVHD object
+ *
+ *  @param    max_blocks  blocks checked or moved by this call, 0 compacts the whole VHD
+ *
+ *  @param    stats       receives what was done, it may be a null pointer
+ *
+ *  @return   If the operation was succesfully executed this function will return TRUE.
+ *            Otherwise (or if the VHD is fixed or read-only), FALSE will be returned.
+ */
+VINILAPI int vinil_vhd_compact(VinilVHD* vhd, uint32_t max_blocks, VinilVHDCompactStats* stats);
+
+/** @brief  Gives direct (zero-copy) access to sectors of a fixed VHD opened
+ *          with VINIL_VHD_OPEN_MMAP. The view stays valid until the VHD is
+ *          closed or its size is changed.
+ *
+ *  @param    vhd       VinilVHD object
+ *
+ *  @param    sector    number of the first sector
+ *
+ *  @param    count     number of sectors
+ *
+ *  @param    advice    how the range will be accessed: VINIL_ADVICE_NORMAL,
+ *                      VINIL_ADVICE_SEQUENTIAL, VINIL_ADVICE_RANDOM or
+ *                      VINIL_ADVICE_WILLNEED
+ *
+ *  @return   a pointer to the first sector or a null pointer if the VHD is not
+ *            mapped or the range is invalid
+ */
+VINILAPI const void* vinil_vhd_map_range(VinilVHD* vhd, uint64_t sector, uint64_t count, int advice);
+
+/** @brief  Releases a view returned by vinil_vhd_map_range. The memory it used
+ *          is given back to the system, but the pointer may still be used
+ *          (its pages are read again from the file).
+ *
+ *  @param    vhd       VinilVHD object
+ *
+ *  @param    view      pointer returned by vinil_vhd_map_range
+ *
+ *  @param    count     number of sectors of the view
+ *
+ *  @return   If the operation was succesfully executed this function will return TRUE.
+ *            Otherwise, FALSE will be returned.
+ */
+VINILAPI int vinil_vhd_unmap_range(VinilVHD* vhd, const void* view, uint64_t count);
+
+/** @brief  Reads a sector from the VinilVHD object at its position indicator,
+ *          which is advanced by count sectors. Sectors of dynamic VHDs which were
+ *          never written are read as zeros and the ones of differencing VHDs are
+ *          read from their parents. The position indicator is not shared safely
+ *          between threads, use vinil_vhd_pread for that.
  *
  *  @param    vhd       VinilVHD object
  *
@@ -150,7 +754,9 @@ VINILAPI void vinil_vhd_close(VinilVHD* vhd);
  */
 VINILAPI int vinil_vhd_read(VinilVHD* vhd, void* buffer, int count);
 
-/** @brief  Writes a sector to a virtual hard disk file
+/** @brief  Writes a sector to a virtual hard disk file at its position indicator,
+ *          which is advanced by count sectors. In dynamic VHDs, blocks are allocated at the end of the file when
+ *          they are written for the first time.
  *
  *  @param    vhd       VinilVHD object
  *
@@ -201,7 +807,9 @@ VINILAPI int64_t vinil_vhd_tell(VinilVHD* vhd);
  */
 VINILAPI int vinil_vhd_seek(VinilVHD* vhd, int64_t offset, int origin);
 
-/** @brief  It is like fflush C function.
+/** @brief  It is like fflush C function, but it also asks the operating system
+ *          to write the data to the disk. The checksums of vinil_vhd_start_crc are
+ *          saved after the data.
  *
  *  @param    vhd       VinilVHD object
  *
@@ -211,7 +819,10 @@ VINILAPI int vinil_vhd_seek(VinilVHD* vhd, int64_t offset, int origin);
 VINILAPI int vinil_vhd_flush(VinilVHD* vhd);
 
 /** @brief  If necessary it changes the virtual hard disk's size 
- *          and write the VinilVHDFooter struct at the end of file
+ *          and write the VinilVHDFooter struct at the end of file.
+ *          For a new dynamic VHD (disk_type == VINIL_VHD_DYNAMIC) it also
+ *          writes the dynamic disk header and an empty BAT. A dynamic VHD
+ *          can only grow while its BAT fits in the space reserved for it.
  *
  *  @param    vhd       VinilVHD object
  *
@@ -0,0 +1,325 @@
+/**
+ *  @file       writeback.c
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#include "writeback.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  uint64_t sector;
+  uint64_t count;
+  uint64_t capacity;    // sectors allocated in data
+  uint8_t* data;
+} WriteBackExtent;
+
+struct VinilWriteBack {
+  WriteBackExtent* extents;
+  size_t extent_count;
+  size_t extent_capacity;
+  uint64_t bytes;
+  uint64_t max_bytes;
+  uint64_t max_age;
+  uint64_t oldest;      // vinil_clock_ns() of the oldest dirty sector
+};
+
+static void write_back_gather(const vinil_iovec* iov, int count, uint8_t* dst) {
+  int i;
+  for (i = 0; i < count; i++) {
+    memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+    dst += iov[i].iov_len;
+  }
+}
+
+// copies size bytes to the request, starting offset bytes after its beginning
+static void write_back_scatter(const vinil_iovec* iov, int count, size_t offset, const uint8_t* src, size_t size) {
+  int i;
+  for (i = 0; i < count && size > 0; i++) {
+    if (offset >= iov[i].iov_len) {
+      offset -= iov[i].iov_len;
+      continue;
+    }
+
+    size_t n = iov[i].iov_len - offset;
+    if (n > size)
+      n = size;
+
+    memcpy((uint8_t*)iov[i].iov_base + offset, src, n);
+    src += n;
+    size -= n;
+    offset = 0;
+  }
+}
+
+// first extent which ends at or after sector (so it may touch or overlap it)
+static size_t write_back_search(VinilWriteBack* wb, uint64_t sector) {
+  size_t low = 0, high = wb->extent_count;
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    if (wb->extents[middle].sector + wb->extents[middle].count < sector)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+
+  return low;
+}
+
+static int write_back_reserve(VinilWriteBack* wb) {
+  if (wb->extent_count < wb->extent_capacity)
+    return TRUE;
+
+  size_t capacity = wb->extent_capacity ? wb->extent_capacity * 2 : 16;
+  WriteBackExtent* extents = (WriteBackExtent*)realloc(wb->extents, capacity * sizeof(WriteBackExtent));
+  if (extents == NULL)
+    return FALSE;
+
+  wb->extents = extents;
+  wb->extent_capacity = capacity;
+
+  return TRUE;
+}
+
+VinilWriteBack* vinil_write_back_create(uint64_t max_bytes, uint64_t max_age_ns) {
+  VinilWriteBack* wb = (VinilWriteBack*)calloc(1, sizeof(VinilWriteBack));
+  if (wb == NULL)
+    return NULL;
+
+  vinil_write_back_set_limits(wb, max_bytes, max_age_ns);
+
+  return wb;
+}
+
+void vinil_write_back_destroy(VinilWriteBack* wb) {
+  size_t i;
+  for (i = 0; i < wb->extent_count; i++)
+    free(wb->extents[i].data);
+
+  free(wb->extents);
+  free(wb);
+}
+
+void vinil_write_back_set_limits(VinilWriteBack* wb, uint64_t max_bytes, uint64_t max_age_ns) {
+  wb->max_bytes = max_bytes;
+  wb->max_age = max_age_ns;
+}
+
+int vinil_write_back_insert(VinilWriteBack* wb, uint64_t sector, const vinil_iovec* iov, int count) {
+  uint64_t size = 0;
+  int k;
+  for (k = 0; k < count; k++)
+    size += iov[k].iov_len;
+
+  uint64_t end = sector + size / 512;
+  if (size == 0)
+    return TRUE;
+
+  if (wb->extent_count == 0)
+    wb->oldest = vinil_clock_ns();
+
+  // extents [i, j) overlap or touch the new sectors and are merged with them
+  size_t i = write_back_search(wb, sector);
+  size_t j = i;
+  while (j < wb->extent_count && wb->extents[j].sector <= end)
+    j++;
+
+  if (i == j) {
+    uint8_t* data = (uint8_t*)malloc((size_t)size);
+    if (data == NULL || !write_back_reserve(wb)) {
+      free(data);
+      return FALSE;
+    }
+
+    write_back_gather(iov, count, data);
+    memmove(&wb->extents[i + 1], &wb->extents[i], (wb->extent_count - i) * sizeof(WriteBackExtent));
+    wb->extents[i].sector = sector;
+    wb->extents[i].count = size / 512;
+    wb->extents[i].capacity = size / 512;
+    wb->extents[i].data = data;
+    wb->extent_count++;
+    wb->bytes += size;
+    return TRUE;
+  }
+
+  WriteBackExtent* first = &wb->extents[i];
+  WriteBackExtent* last = &wb->extents[j - 1];
+  uint64_t start = first->sector < sector ? first->sector : sector;
+  uint64_t stop = last->sector + last->count > end ? last->sector + last->count : end;
+  uint64_t merged = 0;
+  size_t e;
+  for (e = i; e < j; e++)
+    merged += wb->extents[e].count;
+
+  if (j == i + 1 && first->sector == start) {
+    // sequential writes grow the same extent, its capacity doubles to keep appends cheap
+    if (stop - start > first->capacity) {
+      uint64_t capacity = first->capacity * 2 > stop - start ? first->capacity * 2 : stop - start;
+      uint8_t* data = (uint8_t*)realloc(first->data, (size_t)(capacity * 512));
+      if (data == NULL)
+        return FALSE;
+
+      first->data = data;
+      first->capacity = capacity;
+    }
+  } else {
+    uint8_t* data = (uint8_t*)malloc((size_t)((stop - start) * 512));
+    if (data == NULL)
+      return FALSE;
+
+    for (e = i; e < j; e++) {
+      memcpy(data + (wb->extents[e].sector - start) * 512, wb->extents[e].data, (size_t)(wb->extents[e].count * 512));
+      free(wb->extents[e].data);
+    }
+
+    first->data = data;
+    first->capacity = stop - start;
+    memmove(&wb->extents[i + 1], &wb->extents[j], (wb->extent_count - j) * sizeof(WriteBackExtent));
+    wb->extent_count -= j - i - 1;
+  }
+
+  first->sector = start;
+  first->count = stop - start;
+  write_back_gather(iov, count, first->data + (sector - start) * 512);
+  wb->bytes += (stop - start - merged) * 512;
+
+  return TRUE;
+}
+
+uint64_t vinil_write_back_covered(VinilWriteBack* wb, uint64_t sector, uint64_t count) {
+  uint64_t end = sector + count;
+  uint64_t covered = 0;
+
+  size_t i;
+  for (i = write_back_search(wb, sector); i < wb->extent_count && wb->extents[i].sector < end; i++) {
+    uint64_t from = wb->extents[i].sector > sector ? wb->extents[i].sector : sector;
+    uint64_t to = wb->extents[i].sector + wb->extents[i].count < end ? wb->extents[i].sector + wb->extents[i].count : end;
+    if (to > from)
+      covered += to - from;
+  }
+
+  return covered;
+}
+
+void vinil_write_back_overlay(VinilWriteBack* wb, uint64_t sector, const vinil_iovec* iov, int count) {
+  uint64_t size = 0;
+  int k;
+  for (k = 0; k < count; k++)
+    size += iov[k].iov_len;
+
+  uint64_t end = sector + size / 512;
+
+  size_t i;
+  for (i = write_back_search(wb, sector); i < wb->extent_count && wb->extents[i].sector < end; i++) {
+    WriteBackExtent* extent = &wb->extents[i];
+    uint64_t from = extent->sector > sector ? extent->sector : sector;
+    uint64_t to = extent->sector + extent->count < end ? extent->sector + extent->count : end;
+    if (to > from)
+      write_back_scatter(iov, count, (size_t)((from - sector) * 512), extent->data + (from - extent->sector) * 512,
+                         (size_t)((to - from) * 512));
+  }
+}
+
+int vinil_write_back_remove(VinilWriteBack* wb, uint64_t sector, uint64_t count) {
+  uint64_t end = sector + count;
+
+  size_t i = write_back_search(wb, sector);
+  while (i < wb->extent_count && wb->extents[i].sector < end) {
+    WriteBackExtent* extent = &wb->extents[i];
+    uint64_t extent_end = extent->sector + extent->count;
+
+    if (extent_end <= sector) {
+      i++;
+      continue;
+    }
+
+    if (extent->sector < sector && extent_end > end) {
+      // the range is in the middle of the extent, its tail becomes a new extent
+      uint64_t tail = extent_end - end;
+      uint8_t* data = (uint8_t*)malloc((size_t)(tail * 512));
+      if (data == NULL || !write_back_reserve(wb)) {
+        free(data);
+        return FALSE;
+      }
+
+      extent = &wb->extents[i];
+      memcpy(data, extent->data + (end - extent->sector) * 512, (size_t)(tail * 512));
+      memmove(&wb->extents[i + 2], &wb->extents[i + 1], (wb->extent_count - i - 1) * sizeof(WriteBackExtent));
+      wb->extents[i + 1].sector = end;
+      wb->extents[i + 1].count = tail;
+      wb->extents[i + 1].capacity = tail;
+      wb->extents[i + 1].data = data;
+      wb->extent_count++;
+
+      extent->count = sector - extent->sector;
+      wb->bytes -= count * 512;
+      return TRUE;
+    }
+
+    if (extent->sector < sector) {
+      wb->bytes -= (extent_end - sector) * 512;
+      extent->count = sector - extent->sector;
+      i++;
+    } else if (extent_end > end) {
+      memmove(extent->data, extent->data + (end - extent->sector) * 512, (size_t)((extent_end - end) * 512));
+      wb->bytes -= (end - extent->sector) * 512;
+      extent->count = extent_end - end;
+      extent->sector = end;
+      i++;
+    } else {
+      wb->bytes -= extent->count * 512;
+      free(extent->data);
+      memmove(&wb->extents[i], &wb->extents[i + 1], (wb->extent_count - i - 1) * sizeof(WriteBackExtent));
+      wb->extent_count--;
+    }
+  }
+
+  return TRUE;
+}
+
+int vinil_write_back_bypass(VinilWriteBack* wb, uint64_t bytes) {
+  return bytes >= wb->max_bytes;
+}
+
+int vinil_write_back_due(VinilWriteBack* wb) {
+  if (wb->extent_count == 0)
+    return FALSE;
+
+  return wb->bytes >= wb->max_bytes || (wb->max_age && vinil_clock_ns() - wb->oldest >= wb->max_age);
+}
+
+uint64_t vinil_write_back_wait(VinilWriteBack* wb) {
+  if (wb->extent_count == 0 || wb->max_age == 0)
+    return UINT64_MAX;
+
+  uint64_t age = vinil_clock_ns() - wb->oldest;
+  return age < wb->max_age ? wb->max_age - age : 0;
+}
+
+size_t vinil_write_back_extents(VinilWriteBack* wb) {
+  return wb->extent_count;
+}
+
+int vinil_write_back_flush(VinilWriteBack* wb, vinil_write_back_fn fn, void* arg) {
+  size_t i;
+  for (i = 0; i < wb->extent_count; i++) {
+    WriteBackExtent* extent = &wb->extents[i];
+    if (!fn(arg, extent->sector, extent->data, extent->count)) {
+      // the failed extent is retried by the next flush, the age does not call for it at once
+      memmove(&wb->extents[0], &wb->extents[i], (wb->extent_count - i) * sizeof(WriteBackExtent));
+      wb->extent_count -= i;
+      wb->oldest = vinil_clock_ns();
+      return FALSE;
+    }
+
+    wb->bytes -= extent->count * 512;
+    free(extent->data);
+  }
+
+  wb->extent_count = 0;
+  wb->bytes = 0;
+
+  return TRUE;
+}
@@ -0,0 +1,150 @@
+/**
+ *  @file       writeback.h
+ *  @brief      Write-back buffer which coalesces small sector writes into extents.
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#ifndef VINIL_WRITEBACK_H_
+#define VINIL_WRITEBACK_H_
+
+#include <stdint.h>
+
+#include "crossplatform.h"
+
+/** @brief Dirty sectors buffered by a write-back buffer, sorted by sector.
+ *         Extents never overlap nor touch each other: adjacent and overlapping
+ *         writes are merged into a single extent. It is not thread-safe, the
+ *         caller serializes the calls. */
+typedef struct VinilWriteBack VinilWriteBack;
+
+/** @brief Writes an extent back, returns TRUE if successful or FALSE otherwise */
+typedef int (*vinil_write_back_fn)(void* arg, uint64_t sector, const void* data, uint64_t count);
+
+/** @brief  Creates an empty write-back buffer
+ *
+ *  @param    max_bytes   the buffer is due when it holds that many bytes
+ *
+ *  @param    max_age_ns  the buffer is due when its oldest dirty sector is that old (0 disables it)
+ *
+ *  @return   a new VinilWriteBack object or a null pointer if an error occurs
+ */
+VINILAPI VinilWriteBack* vinil_write_back_create(uint64_t max_bytes, uint64_t max_age_ns);
+
+/** @brief  Destroys a write-back buffer, the buffered sectors are lost
+ *
+ *  @param    wb          VinilWriteBack object
+ */
+VINILAPI void vinil_write_back_destroy(VinilWriteBack* wb);
+
+/** @brief  Changes the thresholds of a write-back buffer
+ *
+ *  @param    wb          VinilWriteBack object
+ *
+ *  @param    max_bytes   the buffer is due when it holds that many bytes
+ *
+ *  @param    max_age_ns  the buffer is due when its oldest dirty sector is that old (0 disables it)
+ */
+VINILAPI void vinil_write_back_set_limits(VinilWriteBack* wb, uint64_t max_bytes, uint64_t max_age_ns);
+
+/** @brief  Copies sectors into the buffer, they replace the buffered copies of the same sectors
+ *
+ *  @param    wb          VinilWriteBack object
+ *
+ *  @param    sector      number of the first sector
+ *
+ *  @param    iov         buffers to be copied, their total length must be a multiple of 512 bytes
+ *
+ *  @param    count       number of entries in iov
+ *
+ *  @return   TRUE if successful or FALSE if there is not enough memory.
+ */
+VINILAPI int vinil_write_back_insert(VinilWriteBack* wb, uint64_t sector, const vinil_iovec* iov, int count);
+
+/** @brief  Counts the buffered sectors of a range
+ *
+ *  @param    wb          VinilWriteBack object
+ *
+ *  @param    sector      number of the first sector
+ *
+ *  @param    count       number of sectors
+ *
+ *  @return   the number of sectors of the range which are in the buffer
+ */
+VINILAPI uint64_t vinil_write_back_covered(VinilWriteBack* wb, uint64_t sector, uint64_t count);
+
+/** @brief  Copies the buffered sectors of a range over the data read from the disk
+ *
+ *  @param    wb          VinilWriteBack object
+ *
+ *  @param    sector      number of the first sector of iov
+ *
+ *  @param    iov         buffers which hold the range
+ *
+ *  @param    count       number of entries in iov
+ */
+VINILAPI void vinil_write_back_overlay(VinilWriteBack* wb, uint64_t sector, const vinil_iovec* iov, int count);
+
+/** @brief  Drops the buffered copies of a range of sectors
+ *
+ *  @param    wb          VinilWriteBack object
+ *
+ *  @param    sector      number of the first sector
+ *
+ *  @param    count       number of sectors
+ *
+ *  @return   TRUE if successful or FALSE if there is not enough memory to split an extent.
+ */
+VINILAPI int vinil_write_back_remove(VinilWriteBack* wb, uint64_t sector, uint64_t count);
+
+/** @brief  Tells if a write should skip the buffer because it is larger than the size threshold
+ *
+ *  @param    wb          VinilWriteBack object
+ *
+ *  @param    bytes       size of the write
+ *
+ *  @return   TRUE if the write should go straight to the disk
+ */
+VINILAPI int vinil_write_back_bypass(VinilWriteBack* wb, uint64_t bytes);
+
+/** @brief  Tells if the buffer reached its size or age threshold
+ *
+ *  @param    wb          VinilWriteBack object
+ *
+ *  @return   TRUE if the buffer should be written back
+ */
+VINILAPI int vinil_write_back_due(VinilWriteBack* wb);
+
+/** @brief  Tells how long the buffer can wait before its oldest dirty sector reaches the
+ *          age threshold
+ *
+ *  @param    wb          VinilWriteBack object
+ *
+ *  @return   nanoseconds until the age threshold (0 if it was reached), or UINT64_MAX if the
+ *            buffer is empty or has no age threshold
+ */
+VINILAPI uint64_t vinil_write_back_wait(VinilWriteBack* wb);
+
+/** @brief  Returns the number of extents in the buffer
+ *
+ *  @param    wb          VinilWriteBack object
+ *
+ *  @return   number of extents
+ */
+VINILAPI size_t vinil_write_back_extents(VinilWriteBack* wb);
+
+/** @brief  Writes every extent back in ascending order of sectors and empties the buffer.
+ *          When an extent fails it and the following ones stay in the buffer, and they
+ *          reach the age threshold again only after the whole age.
+ *
+ *  @param    wb          VinilWriteBack object
+ *
+ *  @param    fn          called once for each extent
+ *
+ *  @param    arg         first argument of fn
+ *
+ *  @return   TRUE if every extent was written or FALSE otherwise.
+ */
+VINILAPI int vinil_write_back_flush(VinilWriteBack* wb, vinil_write_back_fn fn, void* arg);
+
+#endif
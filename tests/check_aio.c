@@ -0,0 +1,164 @@
+/**
+ *  @file       check_aio.c
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <check.h>
+
+#include "vhd.h"
+#include "aio.h"
+
+#define AIO_TEST_SECTORS  (16*1024)
+#define AIO_TEST_REQUESTS 64
+#define AIO_TEST_CHUNK    8
+
+static VinilVHD* create_vhd(const char* vhd_path, int disk_type) {
+  remove(vhd_path);
+
+  VinilVHD* vhd = vinil_vhd_open(vhd_path);
+  if (vhd == NULL)
+    return NULL;
+
+  uint64_t size = AIO_TEST_SECTORS*512;
+  memcpy(vhd->footer->cookie, "conectix", 8);
+  vhd->footer->file_format_version = 0x00010000;
+  vhd->footer->timestamp = time(NULL);
+  memcpy(vhd->footer->creator_application, "vnil", 4);
+  vhd->footer->creator_version = 0x00000001;
+  vhd->footer->creator_host_os = 0x4D616320;                    // Mac OS X
+  vhd->footer->original_size = size;
+  vhd->footer->current_size = size;
+  vhd->footer->disk_geometry = vinil_compute_chs(size);
+  vhd->footer->disk_type = disk_type;
+  vinil_uuid_generate(&vhd->footer->uuid);
+
+  if (!vinil_vhd_commit_structural_changes(vhd)) {
+    vinil_vhd_close(vhd);
+    return NULL;
+  }
+
+  return vhd;
+}
+
+static int run_requests(VinilAIO* aio, VinilAIORequest* requests, int count) {
+  VinilAIOCompletion completions[AIO_TEST_REQUESTS];
+  int submitted = 0;
+  int completed = 0;
+  int ok = TRUE;
+
+  while (completed < count) {
+    if (submitted < count)
+      submitted += vinil_aio_submit(aio, requests + submitted, count - submitted);
+
+    int n = vinil_aio_wait(aio, completions, 1, AIO_TEST_REQUESTS);
+    int i;
+    for (i = 0; i < n; i++)
+      if (!completions[i].result || completions[i].tag != requests[completions[i].tag].tag)
+        ok = FALSE;
+    completed += n;
+  }
+
+  return ok && vinil_aio_in_flight(aio) == 0;
+}
+
+static void check_aio(VinilVHD* vhd, int flags, const char* name) {
+  char error_msg[256];
+  VinilAIORequest requests[AIO_TEST_REQUESTS + 1];
+
+  char* written = (char*)malloc(AIO_TEST_REQUESTS*AIO_TEST_CHUNK*512);
+  char* read = (char*)malloc(AIO_TEST_REQUESTS*AIO_TEST_CHUNK*512);
+
+  VinilAIO* aio = vinil_aio_create(vhd, 16, flags);
+  sprintf(error_msg, "Cannot create an asynchronous queue for %s", name);
+  fail_unless(aio != NULL, error_msg);
+
+  if (flags & VINIL_AIO_NO_IO_URING || vhd->header != NULL) {
+    sprintf(error_msg, "%s should use the thread pool", name);
+    fail_unless(vinil_aio_backend(aio) == VINIL_AIO_BACKEND_THREADS, error_msg);
+  }
+
+  // requests are spread over the disk, one chunk every 256 sectors
+  int i;
+  for (i = 0; i < AIO_TEST_REQUESTS; i++) {
+    memset(written + i*AIO_TEST_CHUNK*512, 'a' + i%26, AIO_TEST_CHUNK*512);
+    requests[i].op = VINIL_AIO_WRITE;
+    requests[i].buffer = written + i*AIO_TEST_CHUNK*512;
+    requests[i].sector = i*256 + i%7;
+    requests[i].count = AIO_TEST_CHUNK;
+    requests[i].tag = i;
+  }
+  requests[AIO_TEST_REQUESTS].op = VINIL_AIO_FLUSH;
+  requests[AIO_TEST_REQUESTS].tag = AIO_TEST_REQUESTS;
+
+  sprintf(error_msg, "Cannot write %s asynchronously", name);
+  fail_unless(run_requests(aio, requests, AIO_TEST_REQUESTS + 1), error_msg);
+
+  memset(read, 0, AIO_TEST_REQUESTS*AIO_TEST_CHUNK*512);
+  for (i = 0; i < AIO_TEST_REQUESTS; i++) {
+    requests[i].op = VINIL_AIO_READ;
+    requests[i].buffer = read + i*AIO_TEST_CHUNK*512;
+  }
+
+  sprintf(error_msg, "Cannot read %s asynchronously", name);
+  fail_unless(run_requests(aio, requests, AIO_TEST_REQUESTS), error_msg);
+
+  sprintf(error_msg, "%s was not read back correctly", name);
+  fail_unless(memcmp(written, read, AIO_TEST_REQUESTS*AIO_TEST_CHUNK*512) == 0, error_msg);
+
+  // a request past the end of the disk completes with an error
+  VinilAIOCompletion completion;
+  requests[0].sector = AIO_TEST_SECTORS;
+  requests[0].tag = 42;
+  fail_unless(vinil_aio_submit(aio, requests, 1) == 1, "Cannot submit an invalid request");
+  fail_unless(vinil_aio_wait(aio, &completion, 1, 1) == 1, "Cannot collect an invalid request");
+  sprintf(error_msg, "%s accepted a request past its end", name);
+  fail_unless(completion.tag == 42 && !completion.result, error_msg);
+
+  // requests which are never collected are waited by vinil_aio_destroy
+  requests[0].sector = 0;
+  fail_unless(vinil_aio_submit(aio, requests, AIO_TEST_REQUESTS) == 16, "The queue depth was not respected");
+  vinil_aio_destroy(aio);
+
+  free(written);
+  free(read);
+}
+
+START_TEST (test_vinil_aio_fixed) {
+  VinilVHD* vhd = create_vhd("../tests/data/aio_fixed.vhd", VINIL_VHD_FIXED);
+  fail_unless(vhd != NULL, "Cannot create aio_fixed.vhd");
+  check_aio(vhd, 0, "aio_fixed.vhd");
+  check_aio(vhd, VINIL_AIO_NO_IO_URING, "aio_fixed.vhd");
+  vinil_vhd_close(vhd);
+} END_TEST
+
+START_TEST (test_vinil_aio_dynamic) {
+  VinilVHD* vhd = create_vhd("../tests/data/aio_dynamic.vhd", VINIL_VHD_DYNAMIC);
+  fail_unless(vhd != NULL, "Cannot create aio_dynamic.vhd");
+  check_aio(vhd, 0, "aio_dynamic.vhd");
+  vinil_vhd_close(vhd);
+} END_TEST
+
+Suite* func_suite(void) {
+  Suite *s = suite_create ("vinil");
+  TCase *tc_core = tcase_create ("AIO");
+  tcase_add_test (tc_core, test_vinil_aio_fixed);
+  tcase_add_test (tc_core, test_vinil_aio_dynamic);
+  suite_add_tcase (s, tc_core);
+  return s;
+}
+
+int main() {
+  int number_failed;
+  Suite *s = func_suite();
+  SRunner *sr = srunner_create(s);
+  srunner_run_all(sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,273 @@
+/**
+ *  @file       check_cbt.c
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <check.h>
+
+#include "vhd.h"
+#include "cbt.h"
+#include "helpers.h"
+
+static int changes(VinilCBT* cbt, const char* since, ExtentLog* log) {
+  memset(log, 0, sizeof(ExtentLog));
+  return vinil_cbt_changes(cbt, since, log_extent, log);
+}
+
+static int vhd_changes(VinilVHD* vhd, const char* since, ExtentLog* log) {
+  memset(log, 0, sizeof(ExtentLog));
+  return vinil_vhd_cbt_changes(vhd, since, log_extent, log);
+}
+
+static void copy_file(const char* from, const char* to) {
+  FILE* in = fopen(from, "rb");
+  FILE* out = fopen(to, "wb");
+  fail_unless(in != NULL && out != NULL, "Cannot copy the tracking file");
+
+  char buffer[4096];
+  size_t size;
+  while ((size = fread(buffer, 1, sizeof(buffer), in)) > 0)
+    fwrite(buffer, 1, size, out);
+
+  fclose(in);
+  fclose(out);
+}
+
+START_TEST (test_vinil_cbt_changes) {
+  char cbt_path[] = "../tests/data/cbt_bitmap.cbt";
+  char copy_path[] = "../tests/data/cbt_bitmap_copy.cbt";
+  remove(cbt_path);
+  remove(copy_path);
+
+  // 1000 sectors tracked by 125 bits of 8 sectors
+  VinilCBT* cbt = vinil_cbt_open(cbt_path, 1000, 4096);
+  fail_unless(cbt != NULL, "Cannot create cbt_bitmap.cbt");
+  fail_unless(vinil_cbt_epoch(cbt) == 1, "Wrong first epoch");
+
+  ExtentLog log;
+  fail_unless(changes(cbt, NULL, &log) && log.count == 0, "A new bitmap has changes");
+
+  vinil_cbt_mark(cbt, 3, 1);
+  vinil_cbt_mark(cbt, 8, 16);
+  vinil_cbt_mark(cbt, 511, 2);
+  vinil_cbt_mark(cbt, 999, 10);
+  fail_unless(changes(cbt, NULL, &log) && log.count == 3, "Wrong number of extents");
+  fail_unless(log.sectors[0] == 0 && log.counts[0] == 24, "Touching granules were not merged");
+  fail_unless(log.sectors[1] == 504 && log.counts[1] == 16, "An extent across two granules was lost");
+  fail_unless(log.sectors[2] == 992 && log.counts[2] == 8, "The last extent passed the end of the disk");
+
+  // a checkpoint only sees the changes made after it
+  fail_unless(vinil_cbt_checkpoint(cbt, "monday"), "Cannot create a checkpoint");
+  fail_unless(!vinil_cbt_checkpoint(cbt, "monday"), "A checkpoint was created twice");
+  fail_unless(changes(cbt, "monday", &log) && log.count == 0, "A new checkpoint has changes");
+  vinil_cbt_mark(cbt, 100, 1);
+  fail_unless(changes(cbt, "monday", &log) && log.count == 1 && log.sectors[0] == 96 && log.counts[0] == 8,
+              "Wrong changes since the checkpoint");
+  fail_unless(changes(cbt, NULL, &log) && log.count == 4, "The epoch lost changes");
+  fail_unless(!changes(cbt, "sunday", &log), "An unknown checkpoint was accepted");
+
+  // while it is open the file does not describe the changes, as after a crash
+  copy_file(cbt_path, copy_path);
+  fail_unless(vinil_cbt_close(cbt), "Cannot save cbt_bitmap.cbt");
+
+  cbt = vinil_cbt_open(cbt_path, 1000, 4096);
+  fail_unless(cbt != NULL, "Cannot open cbt_bitmap.cbt");
+  fail_unless(vinil_cbt_epoch(cbt) == 1, "The epoch changed");
+  fail_unless(changes(cbt, "monday", &log) && log.count == 1 && log.sectors[0] == 96, "The checkpoint was not saved");
+  fail_unless(changes(cbt, NULL, &log) && log.count == 4, "The changes were not saved");
+
+  // the oldest checkpoint is forgotten, the epoch keeps its changes
+  int i;
+  for (i = 0; i < VINIL_CBT_CHECKPOINTS; i++) {
+    char name[16];
+    snprintf(name, sizeof(name), "day%d", i);
+    fail_unless(vinil_cbt_checkpoint(cbt, name), "Cannot create a checkpoint");
+  }
+  fail_unless(!changes(cbt, "monday", &log), "Too many checkpoints were kept");
+  fail_unless(changes(cbt, "day0", &log) && log.count == 0, "Wrong changes since day0");
+  fail_unless(changes(cbt, NULL, &log) && log.count == 4, "The forgotten checkpoint lost changes");
+
+  vinil_cbt_reset(cbt);
+  fail_unless(vinil_cbt_epoch(cbt) == 2, "The epoch did not change");
+  fail_unless(changes(cbt, NULL, &log) && log.count == 0 && !changes(cbt, "day0", &log), "The reset kept changes");
+  fail_unless(vinil_cbt_close(cbt), "Cannot save cbt_bitmap.cbt");
+
+  cbt = vinil_cbt_open(copy_path, 1000, 4096);
+  fail_unless(cbt != NULL, "Cannot open cbt_bitmap_copy.cbt");
+  fail_unless(vinil_cbt_epoch(cbt) == 2 && changes(cbt, NULL, &log) && log.count == 0 && !changes(cbt, "monday", &log),
+              "A file which was in use was trusted");
+  vinil_cbt_close(cbt);
+
+  cbt = vinil_cbt_open(cbt_path, 1000, 8192);
+  fail_unless(cbt != NULL && vinil_cbt_epoch(cbt) == 3, "A file with another granularity was trusted");
+  vinil_cbt_close(cbt);
+
+  fail_unless(vinil_cbt_open(cbt_path, 1000, 1000) == NULL, "A granularity which is not a power of two was accepted");
+} END_TEST
+
+START_TEST (test_vinil_vhd_cbt) {
+  char vhd_path[] = "../tests/data/cbt_dynamic.vhd";
+  char cbt_path[] = "../tests/data/cbt_dynamic.cbt";
+  remove(vhd_path);
+  remove(cbt_path);
+
+  VinilVHD* vhd = vinil_vhd_create(vhd_path, 8*1024*1024, VINIL_VHD_DYNAMIC, VINIL_VHD_PREALLOC_SPARSE);
+  fail_unless(vhd != NULL, "Cannot create cbt_dynamic.vhd");
+  fail_unless(!vinil_vhd_cbt_checkpoint(vhd, "none"), "A checkpoint was created without tracking");
+  fail_unless(vinil_vhd_start_cbt(vhd, cbt_path, 0), "Cannot start the tracking");
+  fail_unless(!vinil_vhd_start_cbt(vhd, cbt_path, 0), "The tracking was started twice");
+
+  char buffer[512*8];
+  memset(buffer, 'a', sizeof(buffer));
+  fail_unless(vinil_vhd_pwrite(vhd, buffer, 130, 8), "Cannot write cbt_dynamic.vhd");
+  fail_unless(vinil_vhd_cbt_checkpoint(vhd, "full"), "Cannot create a checkpoint");
+
+  vinil_iovec iov[2];
+  iov[0].iov_base = buffer;
+  iov[0].iov_len = 512;
+  iov[1].iov_base = buffer + 512;
+  iov[1].iov_len = 512;
+  fail_unless(vinil_vhd_pwritev(vhd, iov, 2, 4096), "Cannot write cbt_dynamic.vhd");
+  fail_unless(vinil_vhd_seek(vhd, 8000, SEEK_SET) && vinil_vhd_write(vhd, buffer, 1), "Cannot write cbt_dynamic.vhd");
+  fail_unless(vinil_vhd_discard(vhd, 12288, 128), "Cannot discard sectors of cbt_dynamic.vhd");
+  fail_unless(vinil_vhd_pread(vhd, buffer, 0, 8), "Cannot read cbt_dynamic.vhd");
+  vinil_vhd_close(vhd);
+
+  // the changes survive the handle
+  vhd = vinil_vhd_open(vhd_path);
+  fail_unless(vhd != NULL, "Cannot open cbt_dynamic.vhd");
+  fail_unless(vinil_vhd_start_cbt(vhd, cbt_path, 0), "Cannot start the tracking");
+
+  ExtentLog log;
+  fail_unless(vhd_changes(vhd, "full", &log) && log.count == 3, "Wrong number of changed extents");
+  fail_unless(log.sectors[0] == 4096 && log.counts[0] == 128, "The vectored write was not tracked");
+  fail_unless(log.sectors[1] == 7936 && log.counts[1] == 128, "The sequential write was not tracked");
+  fail_unless(log.sectors[2] == 12288 && log.counts[2] == 128, "The discard was not tracked");
+  fail_unless(vhd_changes(vhd, NULL, &log) && log.count == 4 && log.sectors[0] == 128 && log.counts[0] == 128,
+              "The write before the checkpoint was not tracked");
+
+  fail_unless(vinil_vhd_stop_cbt(vhd), "Cannot stop the tracking");
+  fail_unless(!vinil_vhd_stop_cbt(vhd), "The tracking was stopped twice");
+  vinil_vhd_close(vhd);
+} END_TEST
+
+#define CBT_GRANULES        2048
+#define CBT_WRITERS         4
+#define CBT_CONCURRENT_CPS  VINIL_CBT_CHECKPOINTS
+
+typedef struct {
+  VinilVHD* vhd;
+  int id;
+  int ok;
+} CBTWriter;
+
+// each writer fills its own granules (of 8 sectors) one by one
+static void* cbt_writer(void* arg) {
+  CBTWriter* writer = (CBTWriter*)arg;
+  char buffer[512];
+  memset(buffer, 'w', sizeof(buffer));
+  writer->ok = 1;
+
+  uint64_t granule;
+  for (granule = writer->id; granule < CBT_GRANULES && writer->ok; granule += CBT_WRITERS)
+    writer->ok = vinil_vhd_pwrite(writer->vhd, buffer, granule * 8, 1);
+
+  return NULL;
+}
+
+static int mark_granules(void* arg, uint64_t sector, uint64_t count) {
+  char* listed = (char*)arg;
+  uint64_t granule;
+  for (granule = sector / 8; granule < (sector + count) / 8; granule++)
+    listed[granule] = 1;
+  return TRUE;
+}
+
+START_TEST (test_vinil_vhd_cbt_concurrent) {
+  char vhd_path[] = "../tests/data/cbt_concurrent.vhd";
+  char cbt_path[] = "../tests/data/cbt_concurrent.cbt";
+  remove(vhd_path);
+  remove(cbt_path);
+
+  VinilVHD* vhd = vinil_vhd_create(vhd_path, 8*1024*1024, VINIL_VHD_DYNAMIC, VINIL_VHD_PREALLOC_SPARSE);
+  fail_unless(vhd != NULL, "Cannot create cbt_concurrent.vhd");
+  vinil_vhd_close(vhd);
+
+  vhd = vinil_vhd_open_with_flags(vhd_path, VINIL_VHD_OPEN_WRITE_BACK);
+  fail_unless(vhd != NULL && vinil_vhd_start_cbt(vhd, cbt_path, 4096), "Cannot start the tracking");
+
+  CBTWriter writers[CBT_WRITERS];
+  vinil_thread threads[CBT_WRITERS];
+  int i;
+  for (i = 0; i < CBT_WRITERS; i++) {
+    writers[i].vhd = vhd;
+    writers[i].id = i;
+    fail_unless(vinil_thread_create(&threads[i], cbt_writer, &writers[i]), "Cannot create thread");
+  }
+
+  // the granules which are still empty right after a checkpoint are written after it
+  static char empty[CBT_CONCURRENT_CPS][CBT_GRANULES];
+  char buffer[512];
+  int cp;
+  for (cp = 0; cp < CBT_CONCURRENT_CPS; cp++) {
+    char name[16];
+    sprintf(name, "cp%d", cp);
+    fail_unless(vinil_vhd_cbt_checkpoint(vhd, name), "Cannot create a checkpoint");
+
+    uint64_t granule;
+    for (granule = 0; granule < CBT_GRANULES; granule++) {
+      fail_unless(vinil_vhd_pread(vhd, buffer, granule * 8, 1), "Cannot read cbt_concurrent.vhd");
+      empty[cp][granule] = buffer[0] == 0;
+    }
+  }
+
+  for (i = 0; i < CBT_WRITERS; i++) {
+    vinil_thread_join(threads[i]);
+    fail_unless(writers[i].ok, "Cannot write cbt_concurrent.vhd");
+  }
+
+  for (cp = 0; cp < CBT_CONCURRENT_CPS; cp++) {
+    char name[16], listed[CBT_GRANULES];
+    sprintf(name, "cp%d", cp);
+    memset(listed, 0, sizeof(listed));
+    fail_unless(vinil_vhd_cbt_changes(vhd, name, mark_granules, listed), "Cannot list the changes");
+
+    uint64_t granule;
+    for (granule = 0; granule < CBT_GRANULES; granule++)
+      fail_unless(!empty[cp][granule] || listed[granule], "A write after a checkpoint was not tracked");
+  }
+
+  // the buffered writes are in the file once a checkpoint is created
+  fail_unless(vinil_vhd_pwrite(vhd, buffer, 1, 1), "Cannot write cbt_concurrent.vhd");
+  fail_unless(vinil_write_back_extents(vhd->write_back) > 0, "The write was not buffered");
+  fail_unless(vinil_vhd_cbt_checkpoint(vhd, "last") && vinil_write_back_extents(vhd->write_back) == 0,
+              "A checkpoint did not write the buffered writes back");
+
+  fail_unless(vinil_vhd_stop_cbt(vhd), "Cannot stop the tracking");
+  vinil_vhd_close(vhd);
+} END_TEST
+
+Suite* func_suite(void) {
+  Suite *s = suite_create ("vinil");
+  TCase *tc_core = tcase_create ("CBT");
+  tcase_add_test (tc_core, test_vinil_cbt_changes);
+  tcase_add_test (tc_core, test_vinil_vhd_cbt);
+  tcase_add_test (tc_core, test_vinil_vhd_cbt_concurrent);
+  suite_add_tcase (s, tc_core);
+  return s;
+}
+
+int main() {
+  int number_failed;
+  Suite *s = func_suite();
+  SRunner *sr = srunner_create(s);
+  srunner_run_all(sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
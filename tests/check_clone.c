@@ -0,0 +1,112 @@
+/**
+ *  @file       check_clone.c
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <check.h>
+
+#include "vhd.h"
+#include "helpers.h"
+
+// a clone has the data and the type of its source, but it is a disk of its own
+static int is_clone(const char* path_a, const char* path_b) {
+  if (!same_data(path_a, path_b))
+    return FALSE;
+
+  VinilVHD* a = vinil_vhd_open_with_flags(path_a, VINIL_VHD_OPEN_READ_ONLY);
+  VinilVHD* b = vinil_vhd_open_with_flags(path_b, VINIL_VHD_OPEN_READ_ONLY);
+  int clone = a && b && a->footer->disk_type == b->footer->disk_type &&
+              memcmp(a->footer->uuid, b->footer->uuid, sizeof(vinil_uuid)) != 0;
+
+  if (a)
+    vinil_vhd_close(a);
+  if (b)
+    vinil_vhd_close(b);
+
+  return clone;
+}
+
+START_TEST (test_vinil_vhd_clone_fixed) {
+  char vhd_path[] = "../tests/data/clone_fixed.vhd";
+  char clone_path[] = "../tests/data/clone_fixed_copy.vhd";
+  remove(vhd_path);
+  remove(clone_path);
+
+  // data at both ends of a sparse 32MB disk
+  VinilVHD* vhd = vinil_vhd_create(vhd_path, 32*1024*1024, VINIL_VHD_FIXED, VINIL_VHD_PREALLOC_SPARSE);
+  fail_unless(vhd != NULL, "Cannot create clone_fixed.vhd");
+  fill_sectors(vhd, 3, 5, 'a');
+  fill_sectors(vhd, 20000, 8, 'b');
+  fill_sectors(vhd, 65536 - 8, 8, 'c');
+  vinil_vhd_close(vhd);
+
+  int method = -1;
+  fail_unless(vinil_vhd_clone(vhd_path, clone_path, &method), "Cannot clone clone_fixed.vhd");
+  fail_unless(method >= VINIL_VHD_CLONE_REFLINK && method <= VINIL_VHD_CLONE_COPY, "Wrong method");
+  fail_unless(is_clone(vhd_path, clone_path), "The clone has other data");
+
+  // the clone is independent of its source
+  vhd = vinil_vhd_open(clone_path);
+  fail_unless(vhd != NULL, "Cannot open clone_fixed_copy.vhd");
+  fill_sectors(vhd, 3, 1, 'z');
+  vinil_vhd_close(vhd);
+
+  vhd = vinil_vhd_open(vhd_path);
+  char buffer[512];
+  fail_unless(vinil_vhd_pread(vhd, buffer, 3, 1) && buffer[0] == 'a', "The source changed");
+  vinil_vhd_close(vhd);
+
+  fail_unless(!vinil_vhd_clone(vhd_path, clone_path, NULL), "The destination was overwritten");
+  fail_unless(!vinil_vhd_clone("../tests/data/clone_missing.vhd", "../tests/data/clone_missing_copy.vhd", NULL),
+              "A missing VHD was cloned");
+} END_TEST
+
+START_TEST (test_vinil_vhd_clone_dynamic) {
+  char vhd_path[] = "../tests/data/clone_dynamic.vhd";
+  char clone_path[] = "../tests/data/clone_dynamic_copy.vhd";
+  remove(vhd_path);
+  remove(clone_path);
+
+  VinilVHD* vhd = vinil_vhd_create(vhd_path, 16*1024*1024, VINIL_VHD_DYNAMIC, VINIL_VHD_PREALLOC_SPARSE);
+  fail_unless(vhd != NULL, "Cannot create clone_dynamic.vhd");
+  fill_sectors(vhd, 5000, 8, 'a');
+  fill_sectors(vhd, 30000, 8, 'b');
+  vinil_vhd_close(vhd);
+
+  fail_unless(vinil_vhd_clone(vhd_path, clone_path, NULL), "Cannot clone clone_dynamic.vhd");
+  fail_unless(is_clone(vhd_path, clone_path), "The clone has other data");
+
+  // both copies of the footer have the new UUID
+  vhd = vinil_vhd_open(clone_path);
+  fail_unless(vhd != NULL, "Cannot open clone_dynamic_copy.vhd");
+  VinilVHDFooter footer;
+  fail_unless(vinil_pread(vhd->fd, &footer, sizeof(footer), 0), "Cannot read the first footer");
+  vinil_vhd_footer_byte_swap(&footer);
+  fail_unless(memcmp(footer.uuid, vhd->footer->uuid, sizeof(vinil_uuid)) == 0 &&
+              vinil_checksum_vhd_footer(&footer) == footer.checksum, "Wrong first footer");
+  vinil_vhd_close(vhd);
+} END_TEST
+
+Suite* func_suite(void) {
+  Suite *s = suite_create ("vinil");
+  TCase *tc_core = tcase_create ("Clone");
+  tcase_add_test (tc_core, test_vinil_vhd_clone_fixed);
+  tcase_add_test (tc_core, test_vinil_vhd_clone_dynamic);
+  suite_add_tcase (s, tc_core);
+  return s;
+}
+
+int main() {
+  int number_failed;
+  Suite *s = func_suite();
+  SRunner *sr = srunner_create(s);
+  srunner_run_all(sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,163 @@
+/**
+ *  @file       check_compact.c
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <check.h>
+
+#include "vhd.h"
+
+#define BLOCK_SECTORS 4096
+
+static void fill_block(VinilVHD* vhd, uint64_t block, int value) {
+  char buffer[512*8];
+  memset(buffer, value, sizeof(buffer));
+  fail_unless(vinil_vhd_pwrite(vhd, buffer, block * BLOCK_SECTORS + 100, 8), "Cannot write the VHD");
+}
+
+static int block_has(VinilVHD* vhd, uint64_t block, int value) {
+  char buffer[512*8];
+  if (!vinil_vhd_pread(vhd, buffer, block * BLOCK_SECTORS + 100, 8))
+    return FALSE;
+
+  size_t i;
+  for (i = 0; i < sizeof(buffer); i++) {
+    if (buffer[i] != value)
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+static int has_data(VinilVHD* vhd) {
+  return block_has(vhd, 0, 0) && block_has(vhd, 1, 0) && block_has(vhd, 2, 0) && block_has(vhd, 3, 'b') &&
+         block_has(vhd, 5, 'a') && block_has(vhd, 7, 'd');
+}
+
+// blocks 5, 1, 3, 2 and 7 are allocated in this order, 1 and 2 only hold zeros
+static VinilVHD* create_sparse(const char* path) {
+  remove(path);
+
+  VinilVHD* vhd = vinil_vhd_create(path, 16*1024*1024, VINIL_VHD_DYNAMIC, VINIL_VHD_PREALLOC_SPARSE);
+  fail_unless(vhd != NULL, "Cannot create the VHD");
+
+  fill_block(vhd, 5, 'a');
+  fill_block(vhd, 1, 0);
+  fill_block(vhd, 3, 'b');
+  fill_block(vhd, 2, 'c');
+  fill_block(vhd, 7, 'd');
+  fill_block(vhd, 2, 0);
+
+  return vhd;
+}
+
+START_TEST (test_vinil_vhd_compact) {
+  char vhd_path[] = "../tests/data/compact_dynamic.vhd";
+  VinilVHD* vhd = create_sparse(vhd_path);
+  uint64_t block_size = 512 + 2*1024*1024;
+  uint64_t first_block = vhd->bat[5] * 512ULL;
+
+  VinilVHDCompactStats stats;
+  fail_unless(vinil_vhd_compact(vhd, 0, &stats), "Cannot compact compact_dynamic.vhd");
+  fail_unless(stats.finished && stats.checked_blocks == 5 && stats.freed_blocks == 2, "Wrong blocks freed");
+  fail_unless(stats.moved_blocks == 1 && vhd->bat[7] * 512ULL == first_block + block_size, "The last block was not moved");
+  fail_unless(stats.file_size == first_block + 3 * block_size + 512, "The file was not truncated");
+  fail_unless(vhd->bat[1] == VINIL_VHD_UNUSED_BLOCK && vhd->bat[2] == VINIL_VHD_UNUSED_BLOCK, "Empty blocks were kept");
+  fail_unless(has_data(vhd), "The data changed");
+
+  // the VHD is still usable, new blocks go after the compacted ones
+  fill_block(vhd, 6, 'e');
+  fail_unless(vhd->bat[6] * 512ULL == first_block + 3 * block_size, "The new block was not allocated at the end");
+  vinil_vhd_close(vhd);
+
+  vhd = vinil_vhd_open(vhd_path);
+  fail_unless(vhd != NULL, "Cannot open the compacted VHD");
+  fail_unless(has_data(vhd) && block_has(vhd, 6, 'e'), "The compacted VHD has other data");
+
+  // nothing is left to do
+  fail_unless(vinil_vhd_compact(vhd, 0, &stats), "Cannot compact compact_dynamic.vhd again");
+  fail_unless(stats.finished && stats.freed_blocks == 0 && stats.moved_blocks == 0, "A compacted VHD was changed");
+  vinil_vhd_close(vhd);
+} END_TEST
+
+START_TEST (test_vinil_vhd_compact_steps) {
+  char vhd_path[] = "../tests/data/compact_steps.vhd";
+  VinilVHD* vhd = create_sparse(vhd_path);
+  uint64_t file_size = (uint64_t)vinil_file_size(vhd->fd);
+
+  // one block is checked or moved at a time, the data can be read between the steps
+  VinilVHDCompactStats stats;
+  int steps = 0, freed = 0, moved = 0;
+  do {
+    fail_unless(vinil_vhd_compact(vhd, 1, &stats), "Cannot compact compact_steps.vhd");
+    fail_unless(stats.checked_blocks + stats.moved_blocks <= 1, "A step did too much");
+    fail_unless(stats.file_size <= file_size, "The file grew");
+    fail_unless(has_data(vhd), "The data changed during the compaction");
+    file_size = stats.file_size;
+    freed += stats.freed_blocks;
+    moved += stats.moved_blocks;
+    steps++;
+  } while (!stats.finished && steps < 100);
+
+  fail_unless(stats.finished && freed == 2 && moved == 1, "The steps did not compact the VHD");
+  fail_unless(steps == 6, "Wrong number of steps");
+  vinil_vhd_close(vhd);
+} END_TEST
+
+START_TEST (test_vinil_vhd_compact_differencing) {
+  char parent_path[] = "../tests/data/compact_parent.vhd";
+  char child_path[] = "../tests/data/compact_child.vhd";
+  remove(parent_path);
+  remove(child_path);
+
+  VinilVHD* vhd = vinil_vhd_create(parent_path, 8*1024*1024, VINIL_VHD_DYNAMIC, VINIL_VHD_PREALLOC_SPARSE);
+  fail_unless(vhd != NULL, "Cannot create compact_parent.vhd");
+  fill_block(vhd, 1, 'p');
+  vinil_vhd_close(vhd);
+
+  // the zeros written to the child hide the parent, they are not freed
+  vhd = vinil_vhd_create_differencing(child_path, parent_path);
+  fail_unless(vhd != NULL, "Cannot create compact_child.vhd");
+  fill_block(vhd, 1, 0);
+
+  VinilVHDCompactStats stats;
+  fail_unless(vinil_vhd_compact(vhd, 0, &stats), "Cannot compact compact_child.vhd");
+  fail_unless(stats.finished && stats.checked_blocks == 1 && stats.freed_blocks == 0, "Zeros of the child were freed");
+  fail_unless(block_has(vhd, 1, 0), "The parent shows through the child");
+  vinil_vhd_close(vhd);
+
+  vhd = vinil_vhd_open_with_flags(parent_path, VINIL_VHD_OPEN_READ_ONLY);
+  fail_unless(!vinil_vhd_compact(vhd, 0, NULL), "A read-only VHD was compacted");
+  vinil_vhd_close(vhd);
+
+  char fixed_path[] = "../tests/data/compact_fixed.vhd";
+  remove(fixed_path);
+  vhd = vinil_vhd_create(fixed_path, 1024*1024, VINIL_VHD_FIXED, VINIL_VHD_PREALLOC_SPARSE);
+  fail_unless(vhd != NULL && !vinil_vhd_compact(vhd, 0, NULL), "A fixed VHD was compacted");
+  vinil_vhd_close(vhd);
+} END_TEST
+
+Suite* func_suite(void) {
+  Suite *s = suite_create ("vinil");
+  TCase *tc_core = tcase_create ("Compact");
+  tcase_add_test (tc_core, test_vinil_vhd_compact);
+  tcase_add_test (tc_core, test_vinil_vhd_compact_steps);
+  tcase_add_test (tc_core, test_vinil_vhd_compact_differencing);
+  suite_add_tcase (s, tc_core);
+  return s;
+}
+
+int main() {
+  int number_failed;
+  Suite *s = func_suite();
+  SRunner *sr = srunner_create(s);
+  srunner_run_all(sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,91 @@
+/**
+ *  @file       check_convert.c
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <check.h>
+
+#include "vhd.h"
+#include "convert.h"
+#include "helpers.h"
+
+START_TEST (test_vinil_is_zero) {
+  uint8_t buffer[4096 + 64];
+  memset(buffer, 0, sizeof(buffer));
+  fail_unless(vinil_is_zero(buffer, sizeof(buffer)), "A zeroed buffer has data");
+  fail_unless(vinil_is_zero(buffer + 3, 1000), "An unaligned zeroed buffer has data");
+  fail_unless(vinil_is_zero(buffer, 0), "An empty buffer has data");
+
+  // every position is found, in the vectorized loop and in the tail
+  size_t i;
+  for (i = 0; i < sizeof(buffer); i += 37) {
+    buffer[i] = 1;
+    fail_unless(!vinil_is_zero(buffer, sizeof(buffer)), "A byte was missed");
+    fail_unless(!vinil_is_zero(buffer + i, sizeof(buffer) - i), "The first byte was missed");
+    buffer[i] = 0;
+  }
+} END_TEST
+
+START_TEST (test_vinil_convert_fixed) {
+  char fixed_path[] = "../tests/data/convert_fixed.vhd";
+  char dynamic_path[] = "../tests/data/convert_dynamic.vhd";
+  char copy_path[] = "../tests/data/convert_copy.vhd";
+  remove(fixed_path);
+  remove(dynamic_path);
+  remove(copy_path);
+
+  // 8 blocks of 2MB: data in blocks 1 and 7 (in its last sector), zeros written in block 3, holes elsewhere
+  VinilVHD* vhd = vinil_vhd_create(fixed_path, 16*1024*1024, VINIL_VHD_FIXED, VINIL_VHD_PREALLOC_SPARSE);
+  fail_unless(vhd != NULL, "Cannot create convert_fixed.vhd");
+  fill_sectors(vhd, 4096 + 17, 3, 'a');
+  fill_sectors(vhd, 3 * 4096 + 100, 8, 0);
+  fill_sectors(vhd, 8 * 4096 - 1, 1, 'z');
+  vinil_vhd_close(vhd);
+
+  VinilConvertStats stats;
+  fail_unless(vinil_convert(fixed_path, dynamic_path, 3, &stats), "Cannot convert convert_fixed.vhd");
+  fail_unless(stats.blocks == 8 && stats.written_blocks == 2, "Wrong number of written blocks");
+  fail_unless(stats.hole_blocks + stats.zero_blocks == 6 && stats.zero_blocks >= 1, "Wrong number of skipped blocks");
+  fail_unless(stats.bytes_read < 8 * 2*1024*1024, "The holes were read");
+  fail_unless(same_data(fixed_path, dynamic_path), "The converted VHD has other data");
+
+  vhd = vinil_vhd_open(dynamic_path);
+  fail_unless(vhd != NULL && vhd->footer->disk_type == VINIL_VHD_DYNAMIC, "The converted VHD is not dynamic");
+  fail_unless(vhd->bat[0] == VINIL_VHD_UNUSED_BLOCK && vhd->bat[1] != VINIL_VHD_UNUSED_BLOCK &&
+              vhd->bat[3] == VINIL_VHD_UNUSED_BLOCK && vhd->bat[7] != VINIL_VHD_UNUSED_BLOCK, "Wrong blocks allocated");
+  vinil_vhd_close(vhd);
+
+  // a dynamic source skips its unallocated blocks
+  fail_unless(vinil_convert(dynamic_path, copy_path, 0, &stats), "Cannot convert convert_dynamic.vhd");
+  fail_unless(stats.written_blocks == 2 && stats.hole_blocks == 6 && stats.bytes_read == 2 * 2*1024*1024,
+              "Unallocated blocks were read");
+  fail_unless(same_data(dynamic_path, copy_path), "The copy has other data");
+
+  fail_unless(!vinil_convert(fixed_path, copy_path, 1, NULL), "The destination was overwritten");
+  fail_unless(!vinil_convert("../tests/data/convert_missing.vhd", "../tests/data/convert_missing_copy.vhd", 1, NULL),
+              "A missing VHD was converted");
+} END_TEST
+
+Suite* func_suite(void) {
+  Suite *s = suite_create ("vinil");
+  TCase *tc_core = tcase_create ("Convert");
+  tcase_add_test (tc_core, test_vinil_is_zero);
+  tcase_add_test (tc_core, test_vinil_convert_fixed);
+  suite_add_tcase (s, tc_core);
+  return s;
+}
+
+int main() {
+  int number_failed;
+  Suite *s = func_suite();
+  SRunner *sr = srunner_create(s);
+  srunner_run_all(sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,114 @@
+/**
+ *  @file       check_diff.c
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <check.h>
+
+#include "vhd.h"
+#include "diff.h"
+#include "helpers.h"
+
+START_TEST (test_vinil_mismatch) {
+  uint8_t a[4096 + 64], b[4096 + 64];
+  memset(a, 'a', sizeof(a));
+  memset(b, 'a', sizeof(b));
+  fail_unless(vinil_mismatch(a, b, sizeof(a)) == sizeof(a), "Equal buffers differ");
+  fail_unless(vinil_mismatch(a + 3, b + 5, 1000) == 1000, "Unaligned equal buffers differ");
+  fail_unless(vinil_mismatch(a, b, 0) == 0, "Empty buffers differ");
+
+  // every position is found, in the vectorized loop and in the tail
+  size_t i;
+  for (i = 0; i < sizeof(a); i += 37) {
+    b[i] = 'b';
+    fail_unless(vinil_mismatch(a, b, sizeof(a)) == i, "Wrong position");
+    fail_unless(vinil_mismatch(a + i, b + i, sizeof(a) - i) == 0, "The first byte was missed");
+    fail_unless(i == 0 || vinil_mismatch(a + 1, b + 1, i - 1) == i - 1, "A byte after the end was compared");
+    b[i] = 'a';
+  }
+} END_TEST
+
+START_TEST (test_vinil_diff) {
+  char fixed_path[] = "../tests/data/diff_fixed.vhd";
+  char dynamic_path[] = "../tests/data/diff_dynamic.vhd";
+  char small_path[] = "../tests/data/diff_small.vhd";
+  remove(fixed_path);
+  remove(dynamic_path);
+  remove(small_path);
+
+  VinilVHD* a = vinil_vhd_create(fixed_path, 16*1024*1024, VINIL_VHD_FIXED, VINIL_VHD_PREALLOC_SPARSE);
+  VinilVHD* b = vinil_vhd_create(dynamic_path, 16*1024*1024, VINIL_VHD_DYNAMIC, VINIL_VHD_PREALLOC_SPARSE);
+  fail_unless(a != NULL && b != NULL, "Cannot create the VHDs");
+
+  // the same data, a run which ends inside the written sectors and one across two chunks
+  fill_sectors(a, 100, 8, 'a');
+  fill_sectors(b, 100, 8, 'a');
+  fill_sectors(a, 600, 4, 'm');
+  fill_sectors(b, 600, 2, 'm');
+  fill_sectors(b, 602, 2, 'n');
+  fill_sectors(a, 8190, 4, 'x');
+  fill_sectors(b, 8190, 4, 'y');
+
+  // data on one side only, and zeros which read as the hole of the other side
+  fill_sectors(a, 20000, 1, 'z');
+  fill_sectors(b, 30000, 8, 0);
+  vinil_vhd_close(a);
+  vinil_vhd_close(b);
+
+  ExtentLog log;
+  memset(&log, 0, sizeof(log));
+  log.limit = 16;
+
+  VinilDiffStats stats;
+  fail_unless(vinil_diff(fixed_path, dynamic_path, 3, log_extent, &log, &stats), "Cannot compare the VHDs");
+  fail_unless(log.count == 3 && stats.extents == 3, "Wrong number of extents");
+  fail_unless(log.sectors[0] == 602 && log.counts[0] == 2, "Wrong first extent");
+  fail_unless(log.sectors[1] == 8190 && log.counts[1] == 4, "The extent across two chunks was split");
+  fail_unless(log.sectors[2] == 20000 && log.counts[2] == 1, "Data on one side only was missed");
+  fail_unless(stats.sectors == 32768 && stats.differing_sectors == 7, "Wrong number of differing sectors");
+  // only the 4 blocks allocated in the dynamic VHD and the data of the fixed one are read
+  fail_unless(stats.skipped_sectors > 16000 && stats.bytes_read < 4 * 2*1024*1024 + 1024*1024,
+              "Unallocated sectors were read");
+
+  memset(&log, 0, sizeof(log));
+  log.limit = 16;
+  fail_unless(vinil_diff(dynamic_path, dynamic_path, 1, log_extent, &log, &stats), "Cannot compare a VHD with itself");
+  fail_unless(log.count == 0 && stats.differing_sectors == 0, "A VHD differs from itself");
+
+  // the callback stops the comparison
+  memset(&log, 0, sizeof(log));
+  log.limit = 1;
+  fail_unless(!vinil_diff(fixed_path, dynamic_path, 0, log_extent, &log, NULL), "The comparison was not stopped");
+  fail_unless(log.count == 1 && log.sectors[0] == 602, "Wrong extent before the stop");
+
+  a = vinil_vhd_create(small_path, 8*1024*1024, VINIL_VHD_DYNAMIC, VINIL_VHD_PREALLOC_SPARSE);
+  fail_unless(a != NULL, "Cannot create diff_small.vhd");
+  vinil_vhd_close(a);
+  fail_unless(!vinil_diff(small_path, dynamic_path, 2, NULL, NULL, NULL), "VHDs of other sizes were compared");
+  fail_unless(!vinil_diff("../tests/data/diff_missing.vhd", dynamic_path, 2, NULL, NULL, NULL),
+              "A missing VHD was compared");
+} END_TEST
+
+Suite* func_suite(void) {
+  Suite *s = suite_create ("vinil");
+  TCase *tc_core = tcase_create ("Diff");
+  tcase_add_test (tc_core, test_vinil_mismatch);
+  tcase_add_test (tc_core, test_vinil_diff);
+  suite_add_tcase (s, tc_core);
+  return s;
+}
+
+int main() {
+  int number_failed;
+  Suite *s = func_suite();
+  SRunner *sr = srunner_create(s);
+  srunner_run_all(sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
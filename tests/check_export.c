@@ -0,0 +1,173 @@
+/**
+ *  @file       check_export.c
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <check.h>
+
+#include "vhd.h"
+#include "export.h"
+
+#define DISK_SIZE (8*1024*1024)
+
+typedef struct {
+  int fd;
+  uint8_t* data;
+  size_t size;
+} StreamReader;
+
+static void* read_stream(void* arg) {
+  StreamReader* reader = (StreamReader*)arg;
+
+  ssize_t n;
+  while ((n = read(reader->fd, reader->data + reader->size, 7001)) > 0)
+    reader->size += n;
+
+  return NULL;
+}
+
+// the output goes through a pipe, so every write must follow the previous one
+static uint8_t* export_pipe(const char* path, int format, VinilExportStats* stats, size_t* size, int* ok) {
+  int fds[2];
+  fail_unless(pipe(fds) == 0, "Cannot create a pipe");
+
+  StreamReader reader;
+  reader.fd = fds[0];
+  reader.data = (uint8_t*)malloc(DISK_SIZE + 512 + 7001);
+  reader.size = 0;
+
+  vinil_thread thread;
+  fail_unless(vinil_thread_create(&thread, read_stream, &reader), "Cannot start the reader");
+
+  *ok = vinil_export(path, fds[1], format, stats);
+  close(fds[1]);
+  vinil_thread_join(thread);
+  close(fds[0]);
+
+  *size = reader.size;
+  return reader.data;
+}
+
+static void create_disk(const char* path, int disk_type) {
+  remove(path);
+
+  VinilVHD* vhd = vinil_vhd_create(path, DISK_SIZE, disk_type, VINIL_VHD_PREALLOC_SPARSE);
+  fail_unless(vhd != NULL, "Cannot create the VHD");
+
+  char buffer[512*4];
+  memset(buffer, 'a', sizeof(buffer));
+  fail_unless(vinil_vhd_pwrite(vhd, buffer, 10, 4), "Cannot write the VHD");
+  memset(buffer, 'b', sizeof(buffer));
+  fail_unless(vinil_vhd_pwrite(vhd, buffer, 3 * 4096 + 4092, 4), "Cannot write the VHD");
+  vinil_vhd_close(vhd);
+}
+
+static int is_disk(const uint8_t* data) {
+  size_t i;
+  for (i = 0; i < DISK_SIZE; i++) {
+    uint8_t expected = 0;
+    if (i >= 10 * 512 && i < 14 * 512)
+      expected = 'a';
+    else if (i >= DISK_SIZE - 4 * 512)
+      expected = 'b';
+    if (data[i] != expected)
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+START_TEST (test_vinil_vhd_block_status) {
+  char vhd_path[] = "../tests/data/export_status.vhd";
+  create_disk(vhd_path, VINIL_VHD_DYNAMIC);
+
+  VinilVHD* vhd = vinil_vhd_open(vhd_path);
+  fail_unless(vhd != NULL, "Cannot open export_status.vhd");
+
+  int allocated;
+  uint64_t run;
+  fail_unless(vinil_vhd_block_status(vhd, 100, 10000, &allocated, &run), "Cannot get the status");
+  fail_unless(allocated && run == 4096 - 100, "Wrong status of the first block");
+  fail_unless(vinil_vhd_block_status(vhd, 4096, 3 * 4096, &allocated, &run), "Cannot get the status");
+  fail_unless(!allocated && run == 2 * 4096, "Wrong status of the unallocated blocks");
+  fail_unless(vinil_vhd_block_status(vhd, 4096 + 5, 10, &allocated, &run) && !allocated && run == 10,
+              "The run passed the range");
+  fail_unless(!vinil_vhd_block_status(vhd, 4 * 4096 - 1, 2, &allocated, &run), "An invalid range was accepted");
+  vinil_vhd_close(vhd);
+} END_TEST
+
+START_TEST (test_vinil_export_dynamic) {
+  char vhd_path[] = "../tests/data/export_dynamic.vhd";
+  create_disk(vhd_path, VINIL_VHD_DYNAMIC);
+
+  // the two unallocated blocks are not read
+  VinilExportStats stats;
+  size_t size;
+  int ok;
+  uint8_t* data = export_pipe(vhd_path, VINIL_EXPORT_RAW, &stats, &size, &ok);
+  fail_unless(ok, "Cannot export export_dynamic.vhd");
+  fail_unless(size == DISK_SIZE && stats.bytes_written == DISK_SIZE, "Wrong size of the raw image");
+  fail_unless(stats.zero_bytes == 2 * 2*1024*1024 && stats.bytes_read == 2 * 2*1024*1024, "Unallocated blocks were read");
+  fail_unless(is_disk(data), "The raw image has other data");
+  free(data);
+
+  // a fixed VHD is the raw image followed by a footer
+  data = export_pipe(vhd_path, VINIL_EXPORT_VHD, &stats, &size, &ok);
+  fail_unless(ok && size == DISK_SIZE + 512 && stats.bytes_written == size, "Cannot export a fixed VHD");
+
+  char copy_path[] = "../tests/data/export_copy.vhd";
+  FILE* f = fopen(copy_path, "wb");
+  fail_unless(f != NULL && fwrite(data, 1, size, f) == size, "Cannot write export_copy.vhd");
+  fclose(f);
+  free(data);
+
+  VinilVHD* vhd = vinil_vhd_open_with_flags(copy_path, VINIL_VHD_OPEN_READ_ONLY);
+  fail_unless(vhd != NULL && vhd->footer->disk_type == VINIL_VHD_FIXED && vhd->footer->current_size == DISK_SIZE,
+              "The exported VHD is not a fixed VHD");
+  vinil_vhd_close(vhd);
+
+  data = export_pipe("../tests/data/export_missing.vhd", VINIL_EXPORT_RAW, NULL, &size, &ok);
+  fail_unless(!ok && size == 0, "A missing VHD was exported");
+  free(data);
+} END_TEST
+
+START_TEST (test_vinil_export_fixed) {
+  char vhd_path[] = "../tests/data/export_fixed.vhd";
+  create_disk(vhd_path, VINIL_VHD_FIXED);
+
+  VinilExportStats stats;
+  size_t size;
+  int ok;
+  uint8_t* data = export_pipe(vhd_path, VINIL_EXPORT_RAW, &stats, &size, &ok);
+  fail_unless(ok && size == DISK_SIZE, "Cannot export export_fixed.vhd");
+  fail_unless(stats.bytes_read + stats.zero_bytes == DISK_SIZE, "Wrong number of bytes");
+  fail_unless(is_disk(data), "The raw image has other data");
+  free(data);
+} END_TEST
+
+Suite* func_suite(void) {
+  Suite *s = suite_create ("vinil");
+  TCase *tc_core = tcase_create ("Export");
+  tcase_add_test (tc_core, test_vinil_vhd_block_status);
+  tcase_add_test (tc_core, test_vinil_export_dynamic);
+  tcase_add_test (tc_core, test_vinil_export_fixed);
+  suite_add_tcase (s, tc_core);
+  return s;
+}
+
+int main() {
+  int number_failed;
+  Suite *s = func_suite();
+  SRunner *sr = srunner_create(s);
+  srunner_run_all(sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
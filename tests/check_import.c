@@ -0,0 +1,156 @@
+/**
+ *  @file       check_import.c
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <check.h>
+
+#include "vhd.h"
+#include "import.h"
+
+#define STREAM_SIZE (5*2*1024*1024 + 1000)
+
+typedef struct {
+  int fd;
+  size_t size;
+} StreamWriter;
+
+// byte i of the stream, blocks 1 and 3 are zeros
+static uint8_t stream_byte(size_t i) {
+  size_t block = i / (2*1024*1024);
+  return block == 1 || block == 3 ? 0 : (uint8_t)(i % 251 + 1);
+}
+
+// the stream is written in odd sized pieces, as a download would be
+static void* write_stream(void* arg) {
+  StreamWriter* writer = (StreamWriter*)arg;
+  uint8_t piece[7001];
+
+  size_t i = 0;
+  while (i < writer->size) {
+    size_t n = writer->size - i < sizeof(piece) ? writer->size - i : sizeof(piece);
+    size_t j;
+    for (j = 0; j < n; j++)
+      piece[j] = stream_byte(i + j);
+    if (write(writer->fd, piece, n) != (ssize_t)n)
+      break;
+    i += n;
+  }
+
+  close(writer->fd);
+
+  return NULL;
+}
+
+static int import_pipe(const char* path, size_t stream_size, uint64_t size, int disk_type, VinilImportStats* stats) {
+  int fds[2];
+  fail_unless(pipe(fds) == 0, "Cannot create a pipe");
+
+  StreamWriter writer;
+  writer.fd = fds[1];
+  writer.size = stream_size;
+
+  vinil_thread thread;
+  fail_unless(vinil_thread_create(&thread, write_stream, &writer), "Cannot start the writer");
+
+  int ok = vinil_import(fds[0], path, size, disk_type, stats);
+
+  // whatever the import did not read is drained, so the writer finishes
+  char drain[4096];
+  while (read(fds[0], drain, sizeof(drain)) > 0);
+  vinil_thread_join(thread);
+  close(fds[0]);
+
+  return ok;
+}
+
+static int has_stream(const char* path, uint64_t size) {
+  VinilVHD* vhd = vinil_vhd_open_with_flags(path, VINIL_VHD_OPEN_READ_ONLY);
+  int same = vhd && vhd->footer->current_size == size;
+
+  uint8_t buffer[512*64];
+  uint64_t sector;
+  for (sector = 0; same && sector < size / 512; sector += 64) {
+    uint64_t count = size / 512 - sector < 64 ? size / 512 - sector : 64;
+    same = vinil_vhd_pread(vhd, buffer, sector, count);
+
+    size_t i;
+    for (i = 0; same && i < count * 512; i++)
+      same = buffer[i] == (sector * 512 + i < STREAM_SIZE ? stream_byte(sector * 512 + i) : 0);
+  }
+
+  if (vhd)
+    vinil_vhd_close(vhd);
+
+  return same;
+}
+
+START_TEST (test_vinil_import_fixed) {
+  char vhd_path[] = "../tests/data/import_fixed.vhd";
+  remove(vhd_path);
+
+  // the disk takes the size of the stream, rounded up to a sector
+  VinilImportStats stats;
+  fail_unless(import_pipe(vhd_path, STREAM_SIZE, 0, VINIL_VHD_FIXED, &stats), "Cannot import import_fixed.vhd");
+  fail_unless(stats.blocks == 6 && stats.zero_blocks == 2 && stats.written_blocks == 4, "Wrong blocks written");
+  fail_unless(stats.bytes_read == STREAM_SIZE, "Wrong number of bytes read");
+  fail_unless(has_stream(vhd_path, (STREAM_SIZE + 511) / 512 * 512), "import_fixed.vhd has other data");
+
+  VinilVHD* vhd = vinil_vhd_open(vhd_path);
+  fail_unless(vhd != NULL && vhd->footer->disk_type == VINIL_VHD_FIXED, "import_fixed.vhd is not fixed");
+  fail_unless(vinil_file_size(vhd->fd) == (STREAM_SIZE + 511) / 512 * 512 + 512, "Wrong size of import_fixed.vhd");
+  vinil_vhd_close(vhd);
+
+  // the destination is never overwritten
+  fail_unless(!import_pipe(vhd_path, 1024, 0, VINIL_VHD_FIXED, NULL), "import_fixed.vhd was overwritten");
+} END_TEST
+
+START_TEST (test_vinil_import_dynamic) {
+  char vhd_path[] = "../tests/data/import_dynamic.vhd";
+  remove(vhd_path);
+
+  // the disk is larger than the stream, the rest reads as zeros
+  VinilImportStats stats;
+  fail_unless(import_pipe(vhd_path, STREAM_SIZE, 16*1024*1024, VINIL_VHD_DYNAMIC, &stats),
+              "Cannot import import_dynamic.vhd");
+  fail_unless(stats.blocks == 6 && stats.zero_blocks == 2 && stats.written_blocks == 4, "Wrong blocks written");
+  fail_unless(has_stream(vhd_path, 16*1024*1024), "import_dynamic.vhd has other data");
+
+  VinilVHD* vhd = vinil_vhd_open(vhd_path);
+  fail_unless(vhd != NULL && vhd->footer->disk_type == VINIL_VHD_DYNAMIC, "import_dynamic.vhd is not dynamic");
+  fail_unless(vhd->bat[0] != VINIL_VHD_UNUSED_BLOCK && vhd->bat[1] == VINIL_VHD_UNUSED_BLOCK &&
+              vhd->bat[3] == VINIL_VHD_UNUSED_BLOCK && vhd->bat[5] != VINIL_VHD_UNUSED_BLOCK &&
+              vhd->bat[6] == VINIL_VHD_UNUSED_BLOCK, "Wrong blocks allocated");
+  vinil_vhd_close(vhd);
+
+  // a stream longer than the disk is refused
+  remove(vhd_path);
+  fail_unless(!import_pipe(vhd_path, STREAM_SIZE, 8*1024*1024, VINIL_VHD_DYNAMIC, NULL), "A longer stream was imported");
+  fail_unless(vinil_vhd_open_with_flags(vhd_path, VINIL_VHD_OPEN_READ_ONLY) == NULL, "The destination was kept");
+  fail_unless(!import_pipe(vhd_path, 1024, 0, VINIL_VHD_DYNAMIC, NULL), "A dynamic VHD without size was imported");
+} END_TEST
+
+Suite* func_suite(void) {
+  Suite *s = suite_create ("vinil");
+  TCase *tc_core = tcase_create ("Import");
+  tcase_add_test (tc_core, test_vinil_import_fixed);
+  tcase_add_test (tc_core, test_vinil_import_dynamic);
+  suite_add_tcase (s, tc_core);
+  return s;
+}
+
+int main() {
+  int number_failed;
+  Suite *s = func_suite();
+  SRunner *sr = srunner_create(s);
+  srunner_run_all(sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,176 @@
+/**
+ *  @file       check_merge.c
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <check.h>
+
+#include "vhd.h"
+#include "helpers.h"
+
+static int sectors_have(VinilVHD* vhd, uint64_t sector, uint64_t count, int value) {
+  char buffer[512*16];
+  if (!vinil_vhd_pread(vhd, buffer, sector, count))
+    return FALSE;
+
+  uint64_t i;
+  for (i = 0; i < count * 512; i++) {
+    if (buffer[i] != value)
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+// block 0 is shared, blocks 1 and 3 only exist in the child and block 2 only in the parent
+static void create_chain(const char* parent_path, const char* child_path, int disk_type) {
+  remove(parent_path);
+  remove(child_path);
+
+  VinilVHD* vhd = vinil_vhd_create(parent_path, 8*1024*1024, disk_type, VINIL_VHD_PREALLOC_SPARSE);
+  fail_unless(vhd != NULL, "Cannot create the parent");
+  fill_sectors(vhd, 100, 8, 'p');
+  fill_sectors(vhd, 2 * 4096, 8, 'q');
+  vinil_vhd_close(vhd);
+
+  vhd = vinil_vhd_create_differencing(child_path, parent_path);
+  fail_unless(vhd != NULL, "Cannot create the child");
+  fill_sectors(vhd, 104, 8, 'c');
+  fill_sectors(vhd, 4096 + 7, 16, 'n');
+  fill_sectors(vhd, 4 * 4096 - 16, 16, 'e');
+  vinil_vhd_close(vhd);
+}
+
+static int has_data(const char* path) {
+  VinilVHD* vhd = vinil_vhd_open_with_flags(path, VINIL_VHD_OPEN_READ_ONLY);
+  int ok = vhd && sectors_have(vhd, 96, 4, 0) && sectors_have(vhd, 100, 4, 'p') && sectors_have(vhd, 104, 8, 'c') &&
+           sectors_have(vhd, 4096, 7, 0) && sectors_have(vhd, 4096 + 7, 16, 'n') &&
+           sectors_have(vhd, 2 * 4096, 8, 'q') && sectors_have(vhd, 4 * 4096 - 16, 16, 'e');
+
+  if (vhd)
+    vinil_vhd_close(vhd);
+
+  return ok;
+}
+
+typedef struct {
+  int calls;
+  int cancel_at;
+  uint64_t last_merged;
+} MergeLog;
+
+static int log_progress(void* arg, const VinilVHDMergeStats* stats) {
+  MergeLog* log = (MergeLog*)arg;
+  log->calls++;
+  fail_unless(stats->merged_blocks > log->last_merged && stats->merged_blocks <= stats->blocks,
+              "Wrong progress");
+  log->last_merged = stats->merged_blocks;
+
+  return log->calls != log->cancel_at;
+}
+
+START_TEST (test_vinil_vhd_merge) {
+  char parent_path[] = "../tests/data/merge_parent.vhd";
+  char child_path[] = "../tests/data/merge_child.vhd";
+  create_chain(parent_path, child_path, VINIL_VHD_DYNAMIC);
+
+  VinilVHD* vhd = vinil_vhd_open(parent_path);
+  fail_unless(vhd != NULL, "Cannot open merge_parent.vhd");
+  int64_t parent_size = vinil_file_size(vhd->fd);
+  vinil_vhd_close(vhd);
+
+  MergeLog log;
+  memset(&log, 0, sizeof(log));
+  VinilVHDMergeStats stats;
+  fail_unless(vinil_vhd_merge(child_path, 3, log_progress, &log, &stats), "Cannot merge merge_child.vhd");
+  fail_unless(stats.blocks == 3 && stats.merged_blocks == 3 && stats.new_blocks == 2, "Wrong blocks merged");
+  fail_unless(log.calls == 3 && stats.bytes >= 2 * 2*1024*1024, "Wrong progress");
+  fail_unless(stats.copy_range_bytes <= stats.bytes, "Wrong bytes");
+
+  // the parent has the data of the child, which still shows the same sectors
+  fail_unless(has_data(parent_path), "The parent does not have the data of the child");
+  fail_unless(has_data(child_path), "The child changed");
+
+  vhd = vinil_vhd_open(parent_path);
+  fail_unless(vhd != NULL, "Cannot open merge_parent.vhd");
+  // block 0 was merged into a copy, the old one is a hole
+  fail_unless(vinil_file_size(vhd->fd) == parent_size + 3 * (512 + 2*1024*1024), "Wrong size of the parent");
+  fail_unless(vhd->bat[1] != VINIL_VHD_UNUSED_BLOCK && vhd->bat[3] != VINIL_VHD_UNUSED_BLOCK, "The BAT was not updated");
+
+  // the new blocks are ordinary blocks of the parent
+  fill_sectors(vhd, 4096, 1, 'x');
+  fail_unless(sectors_have(vhd, 4096, 1, 'x') && sectors_have(vhd, 4096 + 7, 16, 'n'), "Cannot write a merged block");
+  vinil_vhd_close(vhd);
+
+  fail_unless(!vinil_vhd_merge(parent_path, 1, NULL, NULL, NULL), "A dynamic VHD was merged");
+} END_TEST
+
+START_TEST (test_vinil_vhd_merge_cancel) {
+  char parent_path[] = "../tests/data/merge_cancel_parent.vhd";
+  char child_path[] = "../tests/data/merge_cancel_child.vhd";
+  create_chain(parent_path, child_path, VINIL_VHD_DYNAMIC);
+
+  VinilVHD* vhd = vinil_vhd_open(parent_path);
+  int64_t parent_size = vinil_file_size(vhd->fd);
+  uint32_t shared_block = vhd->bat[0];
+  vinil_vhd_close(vhd);
+
+  // block 0, which both have, is merged first
+  MergeLog log;
+  memset(&log, 0, sizeof(log));
+  log.cancel_at = 1;
+  fail_unless(!vinil_vhd_merge(child_path, 1, log_progress, &log, NULL), "The merge was not cancelled");
+  fail_unless(log.calls == 1, "The merge went on");
+
+  // the parent keeps its blocks, the space reserved for the new ones is given back
+  vhd = vinil_vhd_open(parent_path);
+  fail_unless(vhd != NULL, "Cannot open the parent of a cancelled merge");
+  fail_unless(vinil_file_size(vhd->fd) == parent_size, "The reserved blocks were kept");
+  fail_unless(vhd->bat[1] == VINIL_VHD_UNUSED_BLOCK && vhd->bat[3] == VINIL_VHD_UNUSED_BLOCK, "The BAT was updated");
+  fail_unless(sectors_have(vhd, 2 * 4096, 8, 'q'), "The parent lost its data");
+  fail_unless(vhd->bat[0] == shared_block && sectors_have(vhd, 100, 8, 'p') && sectors_have(vhd, 108, 4, 0),
+              "The block of the parent was changed");
+  vinil_vhd_close(vhd);
+
+  fail_unless(has_data(child_path), "The child changed");
+
+  // the merge can be done again
+  fail_unless(vinil_vhd_merge(child_path, 0, NULL, NULL, NULL), "Cannot merge after a cancelled merge");
+  fail_unless(has_data(parent_path), "The parent does not have the data of the child");
+} END_TEST
+
+START_TEST (test_vinil_vhd_merge_fixed) {
+  char parent_path[] = "../tests/data/merge_fixed_parent.vhd";
+  char child_path[] = "../tests/data/merge_fixed_child.vhd";
+  create_chain(parent_path, child_path, VINIL_VHD_FIXED);
+
+  VinilVHDMergeStats stats;
+  fail_unless(vinil_vhd_merge(child_path, 2, NULL, NULL, &stats), "Cannot merge merge_fixed_child.vhd");
+  fail_unless(stats.blocks == 3 && stats.new_blocks == 0 && stats.bytes == 40 * 512, "Wrong sectors merged");
+  fail_unless(has_data(parent_path), "The parent does not have the data of the child");
+} END_TEST
+
+Suite* func_suite(void) {
+  Suite *s = suite_create ("vinil");
+  TCase *tc_core = tcase_create ("Merge");
+  tcase_add_test (tc_core, test_vinil_vhd_merge);
+  tcase_add_test (tc_core, test_vinil_vhd_merge_cancel);
+  tcase_add_test (tc_core, test_vinil_vhd_merge_fixed);
+  suite_add_tcase (s, tc_core);
+  return s;
+}
+
+int main() {
+  int number_failed;
+  Suite *s = func_suite();
+  SRunner *sr = srunner_create(s);
+  srunner_run_all(sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,419 @@
+/**
+ *  @file       check_nbd.c
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <check.h>
+
+#include "vhd.h"
+#include "nbd.h"
+
+#define SOCKET_PATH "../tests/data/nbd.sock"
+
+#define OPT_EXPORT_NAME         1
+#define OPT_GO                  7
+#define OPT_STRUCTURED_REPLY    8
+#define OPT_SET_META_CONTEXT    10
+
+#define CMD_READ                0
+#define CMD_WRITE               1
+#define CMD_DISC                2
+#define CMD_FLUSH               3
+#define CMD_TRIM                4
+#define CMD_WRITE_ZEROES        6
+#define CMD_BLOCK_STATUS        7
+
+#define REPLY_TYPE_OFFSET_DATA  1
+#define REPLY_TYPE_OFFSET_HOLE  2
+#define REPLY_TYPE_BLOCK_STATUS 5
+
+typedef struct {
+  uint16_t flags;
+  uint16_t type;
+  uint64_t cookie;
+  uint32_t length;
+  uint8_t payload[64*1024 + 8];
+} Chunk;
+
+static void put16(uint8_t* p, uint16_t value) {
+  p[0] = (uint8_t)(value >> 8);
+  p[1] = (uint8_t)value;
+}
+
+static void put32(uint8_t* p, uint32_t value) {
+  put16(p, (uint16_t)(value >> 16));
+  put16(p + 2, (uint16_t)value);
+}
+
+static void put64(uint8_t* p, uint64_t value) {
+  put32(p, (uint32_t)(value >> 32));
+  put32(p + 4, (uint32_t)value);
+}
+
+static uint32_t get32(const uint8_t* p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint64_t get64(const uint8_t* p) {
+  return ((uint64_t)get32(p) << 32) | get32(p + 4);
+}
+
+static void receive(int fd, void* buffer, size_t size) {
+  fail_unless(vinil_read_stream(fd, buffer, size) == (int64_t)size, "The server closed the connection");
+}
+
+static void* serve(void* arg) {
+  vinil_nbd_run((VinilNBD*)arg);
+  return NULL;
+}
+
+static int connect_server(void) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, SOCKET_PATH);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  fail_unless(fd >= 0 && connect(fd, (struct sockaddr*)&address, sizeof(address)) == 0, "Cannot connect");
+
+  uint8_t hello[18];
+  receive(fd, hello, sizeof(hello));
+  fail_unless(memcmp(hello, "NBDMAGICIHAVEOPT", 16) == 0 && hello[17] == 3, "Wrong greeting");
+
+  uint8_t client_flags[4];
+  put32(client_flags, 3);
+  fail_unless(vinil_write_stream(fd, client_flags, 4), "Cannot send the client flags");
+
+  return fd;
+}
+
+static void send_option(int fd, uint32_t option, const void* data, uint32_t size) {
+  uint8_t header[16];
+  memcpy(header, "IHAVEOPT", 8);
+  put32(header + 8, option);
+  put32(header + 12, size);
+  fail_unless(vinil_write_stream(fd, header, 16) && vinil_write_stream(fd, data, size), "Cannot send an option");
+}
+
+// returns the type of the reply, its data is discarded
+static uint32_t receive_option_reply(int fd, uint32_t option) {
+  uint8_t header[20];
+  receive(fd, header, sizeof(header));
+  fail_unless(get64(header) == 0x0003e889045565a9ULL && get32(header + 8) == option, "Wrong option reply");
+
+  uint8_t data[256];
+  uint32_t size = get32(header + 16);
+  fail_unless(size <= sizeof(data), "Option reply too large");
+  receive(fd, data, size);
+
+  return get32(header + 12);
+}
+
+// structured replies, base:allocation and NBD_OPT_GO, as QEMU does it
+static int connect_structured(const char* name, uint64_t* size, uint16_t* flags) {
+  int fd = connect_server();
+  send_option(fd, OPT_STRUCTURED_REPLY, NULL, 0);
+  fail_unless(receive_option_reply(fd, OPT_STRUCTURED_REPLY) == 1, "Structured replies were refused");
+
+  uint8_t meta[64];
+  uint32_t name_size = (uint32_t)strlen(name);
+  put32(meta, name_size);
+  memcpy(meta + 4, name, name_size);
+  put32(meta + 4 + name_size, 1);
+  put32(meta + 8 + name_size, 15);
+  memcpy(meta + 12 + name_size, "base:allocation", 15);
+  send_option(fd, OPT_SET_META_CONTEXT, meta, 27 + name_size);
+  uint32_t type = receive_option_reply(fd, OPT_SET_META_CONTEXT);
+  if (type == 0x80000006) {
+    close(fd);
+    return -1;
+  }
+  fail_unless(type == 4, "base:allocation is missing");
+  fail_unless(receive_option_reply(fd, OPT_SET_META_CONTEXT) == 1, "Wrong end of the contexts");
+
+  uint8_t go[64];
+  put32(go, name_size);
+  memcpy(go + 4, name, name_size);
+  put16(go + 4 + name_size, 0);
+  send_option(fd, OPT_GO, go, 6 + name_size);
+
+  for (;;) {
+    uint8_t header[20];
+    receive(fd, header, sizeof(header));
+    type = get32(header + 12);
+    uint8_t data[64];
+    receive(fd, data, get32(header + 16));
+    if (type == 0x80000006) {
+      close(fd);
+      return -1;
+    }
+    if (type == 1)
+      break;
+    if (type == 3 && data[1] == 0) {
+      *size = get64(data + 2);
+      *flags = (uint16_t)((data[10] << 8) | data[11]);
+    }
+  }
+
+  return fd;
+}
+
+static void send_request(int fd, uint16_t type, uint16_t flags, uint64_t cookie, uint64_t offset, uint32_t length,
+                         const void* data) {
+  uint8_t header[28];
+  put32(header, 0x25609513);
+  put16(header + 4, flags);
+  put16(header + 6, type);
+  put64(header + 8, cookie);
+  put64(header + 16, offset);
+  put32(header + 24, length);
+  fail_unless(vinil_write_stream(fd, header, 28), "Cannot send a request");
+  if (type == CMD_WRITE)
+    fail_unless(vinil_write_stream(fd, data, length), "Cannot send the data");
+}
+
+// returns the error of a simple reply, the cookie must be known to find the size of a read
+static uint32_t receive_simple_reply(int fd, uint64_t* cookie) {
+  uint8_t header[16];
+  receive(fd, header, sizeof(header));
+  fail_unless(get32(header) == 0x67446698, "Wrong simple reply");
+  *cookie = get64(header + 8);
+
+  return get32(header + 4);
+}
+
+static uint32_t request(int fd, uint16_t type, uint16_t flags, uint64_t offset, uint32_t length, const void* data) {
+  uint64_t cookie;
+  send_request(fd, type, flags, 77, offset, length, data);
+  uint32_t error = receive_simple_reply(fd, &cookie);
+  fail_unless(cookie == 77, "Wrong cookie");
+
+  return error;
+}
+
+static void receive_chunk(int fd, Chunk* chunk) {
+  uint8_t header[20];
+  receive(fd, header, sizeof(header));
+  fail_unless(get32(header) == 0x668e33ef, "Wrong structured reply");
+  chunk->flags = (uint16_t)((header[4] << 8) | header[5]);
+  chunk->type = (uint16_t)((header[6] << 8) | header[7]);
+  chunk->cookie = get64(header + 8);
+  chunk->length = get32(header + 16);
+  fail_unless(chunk->length <= sizeof(chunk->payload), "Chunk too large");
+  receive(fd, chunk->payload, chunk->length);
+}
+
+START_TEST (test_vinil_nbd_simple) {
+  char vhd_path[] = "../tests/data/nbd_simple.vhd";
+  remove(vhd_path);
+
+  VinilVHD* vhd = vinil_vhd_create(vhd_path, 8*1024*1024, VINIL_VHD_DYNAMIC, VINIL_VHD_PREALLOC_SPARSE);
+  fail_unless(vhd != NULL, "Cannot create nbd_simple.vhd");
+
+  VinilNBD* nbd = vinil_nbd_create(4);
+  fail_unless(nbd != NULL, "Cannot create the server");
+  fail_unless(vinil_nbd_add_export(nbd, "disk", vhd, FALSE), "Cannot add the export");
+  fail_unless(!vinil_nbd_add_export(nbd, "disk", vhd, FALSE), "An export was added twice");
+  fail_unless(vinil_nbd_listen_unix(nbd, SOCKET_PATH), "Cannot listen");
+
+  vinil_thread thread;
+  fail_unless(vinil_thread_create(&thread, serve, nbd), "Cannot start the server");
+
+  // the old NBD_OPT_EXPORT_NAME, which nbd-client and the kernel use
+  int fd = connect_server();
+  send_option(fd, OPT_EXPORT_NAME, "disk", 4);
+  uint8_t reply[10];
+  receive(fd, reply, sizeof(reply));
+  fail_unless(get64(reply) == 8*1024*1024, "Wrong size");
+  fail_unless((reply[9] & 0x02) == 0 && (reply[9] & 0x04) && (reply[9] & 0x20), "Wrong transmission flags");
+
+  uint8_t* data = (uint8_t*)malloc(64*1024);
+  uint8_t* check = (uint8_t*)malloc(64*1024);
+  int i;
+  for (i = 0; i < 64*1024; i++)
+    data[i] = (uint8_t)(i * 31 + i / 512);
+
+  fail_unless(request(fd, CMD_WRITE, 0, 1024*1024, 64*1024, data) == 0, "Cannot write");
+  fail_unless(request(fd, CMD_WRITE, 1, 5*1024*1024, 512, data) == 0, "Cannot write with FUA");
+  fail_unless(request(fd, CMD_WRITE, 0, 100, 512, data) == 22, "An unaligned write was accepted");
+  fail_unless(request(fd, CMD_WRITE, 0, 8*1024*1024, 512, data) == 28, "A write past the end was accepted");
+  fail_unless(request(fd, CMD_FLUSH, 0, 0, 0, NULL) == 0, "Cannot flush");
+
+  // 16 reads in flight, the replies may come in any order
+  for (i = 0; i < 16; i++)
+    send_request(fd, CMD_READ, 0, 1000 + i, 1024*1024 + i * 4096 + 7, 4000, NULL);
+  int seen = 0;
+  for (i = 0; i < 16; i++) {
+    uint64_t cookie;
+    fail_unless(receive_simple_reply(fd, &cookie) == 0, "Cannot read");
+    fail_unless(cookie >= 1000 && cookie < 1016 && !(seen & (1 << (cookie - 1000))), "Wrong cookie");
+    seen |= 1 << (cookie - 1000);
+    receive(fd, check, 4000);
+    fail_unless(memcmp(check, data + (cookie - 1000) * 4096 + 7, 4000) == 0, "Wrong data");
+  }
+
+  // a second connection sees the writes of the first one
+  int fd2 = connect_server();
+  send_option(fd2, OPT_EXPORT_NAME, "", 0);
+  receive(fd2, reply, sizeof(reply));
+  fail_unless(request(fd2, CMD_TRIM, 0, 1024*1024 + 300, 8192, NULL) == 0, "Cannot trim");
+  fail_unless(request(fd2, CMD_WRITE_ZEROES, 2, 1024*1024 + 32768, 4096, NULL) == 0, "Cannot write zeroes");
+
+  send_request(fd, CMD_READ, 0, 5, 1024*1024, 64*1024, NULL);
+  uint64_t cookie;
+  fail_unless(receive_simple_reply(fd, &cookie) == 0 && cookie == 5, "Cannot read");
+  receive(fd, check, 64*1024);
+  memset(data + 512, 0, 7680);
+  memset(data + 32768, 0, 4096);
+  fail_unless(memcmp(check, data, 64*1024) == 0, "The trim or the zeroes were not applied");
+
+  fail_unless(request(fd, CMD_BLOCK_STATUS, 0, 0, 4096, NULL) == 22, "Block status without base:allocation");
+
+  send_request(fd, CMD_DISC, 0, 0, 0, 0, NULL);
+  fail_unless(vinil_read_stream(fd, reply, 1) == 0, "The connection was not closed");
+  close(fd);
+  close(fd2);
+
+  vinil_nbd_stop(nbd);
+  vinil_thread_join(thread);
+
+  VinilNBDStats stats;
+  vinil_nbd_get_stats(nbd, &stats);
+  fail_unless(stats.connections == 2 && stats.errors == 3, "Wrong statistics");
+  fail_unless(stats.bytes_written == 64*1024 + 512, "Wrong statistics");
+  vinil_nbd_destroy(nbd);
+  fail_unless(access(SOCKET_PATH, F_OK) != 0, "The socket was not removed");
+
+  vinil_vhd_close(vhd);
+  free(data);
+  free(check);
+} END_TEST
+
+START_TEST (test_vinil_nbd_structured) {
+  char vhd_path[] = "../tests/data/nbd_structured.vhd";
+  remove(vhd_path);
+
+  VinilVHD* vhd = vinil_vhd_create(vhd_path, 8*1024*1024, VINIL_VHD_DYNAMIC, VINIL_VHD_PREALLOC_SPARSE);
+  fail_unless(vhd != NULL, "Cannot create nbd_structured.vhd");
+  uint8_t sector[512];
+  memset(sector, 'v', sizeof(sector));
+  fail_unless(vinil_vhd_pwrite(vhd, sector, 4096 + 8, 1), "Cannot write nbd_structured.vhd");
+
+  VinilNBD* nbd = vinil_nbd_create(2);
+  fail_unless(nbd != NULL, "Cannot create the server");
+  fail_unless(vinil_nbd_add_export(nbd, "rw", vhd, FALSE) && vinil_nbd_add_export(nbd, "ro", vhd, TRUE),
+              "Cannot add the exports");
+  fail_unless(vinil_nbd_listen_unix(nbd, SOCKET_PATH), "Cannot listen");
+
+  vinil_thread thread;
+  fail_unless(vinil_thread_create(&thread, serve, nbd), "Cannot start the server");
+
+  uint64_t size = 0;
+  uint16_t flags = 0;
+  fail_unless(connect_structured("missing", &size, &flags) < 0, "An unknown export was accepted");
+
+  int fd = connect_structured("rw", &size, &flags);
+  fail_unless(size == 8*1024*1024 && (flags & 0x80) && !(flags & 0x02), "Wrong export information");
+
+  // block 1 holds data, blocks 0 and 3 are holes which are not read
+  Chunk* chunk = (Chunk*)malloc(sizeof(Chunk));
+  send_request(fd, CMD_READ, 0, 9, 0, 64*1024, NULL);
+  receive_chunk(fd, chunk);
+  fail_unless(chunk->cookie == 9 && chunk->type == REPLY_TYPE_OFFSET_HOLE && (chunk->flags & 1), "Wrong hole");
+  fail_unless(get64(chunk->payload) == 0 && get32(chunk->payload + 8) == 64*1024, "Wrong hole");
+
+  send_request(fd, CMD_READ, 0, 10, 2*1024*1024 - 1024, 8192, NULL);
+  uint8_t* read = (uint8_t*)calloc(1, 8192);
+  int chunks = 0, done = FALSE;
+  while (!done) {
+    receive_chunk(fd, chunk);
+    fail_unless(chunk->cookie == 10, "Wrong cookie");
+    uint64_t offset = get64(chunk->payload) - (2*1024*1024 - 1024);
+    if (chunk->type == REPLY_TYPE_OFFSET_DATA)
+      memcpy(read + offset, chunk->payload + 8, chunk->length - 8);
+    else
+      fail_unless(chunk->type == REPLY_TYPE_OFFSET_HOLE, "Wrong chunk");
+    done = chunk->flags & 1;
+    chunks++;
+  }
+  fail_unless(chunks == 2 && read[1024 + 8*512] == 'v' && read[1024 + 9*512] == 0 && read[0] == 0, "Wrong data");
+
+  // NBD_CMD_FLAG_DF gets the same bytes in a single chunk
+  send_request(fd, CMD_READ, 4, 11, 2*1024*1024 - 1024, 8192, NULL);
+  receive_chunk(fd, chunk);
+  fail_unless(chunk->type == REPLY_TYPE_OFFSET_DATA && (chunk->flags & 1) && chunk->length == 8200, "Wrong chunk");
+  fail_unless(memcmp(chunk->payload + 8, read, 8192) == 0, "Wrong data");
+
+  send_request(fd, CMD_BLOCK_STATUS, 0, 12, 1024*1024, 4*1024*1024, NULL);
+  receive_chunk(fd, chunk);
+  fail_unless(chunk->type == REPLY_TYPE_BLOCK_STATUS && (chunk->flags & 1) && get32(chunk->payload) == 1,
+              "Wrong block status");
+  fail_unless(chunk->length == 4 + 3 * 8, "Wrong descriptors");
+  fail_unless(get32(chunk->payload + 4) == 1024*1024 && get32(chunk->payload + 8) == 3, "Wrong descriptors");
+  fail_unless(get32(chunk->payload + 12) == 2*1024*1024 && get32(chunk->payload + 16) == 0, "Wrong descriptors");
+  fail_unless(get32(chunk->payload + 20) == 1024*1024 && get32(chunk->payload + 24) == 3, "Wrong descriptors");
+
+  send_request(fd, CMD_BLOCK_STATUS, 8, 13, 1024*1024, 4*1024*1024, NULL);
+  receive_chunk(fd, chunk);
+  fail_unless(chunk->length == 4 + 8, "More than one descriptor");
+
+  // the zeroes free the block, so it is a hole again
+  send_request(fd, CMD_WRITE_ZEROES, 0, 14, 2*1024*1024, 2*1024*1024, NULL);
+  uint64_t cookie;
+  fail_unless(receive_simple_reply(fd, &cookie) == 0 && cookie == 14, "Cannot write zeroes");
+  send_request(fd, CMD_READ, 0, 15, 2*1024*1024, 4096, NULL);
+  receive_chunk(fd, chunk);
+  fail_unless(chunk->type == REPLY_TYPE_OFFSET_HOLE, "The zeroes were written");
+
+  send_request(fd, CMD_READ, 0, 16, 8*1024*1024 - 512, 1024, NULL);
+  receive_chunk(fd, chunk);
+  fail_unless(chunk->type == 0x8001 && (chunk->flags & 1) && get32(chunk->payload) == 22, "A read past the end");
+  close(fd);
+
+  fd = connect_structured("ro", &size, &flags);
+  fail_unless(flags & 0x02, "The export is not read only");
+  send_request(fd, CMD_WRITE, 0, 17, 0, 512, sector);
+  fail_unless(receive_simple_reply(fd, &cookie) == 1 && cookie == 17, "A read only export was written");
+  close(fd);
+
+  vinil_nbd_stop(nbd);
+  vinil_thread_join(thread);
+
+  VinilNBDStats stats;
+  vinil_nbd_get_stats(nbd, &stats);
+  fail_unless(stats.connections == 2 && stats.bytes_read == 7168 + 8192 && stats.bytes_written == 0,
+              "Wrong statistics");
+  fail_unless(stats.hole_bytes == 64*1024 + 1024 + 4096, "Wrong statistics");
+  vinil_nbd_destroy(nbd);
+
+  vinil_vhd_close(vhd);
+  free(chunk);
+  free(read);
+} END_TEST
+
+Suite* func_suite(void) {
+  Suite *s = suite_create ("vinil");
+  TCase *tc_core = tcase_create ("NBD");
+  tcase_add_test (tc_core, test_vinil_nbd_simple);
+  tcase_add_test (tc_core, test_vinil_nbd_structured);
+  suite_add_tcase (s, tc_core);
+  return s;
+}
+
+int main() {
+  int number_failed;
+  Suite *s = func_suite();
+  SRunner *sr = srunner_create(s);
+  srunner_run_all(sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
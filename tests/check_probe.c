@@ -0,0 +1,71 @@
+/**
+ *  @file       check_probe.c
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <check.h>
+
+#include "vhd.h"
+
+START_TEST (test_vinil_vhd_probe) {
+  char fixed_path[] = "../tests/data/probe_fixed.vhd";
+  char dynamic_path[] = "../tests/data/probe_dynamic.vhd";
+  remove(fixed_path);
+  remove(dynamic_path);
+
+  VinilVHD* vhd = vinil_vhd_create(fixed_path, 1024*1024, VINIL_VHD_FIXED, VINIL_VHD_PREALLOC_SPARSE);
+  fail_unless(vhd != NULL, "Cannot create probe_fixed.vhd");
+  vinil_vhd_close(vhd);
+
+  vhd = vinil_vhd_create(dynamic_path, 8*1024*1024, VINIL_VHD_DYNAMIC, VINIL_VHD_PREALLOC_SPARSE);
+  fail_unless(vhd != NULL, "Cannot create probe_dynamic.vhd");
+  VinilVHDFooter created = *vhd->footer;
+  vinil_vhd_close(vhd);
+
+  VinilVHDFooter footer;
+  fail_unless(vinil_vhd_probe(fixed_path, &footer), "Cannot probe probe_fixed.vhd");
+  fail_unless(footer.disk_type == VINIL_VHD_FIXED && footer.current_size == 1024*1024, "Wrong fixed footer");
+
+  fail_unless(vinil_vhd_probe(dynamic_path, &footer), "Cannot probe probe_dynamic.vhd");
+  fail_unless(footer.disk_type == VINIL_VHD_DYNAMIC && footer.current_size == 8*1024*1024, "Wrong dynamic footer");
+  fail_unless(memcmp(&footer.uuid, &created.uuid, sizeof(footer.uuid)) == 0, "Wrong UUID");
+
+  // a corrupted footer is rejected
+  FILE* file = fopen(fixed_path, "r+b");
+  fail_unless(file != NULL, "Cannot open probe_fixed.vhd");
+  fseek(file, -(long)sizeof(VinilVHDFooter) + 40, SEEK_END);
+  fputc('x', file);
+  fclose(file);
+  fail_unless(!vinil_vhd_probe(fixed_path, &footer), "A corrupted footer was accepted");
+
+  // so are files which are not VHDs, too small or missing
+  file = fopen(fixed_path, "wb");
+  fail_unless(file != NULL, "Cannot truncate probe_fixed.vhd");
+  fputs("not a vhd", file);
+  fclose(file);
+  fail_unless(!vinil_vhd_probe(fixed_path, &footer), "A small file was accepted");
+  fail_unless(!vinil_vhd_probe("../tests/data/probe_missing.vhd", &footer), "A missing file was accepted");
+} END_TEST
+
+Suite* func_suite(void) {
+  Suite *s = suite_create ("vinil");
+  TCase *tc_core = tcase_create ("Probe");
+  tcase_add_test (tc_core, test_vinil_vhd_probe);
+  suite_add_tcase (s, tc_core);
+  return s;
+}
+
+int main() {
+  int number_failed;
+  Suite *s = func_suite();
+  SRunner *sr = srunner_create(s);
+  srunner_run_all(sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
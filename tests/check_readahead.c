@@ -0,0 +1,245 @@
+/**
+ *  @file       check_readahead.c
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <check.h>
+
+#include "vhd.h"
+#include "readahead.h"
+
+typedef struct {
+  int reads;
+  uint64_t sectors;
+  VinilReadahead* ra;       // when set, the first fill does what another thread would do meanwhile
+  uint64_t invalidate;      // sector written during the fill
+  uint64_t read;            // sector read during the fill
+} FillLog;
+
+static int read_sectors(VinilReadahead* ra, uint64_t sector, uint64_t count, FillLog* log);
+
+// every sector is filled with the low byte of its number
+static int fill_sectors(void* arg, uint64_t sector, const vinil_iovec* iov, int count) {
+  FillLog* log = (FillLog*)arg;
+  log->reads++;
+
+  VinilReadahead* ra = log->ra;
+  if (ra) {
+    log->ra = NULL;
+    if (log->invalidate)
+      vinil_readahead_invalidate(ra, log->invalidate, 1);
+    if (log->read && !read_sectors(ra, log->read, 8, log))
+      return FALSE;
+  }
+
+  int i;
+  for (i = 0; i < count; i++) {
+    size_t offset;
+    for (offset = 0; offset < iov[i].iov_len; offset += 512)
+      memset((uint8_t*)iov[i].iov_base + offset, (int)(sector++ & 0xFF), 512);
+    log->sectors += iov[i].iov_len / 512;
+  }
+
+  return TRUE;
+}
+
+static int read_sectors(VinilReadahead* ra, uint64_t sector, uint64_t count, FillLog* log) {
+  uint8_t buffer[512*8];
+  vinil_iovec iov;
+  iov.iov_base = buffer;
+  iov.iov_len = (size_t)count * 512;
+
+  if (!vinil_readahead_read(ra, NULL, sector, &iov, 1, fill_sectors, log))
+    return FALSE;
+
+  uint64_t i;
+  for (i = 0; i < count; i++) {
+    if (buffer[i * 512] != ((sector + i) & 0xFF))
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+START_TEST (test_vinil_readahead_streams) {
+  VinilStats* stats = vinil_stats_create();
+  VinilReadahead* ra = vinil_readahead_create(100000, 16, 64, TRUE, stats);
+  fail_unless(ra != NULL, "Cannot create VinilReadahead");
+
+  // two interleaved streams of 8 sectors reads
+  FillLog log;
+  memset(&log, 0, sizeof(log));
+  int i;
+  for (i = 0; i < 32; i++) {
+    fail_unless(read_sectors(ra, (uint64_t)i * 8, 8, &log), "Wrong data in the first stream");
+    fail_unless(read_sectors(ra, 50000 + (uint64_t)i * 8, 8, &log), "Wrong data in the second stream");
+  }
+
+  // each stream reads its first request, then windows of 16, 32 and 64 sectors
+  VinilVHDStats snapshot;
+  vinil_stats_snapshot(stats, &snapshot);
+  fail_unless(log.reads < 16, "The streams were not detected");
+  fail_unless(snapshot.readahead_windows[4] == 2 && snapshot.readahead_windows[5] == 2, "Wrong windows");
+  fail_unless(snapshot.readahead_windows[6] > 0 && snapshot.readahead_windows[7] == 0, "The window passed the maximum");
+  fail_unless(snapshot.readahead_hits == 64 - (uint64_t)log.reads, "Wrong number of hits");
+
+  // a written sector is read again
+  fail_unless(read_sectors(ra, 256, 8, &log), "Cannot read");
+  int reads = log.reads;
+  fail_unless(read_sectors(ra, 264, 8, &log) && log.reads == reads, "The prefetched sectors were not used");
+  vinil_readahead_invalidate(ra, 270, 1);
+  fail_unless(read_sectors(ra, 272, 8, &log) && log.reads == reads + 1, "Invalidated sectors were used");
+
+  // random reads never prefetch
+  memset(&log, 0, sizeof(log));
+  for (i = 0; i < 32; i++)
+    fail_unless(read_sectors(ra, (uint64_t)(i * 7919 % 97) * 1000, 1, &log), "Wrong data in a random read");
+  fail_unless(log.sectors == 32, "Random reads were prefetched");
+
+  vinil_readahead_destroy(ra);
+  vinil_stats_destroy(stats);
+} END_TEST
+
+START_TEST (test_vinil_readahead_concurrent_fill) {
+  VinilReadahead* ra = vinil_readahead_create(100000, 16, 64, TRUE, NULL);
+  fail_unless(ra != NULL, "Cannot create VinilReadahead");
+
+  FillLog log;
+  memset(&log, 0, sizeof(log));
+  fail_unless(read_sectors(ra, 0, 8, &log), "Cannot read");
+
+  // a read of the stream whose buffer is being filled goes straight to the disk
+  log.ra = ra;
+  log.read = 16;
+  fail_unless(read_sectors(ra, 8, 8, &log) && log.reads == 3 && log.sectors == 8 + 16 + 8,
+              "The buffer was filled twice");
+  fail_unless(read_sectors(ra, 16, 8, &log) && log.reads == 3, "The filled buffer was not kept");
+
+  // a fill which saw a write is not kept
+  memset(&log, 0, sizeof(log));
+  fail_unless(read_sectors(ra, 24, 8, &log) && read_sectors(ra, 32, 8, &log) && read_sectors(ra, 40, 8, &log) &&
+              read_sectors(ra, 48, 8, &log) && log.reads == 1, "The stream was lost");
+  log.ra = ra;
+  log.invalidate = 60;
+  fail_unless(read_sectors(ra, 56, 8, &log) && log.reads == 2, "Cannot read");
+  fail_unless(read_sectors(ra, 64, 8, &log) && log.reads == 3, "A fill which saw a write was kept");
+  fail_unless(read_sectors(ra, 72, 8, &log) && log.reads == 3, "The next fill was not kept");
+
+  vinil_readahead_destroy(ra);
+} END_TEST
+
+START_TEST (test_vinil_readahead_advise) {
+  VinilReadahead* ra = vinil_readahead_create(1000, 16, 64, FALSE, NULL);
+  fail_unless(ra != NULL, "Cannot create VinilReadahead");
+
+  uint64_t from = 0;
+  fail_unless(vinil_readahead_advise(ra, 0, 4, &from) == 0, "A single read was prefetched");
+  fail_unless(vinil_readahead_advise(ra, 4, 4, &from) == 16 && from == 8, "The stream was not detected");
+  fail_unless(vinil_readahead_advise(ra, 8, 4, &from) == 0, "The window was requested twice");
+  fail_unless(vinil_readahead_advise(ra, 12, 4, &from) == 0, "The window was requested twice");
+
+  // less than half of the window is ahead, the next one doubles
+  fail_unless(vinil_readahead_advise(ra, 16, 4, &from) == 32 && from == 24, "The next window was not requested");
+
+  // nothing is prefetched after the end of the disk
+  fail_unless(vinil_readahead_advise(ra, 990, 4, &from) == 0, "A random read was prefetched");
+  fail_unless(vinil_readahead_advise(ra, 994, 4, &from) == 2 && from == 998, "The window passed the end of the disk");
+
+  vinil_readahead_destroy(ra);
+} END_TEST
+
+START_TEST (test_vinil_vhd_readahead) {
+  char vhd_path[] = "../tests/data/readahead_dynamic.vhd";
+  remove(vhd_path);
+
+  VinilVHD* vhd = vinil_vhd_create(vhd_path, 8*1024*1024, VINIL_VHD_DYNAMIC, VINIL_VHD_PREALLOC_SPARSE);
+  fail_unless(vhd != NULL, "Cannot create readahead_dynamic.vhd");
+
+  char buffer[512*8];
+  int i;
+  for (i = 0; i < 1024; i += 8) {
+    memset(buffer, i / 8, sizeof(buffer));
+    fail_unless(vinil_vhd_pwrite(vhd, buffer, 4000 + i, 8), "Cannot write readahead_dynamic.vhd");
+  }
+  vinil_vhd_close(vhd);
+
+  vhd = vinil_vhd_open_with_flags(vhd_path, VINIL_VHD_OPEN_READAHEAD | VINIL_VHD_OPEN_STATS);
+  fail_unless(vhd != NULL, "Cannot open readahead_dynamic.vhd");
+
+  // a sequential scan across the boundary between two blocks
+  fail_unless(vinil_vhd_seek(vhd, 4000, SEEK_SET), "Cannot seek readahead_dynamic.vhd");
+  for (i = 0; i < 1024; i += 8) {
+    char expected = i == 80 ? 'w' : (char)(i / 8);
+    fail_unless(vinil_vhd_read(vhd, buffer, 8), "Cannot read readahead_dynamic.vhd");
+    fail_unless(buffer[0] == expected && buffer[sizeof(buffer) - 1] == expected, "Wrong data");
+
+    // the scan sees a write to sectors which were already prefetched
+    if (i == 64) {
+      memset(buffer, 'w', sizeof(buffer));
+      fail_unless(vinil_vhd_pwrite(vhd, buffer, 4080, 8), "Cannot write readahead_dynamic.vhd");
+    }
+  }
+
+  VinilVHDStats stats;
+  vinil_vhd_get_stats(vhd, &stats);
+  fail_unless(stats.readahead_hits > 100, "The sequential scan was not prefetched");
+  fail_unless(stats.readahead_windows[7] == 1 && stats.readahead_bytes > 0, "The windows were not recorded");
+  fail_unless(vinil_vhd_set_readahead(vhd, 4096, 1024*1024), "Cannot configure the readahead");
+  vinil_vhd_close(vhd);
+
+  vhd = vinil_vhd_open(vhd_path);
+  fail_unless(!vinil_vhd_set_readahead(vhd, 4096, 1024*1024), "A VHD without readahead was configured");
+  vinil_vhd_close(vhd);
+} END_TEST
+
+START_TEST (test_vinil_vhd_readahead_fixed) {
+  char vhd_path[] = "../tests/data/readahead_fixed.vhd";
+  remove(vhd_path);
+
+  VinilVHD* vhd = vinil_vhd_create(vhd_path, 1024*1024, VINIL_VHD_FIXED, VINIL_VHD_PREALLOC_SPARSE);
+  fail_unless(vhd != NULL, "Cannot create readahead_fixed.vhd");
+  vinil_vhd_close(vhd);
+
+  vhd = vinil_vhd_open_with_flags(vhd_path, VINIL_VHD_OPEN_READAHEAD | VINIL_VHD_OPEN_STATS);
+  fail_unless(vhd != NULL, "Cannot open readahead_fixed.vhd");
+
+  // the operating system is asked for 64KB, 128KB, 256KB and 512KB
+  char buffer[512*8];
+  int i;
+  for (i = 0; i < 2048; i += 8)
+    fail_unless(vinil_vhd_read(vhd, buffer, 8), "Cannot read readahead_fixed.vhd");
+
+  VinilVHDStats stats;
+  vinil_vhd_get_stats(vhd, &stats);
+  fail_unless(stats.readahead_windows[7] == 1 && stats.readahead_windows[8] == 1 && stats.readahead_windows[9] == 1 &&
+              stats.readahead_windows[10] == 1, "Wrong windows");
+  fail_unless(stats.readahead_hits == 2048 / 8 - 2, "Wrong number of hits");
+  vinil_vhd_close(vhd);
+} END_TEST
+
+Suite* func_suite(void) {
+  Suite *s = suite_create ("vinil");
+  TCase *tc_core = tcase_create ("Readahead");
+  tcase_add_test (tc_core, test_vinil_readahead_streams);
+  tcase_add_test (tc_core, test_vinil_readahead_concurrent_fill);
+  tcase_add_test (tc_core, test_vinil_readahead_advise);
+  tcase_add_test (tc_core, test_vinil_vhd_readahead);
+  tcase_add_test (tc_core, test_vinil_vhd_readahead_fixed);
+  suite_add_tcase (s, tc_core);
+  return s;
+}
+
+int main() {
+  int number_failed;
+  Suite *s = func_suite();
+  SRunner *sr = srunner_create(s);
+  srunner_run_all(sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
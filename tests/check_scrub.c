@@ -0,0 +1,342 @@
+/**
+ *  @file       check_scrub.c
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <check.h>
+
+#include "vhd.h"
+#include "crc.h"
+#include "scrub.h"
+#include "helpers.h"
+
+typedef struct {
+  int count;
+  uint64_t block;
+  uint64_t sector;
+} BadBlockLog;
+
+static int log_bad_block(void* arg, uint64_t block, uint64_t sector, uint64_t count, uint32_t expected,
+                         uint32_t actual) {
+  BadBlockLog* log = (BadBlockLog*)arg;
+  (void)count;
+  log->count++;
+  log->block = block;
+  log->sector = sector;
+  return expected != actual;
+}
+
+START_TEST (test_vinil_crc32c) {
+  fail_unless(vinil_crc32c(0, "123456789", 9) == 0xE3069283, "Wrong checksum");
+  fail_unless(vinil_crc32c(0, "", 0) == 0, "Wrong checksum of nothing");
+
+  // a checksum can be computed in parts, aligned or not
+  uint8_t buffer[4096 + 3];
+  size_t i;
+  for (i = 0; i < sizeof(buffer); i++)
+    buffer[i] = (uint8_t)(i * 7919);
+  uint32_t whole = vinil_crc32c(0, buffer, sizeof(buffer));
+  for (i = 0; i < sizeof(buffer); i += 511)
+    fail_unless(vinil_crc32c(vinil_crc32c(0, buffer, i), buffer + i, sizeof(buffer) - i) == whole, "Wrong parts");
+} END_TEST
+
+START_TEST (test_vinil_crc_file) {
+  char crc_path[] = "../tests/data/scrub_file.crc";
+  remove(crc_path);
+
+  // 1000 sectors in 125 blocks of 8 sectors, they are all stale in a new file
+  VinilCRC* crc = vinil_crc_open(crc_path, 1000, 4096);
+  fail_unless(crc != NULL, "Cannot create scrub_file.crc");
+  fail_unless(vinil_crc_blocks(crc) == 125 && vinil_crc_block_sectors(crc) == 8, "Wrong blocks");
+  fail_unless(vinil_crc_next_stale(crc, 0) == 0 && vinil_crc_next_stale(crc, 124) == 124, "New blocks are not stale");
+
+  uint64_t block;
+  for (block = 0; block < 125; block++)
+    vinil_crc_set(crc, block, (uint32_t)block * 3);
+  fail_unless(vinil_crc_next_stale(crc, 0) == 125, "A checksummed block is stale");
+
+  vinil_crc_invalidate(crc, 70, 20);
+  vinil_crc_invalidate(crc, 999, 100);
+  fail_unless(vinil_crc_next_stale(crc, 0) == 8 && vinil_crc_next_stale(crc, 9) == 9 &&
+              vinil_crc_next_stale(crc, 12) == 124, "Wrong stale blocks");
+  fail_unless(!vinil_crc_stale(crc, 7) && vinil_crc_stale(crc, 11) && !vinil_crc_stale(crc, 12), "Wrong stale blocks");
+  fail_unless(vinil_crc_close(crc), "Cannot save scrub_file.crc");
+
+  crc = vinil_crc_open(crc_path, 1000, 4096);
+  fail_unless(crc != NULL, "Cannot open scrub_file.crc");
+  fail_unless(vinil_crc_get(crc, 100) == 300 && vinil_crc_next_stale(crc, 0) == 8, "The checksums were not saved");
+  fail_unless(vinil_crc_close(crc), "Cannot save scrub_file.crc");
+
+  crc = vinil_crc_open(crc_path, 1000, 8192);
+  fail_unless(crc != NULL && vinil_crc_next_stale(crc, 0) == 0, "A file with another block size was trusted");
+  fail_unless(vinil_crc_close(crc), "Cannot save scrub_file.crc");
+
+  fail_unless(vinil_crc_open(crc_path, 1000, 3000) == NULL, "A block size which is not a power of two was accepted");
+} END_TEST
+
+START_TEST (test_vinil_scrub) {
+  char vhd_path[] = "../tests/data/scrub_dynamic.vhd";
+  char crc_path[] = "../tests/data/scrub_dynamic.crc";
+  remove(vhd_path);
+  remove(crc_path);
+
+  // data in blocks 0 and 3 of 2MB, checksums of 64KB
+  VinilVHD* vhd = vinil_vhd_create(vhd_path, 8*1024*1024, VINIL_VHD_DYNAMIC, VINIL_VHD_PREALLOC_SPARSE);
+  fail_unless(vhd != NULL, "Cannot create scrub_dynamic.vhd");
+  fail_unless(vinil_vhd_start_crc(vhd, crc_path, 0), "Cannot start the checksums");
+  fill_sectors(vhd, 10, 8, 'a');
+  fill_sectors(vhd, 3 * 4096 + 200, 8, 'b');
+
+  BadBlockLog log;
+  memset(&log, 0, sizeof(log));
+  VinilScrubStats stats;
+  fail_unless(vinil_scrub(vhd, 2, 0, log_bad_block, &log, &stats), "Cannot scrub scrub_dynamic.vhd");
+  fail_unless(stats.blocks == 128 && stats.verified_blocks == 2 && stats.stale_blocks == 126 && log.count == 0,
+              "The written blocks were not checksummed");
+  vinil_vhd_close(vhd);
+
+  vhd = vinil_vhd_open(vhd_path);
+  fail_unless(vhd != NULL && vinil_vhd_start_crc(vhd, crc_path, 0), "Cannot open scrub_dynamic.vhd");
+  fail_unless(vinil_scrub(vhd, 3, 0, log_bad_block, &log, &stats), "Cannot scrub scrub_dynamic.vhd");
+  fail_unless(stats.verified_blocks == 128 && stats.bad_blocks == 0 && log.count == 0, "Wrong verification");
+  fail_unless(stats.bytes_read == 2 * 2*1024*1024, "Unallocated blocks were read");
+
+  // a live write checksums its block
+  fill_sectors(vhd, 4000, 1, 'c');
+  fill_sectors(vhd, 128 * 40, 128, 'e');
+  fail_unless(vinil_scrub(vhd, 3, 0, log_bad_block, &log, &stats), "Cannot scrub scrub_dynamic.vhd");
+  fail_unless(stats.verified_blocks == 128 && stats.stale_blocks == 0 && log.count == 0, "A written block was not verified");
+
+  // the reads of all the threads are limited: the second block waits 200ms at 10MB/s
+  uint64_t start = vinil_clock_ns();
+  fail_unless(vinil_scrub(vhd, 4, 10*1024*1024, NULL, NULL, &stats), "Cannot scrub scrub_dynamic.vhd");
+  fail_unless(vinil_clock_ns() - start > 150000000ULL, "The rate was not limited");
+
+  uint64_t offset = (uint64_t)vhd->bat[3] * 512 + 512 + 203 * 512 + 100;
+  vinil_vhd_close(vhd);
+
+  // silent corruption of the data region
+  FILE* file = fopen(vhd_path, "r+b");
+  fail_unless(file != NULL, "Cannot open scrub_dynamic.vhd");
+  fseek(file, (long)offset, SEEK_SET);
+  fputc('x', file);
+  fclose(file);
+
+  vhd = vinil_vhd_open_with_flags(vhd_path, VINIL_VHD_OPEN_READ_ONLY);
+  fail_unless(vhd != NULL && vinil_vhd_start_crc(vhd, crc_path, 0), "Cannot open scrub_dynamic.vhd");
+  fail_unless(vinil_scrub(vhd, 4, 0, log_bad_block, &log, &stats), "Cannot scrub scrub_dynamic.vhd");
+  fail_unless(stats.bad_blocks == 1 && stats.verified_blocks == 127, "The corruption was not found");
+  fail_unless(log.count == 1 && log.block == (3 * 4096 + 203) / 128 && log.sector == log.block * 128,
+              "Wrong bad block");
+  fail_unless(vinil_vhd_stop_crc(vhd) && !vinil_scrub(vhd, 1, 0, NULL, NULL, NULL), "A VHD without checksums was scrubbed");
+  vinil_vhd_close(vhd);
+
+  // the checksums are not counted as reads and see the sectors which were not written back yet
+  remove(crc_path);
+  vhd = vinil_vhd_open_with_flags(vhd_path, VINIL_VHD_OPEN_STATS | VINIL_VHD_OPEN_WRITE_BACK);
+  fail_unless(vhd != NULL && vinil_vhd_start_crc(vhd, crc_path, 0), "Cannot open scrub_dynamic.vhd");
+  fill_sectors(vhd, 2 * 4096, 8, 'd');
+  fail_unless(vhd->bat[2] == VINIL_VHD_UNUSED_BLOCK, "The write was not buffered");
+  fail_unless(!vinil_crc_stale(vhd->crc, 64), "The buffered write was not checksummed");
+  fail_unless(vinil_vhd_stop_crc(vhd), "Cannot stop the checksums");
+  VinilVHDStats vhd_stats;
+  vinil_vhd_get_stats(vhd, &vhd_stats);
+  fail_unless(vhd_stats.ops[VINIL_STATS_READ] == 0, "The checksums were counted as reads");
+  vinil_vhd_close(vhd);
+
+  vhd = vinil_vhd_open(vhd_path);
+  fail_unless(vhd != NULL && vinil_vhd_start_crc(vhd, crc_path, 0), "Cannot open scrub_dynamic.vhd");
+  fail_unless(vinil_scrub(vhd, 4, 0, NULL, NULL, &stats), "Cannot scrub scrub_dynamic.vhd");
+  fail_unless(stats.verified_blocks == 128 && stats.bad_blocks == 0, "The buffered sectors were not checksummed");
+  vinil_vhd_close(vhd);
+} END_TEST
+
+// copies a file as a crash would leave it
+static void copy_file(const char* from, const char* to) {
+  FILE* in = fopen(from, "rb");
+  FILE* out = fopen(to, "wb");
+  fail_unless(in != NULL && out != NULL, "Cannot copy the file");
+
+  char buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), in)) > 0)
+    fwrite(buffer, 1, n, out);
+
+  fclose(in);
+  fclose(out);
+}
+
+START_TEST (test_vinil_crc_crash) {
+  char vhd_path[] = "../tests/data/scrub_crash.vhd";
+  char crc_path[] = "../tests/data/scrub_crash.crc";
+  char crash_path[] = "../tests/data/scrub_crash_copy.crc";
+  remove(vhd_path);
+  remove(crc_path);
+
+  VinilVHD* vhd = vinil_vhd_create(vhd_path, 8*1024*1024, VINIL_VHD_DYNAMIC, VINIL_VHD_PREALLOC_SPARSE);
+  fail_unless(vhd != NULL && vinil_vhd_start_crc(vhd, crc_path, 0), "Cannot create scrub_crash.vhd");
+
+  char block[64*1024];
+  memset(block, 'a', sizeof(block));
+  fail_unless(vinil_vhd_pwrite(vhd, block, 0, 128), "Cannot write the VHD");
+  fill_sectors(vhd, 5 * 128 + 3, 2, 'b');
+  fail_unless(vinil_vhd_flush(vhd), "Cannot flush the VHD");
+
+  // blocks written after the save are marked in the file first
+  fill_sectors(vhd, 70 * 128, 1, 'c');
+  copy_file(crc_path, crash_path);
+
+  VinilCRC* crc = vinil_crc_open(crash_path, 8*1024*1024 / 512, 0);
+  fail_unless(crc != NULL, "Cannot open the crashed checksums");
+  fail_unless(!vinil_crc_stale(crc, 0) && vinil_crc_get(crc, 0) == vinil_crc32c(0, block, sizeof(block)),
+              "The saved checksum was lost");
+  fail_unless(!vinil_crc_stale(crc, 5) && vinil_crc_stale(crc, 1), "Wrong saved blocks");
+  fail_unless(vinil_crc_stale(crc, 70), "A block written after the save was trusted");
+  fail_unless(vinil_crc_close(crc), "Cannot close the crashed checksums");
+
+  vinil_vhd_close(vhd);
+  remove(crash_path);
+} END_TEST
+
+// reads a whole file, the caller frees it
+static char* read_file(const char* path, long* size) {
+  FILE* file = fopen(path, "rb");
+  fail_unless(file != NULL, "Cannot read the file");
+  fseek(file, 0, SEEK_END);
+  *size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  char* data = (char*)malloc((size_t)*size);
+  fail_unless(data != NULL && fread(data, 1, (size_t)*size, file) == (size_t)*size, "Cannot read the file");
+  fclose(file);
+
+  return data;
+}
+
+START_TEST (test_vinil_scrub_read_only) {
+  char vhd_path[] = "../tests/data/scrub_read_only.vhd";
+  char crc_path[] = "../tests/data/scrub_read_only.crc";
+  remove(vhd_path);
+  remove(crc_path);
+
+  fail_unless(vinil_crc_file_state(crc_path) == VINIL_CRC_FILE_INVALID, "A missing file has a state");
+  VinilVHD* vhd = vinil_vhd_create(vhd_path, 8*1024*1024, VINIL_VHD_DYNAMIC, VINIL_VHD_PREALLOC_SPARSE);
+  fail_unless(vhd != NULL && vinil_vhd_start_crc(vhd, crc_path, 0), "Cannot create scrub_read_only.vhd");
+  fill_sectors(vhd, 300, 20, 'a');
+
+  // the file of a writer is not trusted
+  fail_unless(vinil_crc_file_state(crc_path) == VINIL_CRC_FILE_OPEN, "The file is not marked as open");
+  fail_unless(vinil_crc_open_read_only(crc_path, 8*1024*1024 / 512) == NULL, "A file in use was opened");
+  vinil_vhd_close(vhd);
+  fail_unless(vinil_crc_file_state(crc_path) == VINIL_CRC_FILE_CLOSED, "The file is not marked as closed");
+
+  long size_before, size_after;
+  char* before = read_file(crc_path, &size_before);
+
+  vhd = vinil_vhd_open_with_flags(vhd_path, VINIL_VHD_OPEN_READ_ONLY);
+  fail_unless(vhd != NULL, "Cannot open scrub_read_only.vhd");
+  fail_unless(vinil_crc_open_read_only(crc_path, 1000) == NULL, "The checksums of another disk were opened");
+  VinilCRC* crc = vinil_crc_open_read_only(crc_path, 8*1024*1024 / 512);
+  fail_unless(crc != NULL, "Cannot open the checksums");
+  fail_unless(vinil_crc_begin_write(crc, 0, 1) == 0 && !vinil_crc_save(crc, NULL, NULL), "Read-only checksums were written");
+
+  VinilScrubStats stats;
+  fail_unless(vinil_scrub_checksums(vhd, crc, 2, 0, NULL, NULL, &stats), "Cannot scrub scrub_read_only.vhd");
+  fail_unless(stats.verified_blocks == 128 && stats.bad_blocks == 0 && stats.stale_blocks == 0, "Wrong verification");
+  fail_unless(vinil_crc_close(crc), "Cannot close the checksums");
+  vinil_vhd_close(vhd);
+
+  // neither the scrub nor the read-only VHD wrote the file
+  char* after = read_file(crc_path, &size_after);
+  fail_unless(size_before == size_after && memcmp(before, after, (size_t)size_before) == 0, "The checksums were written");
+  free(before);
+  free(after);
+} END_TEST
+
+typedef struct {
+  VinilVHD* vhd;
+  int thread;
+  int stop;
+} CRCWriter;
+
+// every thread writes its own blocks, whole or partly
+static void* crc_writer(void* arg) {
+  CRCWriter* writer = (CRCWriter*)arg;
+  char buffer[64*1024];
+  int i;
+  for (i = 0; !vinil_atomic_load(&writer->stop) || i < 64; i++) {
+    uint64_t block = (uint64_t)(i % 32) * 4 + (uint64_t)writer->thread;
+    memset(buffer, 'a' + i % 26, sizeof(buffer));
+    uint64_t sector = block * 128 + (i % 2 ? (uint64_t)(i % 100) : 0);
+    uint64_t count = i % 2 ? 7 : 128;
+    fail_unless(vinil_vhd_pwrite(writer->vhd, buffer, sector, count), "Cannot write the VHD");
+  }
+
+  return NULL;
+}
+
+START_TEST (test_vinil_scrub_concurrent) {
+  char vhd_path[] = "../tests/data/scrub_concurrent.vhd";
+  char crc_path[] = "../tests/data/scrub_concurrent.crc";
+  remove(vhd_path);
+  remove(crc_path);
+
+  VinilVHD* vhd = vinil_vhd_create(vhd_path, 8*1024*1024, VINIL_VHD_DYNAMIC, VINIL_VHD_PREALLOC_SPARSE);
+  fail_unless(vhd != NULL && vinil_vhd_start_crc(vhd, crc_path, 0), "Cannot create scrub_concurrent.vhd");
+  fail_unless(vinil_vhd_stop_crc(vhd) && vinil_vhd_start_crc(vhd, crc_path, 0), "Cannot restart the checksums");
+
+  CRCWriter writers[4];
+  vinil_thread threads[4];
+  int i;
+  for (i = 0; i < 4; i++) {
+    writers[i].vhd = vhd;
+    writers[i].thread = i;
+    writers[i].stop = FALSE;
+    fail_unless(vinil_thread_create(&threads[i], crc_writer, &writers[i]), "Cannot start a writer");
+  }
+
+  // blocks which change while they are read are skipped, never reported as bad
+  VinilScrubStats stats;
+  for (i = 0; i < 20; i++) {
+    fail_unless(vinil_scrub(vhd, 2, 0, NULL, NULL, &stats), "Cannot scrub scrub_concurrent.vhd");
+    fail_unless(stats.bad_blocks == 0, "A block being written was reported as bad");
+  }
+
+  for (i = 0; i < 4; i++) {
+    vinil_atomic_store(&writers[i].stop, TRUE);
+    vinil_thread_join(threads[i]);
+  }
+
+  // no block was written by two threads at once, so every one has the checksum of its last write
+  fail_unless(vinil_scrub(vhd, 2, 0, NULL, NULL, &stats), "Cannot scrub scrub_concurrent.vhd");
+  fail_unless(stats.verified_blocks == 128 && stats.bad_blocks == 0, "The writes were not checksummed");
+  vinil_vhd_close(vhd);
+} END_TEST
+
+Suite* func_suite(void) {
+  Suite *s = suite_create ("vinil");
+  TCase *tc_core = tcase_create ("Scrub");
+  tcase_add_test (tc_core, test_vinil_crc32c);
+  tcase_add_test (tc_core, test_vinil_crc_file);
+  tcase_add_test (tc_core, test_vinil_scrub);
+  tcase_add_test (tc_core, test_vinil_crc_crash);
+  tcase_add_test (tc_core, test_vinil_scrub_concurrent);
+  tcase_add_test (tc_core, test_vinil_scrub_read_only);
+  suite_add_tcase (s, tc_core);
+  return s;
+}
+
+int main() {
+  int number_failed;
+  Suite *s = func_suite();
+  SRunner *sr = srunner_create(s);
+  srunner_run_all(sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
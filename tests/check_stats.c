@@ -0,0 +1,121 @@
+/**
+ *  @file       check_stats.c
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <check.h>
+
+#include "vhd.h"
+#include "stats.h"
+
+static void* record_worker(void* arg) {
+  VinilStats* stats = (VinilStats*)arg;
+
+  int i;
+  for (i = 0; i < 10000; i++) {
+    vinil_stats_record(stats, VINIL_STATS_READ, 512, 1500);
+    vinil_stats_count(stats, VINIL_STATS_SPLIT);
+  }
+
+  return NULL;
+}
+
+START_TEST (test_vinil_stats_record) {
+  VinilStats* stats = vinil_stats_create();
+  fail_unless(stats != NULL, "Cannot create VinilStats");
+
+  vinil_thread threads[8];
+  int i;
+  for (i = 0; i < 8; i++)
+    fail_unless(vinil_thread_create(&threads[i], record_worker, stats), "Cannot create thread");
+  for (i = 0; i < 8; i++)
+    vinil_thread_join(threads[i]);
+
+  // bucket 0 is below 1us, bucket i covers [2^(i-1), 2^i) us
+  vinil_stats_record(stats, VINIL_STATS_WRITE, 4096, 999);
+  vinil_stats_record(stats, VINIL_STATS_WRITE, 4096, 1000);
+  vinil_stats_record(stats, VINIL_STATS_WRITE, 4096, 2000000000000ULL);
+
+  VinilVHDStats snapshot;
+  vinil_stats_snapshot(stats, &snapshot);
+  fail_unless(snapshot.ops[VINIL_STATS_READ] == 80000, "Lost read operations");
+  fail_unless(snapshot.bytes[VINIL_STATS_READ] == 80000 * 512, "Lost read bytes");
+  fail_unless(snapshot.latency[VINIL_STATS_READ][1] == 80000, "Wrong latency bucket");
+  fail_unless(snapshot.split_requests == 80000, "Lost split requests");
+  fail_unless(snapshot.ops[VINIL_STATS_WRITE] == 3 && snapshot.bytes[VINIL_STATS_WRITE] == 3 * 4096, "Lost writes");
+  fail_unless(snapshot.latency[VINIL_STATS_WRITE][0] == 1 && snapshot.latency[VINIL_STATS_WRITE][1] == 1 &&
+              snapshot.latency[VINIL_STATS_WRITE][VINIL_STATS_BUCKETS - 1] == 1, "Wrong latency buckets");
+
+  vinil_stats_destroy(stats);
+} END_TEST
+
+START_TEST (test_vinil_vhd_get_stats) {
+  char vhd_path[] = "../tests/data/stats_dynamic.vhd";
+  remove(vhd_path);
+  VinilVHD* vhd = vinil_vhd_create(vhd_path, 8*1024*1024, VINIL_VHD_DYNAMIC, VINIL_VHD_PREALLOC_SPARSE);
+  fail_unless(vhd != NULL, "Cannot create stats_dynamic.vhd");
+
+  VinilVHDStats snapshot;
+  fail_unless(!vinil_vhd_get_stats(vhd, &snapshot), "Statistics are collected without VINIL_VHD_OPEN_STATS");
+  vinil_vhd_close(vhd);
+
+  vhd = vinil_vhd_open_with_flags(vhd_path, VINIL_VHD_OPEN_STATS);
+  fail_unless(vhd != NULL, "Cannot open stats_dynamic.vhd");
+
+  char buffer[512*16];
+  memset(buffer, 's', sizeof(buffer));
+
+  // the write crosses the boundary between the first and the second block
+  fail_unless(vinil_vhd_pwrite(vhd, buffer, 4088, 16), "Cannot write stats_dynamic.vhd");
+  fail_unless(vinil_vhd_pread(vhd, buffer, 0, 16), "Cannot read stats_dynamic.vhd");
+
+  vinil_iovec iov[2];
+  iov[0].iov_base = buffer;
+  iov[0].iov_len = 512;
+  iov[1].iov_base = buffer + 512;
+  iov[1].iov_len = 512;
+  fail_unless(vinil_vhd_preadv(vhd, iov, 2, 10), "Cannot read stats_dynamic.vhd");
+  fail_unless(vinil_vhd_flush(vhd), "Cannot flush stats_dynamic.vhd");
+  fail_unless(vinil_vhd_discard(vhd, 0, 4096), "Cannot discard stats_dynamic.vhd");
+
+  fail_unless(vinil_vhd_get_stats(vhd, &snapshot), "Cannot get statistics of stats_dynamic.vhd");
+  fail_unless(snapshot.ops[VINIL_STATS_WRITE] == 1 && snapshot.bytes[VINIL_STATS_WRITE] == 512*16, "Wrong write statistics");
+  fail_unless(snapshot.ops[VINIL_STATS_READ] == 2 && snapshot.bytes[VINIL_STATS_READ] == 512*18, "Wrong read statistics");
+  fail_unless(snapshot.ops[VINIL_STATS_FLUSH] == 1, "Wrong flush statistics");
+  fail_unless(snapshot.ops[VINIL_STATS_DISCARD] == 1 && snapshot.bytes[VINIL_STATS_DISCARD] == 512*4096,
+              "Wrong discard statistics");
+  fail_unless(snapshot.split_requests == 1 && snapshot.merged_requests == 1, "Wrong split/merged statistics");
+  fail_unless(snapshot.metadata_reads > 0 && snapshot.metadata_writes > 0, "Metadata I/O was not counted");
+
+  uint64_t total = 0;
+  int i;
+  for (i = 0; i < VINIL_STATS_BUCKETS; i++)
+    total += snapshot.latency[VINIL_STATS_READ][i];
+  fail_unless(total == 2, "Wrong read latency histogram");
+
+  vinil_vhd_close(vhd);
+} END_TEST
+
+Suite* func_suite(void) {
+  Suite *s = suite_create ("vinil");
+  TCase *tc_core = tcase_create ("Stats");
+  tcase_add_test (tc_core, test_vinil_stats_record);
+  tcase_add_test (tc_core, test_vinil_vhd_get_stats);
+  suite_add_tcase (s, tc_core);
+  return s;
+}
+
+int main() {
+  int number_failed;
+  Suite *s = func_suite();
+  SRunner *sr = srunner_create(s);
+  srunner_run_all(sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,80 @@
+/**
+ *  @file       check_trace.c
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <check.h>
+
+#include "vhd.h"
+#include "trace.h"
+
+START_TEST (test_vinil_vhd_trace) {
+  char vhd_path[] = "../tests/data/trace_dynamic.vhd";
+  char trace_path[] = "../tests/data/trace_dynamic.trace";
+  remove(vhd_path);
+
+  VinilVHD* vhd = vinil_vhd_create(vhd_path, 8*1024*1024, VINIL_VHD_DYNAMIC, VINIL_VHD_PREALLOC_SPARSE);
+  fail_unless(vhd != NULL, "Cannot create trace_dynamic.vhd");
+  fail_unless(vinil_vhd_start_trace(vhd, trace_path), "Cannot start the trace");
+  fail_unless(!vinil_vhd_start_trace(vhd, trace_path), "A second trace was started");
+
+  char buffer[512*8];
+  memset(buffer, 't', sizeof(buffer));
+  fail_unless(vinil_vhd_seek(vhd, 100, SEEK_SET), "Cannot seek trace_dynamic.vhd");
+  fail_unless(vinil_vhd_write(vhd, buffer, 8), "Cannot write trace_dynamic.vhd");
+  fail_unless(vinil_vhd_pread(vhd, buffer, 104, 4), "Cannot read trace_dynamic.vhd");
+  fail_unless(!vinil_vhd_pread(vhd, buffer, 16383, 2), "Read after the end of trace_dynamic.vhd");
+  fail_unless(vinil_vhd_flush(vhd), "Cannot flush trace_dynamic.vhd");
+  fail_unless(vinil_vhd_discard(vhd, 100, 8), "Cannot discard trace_dynamic.vhd");
+
+  fail_unless(vinil_vhd_stop_trace(vhd), "Cannot stop the trace");
+  fail_unless(vinil_vhd_pread(vhd, buffer, 0, 1), "Cannot read trace_dynamic.vhd");
+  vinil_vhd_close(vhd);
+
+  int ops[] = {VINIL_TRACE_SEEK, VINIL_TRACE_WRITE, VINIL_TRACE_READ, VINIL_TRACE_READ,
+               VINIL_TRACE_FLUSH, VINIL_TRACE_DISCARD};
+  uint64_t sectors[] = {100, 100, 104, 16383, 0, 100};
+  uint32_t counts[] = {0, 8, 4, 2, 0, 8};
+  int results[] = {TRUE, TRUE, TRUE, FALSE, TRUE, TRUE};
+
+  VinilTraceReader* reader = vinil_trace_reader_open(trace_path);
+  fail_unless(reader != NULL, "Cannot open the trace");
+
+  VinilTraceRecord record;
+  uint64_t timestamp = 0;
+  int i;
+  for (i = 0; i < 6; i++) {
+    fail_unless(vinil_trace_reader_next(reader, &record), "Missing trace record");
+    fail_unless(record.op == ops[i] && record.sector == sectors[i] && record.count == counts[i], "Wrong trace record");
+    fail_unless(record.result == results[i], "Wrong result in the trace");
+    fail_unless(record.timestamp >= timestamp && record.thread == 1, "Wrong timestamp or thread in the trace");
+    timestamp = record.timestamp;
+  }
+  fail_unless(!vinil_trace_reader_next(reader, &record), "Calls after vinil_vhd_stop_trace were traced");
+  vinil_trace_reader_close(reader);
+
+  fail_unless(vinil_trace_reader_open(vhd_path) == NULL, "A VHD was opened as a trace");
+} END_TEST
+
+Suite* func_suite(void) {
+  Suite *s = suite_create ("vinil");
+  TCase *tc_core = tcase_create ("Trace");
+  tcase_add_test (tc_core, test_vinil_vhd_trace);
+  suite_add_tcase (s, tc_core);
+  return s;
+}
+
+int main() {
+  int number_failed;
+  Suite *s = func_suite();
+  SRunner *sr = srunner_create(s);
+  srunner_run_all(sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
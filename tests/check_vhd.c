@@ -6,6 +6,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 
 #include <check.h>
@@ -62,7 +63,7 @@ START_TEST (test_vinil_open) {
     fail_unless(vhd != NULL, error_msg);
     
     sprintf(error_msg, "Cannot open %s file descriptor", vhd_files[i]);
-    fail_unless(vhd->fd != NULL, error_msg);
+    fail_unless(vhd->fd >= 0, error_msg);
     
     sprintf(error_msg, "Cannot open %s footer", vhd_files[i]);
     fail_unless(vhd->footer != NULL, error_msg);
@@ -279,6 +280,677 @@ START_TEST (test_vinil_geometry_encode) {
   }
 } END_TEST
 
+START_TEST (test_vinil_dynamic_vhd) {
+  char vhd_file[] = "new_dynamic_vhd_file.vhd";
+  
+  char vhd_path[256];
+  sprintf(vhd_path, "../tests/data/%s", vhd_file);
+  remove(vhd_path);
+  
+  VinilVHD* vhd = vinil_vhd_open(vhd_path);
+  fail_unless(vhd != NULL, "Cannot open new_dynamic_vhd_file.vhd");
+  
+  memcpy(vhd->footer->cookie, "conectix", 9);
+  vhd->footer->features = 0;
+  vhd->footer->file_format_version = 0x00010000;
+  vhd->footer->timestamp = time(NULL);
+  memcpy(vhd->footer->creator_application, "vnil", 4);
+  vhd->footer->creator_version = 0x00000001;
+  vhd->footer->creator_host_os = 0x4D616320;                    // Mac OS X
+  vhd->footer->original_size = 8*1024*1024;                     // 8MB
+  vhd->footer->current_size = 8*1024*1024;                      // 8MB
+  vhd->footer->disk_geometry = vinil_compute_chs(8*1024*1024);
+  vhd->footer->disk_type = VINIL_VHD_DYNAMIC;
+  vinil_uuid_generate(&vhd->footer->uuid);
+  vhd->footer->saved_state = 0;
+  
+  fail_unless(vinil_vhd_commit_structural_changes(vhd), "Cannot commit changes in new_dynamic_vhd_file.vhd");
+  fail_unless(vhd->header != NULL, "new_dynamic_vhd_file.vhd has no dynamic header");
+  fail_unless(vhd->header->max_table_entries == 4, "Wrong number of BAT entries in new_dynamic_vhd_file.vhd");
+  
+  unsigned char buffer[1024];
+  int i;
+  for (i = 0; i < 1024; i++)
+    buffer[i] = 'a';
+  
+  // the last sector of the first block and the first sector of the second one
+  fail_unless(vinil_vhd_seek(vhd, 4095, SEEK_SET), "Cannot execute vinil_vhd_seek in new_dynamic_vhd_file.vhd");
+  fail_unless(vinil_vhd_write(vhd, buffer, 2), "Cannot write 2 sectors to new_dynamic_vhd_file.vhd");
+  fail_unless(vinil_vhd_tell(vhd) == 4097, "vinil_vhd_tell function returns a wrong sector number");
+  
+  vinil_vhd_close(vhd);
+  
+  // checking the new file...
+  vhd = vinil_vhd_open(vhd_path);
+  fail_unless(vhd != NULL, "Cannot reopen new_dynamic_vhd_file.vhd");
+  fail_unless(vhd->bat[0] != VINIL_VHD_UNUSED_BLOCK, "Block 0 of new_dynamic_vhd_file.vhd was not allocated");
+  fail_unless(vhd->bat[1] != VINIL_VHD_UNUSED_BLOCK, "Block 1 of new_dynamic_vhd_file.vhd was not allocated");
+  fail_unless(vhd->bat[2] == VINIL_VHD_UNUSED_BLOCK, "Block 2 of new_dynamic_vhd_file.vhd was allocated");
+  
+  unsigned char sector[512];
+  int count = 0;
+  int written = 0;
+  int zeros = 0;
+  while (vinil_vhd_read(vhd, sector, 1)) {
+    if (sector[0] == 'a' && sector[511] == 'a')
+      written++;
+    else if (sector[0] == 0 && sector[511] == 0)
+      zeros++;
+    count++;
+  }
+  
+  fail_unless((uint64_t)count*512 == vhd->footer->current_size, "Wrong number of sectors in new_dynamic_vhd_file.vhd");
+  fail_unless(written == 2, "Wrong number of written sectors in new_dynamic_vhd_file.vhd");
+  fail_unless(zeros == count - 2, "Unallocated sectors of new_dynamic_vhd_file.vhd are not zero");
+  
+  vinil_vhd_close(vhd);
+  
+  FILE* f = fopen(vhd_path, "rb");
+  fail_unless(f != NULL, "Cannot open new_dynamic_vhd_file.vhd");
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fclose(f);
+  
+  fail_unless(size < 5*1024*1024, "new_dynamic_vhd_file.vhd was fully allocated");
+} END_TEST
+
+static VinilVHD* create_dynamic_vhd(const char* vhd_path, uint64_t size) {
+  remove(vhd_path);
+  
+  VinilVHD* vhd = vinil_vhd_open(vhd_path);
+  if (vhd == NULL)
+    return NULL;
+  
+  memcpy(vhd->footer->cookie, "conectix", 8);
+  vhd->footer->file_format_version = 0x00010000;
+  vhd->footer->timestamp = time(NULL);
+  memcpy(vhd->footer->creator_application, "vnil", 4);
+  vhd->footer->creator_version = 0x00000001;
+  vhd->footer->creator_host_os = 0x4D616320;                    // Mac OS X
+  vhd->footer->original_size = size;
+  vhd->footer->current_size = size;
+  vhd->footer->disk_geometry = vinil_compute_chs(size);
+  vhd->footer->disk_type = VINIL_VHD_DYNAMIC;
+  vinil_uuid_generate(&vhd->footer->uuid);
+  
+  if (!vinil_vhd_commit_structural_changes(vhd)) {
+    vinil_vhd_close(vhd);
+    return NULL;
+  }
+  
+  return vhd;
+}
+
+static int read_sector_char(VinilVHD* vhd, int64_t sector) {
+  unsigned char buffer[512];
+  if (!vinil_vhd_seek(vhd, sector, SEEK_SET) || !vinil_vhd_read(vhd, buffer, 1))
+    return -1;
+  
+  return buffer[0] == buffer[511] ? buffer[0] : -1;
+}
+
+static int write_sector_char(VinilVHD* vhd, int64_t sector, char c) {
+  char buffer[512];
+  memset(buffer, c, 512);
+  
+  return vinil_vhd_seek(vhd, sector, SEEK_SET) && vinil_vhd_write(vhd, buffer, 1);
+}
+
+START_TEST (test_vinil_differencing_vhd) {
+  char vhd_path[256];
+  char parent_path[256];
+  char error_msg[256];
+  
+  sprintf(vhd_path, "../tests/data/diff_base.vhd");
+  VinilVHD* vhd = create_dynamic_vhd(vhd_path, 8*1024*1024);
+  fail_unless(vhd != NULL, "Cannot create diff_base.vhd");
+  fail_unless(write_sector_char(vhd, 0, 'a'), "Cannot write to diff_base.vhd");
+  fail_unless(write_sector_char(vhd, 5000, 'a'), "Cannot write to diff_base.vhd");
+  vinil_vhd_close(vhd);
+  
+  // a chain of 10 differencing layers, each one owning a different sector
+  int i;
+  for (i = 0; i < 10; i++) {
+    strcpy(parent_path, vhd_path);
+    sprintf(vhd_path, "../tests/data/diff_layer_%d.vhd", i);
+    remove(vhd_path);
+    
+    vhd = vinil_vhd_create_differencing(vhd_path, parent_path);
+    sprintf(error_msg, "Cannot create diff_layer_%d.vhd", i);
+    fail_unless(vhd != NULL, error_msg);
+    fail_unless(vhd->footer->disk_type == VINIL_VHD_DIFFERENCING, error_msg);
+    fail_unless(vhd->footer->current_size == 8*1024*1024, error_msg);
+    
+    sprintf(error_msg, "Cannot write to diff_layer_%d.vhd", i);
+    fail_unless(write_sector_char(vhd, 100 + i, 'b' + i), error_msg);
+    vinil_vhd_close(vhd);
+  }
+  
+  vhd = vinil_vhd_open(vhd_path);
+  fail_unless(vhd != NULL, "Cannot open diff_layer_9.vhd");
+  fail_unless(vhd->owners[0] == vhd, "Block 0 is not owned by the top layer");
+  fail_unless(vhd->owners[1] != NULL && vhd->owners[1]->footer->disk_type == VINIL_VHD_DYNAMIC, 
+              "Block 1 is not owned by the base layer");
+  fail_unless(vhd->owners[2] == NULL, "Block 2 is owned by some layer");
+  
+  fail_unless(read_sector_char(vhd, 0) == 'a', "Wrong data read from the base layer");
+  fail_unless(read_sector_char(vhd, 5000) == 'a', "Wrong data read from the base layer");
+  fail_unless(read_sector_char(vhd, 200) == 0, "Wrong data read from an unallocated sector");
+  fail_unless(read_sector_char(vhd, 12000) == 0, "Wrong data read from an unallocated block");
+  for (i = 0; i < 10; i++) {
+    sprintf(error_msg, "Wrong data read from diff_layer_%d.vhd", i);
+    fail_unless(read_sector_char(vhd, 100 + i) == 'b' + i, error_msg);
+  }
+  
+  // allocating a block in the child must not hide the other sectors of its parents
+  fail_unless(write_sector_char(vhd, 6000, 'z'), "Cannot write to diff_layer_9.vhd");
+  fail_unless(vhd->owners[1] == vhd, "Block 1 is not owned by the top layer");
+  fail_unless(read_sector_char(vhd, 6000) == 'z', "Wrong data read from the top layer");
+  fail_unless(read_sector_char(vhd, 5000) == 'a', "Wrong data read from the base layer");
+  
+  vinil_vhd_close(vhd);
+  
+  vhd = vinil_vhd_open("../tests/data/diff_layer_8.vhd");
+  fail_unless(vhd != NULL, "Cannot open diff_layer_8.vhd");
+  fail_unless(read_sector_char(vhd, 6000) == 0, "diff_layer_8.vhd was changed by its child");
+  vinil_vhd_close(vhd);
+} END_TEST
+
+typedef struct {
+  VinilVHD* vhd;
+  int id;
+  int ok;
+} PwriteWorker;
+
+static void* pwrite_worker(void* arg) {
+  PwriteWorker* worker = (PwriteWorker*)arg;
+  unsigned char buffer[512*4];
+  memset(buffer, 'a' + worker->id, sizeof(buffer));
+  
+  // every thread writes to every block, so allocations race with each other
+  uint64_t sector;
+  worker->ok = 1;
+  for (sector = worker->id * 4; sector < 16384; sector += 8 * 4)
+    worker->ok = worker->ok && vinil_vhd_pwrite(worker->vhd, buffer, sector, 4);
+  
+  return NULL;
+}
+
+START_TEST (test_vinil_pread_pwrite) {
+  char vhd_path[] = "../tests/data/pwrite_dynamic.vhd";
+  VinilVHD* vhd = create_dynamic_vhd(vhd_path, 8*1024*1024);
+  fail_unless(vhd != NULL, "Cannot create pwrite_dynamic.vhd");
+  
+  PwriteWorker workers[8];
+  vinil_thread threads[8];
+  int i;
+  for (i = 0; i < 8; i++) {
+    workers[i].vhd = vhd;
+    workers[i].id = i;
+    fail_unless(vinil_thread_create(&threads[i], pwrite_worker, &workers[i]), "Cannot create thread");
+  }
+  
+  for (i = 0; i < 8; i++) {
+    vinil_thread_join(threads[i]);
+    fail_unless(workers[i].ok, "vinil_vhd_pwrite failed");
+  }
+  
+  fail_unless(vinil_vhd_tell(vhd) == 0, "vinil_vhd_pwrite changed the position indicator");
+  vinil_vhd_close(vhd);
+  
+  vhd = vinil_vhd_open(vhd_path);
+  fail_unless(vhd != NULL, "Cannot reopen pwrite_dynamic.vhd");
+  
+  unsigned char buffer[512*32];
+  uint64_t sector;
+  for (sector = 0; sector < 16384; sector += 32) {
+    fail_unless(vinil_vhd_pread(vhd, buffer, sector, 32), "vinil_vhd_pread failed");
+    for (i = 0; i < 32; i++)
+      fail_unless(buffer[i*512] == 'a' + i/4 && buffer[i*512 + 511] == 'a' + i/4, "Wrong data in pwrite_dynamic.vhd");
+  }
+  
+  fail_unless(!vinil_vhd_pread(vhd, buffer, 16383, 2), "vinil_vhd_pread read after the end of the disk");
+  
+  vinil_vhd_close(vhd);
+} END_TEST
+
+START_TEST (test_vinil_create) {
+  char *vhd_files[] = {"create_sparse.vhd", 
+                       "create_fallocate.vhd",
+                       "create_full.vhd"};
+  
+  char vhd_path[256];
+  char error_msg[256];
+  
+  int i;
+  for (i = 0; i < 3; i++) {
+    sprintf(vhd_path, "../tests/data/%s", vhd_files[i]);
+    remove(vhd_path);
+    
+    // 20MB are not a multiple of the zero fill chunks
+    VinilVHD* vhd = vinil_vhd_create(vhd_path, 20*1024*1024, VINIL_VHD_FIXED, i);
+    sprintf(error_msg, "Cannot create %s", vhd_files[i]);
+    fail_unless(vhd != NULL, error_msg);
+    
+    sprintf(error_msg, "%s has a wrong size", vhd_files[i]);
+    fail_unless(vinil_file_size(vhd->fd) == 20*1024*1024 + 512, error_msg);
+    
+    fail_unless(write_sector_char(vhd, 40959, 'e'), "Cannot write the last sector");
+    fail_unless(vinil_vhd_create(vhd_path, 1024*1024, VINIL_VHD_FIXED, i) == NULL, "An existing VHD was overwritten");
+    vinil_vhd_close(vhd);
+    
+    vhd = vinil_vhd_open(vhd_path);
+    sprintf(error_msg, "Cannot reopen %s", vhd_files[i]);
+    fail_unless(vhd != NULL && vhd->footer->disk_type == VINIL_VHD_FIXED, error_msg);
+    fail_unless(read_sector_char(vhd, 0) == 0 && read_sector_char(vhd, 40959) == 'e', error_msg);
+    vinil_vhd_close(vhd);
+  }
+  
+  sprintf(vhd_path, "../tests/data/create_dynamic.vhd");
+  remove(vhd_path);
+  fail_unless(vinil_vhd_create(vhd_path, 1024*1024, VINIL_VHD_DYNAMIC, VINIL_VHD_PREALLOC_FULL) == NULL, 
+              "Dynamic VHDs can't be preallocated");
+  
+  VinilVHD* vhd = vinil_vhd_create(vhd_path, 8*1024*1024, VINIL_VHD_DYNAMIC, VINIL_VHD_PREALLOC_SPARSE);
+  fail_unless(vhd != NULL && vhd->header != NULL, "Cannot create create_dynamic.vhd");
+  fail_unless(write_sector_char(vhd, 5000, 'd'), "Cannot write create_dynamic.vhd");
+  vinil_vhd_close(vhd);
+  
+  vhd = vinil_vhd_open(vhd_path);
+  fail_unless(vhd != NULL && read_sector_char(vhd, 5000) == 'd', "Cannot reopen create_dynamic.vhd");
+  vinil_vhd_close(vhd);
+} END_TEST
+
+START_TEST (test_vinil_discard) {
+  char vhd_path[] = "../tests/data/discard_fixed.vhd";
+  remove(vhd_path);
+  VinilVHD* vhd = vinil_vhd_create(vhd_path, 8*1024*1024, VINIL_VHD_FIXED, VINIL_VHD_PREALLOC_FULL);
+  fail_unless(vhd != NULL, "Cannot create discard_fixed.vhd");
+  
+  int i;
+  for (i = 0; i < 2048; i++)
+    fail_unless(write_sector_char(vhd, i, 'a'), "Cannot write discard_fixed.vhd");
+  
+  fail_unless(vinil_vhd_discard(vhd, 8, 1024), "Cannot discard sectors of discard_fixed.vhd");
+  fail_unless(read_sector_char(vhd, 7) == 'a' && read_sector_char(vhd, 8) == 0, "Wrong data in discard_fixed.vhd");
+  fail_unless(read_sector_char(vhd, 1031) == 0 && read_sector_char(vhd, 1032) == 'a', "Wrong data in discard_fixed.vhd");
+  fail_unless(!vinil_vhd_discard(vhd, 16383, 2), "vinil_vhd_discard discarded after the end of the disk");
+  vinil_vhd_close(vhd);
+  
+  // blocks which become empty are freed, the last one of the file is cut off
+  char dynamic_path[] = "../tests/data/discard_dynamic.vhd";
+  vhd = create_dynamic_vhd(dynamic_path, 8*1024*1024);
+  fail_unless(vhd != NULL, "Cannot create discard_dynamic.vhd");
+  int64_t empty_size = vinil_file_size(vhd->fd);
+  
+  for (i = 100; i < 200; i++)
+    fail_unless(write_sector_char(vhd, i, 'c'), "Cannot write discard_dynamic.vhd");
+  fail_unless(write_sector_char(vhd, 8200, 'd'), "Cannot write discard_dynamic.vhd");
+  
+  fail_unless(vinil_vhd_discard(vhd, 8192, 4096), "Cannot discard a block of discard_dynamic.vhd");
+  fail_unless(vhd->bat[2] == VINIL_VHD_UNUSED_BLOCK, "Empty block was not freed");
+  fail_unless(read_sector_char(vhd, 8200) == 0, "Discarded sector was not zeroed");
+  
+  fail_unless(vinil_vhd_discard(vhd, 150, 10), "Cannot discard sectors of discard_dynamic.vhd");
+  fail_unless(vhd->bat[0] != VINIL_VHD_UNUSED_BLOCK, "Used block was freed");
+  fail_unless(read_sector_char(vhd, 149) == 'c' && read_sector_char(vhd, 150) == 0, "Wrong data in discard_dynamic.vhd");
+  fail_unless(read_sector_char(vhd, 159) == 0 && read_sector_char(vhd, 160) == 'c', "Wrong data in discard_dynamic.vhd");
+  
+  fail_unless(vinil_vhd_discard(vhd, 0, 4096), "Cannot discard a block of discard_dynamic.vhd");
+  fail_unless(vinil_file_size(vhd->fd) == empty_size, "Freed blocks were not cut off");
+  
+  fail_unless(write_sector_char(vhd, 5000, 'b'), "Cannot write discard_dynamic.vhd");
+  vinil_vhd_close(vhd);
+  
+  vhd = vinil_vhd_open(dynamic_path);
+  fail_unless(vhd != NULL, "Cannot reopen discard_dynamic.vhd");
+  fail_unless(read_sector_char(vhd, 150) == 0 && read_sector_char(vhd, 5000) == 'b', "Wrong data in discard_dynamic.vhd");
+  
+  // a differencing VHD hides the data of its parent
+  char child_path[] = "../tests/data/discard_child.vhd";
+  remove(child_path);
+  VinilVHD* child = vinil_vhd_create_differencing(child_path, dynamic_path);
+  vinil_vhd_close(vhd);
+  fail_unless(child != NULL, "Cannot create discard_child.vhd");
+  fail_unless(vinil_vhd_discard(child, 4999, 2), "Cannot discard sectors of discard_child.vhd");
+  fail_unless(read_sector_char(child, 5000) == 0 && read_sector_char(child->parent, 5000) == 'b', 
+              "Wrong data in discard_child.vhd");
+  
+  // blocks which no parent owns are not allocated by a discard, and freed when they become empty
+  int64_t child_size = vinil_file_size(child->fd);
+  fail_unless(vinil_vhd_discard(child, 8192, 4096), "Cannot discard sectors of discard_child.vhd");
+  fail_unless(child->bat[2] == VINIL_VHD_UNUSED_BLOCK && vinil_file_size(child->fd) == child_size,
+              "A discard allocated a block of discard_child.vhd");
+  fail_unless(write_sector_char(child, 8300, 'e') && child->owners[2] == child, "Cannot write discard_child.vhd");
+  fail_unless(vinil_vhd_discard(child, 8300, 1), "Cannot discard sectors of discard_child.vhd");
+  fail_unless(child->bat[2] == VINIL_VHD_UNUSED_BLOCK && child->owners[2] == NULL, "Empty block was not freed");
+  fail_unless(read_sector_char(child, 8300) == 0 && vinil_file_size(child->fd) == child_size,
+              "Wrong data in discard_child.vhd");
+  vinil_vhd_close(child);
+} END_TEST
+
+typedef struct {
+  VinilVHD* vhd;
+  int id;
+  int ok;
+  uint64_t* stop;
+} DiscardWorker;
+
+// each writer fills and empties its own block, so it is allocated and freed over and over
+static void* discard_writer(void* arg) {
+  DiscardWorker* worker = (DiscardWorker*)arg;
+  uint64_t sector = (uint64_t)worker->id * 4096 + 1;
+  unsigned char buffer[512];
+  worker->ok = 1;
+  
+  int round;
+  for (round = 0; round < 500 && worker->ok; round++) {
+    memset(buffer, 'a' + round % 26, sizeof(buffer));
+    worker->ok = vinil_vhd_pwrite(worker->vhd, buffer, sector, 1);
+    
+    memset(buffer, 0, sizeof(buffer));
+    worker->ok = worker->ok && vinil_vhd_pread(worker->vhd, buffer, sector, 1) && buffer[0] == 'a' + round % 26 &&
+                 vinil_vhd_discard(worker->vhd, sector, 1);
+  }
+  
+  return NULL;
+}
+
+// the other sectors of the blocks are discarded while they are written
+static void* discard_other_sectors(void* arg) {
+  DiscardWorker* worker = (DiscardWorker*)arg;
+  worker->ok = 1;
+  
+  while (!vinil_atomic_load(worker->stop) && worker->ok) {
+    uint64_t block;
+    for (block = 0; block < 4; block++)
+      worker->ok = worker->ok && vinil_vhd_discard(worker->vhd, block * 4096 + 100, 8);
+  }
+  
+  return NULL;
+}
+
+START_TEST (test_vinil_concurrent_discard) {
+  char vhd_path[] = "../tests/data/discard_concurrent.vhd";
+  VinilVHD* vhd = create_dynamic_vhd(vhd_path, 8*1024*1024);
+  fail_unless(vhd != NULL, "Cannot create discard_concurrent.vhd");
+  
+  uint64_t stop = 0;
+  DiscardWorker workers[5];
+  vinil_thread threads[5];
+  int i;
+  for (i = 0; i < 5; i++) {
+    workers[i].vhd = vhd;
+    workers[i].id = i;
+    workers[i].stop = &stop;
+    fail_unless(vinil_thread_create(&threads[i], i < 4 ? discard_writer : discard_other_sectors, &workers[i]),
+                "Cannot create thread");
+  }
+  
+  for (i = 0; i < 4; i++) {
+    vinil_thread_join(threads[i]);
+    fail_unless(workers[i].ok, "A write was lost by a concurrent discard");
+  }
+  vinil_atomic_store(&stop, 1);
+  vinil_thread_join(threads[4]);
+  fail_unless(workers[4].ok, "vinil_vhd_discard failed");
+  
+  fail_unless(vinil_vhd_discard(vhd, 0, 16384), "Cannot discard discard_concurrent.vhd");
+  for (i = 0; i < 4; i++)
+    fail_unless(vhd->bat[i] == VINIL_VHD_UNUSED_BLOCK, "An empty block was not freed");
+  fail_unless(write_sector_char(vhd, 4097, 'q'), "Cannot write discard_concurrent.vhd");
+  vinil_vhd_close(vhd);
+  
+  // a bitmap written over the footer would make the file unreadable
+  vhd = vinil_vhd_open(vhd_path);
+  fail_unless(vhd != NULL, "discard_concurrent.vhd was corrupted");
+  fail_unless(read_sector_char(vhd, 4097) == 'q' && read_sector_char(vhd, 1) == 0, "Wrong data in discard_concurrent.vhd");
+  vinil_vhd_close(vhd);
+} END_TEST
+
+// reads the sector of a block which is written and discarded by a discard_writer,
+// it must never find the data of another block
+static void* discard_reader(void* arg) {
+  DiscardWorker* worker = (DiscardWorker*)arg;
+  uint64_t sector = (uint64_t)worker->id * 4096 + 1;
+  unsigned char buffer[512];
+  worker->ok = 1;
+  
+  while (!vinil_atomic_load(worker->stop) && worker->ok) {
+    worker->ok = vinil_vhd_pread(worker->vhd, buffer, sector, 1) &&
+                 (buffer[0] == 0 || (buffer[0] >= 'a' && buffer[0] <= 'z' && (buffer[0] - 'a') % 2 == worker->id % 2));
+  }
+  
+  return NULL;
+}
+
+// like discard_writer, but the letters tell the blocks apart
+static void* discard_parity_writer(void* arg) {
+  DiscardWorker* worker = (DiscardWorker*)arg;
+  uint64_t sector = (uint64_t)worker->id * 4096 + 1;
+  unsigned char buffer[512];
+  worker->ok = 1;
+  
+  int round;
+  for (round = 0; round < 2000 && worker->ok; round++) {
+    memset(buffer, 'a' + (round * 2 + worker->id % 2) % 26, sizeof(buffer));
+    worker->ok = vinil_vhd_pwrite(worker->vhd, buffer, sector, 1) && vinil_vhd_discard(worker->vhd, sector, 1);
+  }
+  
+  return NULL;
+}
+
+START_TEST (test_vinil_concurrent_read_discard) {
+  char vhd_path[] = "../tests/data/discard_read.vhd";
+  VinilVHD* vhd = create_dynamic_vhd(vhd_path, 8*1024*1024);
+  fail_unless(vhd != NULL, "Cannot create discard_read.vhd");
+  
+  // the blocks are freed and allocated at the end of the file over and over, so
+  // a reader which kept a freed offset would find the other block there
+  uint64_t stop = 0;
+  DiscardWorker workers[4];
+  vinil_thread threads[4];
+  int i;
+  for (i = 0; i < 4; i++) {
+    workers[i].vhd = vhd;
+    workers[i].id = i % 2;
+    workers[i].stop = &stop;
+    fail_unless(vinil_thread_create(&threads[i], i < 2 ? discard_parity_writer : discard_reader, &workers[i]),
+                "Cannot create thread");
+  }
+  
+  for (i = 0; i < 2; i++)
+    vinil_thread_join(threads[i]);
+  vinil_atomic_store(&stop, 1);
+  for (i = 2; i < 4; i++)
+    vinil_thread_join(threads[i]);
+  
+  fail_unless(workers[0].ok && workers[1].ok, "Cannot write and discard discard_read.vhd");
+  fail_unless(workers[2].ok && workers[3].ok, "A read found the data of another block");
+  vinil_vhd_close(vhd);
+  
+  vhd = vinil_vhd_open(vhd_path);
+  fail_unless(vhd != NULL, "discard_read.vhd was corrupted");
+  fail_unless(read_sector_char(vhd, 1) == 0 && read_sector_char(vhd, 4097) == 0, "Wrong data in discard_read.vhd");
+  vinil_vhd_close(vhd);
+} END_TEST
+
+static void check_direct_io(const char* vhd_path, const char* vhd_file) {
+  char error_msg[256];
+  
+  VinilVHD* vhd = vinil_vhd_open_with_flags(vhd_path, VINIL_VHD_OPEN_DIRECT);
+  sprintf(error_msg, "Cannot open %s with VINIL_VHD_OPEN_DIRECT", vhd_file);
+  fail_unless(vhd != NULL, error_msg);
+  fail_unless(vhd->alignment >= 512 && vhd->alignment <= VINIL_DIRECT_ALIGNMENT, "Invalid direct I/O alignment");
+  
+  char* aligned = (char*)vinil_alloc_aligned_buffer(512*128);
+  fail_unless(aligned != NULL && (uintptr_t)aligned % VINIL_DIRECT_ALIGNMENT == 0, "Cannot allocate an aligned buffer");
+  memset(aligned, 'x', 512*128);
+  
+  // misaligned buffers, sectors and sizes are read-modify-written
+  char* unaligned = (char*)malloc(512*12 + 1);
+  memset(unaligned + 1, 'y', 512*12);
+  
+  sprintf(error_msg, "Cannot write %s with VINIL_VHD_OPEN_DIRECT", vhd_file);
+  fail_unless(vinil_vhd_pwrite(vhd, aligned, 0, 128), error_msg);
+  fail_unless(vinil_vhd_pwrite(vhd, unaligned + 1, 4090, 12), error_msg);
+  fail_unless(write_sector_char(vhd, 16383, 'z'), error_msg);
+  
+  memset(aligned, 0, 512*128);
+  sprintf(error_msg, "Cannot read %s with VINIL_VHD_OPEN_DIRECT", vhd_file);
+  fail_unless(vinil_vhd_pread(vhd, aligned, 4089, 14), error_msg);
+  fail_unless(aligned[0] == 0 && aligned[512] == 'y' && aligned[512*13 - 1] == 'y' && aligned[512*13] == 0, error_msg);
+  
+  vinil_free_aligned_buffer(aligned);
+  free(unaligned);
+  vinil_vhd_close(vhd);
+  
+  vhd = vinil_vhd_open(vhd_path);
+  sprintf(error_msg, "%s was corrupted by VINIL_VHD_OPEN_DIRECT", vhd_file);
+  fail_unless(vhd != NULL, error_msg);
+  fail_unless(read_sector_char(vhd, 0) == 'x' && read_sector_char(vhd, 127) == 'x', error_msg);
+  fail_unless(read_sector_char(vhd, 128) == 0 && read_sector_char(vhd, 4089) == 0, error_msg);
+  fail_unless(read_sector_char(vhd, 4090) == 'y' && read_sector_char(vhd, 4101) == 'y', error_msg);
+  fail_unless(read_sector_char(vhd, 4102) == 0 && read_sector_char(vhd, 16383) == 'z', error_msg);
+  vinil_vhd_close(vhd);
+}
+
+START_TEST (test_vinil_direct_io) {
+  VinilVHD* vhd = create_dynamic_vhd("../tests/data/direct_dynamic.vhd", 8*1024*1024);
+  fail_unless(vhd != NULL, "Cannot create direct_dynamic.vhd");
+  vinil_vhd_close(vhd);
+  check_direct_io("../tests/data/direct_dynamic.vhd", "direct_dynamic.vhd");
+  
+  // the footer of a new fixed VHD is written through the bounce buffer
+  char vhd_path[] = "../tests/data/direct_fixed.vhd";
+  remove(vhd_path);
+  vhd = vinil_vhd_open_with_flags(vhd_path, VINIL_VHD_OPEN_DIRECT);
+  fail_unless(vhd != NULL, "Cannot create direct_fixed.vhd");
+  memcpy(vhd->footer->cookie, "conectix", 8);
+  vhd->footer->current_size = 8*1024*1024;
+  vhd->footer->disk_type = VINIL_VHD_FIXED;
+  fail_unless(vinil_vhd_commit_structural_changes(vhd), "Cannot commit changes in direct_fixed.vhd");
+  vinil_vhd_close(vhd);
+  check_direct_io(vhd_path, "direct_fixed.vhd");
+} END_TEST
+
+static void check_vectored_io(VinilVHD* vhd, const char* vhd_file) {
+  char error_msg[256];
+  unsigned char pattern[512*12];
+  unsigned char buffer[512*12];
+  unsigned char scattered[512*12];
+  int i;
+  
+  for (i = 0; i < (int)sizeof(pattern); i++)
+    pattern[i] = (unsigned char)(i * 7 + 3);
+  
+  // entries which do not end at sector boundaries
+  vinil_iovec iov[4];
+  size_t lengths[4] = {100, 1948, 3000, 1096};
+  size_t offset = 0;
+  for (i = 0; i < 4; i++) {
+    iov[i].iov_base = pattern + offset;
+    iov[i].iov_len = lengths[i];
+    offset += lengths[i];
+  }
+  
+  // the request crosses the boundary between the first and the second block
+  sprintf(error_msg, "vinil_vhd_pwritev failed in %s", vhd_file);
+  fail_unless(vinil_vhd_pwritev(vhd, iov, 4, 4090), error_msg);
+  
+  sprintf(error_msg, "vinil_vhd_pread failed in %s", vhd_file);
+  fail_unless(vinil_vhd_pread(vhd, buffer, 4090, 12), error_msg);
+  
+  sprintf(error_msg, "vinil_vhd_pwritev wrote wrong data in %s", vhd_file);
+  fail_unless(memcmp(buffer, pattern, sizeof(pattern)) == 0, error_msg);
+  
+  memset(scattered, 0xff, sizeof(scattered));
+  for (i = 0; i < 4; i++)
+    iov[i].iov_base = scattered + ((char*)iov[i].iov_base - (char*)pattern);
+  
+  sprintf(error_msg, "vinil_vhd_preadv failed in %s", vhd_file);
+  fail_unless(vinil_vhd_preadv(vhd, iov, 4, 4090), error_msg);
+  
+  sprintf(error_msg, "vinil_vhd_preadv read wrong data in %s", vhd_file);
+  fail_unless(memcmp(scattered, pattern, sizeof(pattern)) == 0, error_msg);
+  
+  iov[0].iov_len = 99;
+  sprintf(error_msg, "vinil_vhd_preadv accepted a partial sector in %s", vhd_file);
+  fail_unless(!vinil_vhd_preadv(vhd, iov, 4, 4090), error_msg);
+}
+
+START_TEST (test_vinil_vectored_io) {
+  VinilVHD* vhd = create_dynamic_vhd("../tests/data/vectored_dynamic.vhd", 8*1024*1024);
+  fail_unless(vhd != NULL, "Cannot create vectored_dynamic.vhd");
+  check_vectored_io(vhd, "vectored_dynamic.vhd");
+  vinil_vhd_close(vhd);
+  
+  char vhd_path[] = "../tests/data/vectored_fixed.vhd";
+  remove(vhd_path);
+  vhd = vinil_vhd_open(vhd_path);
+  fail_unless(vhd != NULL, "Cannot create vectored_fixed.vhd");
+  memcpy(vhd->footer->cookie, "conectix", 8);
+  vhd->footer->current_size = 8*1024*1024;
+  vhd->footer->disk_type = VINIL_VHD_FIXED;
+  fail_unless(vinil_vhd_commit_structural_changes(vhd), "Cannot commit changes in vectored_fixed.vhd");
+  check_vectored_io(vhd, "vectored_fixed.vhd");
+  vinil_vhd_close(vhd);
+} END_TEST
+
+START_TEST (test_vinil_map_range) {
+  char *vhd_files[] = {"vhd_test_y.vhd", 
+                       "vhd_test_zero.vhd"};
+  
+  char vhd_path[256];
+  char error_msg[256];
+  unsigned char sector[512];
+  
+  int i;
+  for (i = 0; i < 2; i++) {
+    sprintf(vhd_path, "../tests/data/%s", vhd_files[i]);
+    
+    VinilVHD* vhd = vinil_vhd_open(vhd_path);
+    VinilVHD* mapped = vinil_vhd_open_with_flags(vhd_path, VINIL_VHD_OPEN_READ_ONLY | VINIL_VHD_OPEN_MMAP);
+    
+    sprintf(error_msg, "Cannot open %s", vhd_files[i]);
+    fail_unless(vhd != NULL && mapped != NULL, error_msg);
+    
+    uint64_t sectors = mapped->footer->current_size / 512;
+    const unsigned char* view = (const unsigned char*)vinil_vhd_map_range(mapped, 0, sectors, VINIL_ADVICE_SEQUENTIAL);
+    sprintf(error_msg, "Cannot map %s", vhd_files[i]);
+    fail_unless(view != NULL, error_msg);
+    
+    uint64_t j;
+    for (j = 0; j < sectors; j++) {
+      fail_unless(vinil_vhd_read(vhd, sector, 1), error_msg);
+      sprintf(error_msg, "Mapped data of %s is different", vhd_files[i]);
+      fail_unless(memcmp(view + j * 512, sector, 512) == 0, error_msg);
+    }
+    
+    sprintf(error_msg, "Cannot read %s through the mapping", vhd_files[i]);
+    fail_unless(vinil_vhd_pread(mapped, sector, sectors - 1, 1), error_msg);
+    fail_unless(memcmp(view + (sectors - 1) * 512, sector, 512) == 0, error_msg);
+    
+    sprintf(error_msg, "%s was mapped after its end", vhd_files[i]);
+    fail_unless(vinil_vhd_map_range(mapped, sectors, 1, VINIL_ADVICE_RANDOM) == NULL, error_msg);
+    
+    sprintf(error_msg, "Cannot unmap %s", vhd_files[i]);
+    fail_unless(vinil_vhd_unmap_range(mapped, view, sectors), error_msg);
+    
+    vinil_vhd_close(mapped);
+    vinil_vhd_close(vhd);
+  }
+  
+  VinilVHD* vhd = create_dynamic_vhd("../tests/data/map_dynamic.vhd", 8*1024*1024);
+  fail_unless(vhd != NULL, "Cannot create map_dynamic.vhd");
+  vinil_vhd_close(vhd);
+  
+  vhd = vinil_vhd_open_with_flags("../tests/data/map_dynamic.vhd", VINIL_VHD_OPEN_MMAP);
+  fail_unless(vhd != NULL, "Cannot open map_dynamic.vhd");
+  fail_unless(vinil_vhd_map_range(vhd, 0, 1, VINIL_ADVICE_NORMAL) == NULL, "Dynamic VHDs can't be mapped");
+  vinil_vhd_close(vhd);
+} END_TEST
+
 Suite* func_suite(void) {
   Suite *s = suite_create ("vinil");
   TCase *tc_core = tcase_create ("VHD");
@@ -289,6 +961,16 @@ Suite* func_suite(void) {
   tcase_add_test (tc_core, test_vinil_seek);
   tcase_add_test (tc_core, test_vinil_vhd_commit_structural_changes);
   tcase_add_test (tc_core, test_vinil_geometry_encode);
+  tcase_add_test (tc_core, test_vinil_dynamic_vhd);
+  tcase_add_test (tc_core, test_vinil_differencing_vhd);
+  tcase_add_test (tc_core, test_vinil_pread_pwrite);
+  tcase_add_test (tc_core, test_vinil_vectored_io);
+  tcase_add_test (tc_core, test_vinil_map_range);
+  tcase_add_test (tc_core, test_vinil_direct_io);
+  tcase_add_test (tc_core, test_vinil_create);
+  tcase_add_test (tc_core, test_vinil_discard);
+  tcase_add_test (tc_core, test_vinil_concurrent_discard);
+  tcase_add_test (tc_core, test_vinil_concurrent_read_discard);
   suite_add_tcase (s, tc_core);
   return s;
 }
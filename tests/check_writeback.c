@@ -0,0 +1,199 @@
+/**
+ *  @file       check_writeback.c
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <check.h>
+
+#include "vhd.h"
+#include "writeback.h"
+
+static int insert_sectors(VinilWriteBack* wb, uint64_t sector, uint64_t count, char value) {
+  char buffer[512*16];
+  memset(buffer, value, (size_t)count * 512);
+
+  vinil_iovec iov;
+  iov.iov_base = buffer;
+  iov.iov_len = (size_t)count * 512;
+
+  return vinil_write_back_insert(wb, sector, &iov, 1);
+}
+
+typedef struct {
+  uint64_t sectors[8];
+  uint64_t counts[8];
+  int extents;
+} FlushLog;
+
+static int log_extent(void* arg, uint64_t sector, const void* data, uint64_t count) {
+  FlushLog* log = (FlushLog*)arg;
+  (void)data;
+  log->sectors[log->extents] = sector;
+  log->counts[log->extents] = count;
+  log->extents++;
+
+  return TRUE;
+}
+
+START_TEST (test_vinil_write_back_merge) {
+  VinilWriteBack* wb = vinil_write_back_create(1024*1024, 0);
+  fail_unless(wb != NULL, "Cannot create VinilWriteBack");
+
+  // adjacent sectors grow one extent, a write in the gap joins two extents
+  fail_unless(insert_sectors(wb, 10, 1, 'a') && insert_sectors(wb, 11, 2, 'b'), "Cannot insert sectors");
+  fail_unless(insert_sectors(wb, 20, 4, 'c'), "Cannot insert sectors");
+  fail_unless(vinil_write_back_extents(wb) == 2, "Adjacent sectors were not merged");
+  fail_unless(insert_sectors(wb, 12, 9, 'd'), "Cannot insert sectors");
+  fail_unless(vinil_write_back_extents(wb) == 1, "Overlapping sectors were not merged");
+  fail_unless(vinil_write_back_covered(wb, 0, 100) == 14, "Wrong number of buffered sectors");
+
+  char buffer[512*16];
+  memset(buffer, 'z', sizeof(buffer));
+  vinil_iovec iov;
+  iov.iov_base = buffer;
+  iov.iov_len = sizeof(buffer);
+  vinil_write_back_overlay(wb, 8, &iov, 1);
+  fail_unless(buffer[0] == 'z' && buffer[2*512] == 'a' && buffer[3*512] == 'b', "Wrong overlay");
+  fail_unless(buffer[4*512] == 'd' && buffer[12*512] == 'd' && buffer[13*512] == 'c', "Wrong overlay");
+
+  // removing the middle of an extent splits it
+  fail_unless(vinil_write_back_remove(wb, 14, 2), "Cannot remove sectors");
+  fail_unless(vinil_write_back_extents(wb) == 2, "The extent was not split");
+  fail_unless(vinil_write_back_covered(wb, 0, 100) == 12, "Wrong number of buffered sectors");
+
+  FlushLog log;
+  log.extents = 0;
+  fail_unless(vinil_write_back_flush(wb, log_extent, &log), "Cannot flush");
+  fail_unless(log.extents == 2, "Wrong number of extents written back");
+  fail_unless(log.sectors[0] == 10 && log.counts[0] == 4 && log.sectors[1] == 16 && log.counts[1] == 8, "Wrong extents");
+  fail_unless(vinil_write_back_extents(wb) == 0 && !vinil_write_back_due(wb), "The buffer was not emptied");
+
+  vinil_write_back_destroy(wb);
+} END_TEST
+
+START_TEST (test_vinil_vhd_write_back) {
+  char vhd_path[] = "../tests/data/write_back_dynamic.vhd";
+  remove(vhd_path);
+
+  VinilVHD* vhd = vinil_vhd_create(vhd_path, 8*1024*1024, VINIL_VHD_DYNAMIC, VINIL_VHD_PREALLOC_SPARSE);
+  fail_unless(vhd != NULL, "Cannot create write_back_dynamic.vhd");
+  vinil_vhd_close(vhd);
+
+  vhd = vinil_vhd_open_with_flags(vhd_path, VINIL_VHD_OPEN_WRITE_BACK | VINIL_VHD_OPEN_STATS);
+  fail_unless(vhd != NULL, "Cannot open write_back_dynamic.vhd");
+  fail_unless(vinil_vhd_set_write_back(vhd, 1024*1024, 0), "Cannot configure the write-back buffer");
+
+  // 256 sequential 512 bytes writes across a block boundary
+  char sector[512];
+  int i;
+  for (i = 0; i < 256; i++) {
+    memset(sector, i, sizeof(sector));
+    fail_unless(vinil_vhd_pwrite(vhd, sector, 4000 + i, 1), "Cannot write write_back_dynamic.vhd");
+  }
+
+  VinilVHDStats stats;
+  vinil_vhd_get_stats(vhd, &stats);
+  fail_unless(stats.metadata_writes == 0, "Buffered writes reached the disk");
+  fail_unless(stats.merged_requests == 255, "Buffered writes were not merged");
+
+  char buffer[512*4];
+  fail_unless(vinil_vhd_pread(vhd, buffer, 3999, 4), "Cannot read write_back_dynamic.vhd");
+  fail_unless(buffer[0] == 0 && buffer[512] == 0 && buffer[2*512] == 1 && buffer[3*512] == 2, "Buffered data was not read");
+
+  // each block is allocated (bitmap, footer and BAT entry) and its bitmap is updated once
+  fail_unless(vinil_vhd_flush(vhd), "Cannot flush write_back_dynamic.vhd");
+  vinil_vhd_get_stats(vhd, &stats);
+  fail_unless(stats.metadata_writes == 2 * 4, "Bitmap updates were not batched");
+
+  fail_unless(vinil_vhd_pwrite(vhd, sector, 10, 1), "Cannot write write_back_dynamic.vhd");
+  fail_unless(vinil_vhd_discard(vhd, 10, 1), "Cannot discard write_back_dynamic.vhd");
+  memset(sector, 'w', sizeof(sector));
+  fail_unless(vinil_vhd_pwrite(vhd, sector, 20, 1), "Cannot write write_back_dynamic.vhd");
+  vinil_vhd_close(vhd);
+
+  vhd = vinil_vhd_open(vhd_path);
+  fail_unless(vhd != NULL, "Cannot open write_back_dynamic.vhd");
+  fail_unless(vinil_vhd_pread(vhd, buffer, 4254, 4), "Cannot read write_back_dynamic.vhd");
+  fail_unless(buffer[0] == (char)254 && buffer[512] == (char)255 && buffer[2*512] == 0, "Wrong data after the flush");
+  fail_unless(vinil_vhd_pread(vhd, buffer, 10, 1) && buffer[0] == 0, "The discarded write was written back");
+  fail_unless(vinil_vhd_pread(vhd, buffer, 20, 1) && buffer[0] == 'w', "vinil_vhd_close lost a buffered write");
+  fail_unless(!vinil_vhd_set_write_back(vhd, 1024*1024, 0), "A VHD without write-back was configured");
+  vinil_vhd_close(vhd);
+} END_TEST
+
+static size_t buffered_extents(VinilVHD* vhd) {
+  vinil_mutex_lock(&vhd->write_back_lock);
+  size_t extents = vinil_write_back_extents(vhd->write_back);
+  vinil_mutex_unlock(&vhd->write_back_lock);
+
+  return extents;
+}
+
+START_TEST (test_vinil_vhd_write_back_age) {
+  VinilWriteBack* wb = vinil_write_back_create(1024*1024, 1000000000);
+  fail_unless(wb != NULL, "Cannot create a write-back buffer");
+  fail_unless(vinil_write_back_wait(wb) == UINT64_MAX, "An empty buffer has to wait");
+  fail_unless(insert_sectors(wb, 0, 1, 'a'), "Cannot insert sectors");
+  fail_unless(vinil_write_back_wait(wb) > 0 && vinil_write_back_wait(wb) <= 1000000000, "Wrong wait");
+  vinil_write_back_set_limits(wb, 1024*1024, 0);
+  fail_unless(vinil_write_back_wait(wb) == UINT64_MAX, "A buffer without age threshold has to wait");
+  vinil_write_back_destroy(wb);
+
+  char vhd_path[] = "../tests/data/write_back_age.vhd";
+  remove(vhd_path);
+
+  VinilVHD* vhd = vinil_vhd_create(vhd_path, 8*1024*1024, VINIL_VHD_DYNAMIC, VINIL_VHD_PREALLOC_SPARSE);
+  fail_unless(vhd != NULL, "Cannot create write_back_age.vhd");
+  vinil_vhd_close(vhd);
+
+  vhd = vinil_vhd_open_with_flags(vhd_path, VINIL_VHD_OPEN_WRITE_BACK);
+  fail_unless(vhd != NULL, "Cannot open write_back_age.vhd");
+  fail_unless(vinil_vhd_set_write_back(vhd, 1024*1024, 20), "Cannot configure the write-back buffer");
+
+  // no other write comes, the old one is written back anyway
+  char sector[512];
+  memset(sector, 'o', sizeof(sector));
+  fail_unless(vinil_vhd_pwrite(vhd, sector, 30, 1), "Cannot write write_back_age.vhd");
+
+  int i;
+  for (i = 0; i < 200 && buffered_extents(vhd) > 0; i++)
+    vinil_sleep_ns(10000000);
+  fail_unless(buffered_extents(vhd) == 0, "An old buffered write was not written back");
+
+  VinilVHD* reader = vinil_vhd_open_with_flags(vhd_path, VINIL_VHD_OPEN_READ_ONLY);
+  fail_unless(reader != NULL, "Cannot open write_back_age.vhd");
+  fail_unless(vinil_vhd_pread(reader, sector, 30, 1) && sector[0] == 'o', "The written back data is not in the file");
+  vinil_vhd_close(reader);
+
+  // without age threshold the write stays in the buffer
+  fail_unless(vinil_vhd_set_write_back(vhd, 1024*1024, 0), "Cannot configure the write-back buffer");
+  fail_unless(vinil_vhd_pwrite(vhd, sector, 40, 1), "Cannot write write_back_age.vhd");
+  vinil_sleep_ns(50000000);
+  fail_unless(buffered_extents(vhd) == 1, "A write was written back without age threshold");
+  vinil_vhd_close(vhd);
+} END_TEST
+
+Suite* func_suite(void) {
+  Suite *s = suite_create ("vinil");
+  TCase *tc_core = tcase_create ("WriteBack");
+  tcase_add_test (tc_core, test_vinil_write_back_merge);
+  tcase_add_test (tc_core, test_vinil_vhd_write_back);
+  tcase_add_test (tc_core, test_vinil_vhd_write_back_age);
+  suite_add_tcase (s, tc_core);
+  return s;
+}
+
+int main() {
+  int number_failed;
+  Suite *s = func_suite();
+  SRunner *sr = srunner_create(s);
+  srunner_run_all(sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
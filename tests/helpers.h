@@ -0,0 +1,75 @@
+/**
+ *  @file       helpers.h
+ *  @brief      Helpers shared by the tests.
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#ifndef VINIL_TESTS_HELPERS_H_
+#define VINIL_TESTS_HELPERS_H_
+
+#include <string.h>
+
+#include <check.h>
+
+#include "vhd.h"
+
+#define EXTENT_LOG_SIZE   16
+
+// extents reported by a callback, it stops after limit of them (EXTENT_LOG_SIZE if it is 0)
+typedef struct {
+  int count;
+  int limit;
+  uint64_t sectors[EXTENT_LOG_SIZE];
+  uint64_t counts[EXTENT_LOG_SIZE];
+} ExtentLog;
+
+static inline int log_extent(void* arg, uint64_t sector, uint64_t count) {
+  ExtentLog* log = (ExtentLog*)arg;
+  int limit = log->limit > 0 && log->limit < EXTENT_LOG_SIZE ? log->limit : EXTENT_LOG_SIZE;
+  if (log->count == limit)
+    return FALSE;
+
+  log->sectors[log->count] = sector;
+  log->counts[log->count] = count;
+  log->count++;
+
+  return TRUE;
+}
+
+// writes count sectors which hold value, however many they are
+static inline void fill_sectors(VinilVHD* vhd, uint64_t sector, uint64_t count, int value) {
+  char buffer[512*16];
+  memset(buffer, value, sizeof(buffer));
+
+  while (count > 0) {
+    uint64_t n = count < sizeof(buffer) / 512 ? count : sizeof(buffer) / 512;
+    fail_unless(vinil_vhd_pwrite(vhd, buffer, sector, n), "Cannot write the VHD");
+    sector += n;
+    count -= n;
+  }
+}
+
+// tells whether two VHDs have the same size and the same data
+static inline int same_data(const char* path_a, const char* path_b) {
+  VinilVHD* a = vinil_vhd_open_with_flags(path_a, VINIL_VHD_OPEN_READ_ONLY);
+  VinilVHD* b = vinil_vhd_open_with_flags(path_b, VINIL_VHD_OPEN_READ_ONLY);
+  int same = a && b && a->footer->current_size == b->footer->current_size;
+
+  char buffer_a[512*64], buffer_b[512*64];
+  uint64_t sector;
+  for (sector = 0; same && sector < a->footer->current_size / 512; sector += 64) {
+    uint64_t n = a->footer->current_size / 512 - sector < 64 ? a->footer->current_size / 512 - sector : 64;
+    same = vinil_vhd_pread(a, buffer_a, sector, n) && vinil_vhd_pread(b, buffer_b, sector, n) &&
+           memcmp(buffer_a, buffer_b, (size_t)(n * 512)) == 0;
+  }
+
+  if (a)
+    vinil_vhd_close(a);
+  if (b)
+    vinil_vhd_close(b);
+
+  return same;
+}
+
+#endif
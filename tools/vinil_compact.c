@@ -0,0 +1,70 @@
+/**
+ *  @file       vinil_compact.c
+ *  @brief      This application compacts a dynamic or differencing Virtual Hard Disk:
+ *              blocks without data are freed, the file is packed and truncated, and
+ *              a JSON summary is printed.
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#include "vhd.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// usage:
+// ./vinil_compact [--step=N] dynamic.vhd
+int main(int argc, char* argv[]) {
+  int step = 0;
+  const char* file = NULL;
+
+  int i;
+  for (i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--step=", 7) == 0)
+      step = atoi(argv[i] + 7);
+    else if (file == NULL && argv[i][0] != '-')
+      file = argv[i];
+    else
+      step = -1;
+  }
+
+  if (file == NULL || step < 0) {
+    fprintf(stderr, "usage: vinil_compact [--step=N] image.vhd\n");
+    return -1;
+  }
+
+  VinilVHD* vhd = vinil_vhd_open(file);
+  if (vhd == NULL) {
+    printf("ERROR: Can't open %s\n", file);
+    return -1;
+  }
+
+  // the steps are what an online compaction would do between the I/O of the VHD
+  int64_t old_size = vinil_file_size(vhd->fd);
+  uint64_t start = vinil_clock_ns();
+  uint64_t steps = 0, checked = 0, freed = 0, moved = 0;
+  VinilVHDCompactStats stats;
+  do {
+    if (!vinil_vhd_compact(vhd, (uint32_t)step, &stats)) {
+      printf("ERROR: Can't compact %s\n", file);
+      vinil_vhd_close(vhd);
+      return -1;
+    }
+
+    steps++;
+    checked += stats.checked_blocks;
+    freed += stats.freed_blocks;
+    moved += stats.moved_blocks;
+  } while (!stats.finished);
+  double seconds = (vinil_clock_ns() - start) / 1e9;
+
+  vinil_vhd_close(vhd);
+
+  printf("{\"file\": \"%s\", \"steps\": %llu, \"checked_blocks\": %llu, \"freed_blocks\": %llu, \"moved_blocks\": %llu, "
+         "\"old_size\": %lld, \"new_size\": %llu, \"seconds\": %.6f}\n",
+         file, (unsigned long long)steps, (unsigned long long)checked, (unsigned long long)freed,
+         (unsigned long long)moved, (long long)old_size, (unsigned long long)stats.file_size, seconds);
+
+  return 0;
+}
@@ -0,0 +1,53 @@
+/**
+ *  @file       vinil_convert.c
+ *  @brief      This application converts a Virtual Hard Disk (usually a fixed one)
+ *              into a dynamic VHD which only allocates the blocks with data, and
+ *              prints a JSON summary of the conversion.
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#include "convert.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// usage:
+// ./vinil_convert [--threads=N] fixed.vhd dynamic.vhd
+int main(int argc, char* argv[]) {
+  int threads = VINIL_CONVERT_DEFAULT_THREADS;
+  const char* files[2];
+  int file_count = 0;
+
+  int i;
+  for (i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--threads=", 10) == 0)
+      threads = atoi(argv[i] + 10);
+    else if (file_count < 2 && argv[i][0] != '-')
+      files[file_count++] = argv[i];
+    else
+      file_count = 3;
+  }
+
+  if (file_count != 2 || threads <= 0) {
+    fprintf(stderr, "usage: vinil_convert [--threads=N] source.vhd destination.vhd\n");
+    return -1;
+  }
+
+  VinilConvertStats stats;
+  uint64_t start = vinil_clock_ns();
+  if (!vinil_convert(files[0], files[1], threads, &stats)) {
+    printf("ERROR: Can't convert %s into %s\n", files[0], files[1]);
+    return -1;
+  }
+  double seconds = (vinil_clock_ns() - start) / 1e9;
+
+  printf("{\"source\": \"%s\", \"destination\": \"%s\", \"threads\": %d, \"blocks\": %llu, \"written_blocks\": %llu, "
+         "\"hole_blocks\": %llu, \"zero_blocks\": %llu, \"bytes_read\": %llu, \"seconds\": %.6f, \"read_mb_s\": %.2f}\n",
+         files[0], files[1], threads, (unsigned long long)stats.blocks, (unsigned long long)stats.written_blocks,
+         (unsigned long long)stats.hole_blocks, (unsigned long long)stats.zero_blocks,
+         (unsigned long long)stats.bytes_read, seconds, seconds > 0 ? stats.bytes_read / (1024.0 * 1024) / seconds : 0);
+
+  return 0;
+}
@@ -0,0 +1,62 @@
+/**
+ *  @file       vinil_diff.c
+ *  @brief      This application compares the data of two Virtual Hard Disks, prints
+ *              every extent of sectors which differ and a JSON summary of the comparison.
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#include "diff.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int print_extent(void* arg, uint64_t sector, uint64_t count) {
+  (void)arg;
+  printf("{\"sector\": %llu, \"count\": %llu}\n", (unsigned long long)sector, (unsigned long long)count);
+  return TRUE;
+}
+
+// usage:
+// ./vinil_diff [--threads=N] [--quiet] replica.vhd golden.vhd
+// like cmp, it returns 0 if the data is the same and 1 if it differs
+int main(int argc, char* argv[]) {
+  int threads = VINIL_DIFF_DEFAULT_THREADS;
+  int quiet = FALSE;
+  const char* files[2];
+  int file_count = 0;
+
+  int i;
+  for (i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--threads=", 10) == 0)
+      threads = atoi(argv[i] + 10);
+    else if (strcmp(argv[i], "--quiet") == 0)
+      quiet = TRUE;
+    else if (file_count < 2 && argv[i][0] != '-')
+      files[file_count++] = argv[i];
+    else
+      file_count = 3;
+  }
+
+  if (file_count != 2 || threads <= 0) {
+    fprintf(stderr, "usage: vinil_diff [--threads=N] [--quiet] a.vhd b.vhd\n");
+    return -1;
+  }
+
+  VinilDiffStats stats;
+  uint64_t start = vinil_clock_ns();
+  if (!vinil_diff(files[0], files[1], threads, quiet ? NULL : print_extent, NULL, &stats)) {
+    printf("ERROR: Can't compare %s with %s\n", files[0], files[1]);
+    return -1;
+  }
+  double seconds = (vinil_clock_ns() - start) / 1e9;
+
+  printf("{\"a\": \"%s\", \"b\": \"%s\", \"threads\": %d, \"sectors\": %llu, \"differing_sectors\": %llu, "
+         "\"extents\": %llu, \"skipped_sectors\": %llu, \"bytes_read\": %llu, \"seconds\": %.6f, \"read_mb_s\": %.2f}\n",
+         files[0], files[1], threads, (unsigned long long)stats.sectors, (unsigned long long)stats.differing_sectors,
+         (unsigned long long)stats.extents, (unsigned long long)stats.skipped_sectors,
+         (unsigned long long)stats.bytes_read, seconds, seconds > 0 ? stats.bytes_read / (1024.0 * 1024) / seconds : 0);
+
+  return stats.differing_sectors > 0 ? 1 : 0;
+}
@@ -0,0 +1,61 @@
+/**
+ *  @file       vinil_export.c
+ *  @brief      This application writes the disk of a Virtual Hard Disk to stdout (a pipe
+ *              to a compressor, ssh or an upload), as a raw image or as a fixed VHD, and
+ *              prints a JSON summary of the export to stderr.
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#include "export.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+  #include <fcntl.h>
+#endif
+
+// usage:
+// ./vinil_export [--vhd] disk.vhd | zstd > disk.raw.zst
+int main(int argc, char* argv[]) {
+  int format = VINIL_EXPORT_RAW;
+  const char* file = NULL;
+  int usage = FALSE;
+
+  int i;
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--vhd") == 0)
+      format = VINIL_EXPORT_VHD;
+    else if (file == NULL && argv[i][0] != '-')
+      file = argv[i];
+    else
+      usage = TRUE;
+  }
+
+  if (usage || file == NULL) {
+    fprintf(stderr, "usage: vinil_export [--vhd] image.vhd > image.raw\n");
+    return -1;
+  }
+
+#ifdef _WIN32
+  _setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+  VinilExportStats stats;
+  uint64_t start = vinil_clock_ns();
+  if (!vinil_export(file, 1, format, &stats)) {
+    fprintf(stderr, "ERROR: Can't export %s\n", file);
+    return -1;
+  }
+  double seconds = (vinil_clock_ns() - start) / 1e9;
+
+  fprintf(stderr, "{\"source\": \"%s\", \"format\": \"%s\", \"bytes_written\": %llu, \"bytes_read\": %llu, "
+                  "\"zero_bytes\": %llu, \"seconds\": %.6f, \"write_mb_s\": %.2f}\n",
+          file, format == VINIL_EXPORT_VHD ? "vhd" : "raw", (unsigned long long)stats.bytes_written,
+          (unsigned long long)stats.bytes_read, (unsigned long long)stats.zero_bytes, seconds,
+          seconds > 0 ? stats.bytes_written / (1024.0 * 1024) / seconds : 0);
+
+  return 0;
+}
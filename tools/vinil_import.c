@@ -0,0 +1,67 @@
+/**
+ *  @file       vinil_import.c
+ *  @brief      This application writes a raw disk image read from stdin (a pipe from
+ *              a download or a decompressor) into a new fixed or dynamic Virtual Hard
+ *              Disk, and prints a JSON summary of the import.
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#include "vhd.h"
+#include "import.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+  #include <fcntl.h>
+#endif
+
+// usage:
+// curl -s http://host/disk.raw | ./vinil_import [--fixed] [--size=BYTES] disk.vhd
+int main(int argc, char* argv[]) {
+  int disk_type = VINIL_VHD_DYNAMIC;
+  uint64_t size = 0;
+  const char* file = NULL;
+  int usage = FALSE;
+
+  int i;
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--fixed") == 0)
+      disk_type = VINIL_VHD_FIXED;
+    else if (strncmp(argv[i], "--size=", 7) == 0)
+      size = strtoull(argv[i] + 7, NULL, 10);
+    else if (file == NULL && argv[i][0] != '-')
+      file = argv[i];
+    else
+      usage = TRUE;
+  }
+
+  if (usage || file == NULL || (disk_type == VINIL_VHD_DYNAMIC && size == 0)) {
+    fprintf(stderr, "usage: vinil_import [--fixed] [--size=BYTES] image.vhd < image.raw\n"
+                    "       a dynamic VHD needs the size of the disk\n");
+    return -1;
+  }
+
+#ifdef _WIN32
+  _setmode(_fileno(stdin), _O_BINARY);
+#endif
+
+  VinilImportStats stats;
+  uint64_t start = vinil_clock_ns();
+  if (!vinil_import(0, file, size, disk_type, &stats)) {
+    printf("ERROR: Can't import %s\n", file);
+    return -1;
+  }
+  double seconds = (vinil_clock_ns() - start) / 1e9;
+
+  printf("{\"destination\": \"%s\", \"type\": \"%s\", \"blocks\": %llu, \"written_blocks\": %llu, "
+         "\"zero_blocks\": %llu, \"bytes_read\": %llu, \"seconds\": %.6f, \"read_mb_s\": %.2f}\n",
+         file, disk_type == VINIL_VHD_FIXED ? "fixed" : "dynamic", (unsigned long long)stats.blocks,
+         (unsigned long long)stats.written_blocks, (unsigned long long)stats.zero_blocks,
+         (unsigned long long)stats.bytes_read, seconds,
+         seconds > 0 ? stats.bytes_read / (1024.0 * 1024) / seconds : 0);
+
+  return 0;
+}
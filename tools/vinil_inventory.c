@@ -0,0 +1,266 @@
+/**
+ *  @file       vinil_inventory.c
+ *  @brief      This application walks directory trees, probes every file with
+ *              vinil_vhd_probe in several threads and prints the size, type, UUID
+ *              and allocation ratio of each Virtual Hard Disk as CSV or JSON lines.
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#include "vhd.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+  #include <windows.h>
+#else
+  #include <dirent.h>
+  #include <sys/stat.h>
+#endif
+
+#define INVENTORY_DEFAULT_THREADS 8
+#define INVENTORY_MAX_THREADS     64
+
+typedef struct {
+  char* path;
+  int is_vhd;
+  VinilVHDFooter footer;
+  int64_t file_size;
+  double allocation;        // allocated part of the disk, -1 if it could not be read
+} InventoryEntry;
+
+typedef struct {
+  InventoryEntry* entries;
+  uint64_t count;
+  uint64_t capacity;
+  uint64_t next;
+} Inventory;
+
+static int inventory_add(Inventory* inventory, const char* path) {
+  if (inventory->count == inventory->capacity) {
+    uint64_t capacity = inventory->capacity ? inventory->capacity * 2 : 1024;
+    InventoryEntry* entries = (InventoryEntry*)realloc(inventory->entries, (size_t)capacity * sizeof(InventoryEntry));
+    if (entries == NULL)
+      return FALSE;
+    inventory->entries = entries;
+    inventory->capacity = capacity;
+  }
+
+  InventoryEntry* entry = &inventory->entries[inventory->count];
+  memset(entry, 0, sizeof(InventoryEntry));
+  entry->path = (char*)malloc(strlen(path) + 1);
+  if (entry->path == NULL)
+    return FALSE;
+  strcpy(entry->path, path);
+  inventory->count++;
+
+  return TRUE;
+}
+
+// only the names are collected, the files are read by the workers
+static int inventory_walk(Inventory* inventory, const char* path) {
+  char child[VINIL_MAX_PATH];
+
+#ifdef _WIN32
+  DWORD attributes = GetFileAttributesA(path);
+  if (attributes == INVALID_FILE_ATTRIBUTES)
+    return FALSE;
+  if (!(attributes & FILE_ATTRIBUTE_DIRECTORY))
+    return inventory_add(inventory, path);
+
+  WIN32_FIND_DATAA data;
+  snprintf(child, sizeof(child), "%s\\*", path);
+  HANDLE find = FindFirstFileA(child, &data);
+  if (find == INVALID_HANDLE_VALUE)
+    return TRUE;
+
+  int ok = TRUE;
+  do {
+    if (strcmp(data.cFileName, ".") == 0 || strcmp(data.cFileName, "..") == 0 ||
+        (data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+      continue;
+    snprintf(child, sizeof(child), "%s\\%s", path, data.cFileName);
+    ok = inventory_walk(inventory, child);
+  } while (ok && FindNextFileA(find, &data));
+
+  FindClose(find);
+#else
+  // symbolic links are not followed, so a tree is never scanned twice
+  struct stat st;
+  if (lstat(path, &st) != 0)
+    return FALSE;
+  if (S_ISREG(st.st_mode))
+    return inventory_add(inventory, path);
+  if (!S_ISDIR(st.st_mode))
+    return TRUE;
+
+  DIR* dir = opendir(path);
+  if (dir == NULL)
+    return TRUE;
+
+  int ok = TRUE;
+  struct dirent* item;
+  while (ok && (item = readdir(dir)) != NULL) {
+    if (strcmp(item->d_name, ".") == 0 || strcmp(item->d_name, "..") == 0)
+      continue;
+    snprintf(child, sizeof(child), "%s/%s", path, item->d_name);
+    ok = inventory_walk(inventory, child);
+  }
+
+  closedir(dir);
+#endif
+
+  return ok;
+}
+
+// allocated blocks of a dynamic VHD or data extents of a fixed one, relative to the size of the disk
+static double inventory_allocation(InventoryEntry* entry) {
+  int fd = vinil_open(entry->path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+
+  entry->file_size = vinil_file_size(fd);
+  double allocation = -1;
+
+  if (entry->footer.disk_type == VINIL_VHD_FIXED) {
+    int64_t end = (int64_t)entry->footer.current_size, offset = 0, data, hole, allocated = 0;
+    while (offset < end && vinil_next_data(fd, offset, &data, &hole) && data < end) {
+      allocated += (hole < end ? hole : end) - data;
+      offset = hole;
+    }
+    allocation = end > 0 ? (double)allocated / end : 0;
+  } else {
+    VinilVHDDynamicHeader header;
+    if (vinil_pread(fd, &header, sizeof(header), (int64_t)entry->footer.data_offset)) {
+      vinil_vhd_dynamic_header_byte_swap(&header);
+
+      uint32_t* bat = (uint32_t*)malloc((header.max_table_entries ? header.max_table_entries : 1) * sizeof(uint32_t));
+      if (memcmp(header.cookie, "cxsparse", 8) == 0 && vinil_checksum_vhd_dynamic_header(&header) == header.checksum && bat &&
+          vinil_pread(fd, bat, header.max_table_entries * sizeof(uint32_t), (int64_t)header.table_offset)) {
+        uint32_t i, used = 0;
+        for (i = 0; i < header.max_table_entries; i++)
+          used += bat[i] != VINIL_VHD_UNUSED_BLOCK;
+        allocation = header.max_table_entries ? (double)used / header.max_table_entries : 0;
+      }
+      free(bat);
+    }
+  }
+
+  vinil_close(fd);
+
+  return allocation;
+}
+
+static void* inventory_worker(void* arg) {
+  Inventory* inventory = (Inventory*)arg;
+
+  for (;;) {
+    uint64_t i = vinil_atomic_add(&inventory->next, 1);
+    if (i >= inventory->count)
+      break;
+
+    InventoryEntry* entry = &inventory->entries[i];
+    entry->is_vhd = vinil_vhd_probe(entry->path, &entry->footer);
+    if (entry->is_vhd)
+      entry->allocation = inventory_allocation(entry);
+  }
+
+  return NULL;
+}
+
+static const char* inventory_type(uint32_t disk_type) {
+  switch (disk_type) {
+    case VINIL_VHD_FIXED:
+      return "fixed";
+    case VINIL_VHD_DYNAMIC:
+      return "dynamic";
+    case VINIL_VHD_DIFFERENCING:
+      return "differencing";
+  }
+
+  return "unknown";
+}
+
+static void inventory_print(const InventoryEntry* entry, int json) {
+  const uint8_t* u = (const uint8_t*)&entry->footer.uuid;
+  char uuid[37];
+  snprintf(uuid, sizeof(uuid), "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+           u[0], u[1], u[2], u[3], u[4], u[5], u[6], u[7], u[8], u[9], u[10], u[11], u[12], u[13], u[14], u[15]);
+
+  if (json) {
+    printf("{\"path\": \"%s\", \"type\": \"%s\", \"size\": %llu, \"file_size\": %lld, \"uuid\": \"%s\", "
+           "\"allocation\": %.4f}\n", entry->path, inventory_type(entry->footer.disk_type),
+           (unsigned long long)entry->footer.current_size, (long long)entry->file_size, uuid, entry->allocation);
+  } else {
+    printf("%s,%s,%llu,%lld,%s,%.4f\n", entry->path, inventory_type(entry->footer.disk_type),
+           (unsigned long long)entry->footer.current_size, (long long)entry->file_size, uuid, entry->allocation);
+  }
+}
+
+// usage:
+// ./vinil_inventory [--json] [--threads=N] /srv/images /mnt/golden
+int main(int argc, char* argv[]) {
+  int json = FALSE;
+  int threads = INVENTORY_DEFAULT_THREADS;
+  int roots = 0;
+
+  Inventory inventory;
+  memset(&inventory, 0, sizeof(inventory));
+
+  int i;
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--json") == 0) {
+      json = TRUE;
+    } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+      threads = atoi(argv[i] + 10);
+    } else if (argv[i][0] != '-') {
+      if (!inventory_walk(&inventory, argv[i]))
+        fprintf(stderr, "WARNING: Can't walk %s\n", argv[i]);
+      roots++;
+    } else {
+      roots = 0;
+      break;
+    }
+  }
+
+  if (roots == 0 || threads <= 0) {
+    fprintf(stderr, "usage: vinil_inventory [--json] [--threads=N] path...\n");
+    return -1;
+  }
+
+  if (threads > INVENTORY_MAX_THREADS)
+    threads = INVENTORY_MAX_THREADS;
+
+  uint64_t start = vinil_clock_ns();
+  vinil_thread workers[INVENTORY_MAX_THREADS];
+  int started = 0;
+  while (started < threads && vinil_thread_create(&workers[started], inventory_worker, &inventory))
+    started++;
+
+  if (started == 0)
+    inventory_worker(&inventory);
+
+  for (i = 0; i < started; i++)
+    vinil_thread_join(workers[i]);
+  double seconds = (vinil_clock_ns() - start) / 1e9;
+
+  if (!json)
+    printf("path,type,size,file_size,uuid,allocation\n");
+
+  uint64_t j, vhds = 0;
+  for (j = 0; j < inventory.count; j++) {
+    if (inventory.entries[j].is_vhd) {
+      inventory_print(&inventory.entries[j], json);
+      vhds++;
+    }
+    free(inventory.entries[j].path);
+  }
+  free(inventory.entries);
+
+  fprintf(stderr, "{\"files\": %llu, \"vhds\": %llu, \"seconds\": %.6f}\n",
+          (unsigned long long)inventory.count, (unsigned long long)vhds, seconds);
+
+  return 0;
+}
@@ -0,0 +1,142 @@
+/**
+ *  @file       vinil_nbd.c
+ *  @brief      This application serves Virtual Hard Disks over the NBD protocol, so they can
+ *              be attached with nbd-client or opened by QEMU without being converted to raw.
+ *              It prints a JSON summary of what was served when it is stopped.
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#include "nbd.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_SOCKETS VINIL_NBD_MAX_LISTENERS
+
+static VinilNBD* server = NULL;
+
+static void stop_server(int signal_number) {
+  (void)signal_number;
+  vinil_nbd_stop(server);
+}
+
+// usage:
+// ./vinil_nbd [--threads=N] [--read-only] [--socket=/run/vinil.sock]... [--port=10809] [--bind=127.0.0.1]
+//             [name=]image.vhd...
+// each image is exported under its name (the file name by default), SIGINT or SIGTERM stops the server
+// e.g. nbd-client -unix /run/vinil.sock /dev/nbd0 -N disk or qemu-img info nbd+unix:///disk?socket=/run/vinil.sock
+int main(int argc, char* argv[]) {
+  int threads = VINIL_NBD_DEFAULT_THREADS;
+  int read_only = FALSE;
+  int port = 0;
+  const char* bind_address = NULL;
+  const char* sockets[MAX_SOCKETS];
+  int socket_count = 0;
+  const char* images[VINIL_NBD_MAX_EXPORTS];
+  int image_count = 0;
+  int usage_error = FALSE;
+
+  int i;
+  for (i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--threads=", 10) == 0)
+      threads = atoi(argv[i] + 10);
+    else if (strcmp(argv[i], "--read-only") == 0)
+      read_only = TRUE;
+    else if (strncmp(argv[i], "--socket=", 9) == 0 && socket_count < MAX_SOCKETS)
+      sockets[socket_count++] = argv[i] + 9;
+    else if (strncmp(argv[i], "--port=", 7) == 0)
+      port = atoi(argv[i] + 7);
+    else if (strncmp(argv[i], "--bind=", 7) == 0)
+      bind_address = argv[i] + 7;
+    else if (image_count < VINIL_NBD_MAX_EXPORTS && argv[i][0] != '-')
+      images[image_count++] = argv[i];
+    else
+      usage_error = TRUE;
+  }
+
+  if (usage_error || image_count == 0 || (socket_count == 0 && port == 0) || threads <= 0 || port < 0 ||
+      socket_count + (port > 0) > MAX_SOCKETS) {
+    fprintf(stderr, "usage: vinil_nbd [--threads=N] [--read-only] [--socket=PATH]... [--port=N] [--bind=ADDRESS] "
+                    "[name=]image.vhd...\n");
+    return -1;
+  }
+
+  server = vinil_nbd_create(threads);
+  if (server == NULL) {
+    printf("ERROR: Can't create the server\n");
+    return -1;
+  }
+
+  VinilVHD* vhds[VINIL_NBD_MAX_EXPORTS];
+  int vhd_count = 0;
+  int ok = TRUE;
+  for (i = 0; ok && i < image_count; i++) {
+    const char* name = images[i];
+    const char* path = strchr(images[i], '=');
+    char export_name[256];
+    if (path && path - name < (int)sizeof(export_name)) {
+      memcpy(export_name, name, path - name);
+      export_name[path - name] = '\0';
+      path++;
+    } else {
+      snprintf(export_name, sizeof(export_name), "%s", name);
+      path = name;
+    }
+
+    vhds[vhd_count] = vinil_vhd_open_with_flags(path, read_only ? VINIL_VHD_OPEN_READ_ONLY : 0);
+    if (vhds[vhd_count] == NULL) {
+      printf("ERROR: Can't open %s\n", path);
+      ok = FALSE;
+    } else if (!vinil_nbd_add_export(server, export_name, vhds[vhd_count++], read_only)) {
+      printf("ERROR: Can't export %s as %s\n", path, export_name);
+      ok = FALSE;
+    }
+  }
+
+  for (i = 0; ok && i < socket_count; i++) {
+    if (!vinil_nbd_listen_unix(server, sockets[i])) {
+      printf("ERROR: Can't listen on %s\n", sockets[i]);
+      ok = FALSE;
+    }
+  }
+
+  if (ok && port > 0 && !vinil_nbd_listen_tcp(server, bind_address, port)) {
+    printf("ERROR: Can't listen on %s:%d\n", bind_address ? bind_address : "127.0.0.1", port);
+    ok = FALSE;
+  }
+
+  uint64_t start = vinil_clock_ns();
+  if (ok) {
+    signal(SIGINT, stop_server);
+    signal(SIGTERM, stop_server);
+#ifdef SIGPIPE
+    signal(SIGPIPE, SIG_IGN);
+#endif
+    ok = vinil_nbd_run(server);
+    if (!ok)
+      printf("ERROR: Can't start the server\n");
+  }
+  double seconds = (vinil_clock_ns() - start) / 1e9;
+
+  VinilNBDStats stats;
+  vinil_nbd_get_stats(server, &stats);
+  vinil_nbd_destroy(server);
+
+  // the buffered writes reach the images here
+  for (i = 0; i < vhd_count; i++)
+    vinil_vhd_close(vhds[i]);
+
+  if (!ok)
+    return -1;
+
+  printf("{\"exports\": %d, \"threads\": %d, \"connections\": %llu, \"requests\": %llu, \"errors\": %llu, "
+         "\"bytes_read\": %llu, \"bytes_written\": %llu, \"hole_bytes\": %llu, \"seconds\": %.6f}\n",
+         image_count, threads, (unsigned long long)stats.connections, (unsigned long long)stats.requests,
+         (unsigned long long)stats.errors, (unsigned long long)stats.bytes_read,
+         (unsigned long long)stats.bytes_written, (unsigned long long)stats.hole_bytes, seconds);
+
+  return 0;
+}
@@ -0,0 +1,246 @@
+/**
+ *  @file       vinil_replay.c
+ *  @brief      This application replays a trace recorded by vinil_vhd_start_trace
+ *              against a Virtual Hard Disk, at the original timing or as fast as
+ *              possible, and prints a JSON summary of the run.
+ *              Every thread of the trace is replayed by its own thread, which issues
+ *              the calls of the recorded one in the order in which they started.
+ *              Traces only keep sizes and sectors, so the replayed writes carry
+ *              a fixed pattern and the image is modified.
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#include "vhd.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int replay_record(VinilVHD* vhd, const VinilTraceRecord* record, uint8_t** buffer, uint64_t* buffer_sectors) {
+  if ((record->op == VINIL_TRACE_READ || record->op == VINIL_TRACE_WRITE) && record->count > *buffer_sectors) {
+    vinil_free_aligned_buffer(*buffer);
+    *buffer = (uint8_t*)vinil_alloc_aligned_buffer((size_t)record->count * 512);
+    *buffer_sectors = *buffer ? record->count : 0;
+    if (*buffer == NULL)
+      return FALSE;
+    memset(*buffer, 0x5A, (size_t)record->count * 512);
+  }
+
+  switch (record->op) {
+    case VINIL_TRACE_READ:
+      return vinil_vhd_pread(vhd, *buffer, record->sector, record->count);
+    case VINIL_TRACE_WRITE:
+      return vinil_vhd_pwrite(vhd, *buffer, record->sector, record->count);
+    case VINIL_TRACE_FLUSH:
+      return vinil_vhd_flush(vhd);
+    case VINIL_TRACE_DISCARD:
+      return vinil_vhd_discard(vhd, record->sector, record->count);
+    case VINIL_TRACE_SEEK:
+      return vinil_vhd_seek(vhd, (int64_t)record->sector, SEEK_SET);
+  }
+
+  return FALSE;
+}
+
+typedef struct {
+  VinilVHD* vhd;
+  const VinilTraceRecord* records;
+  size_t count;
+  int fast;
+  uint64_t start;
+  uint64_t failed;
+  uint64_t lag;
+  vinil_thread handle;
+  int started;
+} ReplayThread;
+
+typedef struct {
+  VinilTraceRecord record;
+  size_t index;
+} ReplayEntry;
+
+// records are written when the calls return, so they are sorted by thread and start,
+// the position in the file breaks ties to keep the sort stable
+static int compare_entries(const void* a, const void* b) {
+  const ReplayEntry* x = (const ReplayEntry*)a;
+  const ReplayEntry* y = (const ReplayEntry*)b;
+  if (x->record.thread != y->record.thread)
+    return x->record.thread < y->record.thread ? -1 : 1;
+  if (x->record.timestamp != y->record.timestamp)
+    return x->record.timestamp < y->record.timestamp ? -1 : 1;
+  return x->index < y->index ? -1 : x->index > y->index;
+}
+
+static VinilTraceRecord* load_records(VinilTraceReader* reader, size_t* count) {
+  ReplayEntry* entries = NULL;
+  size_t capacity = 0;
+  VinilTraceRecord record;
+
+  *count = 0;
+  while (vinil_trace_reader_next(reader, &record)) {
+    if (*count == capacity) {
+      capacity = capacity ? capacity * 2 : 4096;
+      ReplayEntry* grown = (ReplayEntry*)realloc(entries, capacity * sizeof(ReplayEntry));
+      if (grown == NULL) {
+        free(entries);
+        return NULL;
+      }
+      entries = grown;
+    }
+    entries[*count].record = record;
+    entries[*count].index = *count;
+    (*count)++;
+  }
+
+  VinilTraceRecord* records = (VinilTraceRecord*)malloc((*count + 1) * sizeof(VinilTraceRecord));
+  if (records) {
+    qsort(entries, *count, sizeof(ReplayEntry), compare_entries);
+
+    size_t i;
+    for (i = 0; i < *count; i++)
+      records[i] = entries[i].record;
+  }
+  free(entries);
+
+  return records;
+}
+
+static void* replay_thread(void* arg) {
+  ReplayThread* thread = (ReplayThread*)arg;
+  uint8_t* buffer = NULL;
+  uint64_t buffer_sectors = 0;
+
+  size_t i;
+  for (i = 0; i < thread->count; i++) {
+    const VinilTraceRecord* record = &thread->records[i];
+
+    // at the original timing each call waits for its timestamp, late calls go at once
+    if (!thread->fast) {
+      uint64_t elapsed = vinil_clock_ns() - thread->start;
+      if (elapsed < record->timestamp)
+        vinil_sleep_ns(record->timestamp - elapsed);
+      else if (elapsed - record->timestamp > thread->lag)
+        thread->lag = elapsed - record->timestamp;
+    }
+
+    // calls which failed when they were recorded are expected to fail again
+    if (replay_record(thread->vhd, record, &buffer, &buffer_sectors) != (record->result != 0))
+      thread->failed++;
+  }
+
+  vinil_free_aligned_buffer(buffer);
+
+  return NULL;
+}
+
+// usage:
+// ./vinil_replay [--fast] [--mmap] [--direct] trace.bin test.vhd
+int main(int argc, char* argv[]) {
+  int fast = FALSE;
+  int flags = 0;
+  const char* files[2];
+  int file_count = 0;
+
+  int i;
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--fast") == 0)
+      fast = TRUE;
+    else if (strcmp(argv[i], "--mmap") == 0)
+      flags |= VINIL_VHD_OPEN_MMAP;
+    else if (strcmp(argv[i], "--direct") == 0)
+      flags |= VINIL_VHD_OPEN_DIRECT;
+    else if (file_count < 2 && argv[i][0] != '-')
+      files[file_count++] = argv[i];
+    else
+      file_count = 3;
+  }
+
+  if (file_count != 2) {
+    fprintf(stderr, "usage: vinil_replay [--fast] [--mmap] [--direct] trace image.vhd\n");
+    return -1;
+  }
+
+  VinilTraceReader* reader = vinil_trace_reader_open(files[0]);
+  if (!reader) {
+    printf("ERROR: Can't open the trace %s\n", files[0]);
+    return -1;
+  }
+
+  VinilVHD* vhd = vinil_vhd_open_with_flags(files[1], flags | VINIL_VHD_OPEN_STATS);
+  if (!vhd) {
+    printf("ERROR: Can't open %s\n", files[1]);
+    vinil_trace_reader_close(reader);
+    return -1;
+  }
+
+  size_t ops = 0;
+  VinilTraceRecord* records = load_records(reader, &ops);
+  vinil_trace_reader_close(reader);
+
+  // the records of each thread are contiguous once they are sorted
+  size_t thread_count = 0;
+  size_t n;
+  for (n = 0; records && n < ops; n++) {
+    if (n == 0 || records[n].thread != records[n - 1].thread)
+      thread_count++;
+  }
+
+  ReplayThread* threads = (ReplayThread*)calloc(thread_count + 1, sizeof(ReplayThread));
+  if (records == NULL || threads == NULL) {
+    printf("ERROR: Can't load the trace %s\n", files[0]);
+    free(records);
+    free(threads);
+    vinil_vhd_close(vhd);
+    return -1;
+  }
+
+  size_t t = 0;
+  for (n = 0; n < ops; n++) {
+    if (n > 0 && records[n].thread != records[n - 1].thread)
+      t++;
+    if (threads[t].records == NULL)
+      threads[t].records = &records[n];
+    threads[t].count++;
+  }
+
+  uint64_t start = vinil_clock_ns();
+  for (t = 0; t < thread_count; t++) {
+    threads[t].vhd = vhd;
+    threads[t].fast = fast;
+    threads[t].start = start;
+    threads[t].started = vinil_thread_create(&threads[t].handle, replay_thread, &threads[t]);
+  }
+
+  // the threads which could not be created are replayed one after the other
+  uint64_t failed = 0, lag = 0;
+  for (t = 0; t < thread_count; t++) {
+    if (threads[t].started)
+      vinil_thread_join(threads[t].handle);
+    else
+      replay_thread(&threads[t]);
+    failed += threads[t].failed;
+    if (threads[t].lag > lag)
+      lag = threads[t].lag;
+  }
+  double seconds = (vinil_clock_ns() - start) / 1e9;
+
+  VinilVHDStats stats;
+  vinil_vhd_get_stats(vhd, &stats);
+
+  uint64_t bytes = stats.bytes[VINIL_STATS_READ] + stats.bytes[VINIL_STATS_WRITE];
+  printf("{\"trace\": \"%s\", \"image\": \"%s\", \"timing\": \"%s\", \"threads\": %llu, \"ops\": %llu, "
+         "\"mismatches\": %llu, \"seconds\": %.6f, \"mb_s\": %.2f, \"iops\": %.1f, \"max_lag_us\": %.1f, "
+         "\"reads\": %llu, \"writes\": %llu, \"flushes\": %llu, \"discards\": %llu}\n",
+         files[0], files[1], fast ? "fast" : "original", (unsigned long long)thread_count, (unsigned long long)ops,
+         (unsigned long long)failed, seconds, seconds > 0 ? bytes / (1024.0 * 1024) / seconds : 0, seconds > 0 ? ops / seconds : 0, lag / 1e3,
+         (unsigned long long)stats.ops[VINIL_STATS_READ], (unsigned long long)stats.ops[VINIL_STATS_WRITE],
+         (unsigned long long)stats.ops[VINIL_STATS_FLUSH], (unsigned long long)stats.ops[VINIL_STATS_DISCARD]);
+
+  free(records);
+  free(threads);
+  vinil_vhd_close(vhd);
+
+  return failed ? -1 : 0;
+}
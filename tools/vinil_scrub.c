@@ -0,0 +1,124 @@
+/**
+ *  @file       vinil_scrub.c
+ *  @brief      This application verifies the data of a Virtual Hard Disk against the
+ *              CRC32C checksums of its blocks, prints every bad block and a JSON summary.
+ *              The checksum file is only read, and it must have been closed by its writer:
+ *              it is never created (or trusted) implicitly, --create checksums the current
+ *              data of a VHD which has no checksum file.
+ *  @author     Igor Bonadio
+ *  @copyright  MIT License. See Copyright Notice in LICENSE.txt
+ */
+
+#include "scrub.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int print_bad_block(void* arg, uint64_t block, uint64_t sector, uint64_t count, uint32_t expected,
+                           uint32_t actual) {
+  (void)arg;
+  printf("{\"block\": %llu, \"sector\": %llu, \"count\": %llu, \"expected\": \"%08x\", \"actual\": \"%08x\"}\n",
+         (unsigned long long)block, (unsigned long long)sector, (unsigned long long)count, expected, actual);
+  return TRUE;
+}
+
+// usage:
+// ./vinil_scrub [--threads=N] [--rate=MB/s] [--create [--block-size=N]] image.vhd [image.vhd.crc]
+// it returns 1 if a bad block was found
+int main(int argc, char* argv[]) {
+  int threads = VINIL_SCRUB_DEFAULT_THREADS;
+  double rate = 0;
+  long block_size = 0;
+  int create = FALSE;
+  const char* files[2];
+  int file_count = 0;
+
+  int i;
+  for (i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--threads=", 10) == 0)
+      threads = atoi(argv[i] + 10);
+    else if (strncmp(argv[i], "--rate=", 7) == 0)
+      rate = atof(argv[i] + 7);
+    else if (strncmp(argv[i], "--block-size=", 13) == 0)
+      block_size = atol(argv[i] + 13);
+    else if (strcmp(argv[i], "--create") == 0)
+      create = TRUE;
+    else if (file_count < 2 && argv[i][0] != '-')
+      files[file_count++] = argv[i];
+    else
+      file_count = 3;
+  }
+
+  if (file_count < 1 || file_count > 2 || threads <= 0 || rate < 0 || block_size < 0 || (block_size && !create)) {
+    fprintf(stderr, "usage: vinil_scrub [--threads=N] [--rate=MB/s] [--create [--block-size=N]] image.vhd [checksums.crc]\n");
+    return -1;
+  }
+
+  char crc_path[VINIL_MAX_PATH];
+  snprintf(crc_path, sizeof(crc_path), "%s.crc", files[0]);
+  if (file_count == 2)
+    snprintf(crc_path, sizeof(crc_path), "%s", files[1]);
+
+  // a file which is open may be rewritten by its writer at any time, and describes data which is changing
+  int state = vinil_crc_file_state(crc_path);
+  if (state == VINIL_CRC_FILE_OPEN) {
+    printf("ERROR: %s is in use, or its VHD was not closed\n", crc_path);
+    return -1;
+  }
+
+  if (state == VINIL_CRC_FILE_INVALID && !create) {
+    printf("ERROR: %s is not a checksum file (--create checksums the current data)\n", crc_path);
+    return -1;
+  }
+
+  VinilVHD* vhd = vinil_vhd_open_with_flags(files[0], VINIL_VHD_OPEN_READ_ONLY);
+  if (vhd == NULL) {
+    printf("ERROR: Can't open %s\n", files[0]);
+    return -1;
+  }
+
+  // the data is trusted as it is, so the new checksums are only verified by the scrub below
+  int created = state == VINIL_CRC_FILE_INVALID;
+  if (created && (!vinil_vhd_start_crc(vhd, crc_path, (uint32_t)block_size) || !vinil_vhd_stop_crc(vhd))) {
+    printf("ERROR: Can't create %s\n", crc_path);
+    vinil_vhd_close(vhd);
+    return -1;
+  }
+
+  VinilCRC* crc = vinil_crc_open_read_only(crc_path, vhd->footer->current_size / 512);
+  if (crc == NULL) {
+    printf("ERROR: %s does not describe %s\n", crc_path, files[0]);
+    vinil_vhd_close(vhd);
+    return -1;
+  }
+
+  VinilScrubStats stats;
+  uint64_t start = vinil_clock_ns();
+  int ok = vinil_scrub_checksums(vhd, crc, threads, (uint64_t)(rate * 1024 * 1024), print_bad_block, NULL, &stats);
+  double seconds = (vinil_clock_ns() - start) / 1e9;
+
+  vinil_crc_close(crc);
+  vinil_vhd_close(vhd);
+
+  if (!ok) {
+    printf("ERROR: Can't scrub %s\n", files[0]);
+    return -1;
+  }
+
+  // a writer which started meanwhile may have changed the blocks after they were read
+  if (vinil_crc_file_state(crc_path) != VINIL_CRC_FILE_CLOSED) {
+    printf("ERROR: %s was opened during the scrub, the results are not reliable\n", crc_path);
+    return -1;
+  }
+
+  printf("{\"vhd\": \"%s\", \"checksums\": \"%s\", \"created\": %s, \"threads\": %d, \"blocks\": %llu, "
+         "\"verified_blocks\": %llu, \"bad_blocks\": %llu, \"stale_blocks\": %llu, \"bytes_read\": %llu, "
+         "\"seconds\": %.6f, \"read_mb_s\": %.2f}\n",
+         files[0], crc_path, created ? "true" : "false", threads, (unsigned long long)stats.blocks,
+         (unsigned long long)stats.verified_blocks, (unsigned long long)stats.bad_blocks,
+         (unsigned long long)stats.stale_blocks, (unsigned long long)stats.bytes_read, seconds,
+         seconds > 0 ? stats.bytes_read / (1024.0 * 1024) / seconds : 0);
+
+  return stats.bad_blocks > 0 ? 1 : 0;
+}